@@ -30,6 +30,7 @@ XHCI_CTX_SIZE  ?= 32
 QEMU           ?= true
 MODE           ?= virt
 TEST           ?= false
+BENCH          ?= false
 
 ifeq ($(V), 1)
   VAR  = $(AR)
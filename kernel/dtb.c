@@ -75,14 +75,15 @@ bool dtb_addresses(uint64_t *start, uint64_t *size){
     return true;
 }
 
-bool dtb_scan(const char *search_name, dtb_node_handler handler, dtb_match_t *match) {
-    if (!dtb_get_header()) return false;
+static int dtb_walk(const char *search_name, dtb_node_handler handler, dtb_match_t *match, dtb_node_done done) {
+    if (!dtb_get_header()) return 0;
 
     uintptr_t base = dtb_base();
     uint32_t *p = (uint32_t *)(base + __builtin_bswap32(hdr->off_dt_struct));
     const char *strings = (const char *)(base + __builtin_bswap32(hdr->off_dt_strings));
     int depth = 0;
     bool active = 0;
+    int matched = 0;
 
     while (1) {
         uint32_t token = __builtin_bswap32(*p++);
@@ -104,10 +105,16 @@ bool dtb_scan(const char *search_name, dtb_node_handler handler, dtb_match_t *ma
             handler(propname, prop, len, match);
         
             p += (len + 3) / 4;
+        } else if (token == FDT_PROP) {
+            uint32_t len = __builtin_bswap32(*p++);
+            p += 1 + (len + 3) / 4;
         } else if (token == FDT_END_NODE) {
             depth--;
-            if (active && match->found)
-                return true;
+            if (active && match->found) {
+                matched++;
+                if (!done) return matched;
+                done(match);
+            }
             active = 0;
             match->compatible = 0;
             match->reg_base = 0;
@@ -116,5 +123,14 @@ bool dtb_scan(const char *search_name, dtb_node_handler handler, dtb_match_t *ma
             match->found = 0;
         }
     }
-    return false;
+    return matched;
+}
+
+bool dtb_scan(const char *search_name, dtb_node_handler handler, dtb_match_t *match) {
+    return dtb_walk(search_name, handler, match, 0) > 0;
+}
+
+int dtb_scan_all(const char *search_name, dtb_node_handler handler, dtb_match_t *match, dtb_node_done done) {
+    if (!done) return 0;
+    return dtb_walk(search_name, handler, match, done);
 }
\ No newline at end of file
@@ -11,9 +11,11 @@ typedef struct {
 } dtb_match_t;
 
 typedef int (*dtb_node_handler)(const char *propname, const void *prop, uint32_t len, dtb_match_t *out);
+typedef void (*dtb_node_done)(dtb_match_t *match);
 
 bool dtb_addresses(uint64_t *start, uint64_t *size);
 bool dtb_scan(const char *search_name, dtb_node_handler handler, dtb_match_t *match);
+int dtb_scan_all(const char *search_name, dtb_node_handler handler, dtb_match_t *match, dtb_node_done done);
 void dtb_set_pa(uint64_t dtb_pa);
 uint64_t dtb_get_pa();
 bool dtb_get_header();
\ No newline at end of file
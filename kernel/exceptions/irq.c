@@ -13,6 +13,8 @@
 #include "networking/interface_manager.h"
 #include "process/syscall.h"
 #include "memory/mmu.h"
+#include "exceptions/spinlock.h"
+#include "filesystem/disk.h"
 
 #define IRQ_TIMER 30
 #define SLEEP_TIMER 27
@@ -50,18 +52,20 @@ void irq_init() {
         write32(GICC_BASE, 0); // Disable CPU Interface
     }
 
+    //Device interrupts are routed to the boot CPU, secondaries only take their own timers and IPIs
     for (int i = 0; i < 128; i++)
-        gic_enable_irq(i, 0x80, 0);
+        gic_enable_irq(i, 0x80, 1);
     
-    gic_enable_irq(IRQ_TIMER, 0x80, 0);
-    gic_enable_irq(MSI_OFFSET + INPUT_IRQ, 0x80, 0);
-    if (UART_IRQ) gic_enable_irq(UART_IRQ, 0x80, 0);
+    gic_enable_irq(IRQ_TIMER, 0x80, 1);
+    gic_enable_irq(MSI_OFFSET + INPUT_IRQ, 0x80, 1);
+    gic_enable_irq(MSI_OFFSET + DISK_IRQ, 0x80, 1);
+    if (UART_IRQ) gic_enable_irq(UART_IRQ, 0x80, 1);
 
     for (uint32_t i = 0; i < (uint32_t)MAX_L2_INTERFACES; ++i) {
-        gic_enable_irq(MSI_OFFSET + NET_IRQ_BASE + (2*i), 0x80, 0);
-        gic_enable_irq(MSI_OFFSET + NET_IRQ_BASE + (2*i+1), 0x80, 0);
+        gic_enable_irq(MSI_OFFSET + NET_IRQ_BASE + (2*i), 0x80, 1);
+        gic_enable_irq(MSI_OFFSET + NET_IRQ_BASE + (2*i+1), 0x80, 1);
     }
-    gic_enable_irq(SLEEP_TIMER, 0x80, 0);
+    gic_enable_irq(SLEEP_TIMER, 0x80, 1);
 
     if (RPI_BOARD != 3){
         write32(GICC_BASE + 0x004, 0xF0); //Priority
@@ -75,7 +79,45 @@ void irq_init() {
     }
 }
 
+void irq_init_cpu() {
+    if (RPI_BOARD == 3) return;
+    write32(GICC_BASE, 0);
+
+    gic_enable_irq(IPI_RESCHEDULE, 0x80, 0);
+    gic_enable_irq(IRQ_TIMER, 0x80, 0);
+    gic_enable_irq(SLEEP_TIMER, 0x80, 0);
+
+    write32(GICC_BASE + 0x004, 0xF0);
+    write32(GICC_BASE, 1);
+}
+
+uint8_t irq_cpu_interface_mask(){
+    if (RPI_BOARD == 3) return 0;
+    //ITARGETSR0 is banked and reads back the mask of the CPU performing the read
+    return read8(GICD_BASE + 0x800);
+}
+
+void irq_send_ipi(uint8_t cpu_mask, uint32_t ipi){
+    if (RPI_BOARD == 3 || !cpu_mask) return;
+    asm volatile ("dsb ishst" ::: "memory");
+    write32(GICD_BASE + 0xF00, ((uint32_t)cpu_mask << 16) | (ipi & 0xF));
+}
+
+irq_flags_t local_irq_save(){
+    irq_flags_t flags;
+    asm volatile ("mrs %0, daif" : "=r"(flags));
+    asm volatile ("msr daifset, #2");
+    asm volatile ("isb");
+    return flags;
+}
+
+void local_irq_restore(irq_flags_t flags){
+    asm volatile ("msr daif, %0" :: "r"(flags));
+    asm volatile ("isb");
+}
+
 void enable_interrupt() {
+    kernel_lock_release();
     asm volatile ("msr daifclr, #2");
     asm volatile ("isb");
 }
@@ -83,6 +125,7 @@ void enable_interrupt() {
 void disable_interrupt(){
     asm volatile ("msr daifset, #2");
     asm volatile ("isb");
+    kernel_lock_acquire();
 }
 
 irq_flags_t irq_save_disable(){
@@ -93,19 +136,26 @@ irq_flags_t irq_save_disable(){
 }
 
 void irq_restore(irq_flags_t flags){
+    if (!(flags & SPSR_IRQ_MASKED)) kernel_lock_release();
     asm volatile ("msr daif, %0" :: "r"(flags));
     asm volatile ("isb");
 }
 
 void irq_el1_handler() {
     save_return_address_interrupt();
+    kernel_lock_acquire();
     syscall_depth++;
     uint32_t irq;
     if (RPI_BOARD == 3){
         irq = 31 - __builtin_clz(read32(GICD_BASE + 0x204));
     } else irq = read32(GICC_BASE + 0xC);
 
-    if (irq == IRQ_TIMER) {
+    if (RPI_BOARD != 3 && (irq & 0x3FF) == IPI_RESCHEDULE) {
+        write32(GICC_BASE + 0x10, irq);
+        syscall_depth--;
+        if (scheduler_should_preempt()) switch_proc(INTERRUPT);
+        process_restore();
+    } else if (irq == IRQ_TIMER) {
         bool can_preempt = true;
         if (get_current_proc() && get_current_proc()->mm.ttbr0 && (get_current_proc()->spsr & 0xF) != 0) can_preempt = false;
         if (RPI_BOARD != 3) write32(GICC_BASE + 0x10, irq);
@@ -116,13 +166,19 @@ void irq_el1_handler() {
         handle_usb_interrupt();
         if (RPI_BOARD != 3) write32(GICC_BASE + 0x10, irq);
         syscall_depth--;
-        if (scheduler_in_idle()) switch_proc(INTERRUPT);
+        if (scheduler_should_preempt()) switch_proc(INTERRUPT);
+        process_restore();
+    } else if (irq == MSI_OFFSET + DISK_IRQ){
+        disk_handle_interrupt();
+        if (RPI_BOARD != 3) write32(GICC_BASE + 0x10, irq);
+        syscall_depth--;
+        if (scheduler_should_preempt()) switch_proc(INTERRUPT);
         process_restore();
     } else if (irq == SLEEP_TIMER){
         wake_processes();
         if (RPI_BOARD != 3) write32(GICC_BASE + 0x10, irq);
         syscall_depth--;
-        if (scheduler_in_idle()) switch_proc(INTERRUPT);
+        if (scheduler_should_preempt()) switch_proc(INTERRUPT);
         process_restore();
     } else if (irq >= MSI_OFFSET + NET_IRQ_BASE && irq <  MSI_OFFSET + NET_IRQ_BASE + (2*MAX_L2_INTERFACES)){
         uint32_t rel = irq - (MSI_OFFSET + NET_IRQ_BASE);
@@ -132,7 +188,7 @@ void irq_el1_handler() {
         else network_handle_upload_interrupt_nic(nic_id);
         if (RPI_BOARD != 3) write32(GICC_BASE + 0x10, irq);
         syscall_depth--;
-        if (scheduler_in_idle()) switch_proc(INTERRUPT);
+        if (scheduler_should_preempt()) switch_proc(INTERRUPT);
         process_restore();
     } else if (irq == UART_IRQ){
         uart_read_in();
@@ -3,7 +3,11 @@
 #include "types.h"
 #include "hw/hw.h"
 
+#define IPI_RESCHEDULE 1
+#define SPSR_IRQ_MASKED (1 << 7)
+
 void irq_init();
+void irq_init_cpu();
 void irq_el1_handler();
 #ifdef __cplusplus
 extern "C" {
@@ -14,6 +18,10 @@ void disable_interrupt();
 void enable_interrupt();
 irq_flags_t irq_save_disable();
 void irq_restore(irq_flags_t flags);
+irq_flags_t local_irq_save();
+void local_irq_restore(irq_flags_t flags);
+uint8_t irq_cpu_interface_mask();
+void irq_send_ipi(uint8_t cpu_mask, uint32_t ipi);
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include "spinlock.h"
+#include "hw/smp.h"
+
+static spinlock_t kernel_lock;
+
+void spin_lock(spinlock_t *lock){
+    u32 tmp;
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr %w0, [%1]\n"
+        "   cbnz %w0, 1b\n"
+        "   stxr %w0, %w2, [%1]\n"
+        "   cbnz %w0, 2b\n"
+        : "=&r"(tmp) : "r"(&lock->locked), "r"(1) : "memory");
+}
+
+bool spin_trylock(spinlock_t *lock){
+    u32 tmp, status = 1;
+    asm volatile(
+        "   ldaxr %w0, [%2]\n"
+        "   cbnz %w0, 1f\n"
+        "   stxr %w1, %w3, [%2]\n"
+        "1:\n"
+        : "=&r"(tmp), "+&r"(status) : "r"(&lock->locked), "r"(1) : "memory");
+    return tmp == 0 && status == 0;
+}
+
+void spin_unlock(spinlock_t *lock){
+    asm volatile("stlr wzr, [%0]" :: "r"(&lock->locked) : "memory");
+}
+
+irq_flags_t spin_lock_irqsave(spinlock_t *lock){
+    irq_flags_t flags = local_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t *lock, irq_flags_t flags){
+    spin_unlock(lock);
+    local_irq_restore(flags);
+}
+
+//Owner is stored as cpu id + 1 so the exception return path can clear it with a zero store
+void kernel_lock_acquire(){
+    u32 self = cpu_id() + 1;
+    if (kernel_lock.owner == self) return;
+    spin_lock(&kernel_lock);
+    kernel_lock.owner = self;
+}
+
+void kernel_lock_release(){
+    if (kernel_lock.owner != cpu_id() + 1) return;
+    kernel_lock.owner = 0;
+    spin_unlock(&kernel_lock);
+}
+
+bool kernel_lock_held(){
+    return kernel_lock.owner == cpu_id() + 1;
+}
+
+void kernel_lock_prepare_return(uint64_t spsr){
+    cpu_data_t *cpu = this_cpu();
+    bool resumes_masked = (spsr & SPSR_IRQ_MASKED) != 0;
+    cpu->lock_release = kernel_lock_held() && !resumes_masked ? (uintptr_t)&kernel_lock : 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.h"
+#include "exceptions/irq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    volatile u32 locked;
+    volatile u32 owner;
+} spinlock_t;
+
+#define SPINLOCK_INIT (spinlock_t){ 0, 0 }
+
+void spin_lock(spinlock_t *lock);
+bool spin_trylock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+irq_flags_t spin_lock_irqsave(spinlock_t *lock);
+void spin_unlock_irqrestore(spinlock_t *lock, irq_flags_t flags);
+
+//The kernel lock takes the place of masked interrupts as the guarantee that nothing else touches shared kernel state.
+//It is held for as long as IRQs are masked on a CPU, including exception handlers, and dropped on return to an unmasked context.
+void kernel_lock_acquire();
+void kernel_lock_release();
+bool kernel_lock_held();
+void kernel_lock_prepare_return(uint64_t spsr);
+
+#ifdef __cplusplus
+}
+#endif
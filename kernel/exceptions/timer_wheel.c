@@ -0,0 +1,183 @@
+#include "timer_wheel.h"
+#include "timer.h"
+#include "irq.h"
+
+//Hierarchical wheel with 1ms resolution. Each level has 64 slots, so the levels cover 64ms, ~4s, ~4.5min and ~4.6h.
+//Timers further out than that sit in the last level and get re-placed every time it cascades.
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 4
+#define TW_MAX_DELTA ((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+//cntv_tval is a signed 32 bit downcounter, a long wait is split into several shorter ones
+#define TW_MAX_PROGRAM_MS 10000
+
+static ktimer_t *slots[TW_LEVELS][TW_SIZE];
+static uint64_t slot_bitmap[TW_LEVELS];
+//Last tick that has been processed, every pending timer expires after it
+static uint64_t wheel_clk;
+static uint32_t wheel_count;
+static bool wheel_running;
+
+static inline int tw_next_bit(uint64_t bitmap, uint32_t start){
+    if (!bitmap) return -1;
+    start &= TW_MASK;
+    uint64_t rotated = start ? (bitmap >> start) | (bitmap << (TW_SIZE - start)) : bitmap;
+    return __builtin_ctzll(rotated);
+}
+
+static void tw_place(ktimer_t *timer, uint64_t expires){
+    uint64_t delta = expires - wheel_clk;
+    if (delta > TW_MAX_DELTA) {
+        delta = TW_MAX_DELTA;
+        expires = wheel_clk + delta;
+    }
+    uint8_t level = 0;
+    while (level + 1 < TW_LEVELS && delta >= (1ULL << (TW_BITS * (level + 1)))) level++;
+    uint8_t slot = (expires >> (TW_BITS * level)) & TW_MASK;
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = 0;
+    timer->next = slots[level][slot];
+    if (timer->next) timer->next->prev = timer;
+    slots[level][slot] = timer;
+    slot_bitmap[level] |= 1ULL << slot;
+}
+
+static void tw_unlink(ktimer_t *timer){
+    if (timer->prev) timer->prev->next = timer->next;
+    else slots[timer->level][timer->slot] = timer->next;
+    if (timer->next) timer->next->prev = timer->prev;
+    if (!slots[timer->level][timer->slot]) slot_bitmap[timer->level] &= ~(1ULL << timer->slot);
+    timer->next = 0;
+    timer->prev = 0;
+}
+
+static void tw_cascade(uint8_t level){
+    uint8_t slot = (wheel_clk >> (TW_BITS * level)) & TW_MASK;
+    ktimer_t *list = slots[level][slot];
+    slots[level][slot] = 0;
+    slot_bitmap[level] &= ~(1ULL << slot);
+    while (list) {
+        ktimer_t *timer = list;
+        list = timer->next;
+        tw_place(timer, timer->expires > wheel_clk ? timer->expires : wheel_clk);
+    }
+    if (!slot && level + 1 < TW_LEVELS) tw_cascade(level + 1);
+}
+
+static uint64_t tw_next_tick(uint64_t now){
+    if (!wheel_count) return now;
+    uint64_t next = (wheel_clk | TW_MASK) + 1;
+    int k = tw_next_bit(slot_bitmap[0], (uint32_t)(wheel_clk + 1));
+    if (k >= 0 && wheel_clk + 1 + (uint64_t)k < next) next = wheel_clk + 1 + k;
+    return next < now ? next : now;
+}
+
+void ktimer_init(ktimer_t *timer, ktimer_fn fn, void *data){
+    if (!timer) return;
+    timer->next = 0;
+    timer->prev = 0;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->data = data;
+    timer->level = 0;
+    timer->slot = 0;
+    timer->pending = false;
+}
+
+void ktimer_arm(ktimer_t *timer, uint64_t expires_msec){
+    if (!timer) return;
+    irq_flags_t irq = irq_save_disable();
+    if (timer->pending) {
+        tw_unlink(timer);
+        wheel_count--;
+    }
+    if (!wheel_count && !wheel_running) {
+        uint64_t now = timer_now_msec();
+        if (wheel_clk < now) wheel_clk = now;
+    }
+    timer->expires = expires_msec;
+    timer->pending = true;
+    tw_place(timer, expires_msec > wheel_clk ? expires_msec : wheel_clk + 1);
+    wheel_count++;
+    if (!wheel_running) timer_wheel_program();
+    irq_restore(irq);
+}
+
+void ktimer_arm_in(ktimer_t *timer, uint64_t msec){
+    ktimer_arm(timer, timer_now_msec() + msec);
+}
+
+bool ktimer_cancel(ktimer_t *timer){
+    if (!timer) return false;
+    irq_flags_t irq = irq_save_disable();
+    bool was_pending = timer->pending;
+    if (was_pending) {
+        tw_unlink(timer);
+        timer->pending = false;
+        wheel_count--;
+    }
+    irq_restore(irq);
+    return was_pending;
+}
+
+bool ktimer_pending(ktimer_t *timer){
+    return timer && timer->pending;
+}
+
+uint64_t timer_wheel_next_expiry(){
+    if (!wheel_count) return KTIMER_NEVER;
+    uint64_t best = KTIMER_NEVER;
+    int k = tw_next_bit(slot_bitmap[0], (uint32_t)(wheel_clk + 1));
+    if (k >= 0) best = wheel_clk + 1 + k;
+    for (uint8_t level = 1; level < TW_LEVELS; level++) {
+        if (!slot_bitmap[level]) continue;
+        uint32_t shift = TW_BITS * level;
+        uint64_t group = (wheel_clk >> shift) + 1;
+        k = tw_next_bit(slot_bitmap[level], (uint32_t)group);
+        uint64_t at = (group + k) << shift;
+        if (at < best) best = at;
+    }
+    return best;
+}
+
+void timer_wheel_program(){
+    irq_flags_t irq = irq_save_disable();
+    uint64_t next = timer_wheel_next_expiry();
+    if (next == KTIMER_NEVER) virtual_timer_disable();
+    else {
+        uint64_t now = timer_now_msec();
+        uint64_t wait = next > now ? next - now : 1;
+        if (wait > TW_MAX_PROGRAM_MS) wait = TW_MAX_PROGRAM_MS;
+        virtual_timer_reset(wait);
+        virtual_timer_enable();
+    }
+    irq_restore(irq);
+}
+
+void timer_wheel_run(){
+    irq_flags_t irq = irq_save_disable();
+    if (wheel_running) {
+        irq_restore(irq);
+        return;
+    }
+    wheel_running = true;
+    uint64_t now = timer_now_msec();
+    while (wheel_clk < now) {
+        wheel_clk = tw_next_tick(now);
+        uint8_t slot = wheel_clk & TW_MASK;
+        if (!slot) tw_cascade(1);
+        while (slots[0][slot]) {
+            ktimer_t *timer = slots[0][slot];
+            tw_unlink(timer);
+            timer->pending = false;
+            wheel_count--;
+            if (timer->fn) timer->fn(timer);
+        }
+    }
+    wheel_running = false;
+    timer_wheel_program();
+    irq_restore(irq);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KTIMER_NEVER 0xFFFFFFFFFFFFFFFFULL
+
+typedef struct ktimer ktimer_t;
+typedef void (*ktimer_fn)(ktimer_t *timer);
+
+//Expiry is in timer_now_msec() units. A timer callback runs from the sleep timer interrupt with the kernel lock held.
+struct ktimer {
+    struct ktimer *next;
+    struct ktimer *prev;
+    uint64_t expires;
+    ktimer_fn fn;
+    void *data;
+    uint8_t level;
+    uint8_t slot;
+    bool pending;
+};
+
+void ktimer_init(ktimer_t *timer, ktimer_fn fn, void *data);
+void ktimer_arm(ktimer_t *timer, uint64_t expires_msec);
+void ktimer_arm_in(ktimer_t *timer, uint64_t msec);
+bool ktimer_cancel(ktimer_t *timer);
+bool ktimer_pending(ktimer_t *timer);
+
+void timer_wheel_run();
+void timer_wheel_program();
+uint64_t timer_wheel_next_expiry();
+
+#ifdef __cplusplus
+}
+#endif
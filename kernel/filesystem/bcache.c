@@ -0,0 +1,337 @@
+#include "bcache.h"
+#include "disk.h"
+#include "memory/page_allocator.h"
+#include "exceptions/irq.h"
+#include "console/kio.h"
+#include "std/memory.h"
+
+#define BCACHE_BLOCKS 256
+#define BCACHE_BUCKETS 128
+#define BCACHE_READAHEAD 16
+#define BCACHE_CHUNK (BCACHE_BLOCKS / 4)
+#define BCACHE_DIRTY_LIMIT (BCACHE_BLOCKS / 2)
+
+typedef struct bcache_entry {
+    struct bcache_entry *hnext;
+    struct bcache_entry *lru_prev;
+    struct bcache_entry *lru_next;
+    uint8_t *data;
+    uint32_t dev;
+    uint32_t block;
+    bool hashed;
+    bool valid;
+    bool dirty;
+    volatile bool loading;
+    volatile bool writing;
+} bcache_entry;
+
+static bcache_entry entries[BCACHE_BLOCKS];
+static bcache_entry *buckets[BCACHE_BUCKETS];
+static bcache_entry *lru_head;
+static bcache_entry *lru_tail;
+static uint32_t dirty_count;
+static bool bcache_ready;
+
+//Where the last read ended, a read starting there is treated as sequential and triggers read-ahead
+static uint32_t ra_dev;
+static uint32_t ra_next_block;
+
+static inline uint32_t bcache_bucket(uint32_t dev, uint32_t block){
+    return (block ^ (dev * 0x9E3779B1u)) & (BCACHE_BUCKETS - 1);
+}
+
+static void lru_unlink(bcache_entry *e){
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = 0;
+}
+
+static void lru_push_head(bcache_entry *e){
+    e->lru_prev = 0;
+    e->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = e;
+    lru_head = e;
+    if (!lru_tail) lru_tail = e;
+}
+
+static void lru_touch(bcache_entry *e){
+    if (lru_head == e) return;
+    lru_unlink(e);
+    lru_push_head(e);
+}
+
+static bool bcache_setup(){
+    if (bcache_ready) return true;
+    uint8_t *data = (uint8_t*)palloc(BCACHE_BLOCKS * BCACHE_BLOCK_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    if (!data){
+        kprintf("[BCACHE] Failed to allocate cache memory");
+        return false;
+    }
+    for (uint32_t i = 0; i < BCACHE_BLOCKS; i++){
+        entries[i] = (bcache_entry){0};
+        entries[i].data = data + (i * BCACHE_BLOCK_SIZE);
+        lru_push_head(&entries[i]);
+    }
+    bcache_ready = true;
+    return true;
+}
+
+static bcache_entry* bcache_lookup(uint32_t dev, uint32_t block){
+    for (bcache_entry *e = buckets[bcache_bucket(dev, block)]; e; e = e->hnext)
+        if (e->dev == dev && e->block == block) return e;
+    return 0;
+}
+
+static void bcache_unhash(bcache_entry *e){
+    if (!e->hashed) return;
+    bcache_entry **link = &buckets[bcache_bucket(e->dev, e->block)];
+    while (*link && *link != e) link = &(*link)->hnext;
+    if (*link) *link = e->hnext;
+    e->hnext = 0;
+    e->hashed = false;
+    e->valid = false;
+}
+
+//Waits for the disk with the cache lock dropped. Entries looked up before may have been evicted or reused once it returns
+static void bcache_wait_io(irq_flags_t *irq){
+    irq_restore(*irq);
+    disk_wait_all();
+    *irq = irq_save_disable();
+}
+
+//The entry stays hashed but writing keeps it from being evicted while the device still reads its data
+static void bcache_writeback(bcache_entry *e, irq_flags_t *irq){
+    e->dirty = false;
+    dirty_count--;
+    e->writing = true;
+    irq_restore(*irq);
+    disk_write(e->data, e->block * BCACHE_BLOCK_SECTORS, BCACHE_BLOCK_SECTORS);
+    *irq = irq_save_disable();
+    e->writing = false;
+}
+
+//Least recently used idle entry, unhashed. Writing back a dirty one drops the lock, it can be touched or redirtied
+//meanwhile so the scan starts over
+static bcache_entry* bcache_evict(irq_flags_t *irq){
+    while (true){
+        bcache_entry *e = lru_tail;
+        while (e && (e->loading || e->writing)) e = e->lru_prev;
+        if (!e){
+            bcache_wait_io(irq);
+            continue;
+        }
+        if (e->dirty){
+            bcache_writeback(e, irq);
+            continue;
+        }
+        bcache_unhash(e);
+        return e;
+    }
+}
+
+//Fresh entry for a block that isn't cached. 0 if another caller cached it while eviction had the lock dropped
+static bcache_entry* bcache_alloc(uint32_t dev, uint32_t block, irq_flags_t *irq){
+    bcache_entry *e = bcache_evict(irq);
+    if (bcache_lookup(dev, block)) return 0;
+    e->dev = dev;
+    e->block = block;
+    e->valid = false;
+    e->dirty = false;
+    uint32_t b = bcache_bucket(dev, block);
+    e->hnext = buckets[b];
+    buckets[b] = e;
+    e->hashed = true;
+    lru_touch(e);
+    return e;
+}
+
+static void bcache_load_done(void *ctx, bool ok){
+    bcache_entry *e = (bcache_entry*)ctx;
+    e->valid = ok;
+    e->loading = false;
+}
+
+static void bcache_write_done(void *ctx, bool ok){
+    (void)ok;
+    ((bcache_entry*)ctx)->writing = false;
+}
+
+//Queues the block for loading if it's not cached yet, the caller is responsible for disk_submit
+static bcache_entry* bcache_start_load(uint32_t dev, uint32_t block, irq_flags_t *irq){
+    bcache_entry *e;
+    while (!(e = bcache_lookup(dev, block))){
+        e = bcache_alloc(dev, block, irq);
+        if (!e) continue;
+        e->loading = true;
+        if (!disk_read_async(e->data, block * BCACHE_BLOCK_SECTORS, BCACHE_BLOCK_SECTORS, bcache_load_done, e)){
+            irq_restore(*irq);
+            disk_read(e->data, block * BCACHE_BLOCK_SECTORS, BCACHE_BLOCK_SECTORS);
+            *irq = irq_save_disable();
+            bcache_load_done(e, true);
+        }
+        return e;
+    }
+    return e;
+}
+
+//Waits with the lock dropped, so the block is looked up again after every wait. A failed load is unhashed
+//by whoever sees it first, anyone else still waiting on that block retries it
+static bcache_entry* bcache_get_loaded(uint32_t dev, uint32_t block, irq_flags_t *irq){
+    while (true){
+        bcache_entry *e = bcache_start_load(dev, block, irq);
+        if (!e->loading){
+            if (!e->valid){
+                bcache_unhash(e);
+                return 0;
+            }
+            lru_touch(e);
+            return e;
+        }
+        disk_submit();
+        bcache_wait_io(irq);
+    }
+}
+
+void bcache_prefetch(uint32_t dev, uint32_t sector, uint32_t count){
+    if (!count) return;
+    irq_flags_t irq = irq_save_disable();
+    if (!bcache_setup()){
+        irq_restore(irq);
+        return;
+    }
+    uint32_t first = sector / BCACHE_BLOCK_SECTORS;
+    uint32_t last = (sector + count - 1) / BCACHE_BLOCK_SECTORS;
+    if (last - first >= BCACHE_CHUNK) last = first + BCACHE_CHUNK - 1;
+    for (uint32_t block = first; block <= last; block++)
+        bcache_start_load(dev, block, &irq);
+    irq_restore(irq);
+}
+
+bool bcache_read_bytes(uint32_t dev, void *buffer, uint64_t offset, size_t size){
+    if (!buffer || !size) return false;
+    irq_flags_t irq = irq_save_disable();
+    if (!bcache_setup()){
+        irq_restore(irq);
+        return false;
+    }
+
+    uint32_t first = offset / BCACHE_BLOCK_SIZE;
+    uint32_t last = (offset + size - 1) / BCACHE_BLOCK_SIZE;
+    bool sequential = dev == ra_dev && (first == ra_next_block || first + 1 == ra_next_block);
+    ra_dev = dev;
+    ra_next_block = last + 1;
+
+    bool ok = true;
+    uint8_t *out = (uint8_t*)buffer;
+    //Chunks keep a single call from evicting blocks it queued but hasn't copied out yet
+    for (uint32_t chunk = first; chunk <= last && ok; chunk += BCACHE_CHUNK){
+        uint32_t chunk_last = last - chunk >= BCACHE_CHUNK ? chunk + BCACHE_CHUNK - 1 : last;
+        for (uint32_t block = chunk; block <= chunk_last; block++)
+            bcache_start_load(dev, block, &irq);
+        if (sequential && chunk_last == last)
+            for (uint32_t block = last + 1; block <= last + BCACHE_READAHEAD; block++)
+                bcache_start_load(dev, block, &irq);
+        disk_submit();
+
+        for (uint32_t block = chunk; block <= chunk_last; block++){
+            bcache_entry *e = bcache_get_loaded(dev, block, &irq);
+            if (!e){
+                ok = false;
+                break;
+            }
+            uint64_t block_start = (uint64_t)block * BCACHE_BLOCK_SIZE;
+            uint64_t from = offset > block_start ? offset - block_start : 0;
+            uint64_t to = offset + size < block_start + BCACHE_BLOCK_SIZE ? offset + size - block_start : BCACHE_BLOCK_SIZE;
+            memcpy(out, e->data + from, to - from);
+            out += to - from;
+        }
+    }
+
+    irq_restore(irq);
+    return ok;
+}
+
+bool bcache_read(uint32_t dev, void *buffer, uint32_t sector, uint32_t count){
+    return bcache_read_bytes(dev, buffer, (uint64_t)sector * 512, (size_t)count * 512);
+}
+
+//Every entry being written is marked first, so the sync fallback dropping the lock can't let one of them be evicted
+//and reused before its turn. Waits for the writes with the lock dropped too
+static void bcache_flush_locked(uint32_t dev, irq_flags_t *irq){
+    //Written in block order so the disk layer can merge neighbours into a single request
+    bcache_entry *dirty[BCACHE_BLOCKS];
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < BCACHE_BLOCKS; i++){
+        bcache_entry *e = &entries[i];
+        if (!e->dirty || e->writing || e->dev != dev) continue;
+        uint32_t j = n++;
+        while (j && dirty[j - 1]->block > e->block){
+            dirty[j] = dirty[j - 1];
+            j--;
+        }
+        dirty[j] = e;
+    }
+
+    for (uint32_t i = 0; i < n; i++){
+        dirty[i]->dirty = false;
+        dirty[i]->writing = true;
+        dirty_count--;
+    }
+
+    for (uint32_t i = 0; i < n; i++){
+        bcache_entry *e = dirty[i];
+        if (disk_write_async(e->data, e->block * BCACHE_BLOCK_SECTORS, BCACHE_BLOCK_SECTORS, bcache_write_done, e)) continue;
+        irq_restore(*irq);
+        disk_write(e->data, e->block * BCACHE_BLOCK_SECTORS, BCACHE_BLOCK_SECTORS);
+        *irq = irq_save_disable();
+        e->writing = false;
+    }
+    bcache_wait_io(irq);
+}
+
+bool bcache_write(uint32_t dev, const void *buffer, uint32_t sector, uint32_t count){
+    if (!buffer || !count) return false;
+    irq_flags_t irq = irq_save_disable();
+    if (!bcache_setup()){
+        irq_restore(irq);
+        return false;
+    }
+
+    const uint8_t *in = (const uint8_t*)buffer;
+    uint32_t first = sector / BCACHE_BLOCK_SECTORS;
+    uint32_t last = (sector + count - 1) / BCACHE_BLOCK_SECTORS;
+    bool ok = true;
+    for (uint32_t block = first; block <= last; block++){
+        uint32_t block_sector = block * BCACHE_BLOCK_SECTORS;
+        uint32_t from = sector > block_sector ? sector - block_sector : 0;
+        uint32_t to = sector + count < block_sector + BCACHE_BLOCK_SECTORS ? sector + count - block_sector : BCACHE_BLOCK_SECTORS;
+
+        bcache_entry *e = 0;
+        if (from == 0 && to == BCACHE_BLOCK_SECTORS && !bcache_lookup(dev, block)) e = bcache_alloc(dev, block, &irq);
+        if (e) e->valid = true;
+        else e = bcache_get_loaded(dev, block, &irq);
+        if (!e){
+            ok = false;
+            break;
+        }
+        memcpy(e->data + (from * 512), in, (to - from) * 512);
+        in += (to - from) * 512;
+        lru_touch(e);
+        if (!e->dirty){
+            e->dirty = true;
+            dirty_count++;
+        }
+    }
+
+    if (dirty_count >= BCACHE_DIRTY_LIMIT) bcache_flush_locked(dev, &irq);
+    irq_restore(irq);
+    return ok;
+}
+
+void bcache_flush(uint32_t dev){
+    irq_flags_t irq = irq_save_disable();
+    if (bcache_ready && dirty_count) bcache_flush_locked(dev, &irq);
+    irq_restore(irq);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BCACHE_DEV_DISK 0
+
+#define BCACHE_BLOCK_SECTORS 8
+#define BCACHE_BLOCK_SIZE (BCACHE_BLOCK_SECTORS * 512)
+
+//Sector based access through the shared block cache. Writes stay in memory until bcache_flush or eviction
+bool bcache_read(uint32_t dev, void *buffer, uint32_t sector, uint32_t count);
+bool bcache_read_bytes(uint32_t dev, void *buffer, uint64_t offset, size_t size);
+bool bcache_write(uint32_t dev, const void *buffer, uint32_t sector, uint32_t count);
+//Only queues the reads so a run of calls merges into few requests, the caller follows up with disk_submit
+void bcache_prefetch(uint32_t dev, uint32_t sector, uint32_t count);
+void bcache_flush(uint32_t dev);
+
+#ifdef __cplusplus
+}
+#endif
@@ -7,12 +7,23 @@ extern "C" {
 #include "types.h"
 #include "files/system_module.h"
 
+#define DISK_IRQ 37
+
+typedef void (*disk_done_fn)(void *ctx, bool ok);
+
 bool init_disk_device();
 void disk_verbose();
 
 void disk_write(const void *buffer, uint32_t sector, uint32_t count);
 void disk_read(void *buffer, uint32_t sector, uint32_t count);
 
+//Queued requests for contiguous sectors are merged until disk_submit. done runs with interrupts disabled, buffers must stay valid until then
+bool disk_read_async(void *buffer, uint32_t sector, uint32_t count, disk_done_fn done, void *ctx);
+bool disk_write_async(const void *buffer, uint32_t sector, uint32_t count, disk_done_fn done, void *ctx);
+void disk_submit();
+void disk_wait_all();
+void disk_handle_interrupt();
+
 extern system_module disk_module;
 
 #ifdef __cplusplus
@@ -2,6 +2,7 @@
 
 #include "exfat.hpp"
 #include "disk.h"
+#include "bcache.h"
 #include "memory/page_allocator.h"
 #include "console/kio.h"
 #include "std/string.h"
@@ -16,7 +17,7 @@ void* ExFATFS::read_cluster(uint32_t cluster_start, uint32_t cluster_size, uint3
 
     void* buffer = (char*)kalloc(fs_page, cluster_count * cluster_size * 512, ALIGN_64B, MEM_PRIV_KERNEL);
     
-    disk_read(buffer, partition_first_sector + lba, count);
+    bcache_read(BCACHE_DEV_DISK, buffer, partition_first_sector + lba, count);
     
     return buffer;
 }
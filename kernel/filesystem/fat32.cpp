@@ -1,5 +1,6 @@
 #include "fat32.hpp"
 #include "disk.h"
+#include "bcache.h"
 #include "memory/page_allocator.h"
 #include "console/kio.h"
 #include "std/memory_access.h"
@@ -18,6 +19,8 @@
         }\
     })
 
+#define FAT32_PREFETCH_SECTORS (64 * BCACHE_BLOCK_SECTORS)
+
 bool FAT32FS::init(uint32_t partition_sector){
     fs_page = palloc(0x1000, MEM_PRIV_KERNEL, MEM_DEV | MEM_RW, false);
 
@@ -56,8 +59,9 @@ bool FAT32FS::init(uint32_t partition_sector){
     read_FAT(mbs->reserved_sectors, mbs->sectors_per_fat, mbs->number_of_fats);
 
     open_files = hash_map_create(512);
+    cluster_maps = hash_map_create(512);
 
-    return fat && open_files;
+    return fat && open_files && cluster_maps;
 }
 
 sizedptr FAT32FS::read_cluster(uint32_t cluster_start, uint32_t cluster_size, uint32_t cluster_count, uint32_t root_index){
@@ -68,7 +72,15 @@ sizedptr FAT32FS::read_cluster(uint32_t cluster_start, uint32_t cluster_size, ui
     void* buffer = kalloc(fs_page, size, ALIGN_64B, MEM_PRIV_KERNEL);
     if (!buffer) return (sizedptr){0, 0};
     
+    //Read-ahead the whole chain first so contiguous runs go out as a single request
     uint32_t next_index = root_index;
+    for (uint32_t i = 0; i < cluster_count && i * cluster_size < FAT32_PREFETCH_SECTORS && next_index >= 2 && next_index < total_fat_entries; i++){
+        bcache_prefetch(BCACHE_DEV_DISK, partition_first_sector + data_start_sector + ((next_index - 2) * cluster_size), cluster_size);
+        next_index = fat[next_index] & 0x0FFFFFFF;
+    }
+    disk_submit();
+
+    next_index = root_index;
     for (uint32_t i = 0; i < cluster_count; i++){
         if (next_index < 2 || next_index >= total_fat_entries){
             kprintfv("Cluster %i = %x (%x)",i,next_index,(cluster_start + ((next_index - 2) * cluster_size)) * 512);
@@ -77,7 +89,7 @@ sizedptr FAT32FS::read_cluster(uint32_t cluster_start, uint32_t cluster_size, ui
 
         uint32_t current_lba = partition_first_sector + data_start_sector + ((next_index - 2) * cluster_size);
         kprintfv("cluster %i = %x (%x)", i, next_index, current_lba * 512);
-        disk_read((void*)((uintptr_t)buffer + (i * cluster_size * 512)), current_lba, cluster_size);
+        bcache_read(BCACHE_DEV_DISK, (void*)((uintptr_t)buffer + (i * cluster_size * 512)), current_lba, cluster_size);
         next_index = fat[next_index] & 0x0FFFFFFF;
         if (next_index >= 0x0FFFFFF8) return (sizedptr){ (uintptr_t)buffer, size };
     }
@@ -98,7 +110,7 @@ bool FAT32FS::write_to_disk(u32 root_index, void *buf, size_t size){
     uint32_t next_index = root_index;
     for (uint32_t i = 0; i < new_cluster_count; i++){
         int32_t current_lba = partition_first_sector + data_start_sector + ((next_index - 2) * cluster_size);
-        disk_write((void*)((uptr)buf + (i * cluster_size * 512)), current_lba, cluster_size);
+        bcache_write(BCACHE_DEV_DISK, (void*)((uptr)buf + (i * cluster_size * 512)), current_lba, cluster_size);
         next_index = fat[next_index] & 0x0FFFFFFF;
         if (next_index >= 0x0FFFFFF8) return true;
     }
@@ -116,11 +128,11 @@ bool FAT32FS::write_section_to_cluster(u32 cluster, u32 offset, void *buf, size_
     
     void *initial = zalloc(512 * sector_count);
     
-    disk_read(initial, sector, sector_count);
+    bcache_read(BCACHE_DEV_DISK, initial, sector, sector_count);
     
     memcpy((void*)((uptr)initial + offset), buf, size);
     
-    disk_write(initial, sector, sector_count);
+    bcache_write(BCACHE_DEV_DISK, initial, sector, sector_count);
     
     return true;
 }
@@ -315,16 +327,43 @@ sizedptr FAT32FS::read_full_file(uint32_t cluster_start, uint32_t cluster_size,
 
 void FAT32FS::read_FAT(uint32_t location, uint32_t size, uint8_t count){
     fat = (uint32_t*)kalloc(fs_page, size * 512, ALIGN_64B, MEM_PRIV_KERNEL);
-    if (!fat) {
+    fat_dirty = (uint8_t*)kalloc(fs_page, (size + 7) / 8, ALIGN_64B, MEM_PRIV_KERNEL);
+    if (!fat || !fat_dirty || !bcache_read(BCACHE_DEV_DISK, (void*)fat, partition_first_sector + location, size)) {
+        if (fat) kfree(fat, size * 512);
+        if (fat_dirty) kfree(fat_dirty, (size + 7) / 8);
+        fat = 0;
+        fat_dirty = 0;
         total_fat_entries = 0;
         return;
     }
-    disk_read((void*)fat, partition_first_sector + location, size);
+    memset(fat_dirty, 0, (size + 7) / 8);
     total_fat_entries = (size * 512) / 4;
 }
 
+void FAT32FS::set_fat(u32 cluster, u32 value){
+    fat[cluster] = value;
+    u32 sector = cluster / FAT32_ENTRIES_PER_SECTOR;
+    fat_dirty[sector / 8] |= 1 << (sector % 8);
+}
+
+//Only the sectors whose entries changed go out, to every copy of the table, in runs of consecutive sectors
 void FAT32FS::write_FAT(u32 location, u32 size, u8 count){
-    disk_write((void*)fat, partition_first_sector + location, size);
+    u32 sector = 0;
+    while (sector < size){
+        if (!(fat_dirty[sector / 8] & (1 << (sector % 8)))) {
+            sector++;
+            continue;
+        }
+        u32 run = 0;
+        while (sector + run < size && (fat_dirty[(sector + run) / 8] & (1 << ((sector + run) % 8)))) {
+            fat_dirty[(sector + run) / 8] &= ~(1 << ((sector + run) % 8));
+            run++;
+        }
+        void *src = (void*)(fat + sector * FAT32_ENTRIES_PER_SECTOR);
+        for (u8 copy = 0; copy < count; copy++)
+            bcache_write(BCACHE_DEV_DISK, src, partition_first_sector + location + copy * size + sector, run);
+        sector += run;
+    }
 }
 
 uint32_t FAT32FS::count_FAT(uint32_t first){
@@ -363,7 +402,7 @@ bool FAT32FS::resize_fat(u32 start, u32 count){
         if (next_c == 0 || next_c >= 0x0FFFFFF8) {
             u32 new_cluster = alloc_fat();
             if (!new_cluster) return false;
-            fat[next] = new_cluster;
+            set_fat(next, new_cluster);
             next_c = new_cluster;
         }
         next = next_c;
@@ -371,7 +410,7 @@ bool FAT32FS::resize_fat(u32 start, u32 count){
     
     if (fat[next] != 0 && fat[next] < 0x0FFFFFF8) {
         dealloc_fat(next);
-        fat[next] = 0x0FFFFFFF;
+        set_fat(next, 0x0FFFFFFF);
     }
     
     write_FAT(mbs->reserved_sectors, mbs->sectors_per_fat, mbs->number_of_fats);
@@ -386,13 +425,13 @@ void FAT32FS::dealloc_fat(u32 cluster){
     if (fat[cluster] != 0 && fat[cluster] < 0x0FFFFFF8)
         dealloc_fat(fat[cluster]);
     
-    fat[cluster] = 0;
+    set_fat(cluster, 0);
 }
 
 u32 FAT32FS::alloc_fat(){
     for (u32 i = 3; i < total_fat_entries; i++){
         if (!fat[i]){
-            fat[i] = 0x0FFFFFFF;
+            set_fat(i, 0x0FFFFFFF);
             print("Allocated cluster %x (%x)",i,(partition_first_sector + data_start_sector + ((i - 2) * mbs->sectors_per_cluster)) * 512);
             return i;
         }
@@ -422,6 +461,52 @@ f32_walk_result FAT32FS::read_entry_handler(FAT32FS *instance, f32file_entry *en
     return {.entry = *entry, .cluster = 0, .offset = 0, .found = true};
 }
 
+f32_cluster_map* FAT32FS::build_cluster_map(u32 first_cluster){
+    u32 count = count_FAT(first_cluster);
+    if (!count) return 0;
+    f32_cluster_map *map = (f32_cluster_map*)kalloc(fs_page, sizeof(f32_cluster_map), ALIGN_64B, MEM_PRIV_KERNEL);
+    if (!map) return 0;
+    map->clusters = (u32*)kalloc(fs_page, count * sizeof(u32), ALIGN_64B, MEM_PRIV_KERNEL);
+    if (!map->clusters){
+        kfree(map, sizeof(f32_cluster_map));
+        return 0;
+    }
+    u32 next_index = first_cluster;
+    map->count = count;
+    for (u32 i = 0; i < count; i++){
+        bool valid = next_index >= 2 && next_index < total_fat_entries;
+        map->clusters[i] = valid ? next_index : 0;
+        if (valid) next_index = fat[next_index] & 0x0FFFFFFF;
+    }
+    return map;
+}
+
+void FAT32FS::free_cluster_map(f32_cluster_map *map){
+    if (!map) return;
+    kfree(map->clusters, map->count * sizeof(u32));
+    kfree(map, sizeof(f32_cluster_map));
+}
+
+//Reads straight from the block cache, merging runs of consecutive clusters into a single read
+size_t FAT32FS::read_mapped(f32_cluster_map *map, uint64_t offset, void *buf, size_t size){
+    u32 cluster_bytes = mbs->sectors_per_cluster * 512;
+    size_t done = 0;
+    while (done < size){
+        u32 index = offset / cluster_bytes;
+        if (index >= map->count || map->clusters[index] < 2) break;
+        u32 in_cluster = offset % cluster_bytes;
+        u32 run = 1;
+        while (index + run < map->count && map->clusters[index + run] == map->clusters[index] + run && (uint64_t)run * cluster_bytes - in_cluster < size - done)
+            run++;
+        size_t amount = min((uint64_t)run * cluster_bytes - in_cluster, (uint64_t)(size - done));
+        uint64_t lba = partition_first_sector + data_start_sector + ((uint64_t)(map->clusters[index] - 2) * mbs->sectors_per_cluster);
+        if (!bcache_read_bytes(BCACHE_DEV_DISK, (char*)buf + done, (lba * 512) + in_cluster, amount)) break;
+        done += amount;
+        offset += amount;
+    }
+    return done;
+}
+
 FS_RESULT FAT32FS::open_file(const char* path, file* descriptor){
     if (!mbs) return FS_RESULT_DRIVER_ERROR;
     uint64_t fid = reserve_fd_gid(path);
@@ -442,37 +527,31 @@ FS_RESULT FAT32FS::open_file(const char* path, file* descriptor){
     if (!walk_result.found) return FS_RESULT_NOTFOUND; 
     f32file_entry entry = walk_result.entry;
     uint32_t filecluster = (entry.hi_first_cluster << 16) | entry.lo_first_cluster;
-    uint32_t fat_count = count_FAT(filecluster);
-    sizedptr buf_ptr = read_full_file(data_start_sector, mbs->sectors_per_cluster, fat_count, entry.filesize, filecluster);
-    void *buf = (void*)buf_ptr.ptr;
-    if (!buf || !buf_ptr.size) return FS_RESULT_NOTFOUND;
+    if (!entry.filesize) return FS_RESULT_NOTFOUND;
+    //Contents are read on demand, the buffer is only filled in once the file is written to
+    f32_cluster_map *map = build_cluster_map(filecluster);
+    if (!map) return FS_RESULT_NOTFOUND;
     descriptor->id = fid;
-    descriptor->size = buf_ptr.size;
+    descriptor->size = entry.filesize;
     mfile = (module_file*)kalloc(fs_page, sizeof(module_file), ALIGN_64B, MEM_PRIV_KERNEL);
     if (!mfile) {
-        kfree(buf, buf_ptr.size ? buf_ptr.size : 1);
+        free_cluster_map(map);
         return FS_RESULT_DRIVER_ERROR;
     }
     memset(mfile, 0, sizeof(module_file));
-    mfile->file_size = buf_ptr.size;
+    mfile->file_size = entry.filesize;
     mfile->name = string_from_literal(fullpath);
-    mfile->file_buffer = (buffer){
-        .buffer = buf,
-        .buffer_size = buf_ptr.size,
-        .limit = buf_ptr.size,
-        .options = buffer_can_grow,
-        .cursor = 0,
-        .data_type = 0,
-    };
     mfile->ignore_cursor = false;
     mfile->fid = descriptor->id;
     mfile->serial = filecluster;
     mfile->references = 1;
     irq = irq_save_disable();
     int ok = hash_map_put(open_files, &fid, sizeof(uint64_t), mfile);
+    if (ok >= 0) ok = hash_map_put(cluster_maps, &fid, sizeof(uint64_t), map);
     irq_restore(irq);
     if (ok < 0) {
-        kfree(mfile->file_buffer.buffer, mfile->file_size ? mfile->file_size : 1);
+        hash_map_remove(open_files, &fid, sizeof(uint64_t), 0);
+        free_cluster_map(map);
         kfree(mfile, sizeof(module_file));
         return FS_RESULT_DRIVER_ERROR;
     }
@@ -491,8 +570,21 @@ size_t FAT32FS::read_file(file *descriptor, void* buf, size_t size){
         return 0;
     }
     if (size > mfile->file_size-descriptor->cursor) size = mfile->file_size-descriptor->cursor;
-    memcpy(buf, (char*)mfile->file_buffer.buffer + descriptor->cursor, size);
+    if (mfile->file_buffer.buffer){
+        memcpy(buf, (char*)mfile->file_buffer.buffer + descriptor->cursor, size);
+        irq_restore(irq);
+        return size;
+    }
+    f32_cluster_map *map = (f32_cluster_map*)hash_map_get(cluster_maps, &descriptor->id, sizeof(uint64_t));
+    if (!map) {
+        irq_restore(irq);
+        return 0;
+    }
+    //The disk is read with the lock dropped, the reference keeps a concurrent close from freeing the map under it
+    mfile->references++;
     irq_restore(irq);
+    size = read_mapped(map, descriptor->cursor, buf, size);
+    close_file(descriptor);
     return size;
 }
 
@@ -500,6 +592,20 @@ size_t FAT32FS::write_file(file *descriptor, const char* buf, size_t size){
     module_file *mfile  = (module_file*)hash_map_get(open_files, &descriptor->id, sizeof(uint64_t));
     if (!mfile) return 0;
     if (mfile->read_only) return 0;
+
+    if (!mfile->file_buffer.buffer){
+        u32 fat_count = count_FAT(mfile->serial);
+        sizedptr buf_ptr = read_full_file(data_start_sector, mbs->sectors_per_cluster, fat_count, mfile->file_size, mfile->serial);
+        if (!buf_ptr.ptr || !buf_ptr.size) return 0;
+        mfile->file_buffer = (buffer){
+            .buffer = (void*)buf_ptr.ptr,
+            .buffer_size = buf_ptr.size,
+            .limit = buf_ptr.size,
+            .options = buffer_can_grow,
+            .cursor = 0,
+            .data_type = 0,
+        };
+    }
     
     size_t written = buffer_write_to(&mfile->file_buffer, buf, size, descriptor->cursor);
     
@@ -521,9 +627,13 @@ void FAT32FS::close_file(file* descriptor){
     if (mfile->references) mfile->references--;
     if (mfile->references == 0){
         hash_map_remove(open_files, &descriptor->id, sizeof(uint64_t), 0);
+        f32_cluster_map *map = (f32_cluster_map*)hash_map_get(cluster_maps, &descriptor->id, sizeof(uint64_t));
+        hash_map_remove(cluster_maps, &descriptor->id, sizeof(uint64_t), 0);
         irq_restore(irq);
-        buffer_destroy(&mfile->file_buffer);
+        free_cluster_map(map);
+        if (mfile->file_buffer.buffer) buffer_destroy(&mfile->file_buffer);
         kfree(mfile, sizeof(module_file));
+        bcache_flush(BCACHE_DEV_DISK);
         return;
     }
     irq_restore(irq);
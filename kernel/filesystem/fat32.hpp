@@ -5,6 +5,8 @@
 #include "fsdriver.hpp"
 #include "data/struct/hashmap.h"
 
+#define FAT32_ENTRIES_PER_SECTOR (512 / 4)
+
 typedef struct fat32_mbs {
     uint8_t jumpboot[3];//3
     char fsname[8];//8
@@ -75,6 +77,12 @@ typedef struct f32longname {
     uint16_t name3[2];
 }__attribute__((packed)) f32longname;
 
+//Cluster numbers of an open file by index, so seeking doesn't need to walk the chain
+typedef struct {
+    u32 *clusters;
+    u32 count;
+} f32_cluster_map;
+
 class FAT32FS;
 
 typedef struct {
@@ -100,11 +108,15 @@ protected:
     sizedptr read_full_file(uint32_t cluster_start, uint32_t cluster_size, uint32_t cluster_count, uint64_t file_size, uint32_t root_index);
     void read_FAT(uint32_t location, uint32_t size, uint8_t count);
     void write_FAT(uint32_t location, uint32_t size, uint8_t count);
+    void set_fat(uint32_t cluster, uint32_t value);
     uint32_t count_FAT(uint32_t first);
     sizedptr list_directory(uint32_t cluster_count, uint32_t root_index);
     f32_walk_result walk_directory(uint32_t cluster_count, uint32_t root_index, const char *seek, f32_entry_handler handler);
     sizedptr read_cluster(uint32_t cluster_start, uint32_t cluster_size, uint32_t cluster_count, uint32_t root_index);
     bool write_to_disk(u32 cluster_start, void* buf, size_t size);
+    f32_cluster_map* build_cluster_map(u32 first_cluster);
+    void free_cluster_map(f32_cluster_map *map);
+    size_t read_mapped(f32_cluster_map *map, uint64_t offset, void *buf, size_t size);
     
     bool write_section_to_cluster(u32 cluster, u32 offset, void *buf, size_t size);
     u32 resolve_cluster_index(u32 start, u32 index);
@@ -118,6 +130,8 @@ protected:
     uint32_t cluster_count = 0;
     uint32_t data_start_sector = 0;
     uint32_t* fat = 0x0;
+    //One bit per FAT sector changed since the last write_FAT
+    uint8_t* fat_dirty = 0x0;
     uint32_t total_fat_entries = 0;
     uint16_t bytes_per_sector = 0;
     uint32_t partition_first_sector = 0;
@@ -131,4 +145,5 @@ protected:
     bool verbose = false;
 
     hash_map_t *open_files;
+    hash_map_t *cluster_maps;
 };
\ No newline at end of file
@@ -2,10 +2,13 @@
 #include "console/kio.h"
 #include "filesystem/modules/module_loader.h"
 #include "memory/page_allocator.h"
+#include "memory/slab.h"
 #include "exceptions/irq.h"
 #include "process/scheduler.h"
 #include "pipe.h"
 #include "files/dir_list.h"
+#include "process/poll.h"
+#include "process/loading/elf_cache.h"
 
 uint64_t fd_id = 256;//First byte reserved
 
@@ -17,11 +20,17 @@ typedef struct {
     uint64_t mfile_id;
     uint64_t file_id;
     size_t file_size;
+    //Where the last read through this descriptor ended, data past it makes the file poll readable
+    size_t read_cursor;
     uint16_t pid;
     system_module* mod;
+    //fs_file_key of the path it was opened with
+    uint64_t file_key;
+    poll_head_t poll;
 } open_file_descriptors;
 
 hash_map_t *open_files;
+static slab_cache *open_file_cache;
 
 void* page;
 
@@ -37,6 +46,7 @@ bool init_filesystem(){
     open_files = hash_map_create(1024);
     open_files->alloc = open_files_alloc;
     open_files->free = release;
+    open_file_cache = slab_cache_create("open_file", sizeof(open_file_descriptors), ALIGN_16B, MEM_RW, 0);
     const char *path = "disk";
     system_module *disk_mod = get_module(&path);
     if (disk_mod){
@@ -61,11 +71,24 @@ FS_RESULT open_file_global(module_root *root, const char* path, file* descriptor
     return FS_RESULT_SUCCESS;
 }
 
+uint64_t fs_file_key(module_root *root, const char* path, system_module **mod){
+    const char *search_path = path;
+    if (!search_path) return 0;
+    if (*search_path == '/') search_path++;
+    if (!*search_path) return 0;
+    system_module *module = get_module_from(root, &search_path);
+    if (!module) return 0;
+    if (mod) *mod = module;
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (const char *c = search_path; *c; c++) h = (h ^ (uint8_t)*c) * 0x100000001B3ULL;
+    return h;
+}
+
 FS_RESULT open_file(module_root *root, const char* path, file* descriptor){
     system_module *mod = 0;
     FS_RESULT result = open_file_global(root, path, descriptor, &mod);
     if (result != FS_RESULT_SUCCESS) return result;
-    open_file_descriptors *of = (open_file_descriptors*)open_files_alloc(sizeof(open_file_descriptors));
+    open_file_descriptors *of = (open_file_descriptors*)slab_alloc(open_file_cache);
     if (!of) {
         close_file_global(descriptor, mod);
         return FS_RESULT_DRIVER_ERROR;
@@ -74,6 +97,7 @@ FS_RESULT open_file(module_root *root, const char* path, file* descriptor){
     of->file_id = reserve_fd_id();
     of->file_size = descriptor->size;
     of->mod = mod;
+    of->file_key = fs_file_key(root, path, 0);
     of->pid = get_current_proc_pid();
     descriptor->id = of->file_id;
     irq_flags_t irq = irq_save_disable();
@@ -87,7 +111,7 @@ FS_RESULT open_file(module_root *root, const char* path, file* descriptor){
             .cursor = 0,
         };
         close_file_global(&tmp, mod);
-        release(of);
+        slab_free(open_file_cache, of);
         return FS_RESULT_DRIVER_ERROR;
     }
     return FS_RESULT_SUCCESS;
@@ -114,6 +138,10 @@ size_t read_file(file *descriptor, char* buf, size_t size){
     size_t amount_read = local.mod->read(&gfd, buf, size, start_cursor);
     descriptor->cursor = gfd.cursor != start_cursor ? gfd.cursor : start_cursor + amount_read;
     descriptor->size = gfd.size;
+    irq = irq_save_disable();
+    ofile = (open_file_descriptors *)hash_map_get(open_files, &descriptor->id, sizeof(uint64_t));
+    if (ofile) ofile->read_cursor = descriptor->cursor;
+    irq_restore(irq);
     return amount_read;
 }
 
@@ -124,6 +152,7 @@ void close_file(file *descriptor){
     hash_map_remove(open_files, &descriptor->id, sizeof(uint64_t), (void**)&ofile);
     irq_restore(irq);
     if (!ofile) return;
+    poll_head_detach(&ofile->poll);
     file gfd = (file){
         .id = ofile->mfile_id,
         .size = ofile->file_size,
@@ -131,7 +160,7 @@ void close_file(file *descriptor){
         .data_type = descriptor->data_type
     };
     close_file_global(&gfd, ofile->mod);
-    release(ofile);
+    slab_free(open_file_cache, ofile);
 }
 
 void close_file_global(file *descriptor, system_module *mod){
@@ -155,6 +184,7 @@ size_t write_file(file *descriptor, const char* buf, size_t size){
     if (ofile) local = *ofile;
     irq_restore(irq);
     if (!ofile || !local.mod || !local.mod->write || local.pid != get_current_proc_pid()) return 0;
+    if (!elf_cache_write_allowed(local.mod, local.file_key)) return 0;
     size_t start_cursor = descriptor->cursor;
     file gfd = (file){
         .id = local.mfile_id,
@@ -167,7 +197,10 @@ size_t write_file(file *descriptor, const char* buf, size_t size){
     descriptor->size = gfd.size;
     irq = irq_save_disable();
     ofile = (open_file_descriptors *)hash_map_get(open_files, &descriptor->id, sizeof(uint64_t));
-    if (ofile) ofile->file_size = gfd.size;
+    if (ofile) {
+        ofile->file_size = gfd.size;
+        if (amount_written) poll_head_wake(&ofile->poll, POLL_IN);
+    }
     irq_restore(irq);
 
     update_pipes(local.mfile_id, buf, amount_written);
@@ -248,6 +281,7 @@ bool truncate(file *descriptor, size_t size){
     if (ofile) local = *ofile;
     irq_restore(irq);
     if (!ofile || !local.mod || !local.mod->truncate || local.pid != get_current_proc_pid()) return false;
+    if (!elf_cache_write_allowed(local.mod, local.file_key)) return false;
 
     file gfd = (file){
         .id = local.mfile_id,
@@ -269,6 +303,22 @@ bool truncate(file *descriptor, size_t size){
     return true;
 }
 
+uint32_t file_poll(uint64_t file_id, uint16_t pid, poll_head_t **head){
+    if (head) *head = 0;
+    if (!open_files) return POLL_ERR;
+    irq_flags_t irq = irq_save_disable();
+    open_file_descriptors *ofile = (open_file_descriptors *)hash_map_get(open_files, &file_id, sizeof(uint64_t));
+    if (!ofile || ofile->pid != pid) {
+        irq_restore(irq);
+        return POLL_ERR;
+    }
+    if (head) *head = &ofile->poll;
+    uint32_t ev = POLL_OUT;
+    if (ofile->file_size > ofile->read_cursor) ev |= POLL_IN;
+    irq_restore(irq);
+    return ev;
+}
+
 void close_files_for_process(uint16_t pid){
     if (open_files) {
         for (;;) {
@@ -4,6 +4,7 @@
 #include "std/string.h"
 #include "files/system_module.h"
 #include "modules/module_loader.h"
+#include "process/poll.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,6 +12,8 @@ extern "C" {
 
 FS_RESULT open_file_global(module_root *root, const char* path, file* descriptor, system_module **mod);
 FS_RESULT open_file(module_root *root, const char* path, file* descriptor);
+//Same for every path that reaches the same file of the same module, 0 if none does. Paired with the module it returns in mod
+uint64_t fs_file_key(module_root *root, const char* path, system_module **mod);
 size_t read_file(file *descriptor, char* buf, size_t size);
 size_t write_file(file *descriptor, const char* buf, size_t size);
 void close_file_global(file *descriptor, system_module *mod);
@@ -26,6 +29,9 @@ size_t simple_write(module_root *root, const char *path, const void *buf, size_t
 
 void close_files_for_process(uint16_t pid);
 
+//Readable while the file has grown past the end of the last read through that descriptor, always writable
+uint32_t file_poll(uint64_t file_id, uint16_t pid, poll_head_t **head);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -1,17 +1,19 @@
 #include "pipe.h"
 #include "filesystem.h"
 #include "memory/page_allocator.h"
+#include "memory/slab.h"
 #include "data/struct/hashmap.h"
 #include "data/struct/linked_list.h"
 #include "process/scheduler.h"
 
-static void *pipe_page;
+static slab_cache *pipe_cache;
 hash_map_t *pipe_map;
 
 //TODO: options
 FS_RESULT create_pipe(module_root *root, const char *source, const char* destination, PIPE_OPTIONS options, file *out_fd){
-    if (!pipe_page) pipe_page = palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, false);
-    pipe_t *pipe = (pipe_t*)kalloc(pipe_page, sizeof(pipe_t), ALIGN_16B, MEM_PRIV_KERNEL);
+    if (!pipe_cache) pipe_cache = slab_cache_create("pipe", sizeof(pipe_t), ALIGN_16B, MEM_RW, 0);
+    pipe_t *pipe = (pipe_t*)slab_alloc(pipe_cache);
+    if (!pipe) return FS_RESULT_DRIVER_ERROR;
     pipe->pid = get_current_proc_pid();
     FS_RESULT result = open_file_global(root, source, &pipe->write_fd, &pipe->write_mod);
     if (result == FS_RESULT_SUCCESS){
@@ -32,7 +34,7 @@ FS_RESULT create_pipe(module_root *root, const char *source, const char* destina
             out_fd->size = pipe->read_fd.size;
         }
     }
-    if (result != FS_RESULT_SUCCESS) kfree(pipe, sizeof(pipe_t));
+    if (result != FS_RESULT_SUCCESS) slab_free(pipe_cache, pipe);
     return result;
 }
 
@@ -65,7 +67,7 @@ void close_pipe_list(void *key, uint64_t keylen, void *value){
 
             close_file_global(&pipe->write_fd, pipe->write_mod);
             close_file(&pipe->read_fd);
-            release(node->data);
+            slab_free(pipe_cache, pipe);
             release(node);
         }
     }
@@ -9,11 +9,18 @@
 #include "std/memory_access.h"
 #include "p9_helper.h"
 #include "filesystem/modules/module_loader.h"
+#include "memory/addr.h"
+#include "memory/mmu.h"
+#include "process/scheduler.h"
 
 #define VIRTIO_9P_ID 0x1009
 
 #define INVALID_FID UINT32_MAX
 
+#define P9_RREAD_HDR (sizeof(p9_packet_header) + sizeof(u32))
+//Most descriptors a read chunk can be split into, header and command included
+#define P9_READ_SEGS 20
+
 bool Virtio9PDriver::init(uint32_t partition_sector){
     uint64_t addr = find_pci_device(VIRTIO_VENDOR, VIRTIO_9P_ID);
     if (!addr){ 
@@ -67,69 +74,55 @@ FS_RESULT Virtio9PDriver::open_file(const char* path, file* descriptor){
         return FS_RESULT_SUCCESS;
     }
     irq_restore(irq);
-    uint32_t f = walk_dir(root, (char*)path);
-    if (f == INVALID_FID){
-        kprintf("[VIRTIO 9P error] failed to navigate to %s",path);
-        return FS_RESULT_NOTFOUND;
-    }
-    r_getattr *attr = get_attribute(f, P9_GETATTR_SIZE);
-    if (!attr) {
-        clunk(&np_dev, f);
-        return FS_RESULT_DRIVER_ERROR;
+
+    uint64_t size = 0;
+    uint32_t f = take_cached_fid(fid, &size);
+    if (f == INVALID_FID) {
+        f = walk_dir(root, (char*)path);
+        if (f == INVALID_FID){
+            kprintf("[VIRTIO 9P error] failed to navigate to %s",path);
+            return FS_RESULT_NOTFOUND;
+        }
+        r_getattr *attr = get_attribute(f, P9_GETATTR_SIZE);
+        if (!attr) {
+            clunk(&np_dev, f);
+            return FS_RESULT_DRIVER_ERROR;
+        }
+        size = read_unaligned64(&attr->size);
+        p9_free(attr);
+        if (open(f) == INVALID_FID){
+            clunk(&np_dev, f);
+            kprintf("[VIRTIO 9P error] failed to open %s",path);
+            return FS_RESULT_DRIVER_ERROR;
+        }
     }
-    uint64_t size = read_unaligned64(&attr->size);
-    p9_free(attr);
     descriptor->size = size;
-    void* file = kalloc(np_dev.memory_page, size ? size : 1, ALIGN_64B, MEM_PRIV_KERNEL);
-    if (!file) {
-        clunk(&np_dev, f);
-        return FS_RESULT_DRIVER_ERROR;
+
+    irq = irq_save_disable();
+    module_file *mfile = (module_file*)hash_map_get(open_files, &fid, sizeof(uint64_t));
+    if (mfile) {
+        //Someone else opened it while we were walking, share theirs
+        mfile->references++;
+        descriptor->size = mfile->file_size;
+        irq_restore(irq);
+        cache_fid(fid, f);
+        return FS_RESULT_SUCCESS;
     }
-    if (open(f) == INVALID_FID){
+    mfile = (module_file*)kalloc(np_dev.memory_page, sizeof(module_file), ALIGN_64B, MEM_PRIV_KERNEL);
+    if (!mfile) {
+        irq_restore(irq);
         clunk(&np_dev, f);
-        kfree(file, size ? size : 1);
-        kprintf("[VIRTIO 9P error] failed to open %s",path);
         return FS_RESULT_DRIVER_ERROR;
     }
-    if (size && read(f, 0, file) != size){
+    memset(mfile, 0, sizeof(module_file));
+    if (hash_map_put(open_files, &descriptor->id, sizeof(uint64_t), mfile) < 0) {
+        irq_restore(irq);
         clunk(&np_dev, f);
-        kfree(file, size ? size : 1);
-        kprintf("[VIRTIO 9P error] failed read file %s",path);
+        kfree(mfile, sizeof(module_file));
         return FS_RESULT_DRIVER_ERROR;
-    } 
-    irq = irq_save_disable();
-    module_file *mfile = (module_file*)hash_map_get(open_files, &fid, sizeof(uint64_t));
-    if (!mfile){
-        mfile = (module_file*)kalloc(np_dev.memory_page, sizeof(module_file), ALIGN_64B, MEM_PRIV_KERNEL);
-        if (!mfile) {
-            irq_restore(irq);
-            clunk(&np_dev, f);
-            kfree(file, size ? size : 1);
-            return FS_RESULT_DRIVER_ERROR;
-        }
-        memset(mfile, 0, sizeof(module_file));
-        mfile->serial = INVALID_FID;
-        if (hash_map_put(open_files, &descriptor->id, sizeof(uint64_t), mfile) < 0) {
-            irq_restore(irq);
-            clunk(&np_dev, f);
-            kfree(mfile, sizeof(module_file));
-            kfree(file, size ? size : 1);
-            return FS_RESULT_DRIVER_ERROR;
-        }
-    } else {
-        if (mfile->serial != INVALID_FID) clunk(&np_dev, (uint32_t)mfile->serial);
-        if (mfile->file_buffer.buffer) kfree(mfile->file_buffer.buffer, mfile->file_buffer.buffer_size ? mfile->file_buffer.buffer_size : 1);
     }
+    //Contents are read from the server on demand, nothing is buffered here
     mfile->file_size = size;
-    mfile->buf = (uptr)file;
-    mfile->file_buffer = (buffer){
-        .buffer = file,
-        .buffer_size = size,
-        .limit = size,
-        .options = buffer_opt_none,
-        .cursor = 0,
-        .data_type = 0,
-    };
     mfile->ignore_cursor = false;
     mfile->fid = descriptor->id;
     mfile->serial = f;
@@ -141,15 +134,22 @@ FS_RESULT Virtio9PDriver::open_file(const char* path, file* descriptor){
 size_t Virtio9PDriver::read_file(file *descriptor, void* buf, size_t size){
     irq_flags_t irq = irq_save_disable();
     module_file *mfile = (module_file*)hash_map_get(open_files, &descriptor->id, sizeof(uint64_t));
+    uint64_t serial = mfile ? mfile->serial : INVALID_FID;
     irq_restore(irq);
-    if (!mfile) return 0;
-    if (!sync_file(mfile) && !mfile->file_buffer.buffer && mfile->file_size) return 0;
-    if (descriptor->cursor > mfile->file_size) return 0;
-    if (size > mfile->file_size-descriptor->cursor) size = mfile->file_size-descriptor->cursor;
-    memcpy(buf, (char*)mfile->file_buffer.buffer + descriptor->cursor, size);
-    descriptor->cursor += size;
-    descriptor->size = mfile->file_size;
-    return size;
+    if (serial == INVALID_FID) return 0;
+    if (!size) return 0;
+
+    size_t got = read((u32)serial, descriptor->cursor, buf, size);
+
+    irq = irq_save_disable();
+    mfile = (module_file*)hash_map_get(open_files, &descriptor->id, sizeof(uint64_t));
+    if (mfile) {
+        if (descriptor->cursor + got > mfile->file_size) mfile->file_size = descriptor->cursor + got;
+        descriptor->size = mfile->file_size;
+    }
+    irq_restore(irq);
+    descriptor->cursor += got;
+    return got;
 }
 
 size_t Virtio9PDriver::write_file(file *descriptor, const char* buf, size_t size){
@@ -162,22 +162,7 @@ size_t Virtio9PDriver::write_file(file *descriptor, const char* buf, size_t size
     if (!written) return 0;
 
     size_t end = start + written;
-    if (end > mfile->file_buffer.buffer_size) {
-        void *new_buf = kalloc(np_dev.memory_page, end ? end : 1, ALIGN_64B, MEM_PRIV_KERNEL);
-        if (new_buf) {
-            if (mfile->file_buffer.buffer && mfile->file_size) memcpy(new_buf, mfile->file_buffer.buffer, mfile->file_size);
-            if (mfile->file_buffer.buffer) kfree(mfile->file_buffer.buffer, mfile->file_buffer.buffer_size ? mfile->file_buffer.buffer_size : 1);
-
-            mfile->file_buffer.buffer = new_buf;
-            mfile->file_buffer.buffer_size = end;
-            mfile->buf = (uptr)new_buf;
-        }
-    }
-
     if (end > mfile->file_size) mfile->file_size = end;
-    mfile->file_buffer.limit = mfile->file_size;
-
-    if (mfile->file_buffer.buffer && start + written <= mfile->file_buffer.buffer_size) memcpy((char*)mfile->file_buffer.buffer + start, buf, written);
 
     descriptor->size = mfile->file_size;
     return written;
@@ -197,17 +182,57 @@ void Virtio9PDriver::close_file(file* descriptor){
     }
     
     uint64_t serial = mfile->serial;
-    void *buf = mfile->file_buffer.buffer;
-    size_t buf_size = mfile->file_buffer.buffer_size ? mfile->file_buffer.buffer_size : 1;
 
     hash_map_remove(open_files, &descriptor->id, sizeof(uint64_t), 0);
     irq_restore(irq);
 
-    if (serial != INVALID_FID) clunk(&np_dev, (u32)serial);
-    if (buf) kfree(buf, buf_size);
+    if (serial != INVALID_FID) cache_fid(descriptor->id, (u32)serial);
     kfree(mfile, sizeof(module_file));
 }
 
+//Hands out the fid kept for gid if the file it names still exists, along with its current size
+uint32_t Virtio9PDriver::take_cached_fid(uint64_t gid, uint64_t *size){
+    uint32_t f = INVALID_FID;
+    irq_flags_t irq = irq_save_disable();
+    for (int i = 0; i < P9_FID_CACHE; i++) {
+        if (!fid_cache[i].used || fid_cache[i].gid != gid) continue;
+        f = fid_cache[i].fid;
+        fid_cache[i].used = false;
+        break;
+    }
+    irq_restore(irq);
+    if (f == INVALID_FID) return INVALID_FID;
+
+    //The fid pins the inode it was walked to. If the path was replaced or removed on the host that inode is unlinked
+    r_getattr *attr = get_attribute(f, P9_GETATTR_SIZE | P9_GETATTR_NLINK);
+    if (!attr || !read_unaligned64(&attr->nlink)) {
+        if (attr) p9_free(attr);
+        clunk(&np_dev, f);
+        return INVALID_FID;
+    }
+    *size = read_unaligned64(&attr->size);
+    p9_free(attr);
+    return f;
+}
+
+void Virtio9PDriver::cache_fid(uint64_t gid, uint32_t fid){
+    uint32_t evict = INVALID_FID;
+    irq_flags_t irq = irq_save_disable();
+    int slot = -1;
+    for (int i = 0; i < P9_FID_CACHE; i++) {
+        if (fid_cache[i].used && fid_cache[i].gid == gid) {
+            //Already holding one for this path, the newer fid replaces it
+            slot = i;
+            break;
+        }
+        if (slot < 0 || !fid_cache[i].used || (fid_cache[slot].used && fid_cache[i].last_use < fid_cache[slot].last_use)) slot = i;
+    }
+    if (fid_cache[slot].used) evict = fid_cache[slot].fid;
+    fid_cache[slot] = (p9_fid_entry){ .gid = gid, .fid = fid, .last_use = fid_clock++, .used = true };
+    irq_restore(irq);
+    if (evict != INVALID_FID) clunk(&np_dev, evict);
+}
+
 size_t Virtio9PDriver::list_contents(const char *path, void* buf, size_t size, uint64_t *offset){
     uint32_t d = walk_dir(root, (char*)path);
     if (d == INVALID_FID){
@@ -410,41 +435,133 @@ bool Virtio9PDriver::set_attribute(u32 fid, u64 mask, u64 value){
     return ok;
 }
 
-uint64_t Virtio9PDriver::read(u32 fid, u64 offset, void *file){
+uint32_t Virtio9PDriver::read_chunk(){
     uint32_t amount = 0x10000;
-    if (max_msize > sizeof(p9_packet_header) + sizeof(u32)) {
-        uint32_t transport_limit = (uint32_t)(max_msize - sizeof(p9_packet_header) - sizeof(u32));
+    if (max_msize > P9_RREAD_HDR) {
+        uint32_t transport_limit = (uint32_t)(max_msize - P9_RREAD_HDR);
         if (transport_limit < amount) amount = transport_limit;
     }
+    return amount;
+}
 
-    uint64_t total = 0;
-    while (1) {
-        t_read *cmd = make_p9_read_packet(fid, offset + total, amount);
-        void* resp = make_p9_sized_buffer(sizeof(p9_packet_header) + sizeof(u32) + amount);
-        
-        virtio_buf b[2] = {VBUF(cmd, read_unaligned32(&cmd->header.size), 0) ,VBUF(resp, sizeof(p9_packet_header) + sizeof(u32) + amount, VIRTQ_DESC_F_WRITE)};
-        virtio_send_nd(&np_dev, b, 2);
-    
-        if (!check_9p_success(resp)) {
-            p9_free(cmd);
-            p9_free(resp);
-            break;
+//Splits [buf, buf + len) into physically contiguous runs the device can write into. 0 if some page can't be resolved
+static uint16_t p9_dma_segments(void *buf, uint32_t len, virtio_buf *out, uint16_t max){
+    uintptr_t va = (uintptr_t)buf;
+    process_t *proc = 0;
+    uint16_t n = 0;
+    while (len) {
+        uint32_t chunk = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+        if (chunk > len) chunk = len;
+        paddr_t pa = 0;
+        if (kva_is_dmap((kaddr_t)va)) {
+            pa = dmap_kva_to_pa((kaddr_t)va);
+        } else {
+            uint64_t *root = 0;
+            if (va < HIGH_VA) {
+                if (!proc) proc = get_current_proc();
+                if (!proc || !proc->mm.ttbr0) return 0;
+                root = (uint64_t*)proc->mm.ttbr0;
+            }
+            int st = MMU_TR_OK;
+            pa = mmu_translate(root, va, &st);
+            if (st != MMU_TR_OK) return 0;
         }
-
-        uint32_t got = read_unaligned32((void*)((uptr)resp + sizeof(p9_packet_header)));
-        if (got > amount) {
-            p9_free(cmd);
-            p9_free(resp);
-            break;
+        if (!pa) return 0;
+        if (n && VIRT_TO_PHYS(out[n - 1].addr) + out[n - 1].len == pa) {
+            out[n - 1].len += chunk;
+        } else {
+            if (n == max) return 0;
+            out[n++] = VBUF(dmap_pa_to_kva(pa), chunk, VIRTQ_DESC_F_WRITE);
         }
+        va += chunk;
+        len -= chunk;
+    }
+    return n;
+}
 
-        memcpy((void*)((uptr)file + total), (void*)((uptr)resp + sizeof(p9_packet_header) + sizeof(u32)), got);
+//Queues one Tread without kicking. Returns 1 when queued, 0 when the ring is full and can_defer allows waiting
+//on earlier reads first, -1 on failure
+int Virtio9PDriver::read_submit(p9_read_op *op, u32 fid, u64 offset, uint8_t *dst, uint32_t want, bool can_defer){
+    virtio_buf b[P9_READ_SEGS];
+    uint16_t segs = p9_dma_segments(dst, want, b + 2, P9_READ_SEGS - 2);
+
+    op->cmd = make_p9_read_packet(fid, offset, want);
+    op->bounce = !segs;
+    op->resp = make_p9_sized_buffer(op->bounce ? P9_RREAD_HDR + want : P9_RREAD_HDR);
+    op->dst = dst;
+    op->want = want;
+    op->req = (virtio_request){};
+    if (!op->cmd || !op->resp) {
+        if (op->cmd) p9_free(op->cmd);
+        if (op->resp) p9_free(op->resp);
+        return -1;
+    }
 
-        p9_free(cmd);
-        p9_free(resp);
+    b[0] = VBUF(op->cmd, read_unaligned32(&op->cmd->header.size), 0);
+    b[1] = VBUF(op->resp, op->bounce ? P9_RREAD_HDR + want : P9_RREAD_HDR, VIRTQ_DESC_F_WRITE);
+    uint16_t n = 2 + segs;
+
+    uint16_t q = np_dev.current_queue;
+    while (virtio_queue_add(&np_dev, q, b, n, &op->req) < 0) {
+        if (n > np_dev.queues[q].size || can_defer) {
+            p9_free(op->cmd);
+            p9_free(op->resp);
+            return can_defer && n <= np_dev.queues[q].size ? 0 : -1;
+        }
+        if (!virtio_reap(&np_dev, q)) asm volatile ("yield");
+    }
+    return 1;
+}
+
+//Bytes the reply carried, UINT32_MAX if it failed. Frees the op's buffers either way
+uint32_t Virtio9PDriver::read_finish(p9_read_op *op){
+    uint32_t got = UINT32_MAX;
+    if (check_9p_success(op->resp)) {
+        got = read_unaligned32((void*)((uptr)op->resp + sizeof(p9_packet_header)));
+        if (got > op->want) got = UINT32_MAX;
+        else if (op->bounce) memcpy(op->dst, (void*)((uptr)op->resp + P9_RREAD_HDR), got);
+    }
+    p9_free(op->cmd);
+    p9_free(op->resp);
+    return got;
+}
 
+//Reads size bytes at offset with up to P9_READ_DEPTH Treads in flight, payloads are scattered straight into buf.
+//Stops at the first short reply, replies after it are drained and ignored
+uint64_t Virtio9PDriver::read(u32 fid, u64 offset, void *buf, u64 size){
+    uint32_t chunk = read_chunk();
+    uint16_t q = np_dev.current_queue;
+    p9_read_op ops[P9_READ_DEPTH];
+    uint32_t first = 0, pending = 0;
+    uint64_t issued = 0, total = 0;
+    bool done = false;
+
+    while (true) {
+        bool queued = false;
+        while (!done && pending < P9_READ_DEPTH && issued < size) {
+            uint32_t want = size - issued > chunk ? chunk : (uint32_t)(size - issued);
+            int r = read_submit(&ops[(first + pending) % P9_READ_DEPTH], fid, offset + issued, (uint8_t*)buf + issued, want, pending != 0);
+            if (r < 0) done = true;
+            if (r <= 0) break;
+            issued += want;
+            pending++;
+            queued = true;
+        }
+        if (queued) virtio_queue_kick(&np_dev, q);
+        if (!pending) break;
+
+        p9_read_op *op = &ops[first];
+        virtio_wait(&np_dev, q, &op->req);
+        uint32_t got = read_finish(op);
+        first = (first + 1) % P9_READ_DEPTH;
+        pending--;
+        if (done) continue;
+        if (got == UINT32_MAX) {
+            done = true;
+            continue;
+        }
         total += got;
-        if (!got) break;
+        if (got < op->want) done = true;
     }
 
     return total;
@@ -506,47 +623,15 @@ bool Virtio9PDriver::stat(const char *path, fs_stat *out_stat){
     return true;
 }
 
+//Picks up size changes made on the host, the contents themselves are always read from the server
 bool Virtio9PDriver::sync_file(module_file *mfile){
     if (!mfile || mfile->serial == INVALID_FID) return false;
 
-    r_getattr *attr = get_attribute((u32)mfile->serial, P9_GETATTR_SIZE | P9_GETATTR_MODE);
+    r_getattr *attr = get_attribute((u32)mfile->serial, P9_GETATTR_SIZE);
     if (!attr) return false;
 
-    size_t new_size = read_unaligned64(&attr->size);
+    mfile->file_size = read_unaligned64(&attr->size);
     p9_free(attr);
-
-    if (!new_size) {
-        if (mfile->file_buffer.buffer) kfree(mfile->file_buffer.buffer, mfile->file_buffer.buffer_size ? mfile->file_buffer.buffer_size : 1);
-        mfile->file_buffer.buffer = 0;
-        mfile->file_buffer.buffer_size = 0;
-        mfile->file_buffer.limit = 0;
-        mfile->buf = 0;
-        mfile->file_size = 0;
-        return true;
-    }
-
-    bool replace_buffer = new_size != mfile->file_buffer.buffer_size;
-    void *new_buf = mfile->file_buffer.buffer;
-    if (replace_buffer) {
-        new_buf = kalloc(np_dev.memory_page, new_size, ALIGN_64B, MEM_PRIV_KERNEL);
-        if (!new_buf) return false;
-    }
-
-    if (read((u32)mfile->serial, 0, new_buf) != new_size) {
-        if (replace_buffer) kfree(new_buf, new_size);
-        kprintf("[VIRTIO 9P error] failed to sync file with serial %x", (u32)mfile->serial);
-        return false;
-    }
-
-    if (replace_buffer) {
-        if (mfile->file_buffer.buffer) kfree(mfile->file_buffer.buffer, mfile->file_buffer.buffer_size ? mfile->file_buffer.buffer_size : 1);
-        mfile->file_buffer.buffer = new_buf;
-        mfile->file_buffer.buffer_size = new_size;
-    }
-
-    mfile->file_buffer.limit = new_size;
-    mfile->buf = (uptr)mfile->file_buffer.buffer;
-    mfile->file_size = new_size;
     return true;
 }
 
@@ -5,6 +5,28 @@
 #include "data/struct/hashmap.h"
 #include "p9_helper.h"
 
+//Treads kept outstanding by a single read
+#define P9_READ_DEPTH 8
+//Walked and opened fids kept after their last close, so reopening skips the walk
+#define P9_FID_CACHE 16
+
+typedef struct p9_read_op {
+    virtio_request req;
+    t_read *cmd;
+    void *resp;
+    //Payload goes here instead of the caller's buffer when the buffer couldn't be handed to the device
+    bool bounce;
+    uint8_t *dst;
+    uint32_t want;
+} p9_read_op;
+
+typedef struct p9_fid_entry {
+    uint64_t gid;
+    uint32_t fid;
+    uint32_t last_use;
+    bool used;
+} p9_fid_entry;
+
 class Virtio9PDriver : public FSDriver {
 public:
     bool init(uint32_t partition_sector) override;
@@ -23,7 +45,12 @@ private:
     uint32_t attach();
     size_t list_contents(uint32_t fid, void *buf, size_t size, uint64_t *offset);
     uint32_t walk_dir(uint32_t fid, char *path);
-    uint64_t read(uint32_t fid, uint64_t offset, void* file);
+    uint64_t read(uint32_t fid, uint64_t offset, void* buf, uint64_t size);
+    uint32_t read_chunk();
+    int read_submit(p9_read_op *op, uint32_t fid, uint64_t offset, uint8_t *dst, uint32_t want, bool can_defer);
+    uint32_t read_finish(p9_read_op *op);
+    uint32_t take_cached_fid(uint64_t gid, uint64_t *size);
+    void cache_fid(uint64_t gid, uint32_t fid);
     size_t write(u32 fid, u64 offset, size_t amount, const char* buf);
     r_getattr* get_attribute(uint32_t fid, uint64_t mask);
     bool set_attribute(u32 fid, u64 mask, u64 value);
@@ -33,4 +60,7 @@ private:
     uint32_t root = 0;
 
     hash_map_t *open_files = nullptr;
+
+    p9_fid_entry fid_cache[P9_FID_CACHE] = {};
+    uint32_t fid_clock = 0;
 };
\ No newline at end of file
@@ -0,0 +1,266 @@
+#include "smp.h"
+#include "hw/hw.h"
+#include "dtb.h"
+#include "console/kio.h"
+#include "exceptions/irq.h"
+#include "exceptions/timer.h"
+#include "exceptions/exception_handler.h"
+#include "memory/mmu.h"
+#include "memory/page_allocator.h"
+#include "memory/va_layout.h"
+#include "process/scheduler.h"
+#include "std/string.h"
+#include "sysregs.h"
+
+#define SMP_KSTACK_SIZE 0x10000
+#define SMP_ONLINE_TIMEOUT_MS 500
+
+#define PSCI_CPU_ON 0xC4000003u
+#define PSCI_SUCCESS 0
+#define PSCI_ALREADY_ON -4
+
+#define RPI_SPIN_TABLE_BASE 0xD8
+
+typedef enum {
+    SMP_METHOD_NONE,
+    SMP_METHOD_PSCI_HVC,
+    SMP_METHOD_PSCI_SMC,
+    SMP_METHOD_SPIN_TABLE,
+} smp_method;
+
+typedef struct {
+    uint64_t mpidr;
+    uint64_t release_addr;
+    smp_method method;
+} smp_cpu_desc;
+
+//Read by smp_secondary_entry with the MMU off, field offsets are hardcoded there
+typedef struct {
+    uint64_t mair;
+    uint64_t tcr;
+    uint64_t ttbr0;
+    uint64_t ttbr1;
+    uint64_t sctlr;
+    uint64_t stack;
+    uint64_t cpu;
+    uint64_t entry;
+} smp_boot_info_t;
+
+__attribute__((aligned(64)))
+smp_boot_info_t smp_boot_info;
+
+extern void smp_secondary_entry();
+
+static cpu_data_t cpus[MAX_CPUS];
+static volatile uint32_t cpu_count = 1;
+
+static smp_cpu_desc cpu_descs[MAX_CPUS];
+static uint32_t cpu_desc_count;
+static smp_method psci_method;
+
+static inline uint64_t psci_call(smp_method method, uint64_t fid, uint64_t x1, uint64_t x2, uint64_t x3){
+    register uint64_t r0 asm("x0") = fid;
+    register uint64_t r1 asm("x1") = x1;
+    register uint64_t r2 asm("x2") = x2;
+    register uint64_t r3 asm("x3") = x3;
+    if (method == SMP_METHOD_PSCI_SMC)
+        asm volatile("smc #0" : "+r"(r0), "+r"(r1), "+r"(r2), "+r"(r3) :: "x4", "x5", "x6", "x7", "memory");
+    else
+        asm volatile("hvc #0" : "+r"(r0), "+r"(r1), "+r"(r2), "+r"(r3) :: "x4", "x5", "x6", "x7", "memory");
+    return r0;
+}
+
+static inline uint64_t read_mpidr(){
+    uint64_t mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return mpidr & 0xFF00FFFFFFULL;
+}
+
+static inline void clean_dcache_range(uintptr_t start, size_t size){
+    for (uintptr_t p = start & ~63ULL; p < start + size; p += 64)
+        asm volatile("dc civac, %0" :: "r"(p) : "memory");
+    asm volatile("dsb sy" ::: "memory");
+}
+
+static int handle_psci_node(const char *propname, const void *prop, uint32_t len, dtb_match_t *match){
+    if (strcmp(propname, "method") == 0 && len){
+        match->compatible = (const char*)prop;
+        match->found = 1;
+    }
+    return 0;
+}
+
+//reg holds the MPIDR affinity, cpu-release-addr is kept in reg_size
+static int handle_cpu_node(const char *propname, const void *prop, uint32_t len, dtb_match_t *match){
+    const uint32_t *cells = (const uint32_t*)prop;
+    if (strcmp(propname, "reg") == 0 && len >= 4){
+        if (len >= 8) match->reg_base = ((uint64_t)__builtin_bswap32(cells[0]) << 32) | __builtin_bswap32(cells[1]);
+        else match->reg_base = __builtin_bswap32(cells[0]);
+        match->found = 1;
+    } else if (strcmp(propname, "enable-method") == 0 && len){
+        match->compatible = (const char*)prop;
+    } else if (strcmp(propname, "cpu-release-addr") == 0 && len >= 8){
+        match->reg_size = ((uint64_t)__builtin_bswap32(cells[0]) << 32) | __builtin_bswap32(cells[1]);
+    }
+    return 0;
+}
+
+static void cpu_node_done(dtb_match_t *match){
+    if (cpu_desc_count >= MAX_CPUS) return;
+    smp_cpu_desc *desc = &cpu_descs[cpu_desc_count];
+    desc->mpidr = match->reg_base;
+    desc->release_addr = match->reg_size;
+    desc->method = SMP_METHOD_NONE;
+    if (match->compatible && strcmp(match->compatible, "spin-table") == 0 && desc->release_addr)
+        desc->method = SMP_METHOD_SPIN_TABLE;
+    else if (match->compatible && strcmp(match->compatible, "psci") == 0)
+        desc->method = psci_method;
+    cpu_desc_count++;
+}
+
+static void smp_discover(){
+    if (USE_DTB){
+        dtb_match_t match = {0};
+        if (dtb_scan("psci", handle_psci_node, &match))
+            psci_method = strcmp(match.compatible, "smc") == 0 ? SMP_METHOD_PSCI_SMC : SMP_METHOD_PSCI_HVC;
+        match = (dtb_match_t){0};
+        dtb_scan_all("cpu@", handle_cpu_node, &match, cpu_node_done);
+        if (cpu_desc_count) return;
+    }
+
+    if (BOARD_TYPE == 1){
+        for (uint32_t i = 0; i < MAX_CPUS; i++)
+            cpu_descs[cpu_desc_count++] = (smp_cpu_desc){ .mpidr = i, .method = SMP_METHOD_PSCI_HVC };
+    } else if (RPI_BOARD == 4){
+        for (uint32_t i = 0; i < 4; i++)
+            cpu_descs[cpu_desc_count++] = (smp_cpu_desc){ .mpidr = i, .release_addr = RPI_SPIN_TABLE_BASE + 8*i, .method = SMP_METHOD_SPIN_TABLE };
+    } else if (RPI_BOARD >= 5){
+        for (uint32_t i = 0; i < 4; i++)
+            cpu_descs[cpu_desc_count++] = (smp_cpu_desc){ .mpidr = i << 8, .method = SMP_METHOD_PSCI_SMC };
+    }
+}
+
+//Identity maps the gigabyte holding the entry trampoline so the MMU can be turned on while still running from its physical address
+static uint64_t smp_trampoline_ttbr0(paddr_t entry_pa){
+    uint64_t *l0 = mmu_alloc();
+    uint64_t *l1 = mmu_alloc();
+    if (!l0 || !l1) return 0;
+    uint64_t attr = PTE_AF | (0b11ULL << PTE_SH_SHIFT) | ((uint64_t)MAIR_IDX_NORMAL << PTE_ATTR_SHIFT);
+    l1[(entry_pa >> 30) & 0x1FF] = (entry_pa & ~((1ULL << 30) - 1)) | attr | PD_BLOCK;
+    l0[(entry_pa >> 39) & 0x1FF] = (pt_va_to_pa(l1) & PTE_ADDR_MASK) | PD_TABLE;
+    clean_dcache_range((uintptr_t)l0, GRANULE_4KB);
+    clean_dcache_range((uintptr_t)l1, GRANULE_4KB);
+    return pt_va_to_pa(l0) & PTE_ADDR_MASK;
+}
+
+__attribute__((noreturn))
+void smp_secondary_main(uint32_t id){
+    cpu_data_t *cpu = &cpus[id];
+    asm volatile("msr tpidr_el1, %0" :: "r"(cpu));
+    set_exception_vectors();
+
+    mmu_swap_ttbr(0);
+    mmu_ttbr0_enable_user();
+    asm volatile("tlbi vmalle1\n\tdsb nsh\n\tisb" ::: "memory");
+
+    irq_init_cpu();
+    cpu->gic_mask = irq_cpu_interface_mask();
+    asm volatile("dmb ish" ::: "memory");
+    cpu->online = true;
+
+    disable_interrupt();
+    switch_proc(YIELD);
+    panic("secondary scheduler returned", id);
+    __builtin_unreachable();
+}
+
+static bool smp_kick(smp_cpu_desc *desc, paddr_t entry_pa){
+    if (desc->method == SMP_METHOD_PSCI_HVC || desc->method == SMP_METHOD_PSCI_SMC){
+        int64_t ret = (int64_t)psci_call(desc->method, PSCI_CPU_ON, desc->mpidr, entry_pa, 0);
+        return ret == PSCI_SUCCESS || ret == PSCI_ALREADY_ON;
+    }
+    if (desc->method == SMP_METHOD_SPIN_TABLE){
+        volatile uint64_t *release = (volatile uint64_t*)PHYS_TO_VIRT(desc->release_addr);
+        *release = entry_pa;
+        clean_dcache_range((uintptr_t)release, sizeof(uint64_t));
+        asm volatile("sev" ::: "memory");
+        return true;
+    }
+    return false;
+}
+
+void smp_init_boot_cpu(){
+    cpus[0].id = 0;
+    cpus[0].mpidr = read_mpidr();
+    cpus[0].online = true;
+    //The boot stack, exception entry from EL0 switches to it through tpidr_el1
+    cpus[0].ksp = (uintptr_t)ksp;
+    asm volatile("msr tpidr_el1, %0" :: "r"(&cpus[0]));
+}
+
+void smp_start_secondaries(){
+    if (RPI_BOARD == 3) return;
+    cpus[0].gic_mask = irq_cpu_interface_mask();
+    smp_discover();
+
+    paddr_t entry_pa = kimg_va_to_pa((kaddr_t)smp_secondary_entry);
+    uint64_t ttbr0 = smp_trampoline_ttbr0(entry_pa);
+    if (!ttbr0) return;
+
+    asm volatile("mrs %0, mair_el1" : "=r"(smp_boot_info.mair));
+    asm volatile("mrs %0, tcr_el1" : "=r"(smp_boot_info.tcr));
+    asm volatile("mrs %0, ttbr1_el1" : "=r"(smp_boot_info.ttbr1));
+    asm volatile("mrs %0, sctlr_el1" : "=r"(smp_boot_info.sctlr));
+    smp_boot_info.ttbr0 = ttbr0;
+    smp_boot_info.entry = (uint64_t)smp_secondary_main;
+
+    for (uint32_t i = 0; i < cpu_desc_count && cpu_count < MAX_CPUS; i++){
+        smp_cpu_desc *desc = &cpu_descs[i];
+        if ((desc->mpidr & 0xFF00FFFFFFULL) == cpus[0].mpidr || desc->method == SMP_METHOD_NONE) continue;
+
+        uint32_t id = cpu_count;
+        cpu_data_t *cpu = &cpus[id];
+        uintptr_t stack = (uintptr_t)palloc(SMP_KSTACK_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+        if (!stack) break;
+        cpu->id = id;
+        cpu->mpidr = desc->mpidr;
+        cpu->ksp = stack + SMP_KSTACK_SIZE;
+        cpu->online = false;
+        scheduler_init_cpu(id);
+
+        smp_boot_info.stack = cpu->ksp;
+        smp_boot_info.cpu = id;
+        clean_dcache_range((uintptr_t)&smp_boot_info, sizeof(smp_boot_info));
+
+        bool online = smp_kick(desc, entry_pa);
+        if (online){
+            uint64_t deadline = timer_now_msec() + SMP_ONLINE_TIMEOUT_MS;
+            while (!cpu->online && timer_now_msec() < deadline)
+                asm volatile("yield");
+            online = cpu->online;
+            if (!online) kprintf("[SMP] CPU %llx did not come online", desc->mpidr);
+        }
+        if (!online){
+            //The slot is handed to the next core, so nothing of this attempt may stay behind
+            scheduler_release_cpu(id);
+            pfree((void*)stack, SMP_KSTACK_SIZE);
+            *cpu = (cpu_data_t){0};
+            continue;
+        }
+        cpu_count++;
+    }
+    kprintf("[SMP] %i CPUs online", cpu_count);
+}
+
+uint32_t smp_cpu_count(){
+    return cpu_count;
+}
+
+cpu_data_t* smp_cpu(uint32_t id){
+    return id < cpu_count ? &cpus[id] : 0;
+}
+
+void smp_send_reschedule(uint32_t id){
+    if (id >= cpu_count || id == cpu_id()) return;
+    irq_send_ipi(cpus[id].gic_mask, IPI_RESCHEDULE);
+}
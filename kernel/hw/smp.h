@@ -0,0 +1,41 @@
+#pragma once
+
+#include "types.h"
+
+#define MAX_CPUS 8
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Offsets of the first three fields are used by the exception vectors and restore_context, keep them in place
+typedef struct cpu_data {
+    uintptr_t cpec;
+    uintptr_t ksp;
+    uintptr_t lock_release;
+    int syscall_depth;
+    uint32_t id;
+    uint64_t mpidr;
+    uint8_t gic_mask;
+    volatile bool online;
+} cpu_data_t;
+
+static inline cpu_data_t* this_cpu(){
+    cpu_data_t *cpu;
+    asm volatile("mrs %0, tpidr_el1" : "=r"(cpu));
+    return cpu;
+}
+
+static inline uint32_t cpu_id(){
+    return this_cpu()->id;
+}
+
+void smp_init_boot_cpu();
+void smp_start_secondaries();
+uint32_t smp_cpu_count();
+cpu_data_t* smp_cpu(uint32_t id);
+void smp_send_reschedule(uint32_t id);
+
+#ifdef __cplusplus
+}
+#endif
@@ -61,7 +61,8 @@ bool register_keypress(keypress kp) {
 
     if (buf->write_index == buf->read_index)
         buf->read_index = (buf->read_index + 1) % INPUT_BUFFER_CAPACITY;
-    
+
+    poll_head_wake(&target->input_poll, POLL_IN);
     return false;
 }
 
@@ -108,6 +109,8 @@ void register_event(kbd_event event){
 
     if (buf->write_index == buf->read_index)
         buf->read_index = (buf->read_index + 1) % INPUT_BUFFER_CAPACITY;
+
+    poll_head_wake(&target->input_poll, POLL_IN);
 }
 
 void mouse_config(gpu_point point, gpu_size size){
@@ -268,6 +271,16 @@ bool sys_read_input(int pid, keypress *out){
     return true;
 }
 
+uint32_t sys_poll_input(uint16_t pid, poll_head_t **head){
+    process_t *process = get_proc_by_pid(pid);
+    if (head) *head = process ? &process->input_poll : 0;
+    if (!process) return POLL_ERR;
+    uint32_t ev = 0;
+    if (process->input_buffer.read_index != process->input_buffer.write_index) ev |= POLL_IN;
+    if (process->event_buffer.read_index != process->event_buffer.write_index) ev |= POLL_IN;
+    return ev;
+}
+
 bool sys_shortcut_triggered_current(uint16_t sid){
     bool value = sys_shortcut_triggered(get_current_proc_pid(), sid);
     return value;
@@ -4,6 +4,7 @@
 #include "keyboard_input.h"
 #include "mouse_input.h"
 #include "graphic_types.h"
+#include "process/poll.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,6 +36,9 @@ bool sys_read_input_current(keypress *out);
 bool sys_read_event(int pid, kbd_event *out);
 bool sys_read_event_current(kbd_event *out);
 
+//Readable while either of the process' key or event buffers has entries
+uint32_t sys_poll_input(uint16_t pid, poll_head_t **head);
+
 bool sys_shortcut_triggered_current(uint16_t sid);
 bool sys_shortcut_triggered(uint16_t pid, uint16_t sid);
 
@@ -29,6 +29,7 @@
 #include "utils/utils.h"
 #include "tools/tools.h"
 #include "process/environment/environment.h"
+#include "hw/smp.h"
 
 extern void trace();
 
@@ -36,6 +37,7 @@ extern char __bss_start[];
 extern char __bss_end[];
 void kernel_main(uint64_t board_type, uint64_t dtb_pa) {
     memset(__bss_start, 0, (size_t)((uintptr_t)__bss_end - (uintptr_t)__bss_start));
+    smp_init_boot_cpu();
     BOARD_TYPE = (uint8_t)board_type;
     dtb_set_pa(dtb_pa);
     if (dtb_get_header()) USE_DTB = 1;
@@ -102,6 +104,10 @@ void kernel_main(uint64_t board_type, uint64_t dtb_pa) {
     if (!run_tests()) panic("Test run failed",0);
 #endif
 
+#if BENCH
+    run_benchmarks();
+#endif
+
     if (usb_available) init_usb_process();
 
     if (network_available && system_config.use_net) launch_net_process();
@@ -3,15 +3,59 @@
 #include "memory/addr.h"
 #include "std/memory.h"
 #include "memory/mm_process.h"
+#include "memory/zero_pool.h"
+#include "process/loading/elf_cache.h"
+#include "alloc/allocate.h"
+
+static bool mm_grow(void **array, uint16_t *cap, uint16_t need, size_t entry){
+    if (need <= *cap) return true;
+    if (need > MAX_VMAS) return false;
+    uint32_t grown = *cap ? (uint32_t)*cap * 2 : MM_VMAS_MIN;
+    while (grown < need) grown *= 2;
+    if (grown > MAX_VMAS) grown = MAX_VMAS;
+    void *fresh = zalloc(grown * entry);
+    if (!fresh) return false;
+    if (*array) {
+        memcpy(fresh, *array, *cap * entry);
+        release(*array);
+    }
+    *array = fresh;
+    *cap = (uint16_t)grown;
+    return true;
+}
+
+void mm_release_vmas(mm_struct *mm){
+    if (!mm) return;
+    if (mm->vmas) release(mm->vmas);
+    if (mm->mmap_free) release(mm->mmap_free);
+    mm->vmas = 0;
+    mm->mmap_free = 0;
+    mm->vma_count = mm->vma_cap = mm->vma_hint = 0;
+    mm->mmap_free_count = mm->mmap_free_cap = 0;
+}
+
+//First vma ending above va, vma_count if there's none
+static uint16_t mm_vma_index(mm_struct *mm, uaddr_t va){
+    uint16_t lo = 0;
+    uint16_t hi = mm->vma_count;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        if (mm->vmas[mid].end <= va) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
 
 vma* mm_find_vma(mm_struct *mm, uaddr_t va){
-    if (!mm) return 0;
-    for (uint16_t i = 0; i < mm->vma_count; i++){
-        vma *m = &mm->vmas[i];
-        if (va < m->start) return 0;
-        if (va < m->end) return m;
+    if (!mm || !mm->vma_count) return 0;
+    if (mm->vma_hint < mm->vma_count) {
+        vma *m = &mm->vmas[mm->vma_hint];
+        if (va >= m->start && va < m->end) return m;
     }
-    return 0;
+    uint16_t i = mm_vma_index(mm, va);
+    if (i >= mm->vma_count || va < mm->vmas[i].start) return 0;
+    mm->vma_hint = i;
+    return &mm->vmas[i];
 }
 
 bool mm_add_vma(mm_struct *mm, uaddr_t start, uaddr_t end, uint8_t prot, uint8_t kind, uint8_t flags){
@@ -19,13 +63,10 @@ bool mm_add_vma(mm_struct *mm, uaddr_t start, uaddr_t end, uint8_t prot, uint8_t
     start &= ~(PAGE_SIZE - 1);
     end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     if (start >= end) return false;
-    if (mm->vma_count >= MAX_VMAS) return false;
 
-    uint16_t ins = 0;
-    while (ins < mm->vma_count && mm->vmas[ins].start < start) ins++;
-
-    if (ins > 0 && start < mm->vmas[ins - 1].end) return false;
+    uint16_t ins = mm_vma_index(mm, start);
     if (ins < mm->vma_count && end > mm->vmas[ins].start) return false;
+    if (!mm_grow((void**)&mm->vmas, &mm->vma_cap, mm->vma_count + 1, sizeof(vma))) return false;
 
     for (uint16_t i = mm->vma_count; i > ins; i--) mm->vmas[i] = mm->vmas[i - 1];
 
@@ -61,7 +102,7 @@ bool mm_remove_vma(mm_struct *mm, uaddr_t start, uaddr_t end) {
     end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     if (start >= end) return false;
 
-    for (uint16_t i = 0; i < mm->vma_count; i++) {
+    for (uint16_t i = mm_vma_index(mm, start); i < mm->vma_count; i++) {
         vma *m = &mm->vmas[i];
         if (end <= m->start) return false;
         if (start >= m->end) continue;
@@ -84,7 +125,8 @@ bool mm_remove_vma(mm_struct *mm, uaddr_t start, uaddr_t end) {
             free_end = m->end;
             m->end = start;
         } else {
-            if (mm->vma_count >= MAX_VMAS) return false;
+            if (!mm_grow((void**)&mm->vmas, &mm->vma_cap, mm->vma_count + 1, sizeof(vma))) return false;
+            m = &mm->vmas[i];
             free_start = start;
             free_end = end;
             for (uint16_t j = mm->vma_count; j > i + 1; j--) mm->vmas[j] = mm->vmas[j-1];
@@ -106,7 +148,7 @@ bool mm_remove_vma(mm_struct *mm, uaddr_t start, uaddr_t end) {
             if (mm->mmap_free[ins - 1].end < free_end) mm->mmap_free[ins - 1].end = free_end;
             ins--;
         } else {
-            if (mm->mmap_free_count >= MAX_VMAS) return true;
+            if (!mm_grow((void**)&mm->mmap_free, &mm->mmap_free_cap, mm->mmap_free_count + 1, sizeof(mm_free_range))) return true;
             for (uint16_t j = mm->mmap_free_count; j > ins; j--) mm->mmap_free[j] = mm->mmap_free[j - 1];
             mm->mmap_free[ins] = (mm_free_range){free_start, free_end};
             mm->mmap_free_count++;
@@ -160,6 +202,69 @@ uaddr_t mm_alloc_mmap(mm_struct *mm, size_t size, uint8_t prot, uint8_t kind, ui
     return base;
 }
 
+static bool mm_page_mapped(process_t *proc, uintptr_t va){
+    int st = MMU_TR_OK;
+    mmu_translate((uint64_t*)proc->mm.ttbr0, va, &st);
+    return st == MMU_TR_OK;
+}
+
+static bool mm_cow_copy(process_t *proc, vma *m, uintptr_t va, paddr_t shared);
+
+static bool mm_fault_map_page(process_t *proc, vma *m, uintptr_t va, bool is_write){
+    if (m->kind == VMA_KIND_FILE) {
+        paddr_t shared = elf_image_page(proc->mm.image, va);
+        if (!shared) return false;
+        proc->mm.fault_pages++;
+        if (is_write && (m->flags & VMA_FLAG_COW)) return mm_cow_copy(proc, m, va, shared);
+        uint8_t prot = m->prot;
+        if (m->flags & VMA_FLAG_COW) prot &= ~MEM_RW;
+        mmu_map_4kb((uint64_t*)proc->mm.ttbr0, va, shared, MAIR_IDX_NORMAL, prot | MEM_NORM, MEM_PRIV_USER);
+        return true;
+    }
+
+    bool zero = m->kind != VMA_KIND_ANON || (m->flags & VMA_FLAG_ZERO);
+    paddr_t phys = zero ? zero_pool_alloc_page() : palloc_inner(PAGE_SIZE, MEM_PRIV_USER, MEM_RW, true, false);
+    if (!phys) return false;
+
+    mmu_map_4kb((uint64_t*)proc->mm.ttbr0, va, phys, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER);
+
+    if (m->kind == VMA_KIND_ANON) proc->mm.rss_anon_pages++;
+    proc->mm.fault_pages++;
+    return true;
+}
+
+//Swaps the image page mapped at va for a private copy with the vma's full permissions
+static bool mm_cow_copy(process_t *proc, vma *m, uintptr_t va, paddr_t shared){
+    paddr_t copy = palloc_inner(PAGE_SIZE, MEM_PRIV_USER, MEM_RW, true, false);
+    if (!copy) return false;
+    memcpy((void*)dmap_pa_to_kva(copy), (void*)dmap_pa_to_kva(shared), PAGE_SIZE);
+
+    //Break before make, the old entry was valid and may be cached
+    uintptr_t page = va & ~(PAGE_SIZE - 1);
+    if (mmu_unmap_and_get_pa((uint64_t*)proc->mm.ttbr0, page, 0)) mmu_flush_va(proc->mm.asid, page);
+    mmu_map_4kb((uint64_t*)proc->mm.ttbr0, page, copy, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER);
+    mmu_publish_entries();
+    proc->mm.faults_cow++;
+    return true;
+}
+
+static paddr_t mm_image_page(process_t *proc, uintptr_t va){
+    if (!proc->mm.image) return 0;
+    int st = MMU_TR_OK;
+    paddr_t pa = mmu_translate((uint64_t*)proc->mm.ttbr0, va & ~(PAGE_SIZE - 1), &st);
+    if (st != MMU_TR_OK || !elf_image_owns(proc->mm.image, va & ~(PAGE_SIZE - 1), pa)) return 0;
+    return pa;
+}
+
+bool mm_make_writable(process_t *proc, uintptr_t va){
+    if (!proc || !proc->mm.ttbr0) return false;
+    vma *m = mm_find_vma(&proc->mm, va);
+    if (!m || !(m->flags & VMA_FLAG_COW)) return true;
+    paddr_t shared = mm_image_page(proc, va);
+    if (!shared) return true;
+    return mm_cow_copy(proc, m, va, shared);
+}
+
 bool mm_try_handle_page_fault(process_t *proc, uintptr_t far, uint64_t esr) {
     if (!proc || !proc->mm.ttbr0) return false;
 
@@ -173,11 +278,19 @@ bool mm_try_handle_page_fault(process_t *proc, uintptr_t far, uint64_t esr) {
 
     if (ifsc >= 0x9 && ifsc <= 0xB) {
         if (!mmu_set_access_flag((uint64_t*)proc->mm.ttbr0, far)) return false;
-        mmu_flush_asid(proc->mm.asid);
+        mmu_flush_va(proc->mm.asid, far);
+        proc->mm.faults_access++;
         return true;
     }
 
-    if (ifsc >= 0xD && ifsc <= 0xF) return false;
+    if (ifsc >= 0xD && ifsc <= 0xF) {
+        if (!is_write) return false;
+        vma *m = mm_find_vma(&proc->mm, far);
+        if (!m || !(m->flags & VMA_FLAG_COW) || !(m->prot & MEM_RW)) return false;
+        paddr_t shared = mm_image_page(proc, far);
+        if (!shared) return false;
+        return mm_cow_copy(proc, m, far, shared);
+    }
     if (ifsc < 0x4 || ifsc > 0x7) return false;
 
     uintptr_t va_page = far & ~(PAGE_SIZE-1);
@@ -195,37 +308,56 @@ bool mm_try_handle_page_fault(process_t *proc, uintptr_t far, uint64_t esr) {
         uintptr_t grow_to = proc->mm.stack_commit;
         if (va_page < grow_to) grow_to = va_page;
         if (((proc->mm.stack_top - grow_to) / PAGE_SIZE) > proc->mm.cap_stack_pages) return false;
+        uint64_t mapped = 0;
         for (uintptr_t page = proc->mm.stack_commit - PAGE_SIZE; page >= grow_to; page -= PAGE_SIZE) {
-            paddr_t phys = palloc_inner(PAGE_SIZE, MEM_PRIV_USER, MEM_RW, true, false);
+            paddr_t phys = zero_pool_alloc_page();
             if (!phys) {
                 for (uintptr_t undo = page + PAGE_SIZE; undo < proc->mm.stack_commit; undo += PAGE_SIZE) {
                     uint64_t pa = 0;
                     if (!mmu_unmap_and_get_pa((uint64_t*)proc->mm.ttbr0, undo, &pa)) continue;
+                    //Valid for a moment, a speculative walk may have cached it
+                    mmu_flush_va(proc->mm.asid, undo);
                     pfree((void*)dmap_pa_to_kva((paddr_t)pa), PAGE_SIZE);
                     if (proc->mm.rss_stack_pages) proc->mm.rss_stack_pages--;
                 }
                 return false;
             }
-            memset((void*)dmap_pa_to_kva(phys), 0, PAGE_SIZE);
             mmu_map_4kb((uint64_t*)proc->mm.ttbr0, page, phys, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER);
             proc->mm.rss_stack_pages++;
+            mapped++;
             if (page == 0) break;
         }
         proc->mm.stack_commit = grow_to;
-        mmu_flush_asid(proc->mm.asid);
+        mmu_publish_entries();
+        proc->mm.faults++;
+        proc->mm.fault_pages += mapped;
         return true;
     }
 
     if (m->kind == VMA_KIND_ANON && proc->mm.rss_anon_pages >= proc->mm.cap_anon_pages) return false;
 
-    paddr_t phys = palloc_inner(PAGE_SIZE, MEM_PRIV_USER, MEM_RW, true, false);
-    if (!phys) return false;
-
-    if (m->kind != VMA_KIND_ANON || (m->flags & VMA_FLAG_ZERO)) memset((void*)dmap_pa_to_kva(phys), 0, PAGE_SIZE);
-    mmu_map_4kb((uint64_t*)proc->mm.ttbr0, va_page, phys, MAIR_IDX_NORMAL, m->prot | MEM_NORM, MEM_PRIV_USER);
-    mmu_flush_asid(proc->mm.asid);
-
-    if (m->kind == VMA_KIND_ANON) proc->mm.rss_anon_pages++;
+    if (!mm_fault_map_page(proc, m, va_page, is_write)) return false;
+    proc->mm.faults++;
+
+    //Neighbours in the same aligned window are likely to be touched next, map them now instead of trapping for each.
+    //File pages are only mapped if the image already has them, reading the disk here would stall with the lock held
+    //and interrupts masked for pages that may never be touched. Best effort, running out of memory or quota here just leaves them to their own faults
+    uintptr_t window = (uintptr_t)MM_FAULT_AROUND_PAGES * PAGE_SIZE;
+    if (window > PAGE_SIZE) {
+        uintptr_t lo = va_page & ~(window - 1);
+        uintptr_t hi = lo + window;
+        if (lo < m->start) lo = m->start;
+        if (hi > m->end || hi < lo) hi = m->end;
+        for (uintptr_t page = lo; page < hi; page += PAGE_SIZE) {
+            if (page == va_page) continue;
+            if (m->kind == VMA_KIND_ANON && proc->mm.rss_anon_pages >= proc->mm.cap_anon_pages) break;
+            if (mm_page_mapped(proc, page)) continue;
+            if (m->kind == VMA_KIND_FILE && !elf_image_peek(proc->mm.image, page)) continue;
+            if (!mm_fault_map_page(proc, m, page, false)) break;
+            proc->mm.fault_around_pages++;
+        }
+    }
 
+    mmu_publish_entries();
     return true;
 }
@@ -9,13 +9,21 @@ typedef struct process process_t;
 #define VMA_FLAG_USERALLOC 2
 #define VMA_FLAG_ZERO 4
 #define VMA_FLAG_NOFREE 8
+//Mapped read only from the process' shared elf image, written pages get a private copy
+#define VMA_FLAG_COW 16
 #define VMA_KIND_ELF 1
 #define VMA_KIND_STACK 2
 #define VMA_KIND_ANON 3
 #define VMA_KIND_SPECIAL 4
+//Demand paged from the file of the process' elf image
+#define VMA_KIND_FILE 5
 
-#define MAX_VMAS 128
+//Vma and free range arrays start at MM_VMAS_MIN entries and double as needed
+#define MM_VMAS_MIN 16
+#define MAX_VMAS 4096
 #define MM_GAP_PAGES 16
+//Pages mapped around a demand fault, the aligned window containing it clipped to its vma. Power of two, 1 maps only the faulting page
+#define MM_FAULT_AROUND_PAGES 16
 
 typedef struct vma {
     uaddr_t start;
@@ -35,10 +43,15 @@ typedef struct mm_struct {
     paddr_t ttbr0_phys;
     uint16_t asid;
     uint32_t asid_gen;
-    vma vmas[MAX_VMAS];
+    //Sorted by start and never overlapping, so lookups can bisect
+    vma *vmas;
     uint16_t vma_count;
-    mm_free_range mmap_free[MAX_VMAS];
+    uint16_t vma_cap;
+    //Index of the last vma mm_find_vma returned, faults and user copies tend to hit the same one again
+    uint16_t vma_hint;
+    mm_free_range *mmap_free;
     uint16_t mmap_free_count;
+    uint16_t mmap_free_cap;
     uaddr_t mmap_bottom;
     uaddr_t mmap_top;
     uaddr_t mmap_cursor;
@@ -49,10 +62,22 @@ typedef struct mm_struct {
     uint64_t rss_anon_pages;
     uint64_t cap_stack_pages;
     uint64_t cap_anon_pages;
+    //Demand faults served and the pages they mapped, fault_around_pages of those weren't the faulting one
+    uint64_t faults;
+    uint64_t fault_pages;
+    uint64_t fault_around_pages;
+    uint64_t faults_access;
+    uint64_t faults_cow;
+    //Shared segments this process was launched from, its pages belong to the image and aren't freed with the process
+    struct elf_image *image;
 } mm_struct;
 
 vma* mm_find_vma(mm_struct *mm, uaddr_t va);
 bool mm_add_vma(mm_struct *mm, uaddr_t start, uaddr_t end, uint8_t prot, uint8_t kind, uint8_t flags);
 bool mm_remove_vma(mm_struct *mm, uaddr_t start, uaddr_t end);
 uaddr_t mm_alloc_mmap(mm_struct *mm, size_t size, uint8_t prot, uint8_t kind, uint8_t flags);
-bool mm_try_handle_page_fault(process_t *proc, uintptr_t far, uint64_t esr);
\ No newline at end of file
+//Frees the vma and free range arrays, the mappings themselves are the caller's
+void mm_release_vmas(mm_struct *mm);
+bool mm_try_handle_page_fault(process_t *proc, uintptr_t far, uint64_t esr);
+//Breaks copy on write for the page at va before the kernel or a device writes to it behind the mmu's back
+bool mm_make_writable(process_t *proc, uintptr_t va);
@@ -17,6 +17,7 @@
 #include "alloc/mem_types.h"
 #include "memory/talloc.h"
 #include "memory/va_layout.h"
+#include "hw/smp.h"
 
 extern char kcode_end;
 
@@ -50,9 +51,15 @@ static uint32_t asid_max;
 static uint32_t asid_next;
 static uint64_t asid_used[65536/64];
 
-static uint64_t pttbr_hw;
-static uint16_t pttbr_asid;
-static uintptr_t *pttbr;
+static uint64_t pttbr_hw_cpu[MAX_CPUS];
+static uint16_t pttbr_asid_cpu[MAX_CPUS];
+static uintptr_t *pttbr_cpu[MAX_CPUS];
+//Address space each core is running, kept across a rollover so it doesn't have to switch to pick up a new asid
+static mm_struct *pttbr_mm_cpu[MAX_CPUS];
+
+#define pttbr_hw (pttbr_hw_cpu[cpu_id()])
+#define pttbr_asid (pttbr_asid_cpu[cpu_id()])
+#define pttbr (pttbr_cpu[cpu_id()])
 
 static inline uint64_t make_pte(uint64_t pa, uint64_t attr_index, uint8_t mem_attr, uint8_t level, uint64_t type) {
     uint64_t sh = (mem_attr & MEM_DEV) ? 0 : 0b11;
@@ -308,7 +315,7 @@ static inline void mmu_flush_all() {
 
 static inline void mmu_flush_icache() {
     asm volatile (
-        "ic iallu\n"         // Invalidate all instruction caches to PoU
+        "ic ialluis\n"       // Invalidate all instruction caches to PoU (Inner Shareable)
         "isb\n"              // Ensure completion before continuing
         ::: "memory"
     );
@@ -804,6 +811,7 @@ void mmu_ttbr0_enable_user() {
 }
 
 void mmu_swap_ttbr(mm_struct *mm){
+    pttbr_mm_cpu[cpu_id()] = mm && mm->ttbr0 ? mm : 0;
     if (mm && mm->ttbr0) {
         pttbr = mm->ttbr0;
         pttbr_asid = mm->asid & asid_mask;
@@ -823,6 +831,19 @@ void mmu_flush_asid(uint16_t asid) {
     asm volatile("dsb ish\n\tisb" ::: "memory");
 }
 
+//Single page of a single address space, for entries that were valid before and changed
+void mmu_flush_va(uint16_t asid, uint64_t va) {
+    uint64_t v = ((uint64_t)(asid & asid_mask) << asid_shift) | ((va >> 12) & 0xFFFFFFFFFFFULL);
+    asm volatile("dsb ishst" ::: "memory");
+    asm volatile("tlbi vae1is, %0":: "r"(v) : "memory");
+    asm volatile("dsb ish\n\tisb" ::: "memory");
+}
+
+//Invalid entries are never cached, so entries that only went from invalid to valid just need to be visible to the walker
+void mmu_publish_entries() {
+    asm volatile("dsb ishst\n\tisb" ::: "memory");
+}
+
 void mmu_asid_ensure(mm_struct *mm) {
     if (!mm) return;
     if (!asid_max) return;
@@ -846,17 +867,30 @@ void mmu_asid_ensure(mm_struct *mm) {
             return;
         }
 
+        //Every asid is handed out again from here, except the ones other cores are running right now.
+        //Those carry over to the new generation, so no two address spaces ever share one
         asid_gen++;
-        mmu_flush_all();
         memset(asid_used, 0, sizeof(asid_used));
         asid_used[0] = 1;
         asid_next = 1;
+        uint32_t self = cpu_id();
+        for (uint32_t c = 0; c < MAX_CPUS; c++) {
+            mm_struct *active = pttbr_mm_cpu[c];
+            if (c == self || !active || !active->asid || active == mm) continue;
+            uint32_t a = (uint32_t)(active->asid & asid_mask);
+            asid_used[a >> 6] |= 1ULL << (a & 63);
+            active->asid_gen = asid_gen;
+        }
+        //Broadcast, entries of the retired asids are dropped on every core
+        mmu_flush_all();
     }
 }
 
 void mmu_asid_release(mm_struct *mm){
     if (!mm || !mm->asid) return;
     if (!asid_max) return;
+    for (uint32_t c = 0; c < MAX_CPUS; c++)
+        if (pttbr_mm_cpu[c] == mm) pttbr_mm_cpu[c] = 0;
     if (mm->asid_gen != asid_gen) {
         mm->asid = 0;
         mm->asid_gen = 0;
@@ -49,6 +49,8 @@ void mmu_swap_ttbr(mm_struct *mm);
 void mmu_ttbr0_disable_user();
 void mmu_ttbr0_enable_user();
 void mmu_flush_asid(uint16_t asid);
+void mmu_flush_va(uint16_t asid, uint64_t va);
+void mmu_publish_entries();
 void mmu_asid_ensure(mm_struct *mm);
 void mmu_asid_release(mm_struct *mm);
 bool mmu_unmap_and_get_pa(uint64_t *table, uint64_t va, uint64_t *pa);
@@ -8,6 +8,9 @@
 #include "sysregs.h"
 #include "memory/addr.h"
 #include "exceptions/exception_handler.h"
+#include "memory/slab.h"
+#include "memory/zero_pool.h"
+#include "exceptions/spinlock.h"
 
 #define PD_TABLE 0b11
 #define PD_BLOCK 0b01
@@ -27,28 +30,38 @@ typedef struct {
     uint32_t alloc_size;
 } alloc_tag;
 
-typedef struct {
-    uint64_t phys_base;
-    uint64_t size;
-    uint64_t owner_phys;
-} big_alloc_entry;
-
-#define BIG_ALLOC_ENTRIES ((PAGE_SIZE - 16) / sizeof(big_alloc_entry))
+#define BUDDY_MAX_ORDER 20
+#define BUDDY_NONE UINT32_MAX
 
-typedef struct big_alloc_page {
-    struct big_alloc_page* next;
-    uint32_t count;
-    uint32_t pad;
-    big_alloc_entry entries[BIG_ALLOC_ENTRIES];
-} big_alloc_page;
+#define PAGE_STATE_ORDER_MASK 0x3F
+#define PAGE_STATE_SLAB 0x40
+#define PAGE_STATE_BIG 0x80
 
+//Per page metadata, indexed relative to the start of RAM.
+//Free block heads use next/prev as their free list links. Pages that own kalloc'd big allocations keep them in a list starting at children,
+//and the first page of each big allocation records its size, owner and siblings
+typedef struct {
+    uint32_t next;
+    uint32_t prev;
+    uint32_t pages;
+    uint32_t owner;
+    uint32_t children;
+} page_meta;
 
 uintptr_t *mem_bitmap;
-static big_alloc_page* big_alloc_meta = 0;
+static page_meta *page_metas;
+//order + 1 for the head of a free block, PAGE_STATE_BIG for the first page of a big allocation, PAGE_STATE_SLAB for slab pages
+static uint8_t *page_states;
+static uint32_t free_heads[BUDDY_MAX_ORDER + 1];
+//Pages sitting in the free lists, kept by buddy_push/buddy_unlink so splits and merges cancel out
+static uint64_t free_page_count = 0;
+//Guards the buddy lists, the bitmap, page_states and page_metas. Kernel processes allocate without the kernel lock,
+//so this is what keeps cores apart. Innermost lock, nothing that takes another lock runs under it
+static spinlock_t page_alloc_lock;
+static uint64_t meta_base_page = 0;
 
 static uint64_t alloc_min_page = 0;
 static uint64_t alloc_max_page = 0;
-static uint64_t alloc_hint_page = 0;
 static uint64_t bitmap_page_count = 0;
 
 static bool page_alloc_verbose = false;
@@ -68,6 +81,8 @@ void page_alloc_enable_high_va(){
     if (!mem_bitmap) return;
     if (page_alloc_high_va) return;
     mem_bitmap = (uintptr_t*)PHYS_TO_VIRT((uintptr_t)mem_bitmap);
+    page_metas = (page_meta*)PHYS_TO_VIRT((uintptr_t)page_metas);
+    page_states = (uint8_t*)PHYS_TO_VIRT((uintptr_t)page_states);
     page_alloc_high_va = true;
 }
 
@@ -88,6 +103,173 @@ static inline uint64_t lowmask64(uint64_t bits) {
     return (1ull << bits) - 1ull;
 }
 
+static inline bool bitmap_test(uint64_t page){
+    return (mem_bitmap[page / 64] >> (page % 64)) & 1;
+}
+
+//Sets or clears a run of pages a word at a time
+static void bitmap_set_range(uint64_t page, uint64_t count, bool used){
+    while (count){
+        uint64_t offset = page % 64;
+        uint64_t bits = 64 - offset < count ? 64 - offset : count;
+        uint64_t mask = lowmask64(bits) << offset;
+        if (used) mem_bitmap[page / 64] |= mask;
+        else mem_bitmap[page / 64] &= ~mask;
+        page += bits;
+        count -= bits;
+    }
+}
+
+static bool bitmap_range_used(uint64_t page, uint64_t count){
+    while (count){
+        uint64_t offset = page % 64;
+        uint64_t bits = 64 - offset < count ? 64 - offset : count;
+        uint64_t mask = lowmask64(bits) << offset;
+        if ((mem_bitmap[page / 64] & mask) != mask) return false;
+        page += bits;
+        count -= bits;
+    }
+    return true;
+}
+
+static inline uint32_t meta_index(uint64_t page){
+    return (uint32_t)(page - meta_base_page);
+}
+
+static inline bool page_has_meta(uint64_t page){
+    return page_metas && page >= meta_base_page && page < alloc_max_page;
+}
+
+static void buddy_push(uint64_t page, uint8_t order){
+    uint32_t r = meta_index(page);
+    page_metas[r].prev = BUDDY_NONE;
+    page_metas[r].next = free_heads[order];
+    if (free_heads[order] != BUDDY_NONE) page_metas[free_heads[order]].prev = r;
+    free_heads[order] = r;
+    page_states[r] = order + 1;
+    free_page_count += 1ULL << order;
+}
+
+static void buddy_unlink(uint32_t r){
+    uint8_t order = (page_states[r] & PAGE_STATE_ORDER_MASK) - 1;
+    page_meta *m = &page_metas[r];
+    if (m->prev != BUDDY_NONE) page_metas[m->prev].next = m->next;
+    else free_heads[order] = m->next;
+    if (m->next != BUDDY_NONE) page_metas[m->next].prev = m->prev;
+    page_states[r] = 0;
+    free_page_count -= 1ULL << order;
+}
+
+//Adds a free block, merging it with its buddy for as long as the buddy is free as a whole
+static void buddy_insert(uint64_t page, uint8_t order){
+    while (order < BUDDY_MAX_ORDER){
+        uint64_t buddy = page ^ (1ULL << order);
+        if (buddy < alloc_min_page || buddy + (1ULL << order) > alloc_max_page) break;
+        uint32_t br = meta_index(buddy);
+        if ((page_states[br] & PAGE_STATE_ORDER_MASK) != order + 1) break;
+        buddy_unlink(br);
+        if (buddy < page) page = buddy;
+        order++;
+    }
+    buddy_push(page, order);
+}
+
+static void buddy_insert_range(uint64_t page, uint64_t count){
+    while (count){
+        uint8_t order = 0;
+        while (order < BUDDY_MAX_ORDER && !(page & (1ULL << order)) && (2ULL << order) <= count) order++;
+        buddy_insert(page, order);
+        page += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+static bool buddy_find_block(uint64_t page, uint64_t *head, uint8_t *order){
+    for (uint8_t o = 0; o <= BUDDY_MAX_ORDER; o++){
+        uint64_t h = page & ~((1ULL << o) - 1);
+        if (h < alloc_min_page) break;
+        if ((page_states[meta_index(h)] & PAGE_STATE_ORDER_MASK) == o + 1){
+            *head = h;
+            *order = o;
+            return true;
+        }
+    }
+    return false;
+}
+
+//Takes pages marked used from outside the allocator out of the free blocks holding them
+static void buddy_reserve_range(uint64_t page, uint64_t count){
+    uint64_t end = page + count;
+    if (page < alloc_min_page) page = alloc_min_page;
+    if (end > alloc_max_page) end = alloc_max_page;
+    while (page < end){
+        uint64_t head;
+        uint8_t order;
+        if (!buddy_find_block(page, &head, &order)){
+            page++;
+            continue;
+        }
+        uint64_t block_end = head + (1ULL << order);
+        uint64_t used_end = end < block_end ? end : block_end;
+        buddy_unlink(meta_index(head));
+        if (head < page) buddy_insert_range(head, page - head);
+        if (used_end < block_end) buddy_insert_range(used_end, block_end - used_end);
+        page = used_end;
+    }
+}
+
+//Smallest block that fits, split down to size with the unused tail given back
+static uint64_t buddy_alloc(uint64_t page_count){
+    uint8_t order = 0;
+    while (order <= BUDDY_MAX_ORDER && (1ULL << order) < page_count) order++;
+    if (order > BUDDY_MAX_ORDER) return 0;
+
+    uint8_t o = order;
+    while (o <= BUDDY_MAX_ORDER && free_heads[o] == BUDDY_NONE) o++;
+    if (o > BUDDY_MAX_ORDER) return 0;
+
+    uint32_t r = free_heads[o];
+    buddy_unlink(r);
+    uint64_t page = meta_base_page + r;
+    while (o > order){
+        o--;
+        buddy_push(page + (1ULL << o), o);
+    }
+    if (page_count < (1ULL << order))
+        buddy_insert_range(page + page_count, (1ULL << order) - page_count);
+
+    for (uint64_t i = 0; i < page_count; i++){
+        page_metas[r + i] = (page_meta){ .next = BUDDY_NONE, .prev = BUDDY_NONE, .pages = 0, .owner = BUDDY_NONE, .children = BUDDY_NONE };
+        page_states[r + i] = 0;
+    }
+    return page;
+}
+
+static void big_alloc_link(uint64_t head, uint64_t owner, uint64_t pages){
+    uint32_t r = meta_index(head);
+    page_meta *m = &page_metas[r];
+    m->pages = (uint32_t)pages;
+    m->owner = page_has_meta(owner) ? meta_index(owner) : BUDDY_NONE;
+    m->prev = BUDDY_NONE;
+    m->next = BUDDY_NONE;
+    if (m->owner != BUDDY_NONE){
+        m->next = page_metas[m->owner].children;
+        if (m->next != BUDDY_NONE) page_metas[m->next].prev = r;
+        page_metas[m->owner].children = r;
+    }
+    page_states[r] = PAGE_STATE_BIG;
+}
+
+static void big_alloc_unlink(uint32_t r){
+    page_meta *m = &page_metas[r];
+    if (m->prev != BUDDY_NONE) page_metas[m->prev].next = m->next;
+    else if (m->owner != BUDDY_NONE && page_metas[m->owner].children == r) page_metas[m->owner].children = m->next;
+    if (m->next != BUDDY_NONE) page_metas[m->next].prev = m->prev;
+    m->next = m->prev = m->owner = BUDDY_NONE;
+    m->pages = 0;
+    page_states[r] = 0;
+}
+
 void pfree(void* ptr, uint64_t size) {
     if (!ptr || !size) return;
     if (!alloc_max_page) page_alloc_init();
@@ -99,15 +281,30 @@ void pfree(void* ptr, uint64_t size) {
     addr /= PAGE_SIZE;
     if (addr < alloc_min_page || addr + pages > alloc_max_page) panic("pfree out of range", (uintptr_t)ptr);
 
-    for (uint64_t i = 0; i < pages; i++){
-        uint64_t index = addr + i;
-        uint64_t table_index = index/64;
-        uint64_t table_offset = index % 64;
-        mem_bitmap[table_index] &= ~(1ULL << table_offset);
+    irq_flags_t irq = spin_lock_irqsave(&page_alloc_lock);
+    if (page_states[meta_index(addr)] & PAGE_STATE_BIG) big_alloc_unlink(meta_index(addr));
+
+    if (bitmap_range_used(addr, pages)){
+        bitmap_set_range(addr, pages, false);
+        buddy_insert_range(addr, pages);
+        spin_unlock_irqrestore(&page_alloc_lock, irq);
+        return;
     }
 
-    if (addr < alloc_hint_page) alloc_hint_page = addr;
-    if (alloc_hint_page < alloc_min_page) alloc_hint_page = alloc_min_page;
+    //Part of the range was already free, only give back what was actually in use
+    uint64_t run = 0;
+    for (uint64_t i = 0; i <= pages; i++){
+        if (i < pages && bitmap_test(addr + i)){
+            run++;
+            continue;
+        }
+        if (run){
+            bitmap_set_range(addr + i - run, run, false);
+            buddy_insert_range(addr + i - run, run);
+        }
+        run = 0;
+    }
+    spin_unlock_irqrestore(&page_alloc_lock, irq);
 }
 
 void free_managed_page(void* ptr){
@@ -117,23 +314,22 @@ void free_managed_page(void* ptr){
     if ((owner_phys & HIGH_VA) == HIGH_VA) owner_phys = VIRT_TO_PHYS(owner_phys);
     owner_phys &= ~0xFFFULL;
 
-    big_alloc_page* mp = big_alloc_meta;
-    while (mp){
-        for (uint32_t i = 0; i < mp->count;){
-            if (mp->entries[i].owner_phys != owner_phys){
-                i++;
-                continue;
-            } 
-
-            uint64_t phys_base = mp->entries[i].phys_base;
-            uint64_t size = mp->entries[i].size;
-
-            mp->count--;
-            mp->entries[i] = mp->entries[mp->count];
-
-            pfree(PHYS_TO_VIRT_P((void*)phys_base), size);
+    uint64_t owner = owner_phys / PAGE_SIZE;
+    if (page_has_meta(owner)){
+        uint32_t r = meta_index(owner);
+        while (true){
+            irq_flags_t irq = spin_lock_irqsave(&page_alloc_lock);
+            uint32_t child = page_metas[r].children;
+            if (child == BUDDY_NONE){
+                spin_unlock_irqrestore(&page_alloc_lock, irq);
+                break;
+            }
+            uint64_t pages = page_metas[child].pages;
+            bool big = (page_states[child] & PAGE_STATE_BIG) && pages;
+            if (!big) big_alloc_unlink(child);
+            spin_unlock_irqrestore(&page_alloc_lock, irq);
+            if (big) pfree(PHYS_TO_VIRT_P((void*)((meta_base_page + child) * PAGE_SIZE)), pages * PAGE_SIZE);
         }
-        mp = mp->next;
     }
 
     mem_page *info = (mem_page*)ptr;
@@ -150,17 +346,23 @@ static void page_alloc_init(){
 
     uint64_t words = (end_page + 63) /64;
     uint64_t bytes = words * sizeof(uint64_t);
-    bitmap_page_count = count_pages(bytes, PAGE_SIZE);
+    uint64_t meta_count = end_page - start_page;
+    uint64_t metas_offset = (bytes + 15) & ~15ULL;
+    uint64_t states_offset = metas_offset + (meta_count * sizeof(page_meta));
+    bitmap_page_count = count_pages(states_offset + meta_count, PAGE_SIZE);
 
     uint64_t sctlr = 0;
     asm volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
+    uintptr_t base = ram_start;
     if ((sctlr & 1) != 0) {
-        mem_bitmap = (uintptr_t*)PHYS_TO_VIRT(ram_start);
+        base = PHYS_TO_VIRT(ram_start);
         page_alloc_high_va = true;
     } else {
-        mem_bitmap = (uintptr_t*)ram_start;
         page_alloc_high_va = false;
     }
+    mem_bitmap = (uintptr_t*)base;
+    page_metas = (page_meta*)(base + metas_offset);
+    page_states = (uint8_t*)(base + states_offset);
     memset(mem_bitmap, 0, bitmap_page_count * PAGE_SIZE);
 
     if (end_page & 63) {
@@ -170,7 +372,11 @@ static void page_alloc_init(){
 
     alloc_min_page = start_page + bitmap_page_count;
     alloc_max_page = end_page;
-    alloc_hint_page = alloc_min_page;
+    meta_base_page = start_page;
+
+    for (uint32_t o = 0; o <= BUDDY_MAX_ORDER; o++)
+        free_heads[o] = BUDDY_NONE;
+    buddy_insert_range(alloc_min_page, alloc_max_page - alloc_min_page);
 
     heap_end = alloc_min_page * PAGE_SIZE;
     mark_used(ram_start, bitmap_page_count);
@@ -185,137 +391,78 @@ void setup_page(uintptr_t address, uint8_t attributes){
     new_info->attributes = attributes;
 }
 
+//Claims page_count pages from the buddy and marks them used
+static uint64_t page_alloc_take(uint64_t page_count){
+    irq_flags_t irq = spin_lock_irqsave(&page_alloc_lock);
+    uint64_t first_page = buddy_alloc(page_count);
+    if (first_page) bitmap_set_range(first_page, page_count, true);
+    spin_unlock_irqrestore(&page_alloc_lock, irq);
+    return first_page;
+}
+
 paddr_t palloc_inner(uint64_t size, uint8_t level, uint8_t attributes, bool full, bool map) {
     if (!alloc_max_page) page_alloc_init();
     if (!page_alloc_high_va) page_alloc_enable_high_va();
     uint64_t page_count = count_pages(size,PAGE_SIZE);
-    uint64_t reg_min = alloc_min_page / 64;
-    uint64_t reg_end = (alloc_max_page + 63) / 64;
-    uint64_t reg_hint = alloc_hint_page / 64;
-
-    if (page_count > 64){
-        kprintfv("[page_alloc] Large allocation > 64p");
-        uint64_t reg_count = page_count/64;
-        uint8_t fractional = page_count % 64;
-        reg_count += fractional > 0;
-        uint64_t align_regs = 1;
-        if (size >= GRANULE_2MB && (size & (GRANULE_2MB - 1)) == 0) align_regs = GRANULE_2MB / (PAGE_SIZE * 64);
-
-        for (int pass = 0; pass < 2; pass++) {
-        uint64_t i0 = pass == 0 ? reg_hint : reg_min;
-        uint64_t i1 = pass == 0 ? reg_end : reg_hint;
-        for (uint64_t i = i0; i + reg_count <= i1; i++) {
-            if (align_regs > 1 && (i % align_regs) != 0) continue;
-            bool found = true;
-            for (uint64_t j = 0; j < reg_count; j++){
-                if (fractional && j == reg_count-1)
-                    found &= (mem_bitmap[i + j] & lowmask64(fractional)) == 0;
-                else
-                    found &= mem_bitmap[i + j] == 0;
-                
-                if (!found) break;
-            }
-            if (found){
-                for (uint64_t j = 0; j < reg_count; j++){
-                    if (fractional && j == reg_count-1)
-                        mem_bitmap[i+j] |= lowmask64(fractional);
-                    else
-                        mem_bitmap[i+j] = UINT64_MAX;
-                }
-
-                alloc_hint_page = (i * 64) + page_count;
-                if (alloc_hint_page < alloc_min_page) alloc_hint_page = alloc_min_page;
-                mem_page* prev_page = 0;
-                for (uint32_t p = 0; p < page_count; p++){
-                    uintptr_t address = ((i * 64) + p) * PAGE_SIZE;
-                    if (map){
-                        if ((attributes & MEM_DEV) != 0 && level == MEM_PRIV_KERNEL)
-                            register_device_memory(address, address);
-                        else if (level != MEM_PRIV_USER)
-                            register_proc_memory(address, address, attributes, level);
-                        if (!full){
-                            setup_page(address, attributes);
-
-                            mem_page* curr = (mem_page*)PHYS_TO_VIRT(address);
-                            if (prev_page) prev_page->next = curr;
-                            prev_page = curr;
-
-                            memset((void*)PHYS_TO_VIRT(address +sizeof(mem_page)), 0, PAGE_SIZE - sizeof(mem_page));
-                        } else {
-                            memset((void*)PHYS_TO_VIRT(address), 0, PAGE_SIZE);
-                        }
-                    }
-                }
-                kprintfv("[page_alloc] Final address %x", (i * 64 * PAGE_SIZE));
-                return (paddr_t)(i * 64 * PAGE_SIZE);
-            }
-        }
+    if (!page_count) page_count = 1;
+
+    //Cleared user and shared pages can come pre-zeroed, kernel ones keep the buddy's reuse order
+    bool prezeroed = false;
+    uint64_t first_page = 0;
+    if (map && full && page_count == 1 && level != MEM_PRIV_KERNEL) {
+        paddr_t pooled = zero_pool_take();
+        if (pooled) {
+            first_page = pooled / PAGE_SIZE;
+            prezeroed = true;
         }
-        return 0;
     }
 
-    for (int pass = 0; pass < 2; pass++) {
-        uint64_t i0 = pass == 0 ? reg_hint : reg_min;
-        uint64_t i1 = pass == 0 ? reg_end : reg_hint;
-
-        for (uint64_t i = i0; i < i1; i++) {
-            if (mem_bitmap[i] == UINT64_MAX) continue;
+    //Blocks are naturally aligned, so runs that are a multiple of 2MB also come back 2MB aligned
+    if (!first_page) first_page = page_alloc_take(page_count);
+    if (!first_page && zero_pool_drain()) first_page = page_alloc_take(page_count);
+    if (!first_page){
+        uart_puts("[page_alloc error] Could not allocate");
+        return 0;
+    }
 
-            uint64_t inv = ~mem_bitmap[i];
-            uint64_t bit = __builtin_ctzll(inv);
-            if (bit > (64 - page_count)){ 
-                continue;
-            }
-            while (bit < 64) {
-                bool found = true;
-                for (uint64_t b = bit; b < bit + page_count; b++){
-                    if ((mem_bitmap[i] >> b) & 1ull){
-                        bit = b + 1;
-                        found = false;
-                        break;
-                    }
-                }
-                if (found) break;
-            }
-            if (bit >= 64) continue;
-            uintptr_t first_address = 0;
-            mem_page* prev_page = 0;
-
-            for (uint64_t j = 0; j < page_count; j++){
-                mem_bitmap[i] |= (1ULL << (bit + j));
-                uint64_t page_index = (i * 64) + (bit + j);
-                uintptr_t address = page_index * PAGE_SIZE;
-                if (!first_address) first_address = address;
-
-                if (map){
-                    if ((attributes & MEM_DEV) != 0 && level == MEM_PRIV_KERNEL)
-                        register_device_memory(address, address);
-                    else if (level != MEM_PRIV_USER)
-                        register_proc_memory(address, address, attributes, level);
-
-                    if (!full) {
-                        setup_page(address, attributes);
-                        mem_page* curr = (mem_page*)PHYS_TO_VIRT(address);
-                        if (prev_page) prev_page->next = curr;
-                        prev_page = curr;
-
-                        memset((void*)PHYS_TO_VIRT(address + sizeof(mem_page)), 0, PAGE_SIZE - sizeof(mem_page));
-                    } else {
-                        memset((void*)PHYS_TO_VIRT(address), 0, PAGE_SIZE);
-                    }
-                }
+    if (map){
+        mem_page* prev_page = 0;
+        for (uint64_t p = 0; p < page_count; p++){
+            uintptr_t address = (first_page + p) * PAGE_SIZE;
+            if ((attributes & MEM_DEV) != 0 && level == MEM_PRIV_KERNEL)
+                register_device_memory(address, address);
+            else if (level != MEM_PRIV_USER)
+                register_proc_memory(address, address, attributes, level);
+
+            if (!full) {
+                setup_page(address, attributes);
+                mem_page* curr = (mem_page*)PHYS_TO_VIRT(address);
+                if (prev_page) prev_page->next = curr;
+                prev_page = curr;
+
+                memset((void*)PHYS_TO_VIRT(address + sizeof(mem_page)), 0, PAGE_SIZE - sizeof(mem_page));
+            } else if (!prezeroed) {
+                memset((void*)PHYS_TO_VIRT(address), 0, PAGE_SIZE);
             }
+        }
+    }
 
-            alloc_hint_page = (first_address / PAGE_SIZE) + page_count;
-            if (alloc_hint_page < alloc_min_page) alloc_hint_page = alloc_min_page;
+    kprintfv("[page_alloc] Final address %x", first_page * PAGE_SIZE);
+    return (paddr_t)(first_page * PAGE_SIZE);
+}
 
-            kprintfv("[page_alloc] Final address %x", first_address);
-            return (paddr_t)first_address;
-        } 
-    }
+paddr_t palloc_spare_page(uint64_t keep_free){
+    if (!alloc_max_page) page_alloc_init();
+    if (!page_alloc_high_va) page_alloc_enable_high_va();
+    irq_flags_t irq = spin_lock_irqsave(&page_alloc_lock);
+    uint64_t page = free_page_count > keep_free ? buddy_alloc(1) : 0;
+    if (page) bitmap_set_range(page, 1, true);
+    spin_unlock_irqrestore(&page_alloc_lock, irq);
+    return (paddr_t)(page * PAGE_SIZE);
+}
 
-    uart_puts("[page_alloc error] Could not allocate");
-    return 0;
+uint64_t page_alloc_free_pages(){
+    return free_page_count;
 }
 
 void* palloc(uint64_t size, uint8_t level, uint8_t attributes, bool full){
@@ -324,6 +471,16 @@ void* palloc(uint64_t size, uint8_t level, uint8_t attributes, bool full){
     return (void*)dmap_pa_to_kva(phys);
 }
 
+void page_mark_slab(void *page, bool slab){
+    if (!page_metas) return;
+    uint64_t addr = VIRT_TO_PHYS((uint64_t)page) / PAGE_SIZE;
+    if (!page_has_meta(addr)) return;
+    irq_flags_t irq = spin_lock_irqsave(&page_alloc_lock);
+    if (slab) page_states[meta_index(addr)] |= PAGE_STATE_SLAB;
+    else page_states[meta_index(addr)] &= ~PAGE_STATE_SLAB;
+    spin_unlock_irqrestore(&page_alloc_lock, irq);
+}
+
 bool page_used(uintptr_t ptr){
     if (!page_alloc_high_va) page_alloc_enable_high_va();
     if (!mem_bitmap || !alloc_max_page) return false;
@@ -346,13 +503,10 @@ void mark_used(uintptr_t address, size_t pages)
     if (pages == 0) return;
 
     uint64_t page_index = address / PAGE_SIZE;
-    for (size_t j = 0; j < pages; j++) {
-        uint64_t idx = page_index + j;
-        uint64_t i = idx / 64;
-        uint64_t bit  = idx % 64;
-
-        mem_bitmap[i] |= (1ULL << bit);
-    }
+    irq_flags_t irq = spin_lock_irqsave(&page_alloc_lock);
+    if (page_metas) buddy_reserve_range(page_index, pages);
+    bitmap_set_range(page_index, pages, true);
+    spin_unlock_irqrestore(&page_alloc_lock, irq);
 }
 void* kalloc_inner(void *page, size_t size, uint16_t alignment, uint8_t level, uintptr_t page_va, uintptr_t *next_va, uintptr_t *ttbr){
     if (!page) return 0;
@@ -395,23 +549,9 @@ void* kalloc_inner(void *page, size_t size, uint16_t alignment, uint8_t level, u
         if (!ptr) return 0;
 
         uintptr_t phys_base = VIRT_TO_PHYS((uintptr_t)ptr);
-
-        big_alloc_page* mp = big_alloc_meta;
-        while (mp && mp->count >= BIG_ALLOC_ENTRIES)
-            mp = mp->next;
-
-        if (!mp) {
-            paddr_t meta_phys =palloc_inner(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, true, true);
-            if (!meta_phys) panic("kalloc no metadata page", alloc_size);
-            mp = (big_alloc_page*)dmap_pa_to_kva(meta_phys);
-            mp->next = big_alloc_meta;
-            big_alloc_meta = mp;
-        }
-
-        mp->entries[mp->count].phys_base = phys_base;
-        mp->entries[mp->count].size = alloc_size;
-        mp->entries[mp->count].owner_phys = owner_phys;
-        mp->count++;
+        irq_flags_t irq = spin_lock_irqsave(&page_alloc_lock);
+        big_alloc_link(phys_base / PAGE_SIZE, owner_phys / PAGE_SIZE, alloc_size / PAGE_SIZE);
+        spin_unlock_irqrestore(&page_alloc_lock, irq);
 
         if (page_va && next_va && ttbr){
             uintptr_t va = *next_va;
@@ -593,6 +733,12 @@ void kfree(void* ptr, size_t size) {
     uintptr_t phys_base = phys& ~0xFFFULL;
     uint64_t page_off = va & 0xFFFULL;
 
+    uint64_t phys_page = phys_base / PAGE_SIZE;
+    if (page_has_meta(phys_page) && (page_states[meta_index(phys_page)] & PAGE_STATE_SLAB)) {
+        slab_free_ptr(ptr);
+        return;
+    }
+
     bool tag_ok = false;
     alloc_tag* tag = 0;
 
@@ -643,29 +789,17 @@ void kfree(void* ptr, size_t size) {
         panic("kfree untracked pointer", va);
     }
 
-    big_alloc_page* mp = big_alloc_meta;
-    while(mp) {
-        for(uint32_t i = 0; i < mp->count; i++)  {
-            if(mp->entries[i].phys_base != phys_base) continue;
-
-            if(mp->entries[i].phys_base != phys) {
-                kprintf("[kfree] non base big ptr=%llx phys=%llx base=%llx", (uint64_t)va, (uint64_t)phys, (uint64_t)phys_base);
-                panic("kfree non base big pointer", va);
-            }
-
-            uint64_t big_size = mp->entries[i].size;
-            mp->count--;
-            mp->entries[i] = mp->entries[mp->count];
-
-            if(!mem_bitmap) {
-                kprintf("[kfree] bitmap not init ptr=%llx phys=%llx", (uint64_t)va, (uint64_t)phys);
-                panic("kfree bitmap not init", va);
-            }
-
-            pfree(PHYS_TO_VIRT_P((void*)phys_base), big_size);
-            return;
-        }
-        mp = mp->next;
+    bool big = false;
+    uint64_t big_size = 0;
+    if (page_has_meta(phys_page)) {
+        irq_flags_t irq = spin_lock_irqsave(&page_alloc_lock);
+        big = (page_states[meta_index(phys_page)] & PAGE_STATE_BIG) != 0;
+        if (big) big_size = (uint64_t)page_metas[meta_index(phys_page)].pages * PAGE_SIZE;
+        spin_unlock_irqrestore(&page_alloc_lock, irq);
+    }
+    if (big) {
+        pfree(PHYS_TO_VIRT_P((void*)phys_base), big_size);
+        return;
     }
 
     kprintf("[kfree] page pointer not tracked ptr=%llx phys=%llx size=%llx", (uint64_t)va, (uint64_t)phys, (uint64_t)size);
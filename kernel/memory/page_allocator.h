@@ -26,11 +26,17 @@ void release_page_index(page_index *index);
 void setup_page(uintptr_t address, uint8_t attributes);
 paddr_t palloc_inner(uint64_t size, uint8_t level, uint8_t attributes, bool full, bool map);
 void* palloc(uint64_t size, uint8_t level, uint8_t attributes, bool full);
+//One unmapped, uncleared page, only while more than keep_free pages stay free afterwards. Never drains the zero pool
+//and fails silently, for callers that only allocate opportunistically
+paddr_t palloc_spare_page(uint64_t keep_free);
+uint64_t page_alloc_free_pages();
 void free_managed_page(void* ptr);
 void pfree(void* ptr, uint64_t size);
 void mark_used(uintptr_t address, size_t pages);
 
 bool page_used(uintptr_t ptr);
+//Flags a page as owned by the slab layer so kfree hands its objects to slab_free_ptr
+void page_mark_slab(void *page, bool slab);
 
 //DEADLINE: 01/03/2026 - malloc syscall will be removed and kalloc will remain as a kernel-only allocator, but allocate is still preferred
 void* kalloc_inner(void *page, size_t size, uint16_t alignment, uint8_t level, uintptr_t page_va, uintptr_t *next_va, uintptr_t *ttbr);
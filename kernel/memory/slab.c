@@ -0,0 +1,248 @@
+#include "slab.h"
+#include "page_allocator.h"
+#include "exceptions/irq.h"
+#include "exceptions/exception_handler.h"
+#include "console/kio.h"
+#include "std/memory.h"
+
+#define SLAB_MAX_CACHES 64
+#define SLAB_MIN_ALIGN 8
+#define SLAB_MAX_ALIGN 256
+#define SLAB_KEEP_EMPTY 1
+#define SLAB_PAGE_MAGIC 0x534C4142u
+
+//Lives at the start of every slab page, objects follow at first_offset
+typedef struct slab_page {
+    struct slab_page *next;
+    struct slab_page *prev;
+    slab_cache *cache;
+    void *free_list;
+    uint32_t magic;
+    uint16_t in_use;
+    uint16_t capacity;
+} slab_page;
+
+struct slab_cache {
+    char name[SLAB_NAME_MAX];
+    uint32_t obj_size;
+    uint32_t stride;
+    uint32_t first_offset;
+    uint32_t capacity;
+    uint8_t attributes;
+    slab_ctor_t ctor;
+    slab_page *partial;
+    slab_page *full;
+    slab_page *empty;
+    uint32_t empty_pages;
+    slab_stats stats;
+};
+
+static slab_cache caches[SLAB_MAX_CACHES];
+static uint32_t cache_count;
+
+//Past 256 the classes are (PAGE_SIZE - header) / n so a page holds n objects without a wasted tail
+static const uint32_t class_sizes[] = { 16, 32, 64, 128, 256, 496, 1008, SLAB_MAX_CLASS_SIZE };
+static const char *class_names[] = { "size-16", "size-32", "size-64", "size-128", "size-256", "size-496", "size-1008", "size-2016" };
+#define SLAB_CLASS_COUNT (sizeof(class_sizes) / sizeof(class_sizes[0]))
+static slab_cache *class_caches[SLAB_CLASS_COUNT];
+
+static inline uint32_t align_up(uint32_t value, uint32_t alignment){
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static inline slab_page* slab_page_of(void *obj){
+    return (slab_page*)((uintptr_t)obj & ~((uintptr_t)PAGE_SIZE - 1));
+}
+
+static void slab_list_push(slab_page **head, slab_page *page){
+    page->prev = 0;
+    page->next = *head;
+    if (*head) (*head)->prev = page;
+    *head = page;
+}
+
+static void slab_list_remove(slab_page **head, slab_page *page){
+    if (page->prev) page->prev->next = page->next;
+    else *head = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->next = page->prev = 0;
+}
+
+slab_cache* slab_cache_create(const char *name, size_t obj_size, uint16_t alignment, uint8_t attributes, slab_ctor_t ctor){
+    if (!obj_size) return 0;
+    if (alignment < SLAB_MIN_ALIGN) alignment = SLAB_MIN_ALIGN;
+    if ((alignment & (alignment - 1)) || alignment > SLAB_MAX_ALIGN){
+        kprintf("[SLAB] bad alignment %x for %s", alignment, name ? name : "?");
+        return 0;
+    }
+    uint32_t stride = align_up(obj_size < sizeof(void*) ? sizeof(void*) : (uint32_t)obj_size, alignment);
+    uint32_t first_offset = align_up(sizeof(slab_page), alignment);
+    if (obj_size > PAGE_SIZE || first_offset + stride > PAGE_SIZE){
+        kprintf("[SLAB] object size %x too big for %s", (uint32_t)obj_size, name ? name : "?");
+        return 0;
+    }
+
+    irq_flags_t irq = irq_save_disable();
+    if (cache_count >= SLAB_MAX_CACHES){
+        irq_restore(irq);
+        kprintf("[SLAB] out of caches for %s", name ? name : "?");
+        return 0;
+    }
+    slab_cache *cache = &caches[cache_count++];
+    *cache = (slab_cache){0};
+    for (uint32_t i = 0; name && name[i] && i < SLAB_NAME_MAX - 1; i++)
+        cache->name[i] = name[i];
+    cache->obj_size = (uint32_t)obj_size;
+    cache->stride = stride;
+    cache->first_offset = first_offset;
+    cache->capacity = (PAGE_SIZE - first_offset) / stride;
+    cache->attributes = attributes;
+    cache->ctor = ctor;
+    cache->stats.obj_size = cache->obj_size;
+    cache->stats.objs_per_page = cache->capacity;
+    irq_restore(irq);
+    return cache;
+}
+
+static slab_page* slab_grow(slab_cache *cache){
+    slab_page *page = (slab_page*)palloc(PAGE_SIZE, MEM_PRIV_KERNEL, cache->attributes, true);
+    if (!page) return 0;
+    page_mark_slab(page, true);
+    page->cache = cache;
+    page->magic = SLAB_PAGE_MAGIC;
+    page->in_use = 0;
+    page->capacity = cache->capacity;
+    page->free_list = 0;
+    //Threaded back to front so the first allocations come out in address order
+    for (uint32_t i = cache->capacity; i > 0; i--){
+        void **obj = (void**)((uintptr_t)page + cache->first_offset + (i - 1) * cache->stride);
+        *obj = page->free_list;
+        page->free_list = obj;
+    }
+    cache->stats.pages++;
+    return page;
+}
+
+void* slab_alloc(slab_cache *cache){
+    if (!cache) return 0;
+    irq_flags_t irq = irq_save_disable();
+    slab_page *page = cache->partial;
+    if (!page && cache->empty){
+        page = cache->empty;
+        slab_list_remove(&cache->empty, page);
+        cache->empty_pages--;
+        slab_list_push(&cache->partial, page);
+    }
+    if (!page){
+        page = slab_grow(cache);
+        if (!page){
+            cache->stats.failures++;
+            irq_restore(irq);
+            return 0;
+        }
+        slab_list_push(&cache->partial, page);
+    }
+
+    void *obj = page->free_list;
+    page->free_list = *(void**)obj;
+    page->in_use++;
+    if (page->in_use == page->capacity){
+        slab_list_remove(&cache->partial, page);
+        slab_list_push(&cache->full, page);
+    }
+    cache->stats.allocs++;
+    cache->stats.in_use++;
+    irq_restore(irq);
+
+    if (cache->ctor) cache->ctor(obj);
+    else memset(obj, 0, cache->obj_size);
+    return obj;
+}
+
+static void slab_release(slab_page *page, void *obj){
+    slab_cache *cache = page->cache;
+    uintptr_t off = (uintptr_t)obj - (uintptr_t)page;
+    if (off < cache->first_offset || (off - cache->first_offset) % cache->stride || !page->in_use){
+        kprintf("[SLAB] bad free of %llx in %s", (uint64_t)(uintptr_t)obj, cache->name);
+        panic("slab free of invalid object", (uintptr_t)obj);
+    }
+
+    *(void**)obj = page->free_list;
+    page->free_list = obj;
+    if (page->in_use == page->capacity){
+        slab_list_remove(&cache->full, page);
+        slab_list_push(&cache->partial, page);
+    }
+    page->in_use--;
+    cache->stats.frees++;
+    cache->stats.in_use--;
+
+    if (page->in_use) return;
+    slab_list_remove(&cache->partial, page);
+    if (cache->empty_pages < SLAB_KEEP_EMPTY){
+        slab_list_push(&cache->empty, page);
+        cache->empty_pages++;
+        return;
+    }
+    page->magic = 0;
+    page_mark_slab(page, false);
+    pfree(page, PAGE_SIZE);
+    cache->stats.pages--;
+}
+
+void slab_free(slab_cache *cache, void *obj){
+    if (!cache || !obj) return;
+    irq_flags_t irq = irq_save_disable();
+    slab_page *page = slab_page_of(obj);
+    if (page->magic != SLAB_PAGE_MAGIC || page->cache != cache){
+        kprintf("[SLAB] %llx does not belong to %s", (uint64_t)(uintptr_t)obj, cache->name);
+        panic("slab free to wrong cache", (uintptr_t)obj);
+    }
+    slab_release(page, obj);
+    irq_restore(irq);
+}
+
+void slab_free_ptr(void *obj){
+    if (!obj) return;
+    irq_flags_t irq = irq_save_disable();
+    slab_page *page = slab_page_of(obj);
+    if (page->magic != SLAB_PAGE_MAGIC || !page->cache){
+        kprintf("[SLAB] %llx is not a slab object", (uint64_t)(uintptr_t)obj);
+        panic("slab free of foreign pointer", (uintptr_t)obj);
+    }
+    slab_release(page, obj);
+    irq_restore(irq);
+}
+
+size_t slab_obj_size(void *obj){
+    if (!obj) return 0;
+    slab_page *page = slab_page_of(obj);
+    return page->magic == SLAB_PAGE_MAGIC ? page->cache->obj_size : 0;
+}
+
+void* slab_alloc_size(size_t size){
+    if (!size || size > SLAB_MAX_CLASS_SIZE) return 0;
+    uint32_t c = 0;
+    while (class_sizes[c] < size) c++;
+    if (!class_caches[c]){
+        irq_flags_t irq = irq_save_disable();
+        if (!class_caches[c]) class_caches[c] = slab_cache_create(class_names[c], class_sizes[c], ALIGN_16B, MEM_RW, 0);
+        irq_restore(irq);
+    }
+    return slab_alloc(class_caches[c]);
+}
+
+slab_stats slab_cache_stats(slab_cache *cache){
+    if (!cache) return (slab_stats){0};
+    irq_flags_t irq = irq_save_disable();
+    slab_stats stats = cache->stats;
+    irq_restore(irq);
+    return stats;
+}
+
+void slab_dump_stats(){
+    for (uint32_t i = 0; i < cache_count; i++){
+        slab_stats s = slab_cache_stats(&caches[i]);
+        kprintf("[SLAB] %s size=%i in_use=%i pages=%i allocs=%i frees=%i failures=%i", caches[i].name, s.obj_size, s.in_use, s.pages, s.allocs, s.frees, s.failures);
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SLAB_NAME_MAX 24
+//Largest request served by the generic size classes, bigger ones belong in kalloc/palloc
+#define SLAB_MAX_CLASS_SIZE 2016
+
+typedef struct slab_cache slab_cache;
+
+//Runs on every object handed out by slab_alloc. Without one, objects come back zeroed like kalloc
+typedef void (*slab_ctor_t)(void *obj);
+
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t failures;
+    uint32_t in_use;
+    uint32_t pages;
+    uint32_t obj_size;
+    uint32_t objs_per_page;
+} slab_stats;
+
+slab_cache* slab_cache_create(const char *name, size_t obj_size, uint16_t alignment, uint8_t attributes, slab_ctor_t ctor);
+void* slab_alloc(slab_cache *cache);
+void slab_free(slab_cache *cache, void *obj);
+
+//Generic power of two-ish size classes, sized so whole objects fill each page
+void* slab_alloc_size(size_t size);
+
+//Frees an object from any cache, kfree routes slab pages here so size class users can keep freeing through kfree/free_sized
+void slab_free_ptr(void *obj);
+size_t slab_obj_size(void *obj);
+
+slab_stats slab_cache_stats(slab_cache *cache);
+void slab_dump_stats();
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,103 @@
+#include "zero_pool.h"
+#include "page_allocator.h"
+#include "memory/addr.h"
+#include "exceptions/irq.h"
+#include "std/memory.h"
+
+static paddr_t pool[ZERO_POOL_PAGES];
+static uint32_t pool_count;
+//Pages taken out of the allocator by refills that haven't been pushed yet
+static uint32_t pool_pending;
+static zero_pool_stats stats;
+//Bytes cleared by one dc zva, 0 if it's prohibited
+static uint32_t zva_block = UINT32_MAX;
+
+static uint32_t zva_block_size(){
+    if (zva_block != UINT32_MAX) return zva_block;
+    uint64_t dczid = 0;
+    asm volatile("mrs %0, dczid_el0" : "=r"(dczid));
+    zva_block = (dczid & (1 << 4)) ? 0 : (4u << (dczid & 0xF));
+    return zva_block;
+}
+
+//Whole cache lines at a time without pulling the old contents in. Falls back to pair stores of xzr,
+//SIMD registers aren't saved across task switches so the idle loop can't use them
+void zero_page(void *page){
+    uint32_t block = zva_block_size();
+    uintptr_t p = (uintptr_t)page;
+    uintptr_t end = p + PAGE_SIZE;
+    if (block && block <= PAGE_SIZE) {
+        for (; p < end; p += block) asm volatile("dc zva, %0" :: "r"(p) : "memory");
+        return;
+    }
+    for (; p < end; p += 64)
+        asm volatile(
+            "stp xzr, xzr, [%0]\n"
+            "stp xzr, xzr, [%0, #16]\n"
+            "stp xzr, xzr, [%0, #32]\n"
+            "stp xzr, xzr, [%0, #48]\n"
+            :: "r"(p) : "memory");
+}
+
+paddr_t zero_pool_take(){
+    paddr_t pa = 0;
+    irq_flags_t irq = irq_save_disable();
+    if (pool_count) {
+        pa = pool[--pool_count];
+        stats.hits++;
+    } else stats.misses++;
+    irq_restore(irq);
+    return pa;
+}
+
+paddr_t zero_pool_alloc_page(){
+    paddr_t pa = zero_pool_take();
+    if (pa) return pa;
+    pa = palloc_inner(PAGE_SIZE, MEM_PRIV_USER, MEM_RW, true, false);
+    if (!pa) return 0;
+    zero_page((void*)dmap_pa_to_kva(pa));
+    return pa;
+}
+
+uint32_t zero_pool_refill(uint32_t max){
+    uint32_t added = 0;
+    while (added < max) {
+        irq_flags_t irq = irq_save_disable();
+        if (pool_count + pool_pending >= ZERO_POOL_PAGES) {
+            irq_restore(irq);
+            break;
+        }
+        //palloc_inner would drain this very pool to satisfy the refill when memory runs short
+        paddr_t pa = palloc_spare_page(ZERO_POOL_MIN_FREE_PAGES);
+        if (pa) pool_pending++;
+        irq_restore(irq);
+        if (!pa) break;
+
+        //The page is ours until it's pushed, clear it with irqs back on
+        zero_page((void*)dmap_pa_to_kva(pa));
+
+        irq = irq_save_disable();
+        pool_pending--;
+        pool[pool_count++] = pa;
+        stats.refilled++;
+        irq_restore(irq);
+        added++;
+    }
+    return added;
+}
+
+uint32_t zero_pool_drain(){
+    irq_flags_t irq = irq_save_disable();
+    uint32_t n = pool_count;
+    while (pool_count) pfree((void*)dmap_pa_to_kva(pool[--pool_count]), PAGE_SIZE);
+    irq_restore(irq);
+    return n;
+}
+
+zero_pool_stats zero_pool_get_stats(){
+    irq_flags_t irq = irq_save_disable();
+    zero_pool_stats s = stats;
+    s.available = pool_count;
+    irq_restore(irq);
+    return s;
+}
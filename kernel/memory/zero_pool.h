@@ -0,0 +1,38 @@
+#pragma once
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Pages kept zeroed ahead of time so faults and palloc(full) don't have to clear them inline
+#define ZERO_POOL_PAGES 256
+//Pages zeroed per refill call, small so the idle loop gets back to checking for work quickly
+#define ZERO_POOL_BATCH 8
+//Refills stop once the allocator is down to this many free pages, what's left belongs to real allocations
+#define ZERO_POOL_MIN_FREE_PAGES 1024
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refilled;
+    uint32_t available;
+} zero_pool_stats;
+
+//Physical address of a zeroed, allocated page, 0 if the pool is empty
+paddr_t zero_pool_take();
+//Zeroed page from the pool, or a fresh one cleared inline when it's empty
+paddr_t zero_pool_alloc_page();
+//Zeroes and queues up to max pages, returns how many were added. Stops early near ZERO_POOL_MIN_FREE_PAGES. Safe with irqs enabled
+uint32_t zero_pool_refill(uint32_t max);
+//Hands every pooled page back to the page allocator, returns how many were released
+uint32_t zero_pool_drain();
+
+void zero_page(void *page);
+
+zero_pool_stats zero_pool_get_stats();
+
+#ifdef __cplusplus
+}
+#endif
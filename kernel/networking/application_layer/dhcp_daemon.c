@@ -3,6 +3,7 @@
 #include "console/kio.h"
 #include "std/memory.h"
 #include "process/scheduler.h"
+#include "exceptions/timer.h"
 #include "random/random.h"
 
 #include "networking/application_layer/dhcp.h"
@@ -147,12 +148,14 @@ static bool packet_mac_matches(const dhcp_packet *p, const uint8_t mac[6]) {
 }
 
 static bool udp_wait_for_type_on(socket_handle_t sock, uint8_t wanted, uint32_t expect_xid, const uint8_t mac[6], dhcp_packet **outp, sizedptr *outsp, uint32_t timeout_ms) {
-    uint32_t waited = 0;
-    while(waited < timeout_ms){
+    uint64_t start_ms = timer_now_msec();
+    for (;;) {
+        uint32_t waited = (uint32_t)(timer_now_msec() - start_ms);
+        if (waited >= timeout_ms) break;
         uint8_t buf[1024];
         net_l4_endpoint src;
         memset(&src, 0, sizeof(src));
-        int64_t r = socket_recvfrom_udp_ex(sock, buf, sizeof(buf), &src);
+        int64_t r = socket_recvfrom_udp_timeout(sock, buf, sizeof(buf), &src, timeout_ms - waited);
         if (r > 0) {
             if (src.port != 67) { continue; }
             if ((size_t)r < sizeof(dhcp_packet) - sizeof(((dhcp_packet*)0)->options) + 4) { continue; }
@@ -173,21 +176,20 @@ static bool udp_wait_for_type_on(socket_handle_t sock, uint8_t wanted, uint32_t
             if (outp) *outp= (dhcp_packet*)copy;
             if (outsp) *outsp = (sizedptr){ copy, (uint32_t)r };
             return true;
-        } else {
-            msleep(50);
-            waited += 50;
         }
     }
     return false;
 }
 
 static bool udp_wait_for_ack_or_nak(socket_handle_t sock, uint32_t expect_xid, const uint8_t mac[6], dhcp_packet **outp, sizedptr *outsp, uint32_t timeout_ms, uint8_t *out_msg_type) {
-    uint32_t waited = 0;
-    while (waited < timeout_ms) {
+    uint64_t start_ms = timer_now_msec();
+    for (;;) {
+        uint32_t waited = (uint32_t)(timer_now_msec() - start_ms);
+        if (waited >= timeout_ms) break;
         uint8_t buf[1024];
         net_l4_endpoint src;
         memset(&src, 0, sizeof(src));
-        int64_t r = socket_recvfrom_udp_ex(sock, buf, sizeof(buf), &src);
+        int64_t r = socket_recvfrom_udp_timeout(sock, buf, sizeof(buf), &src, timeout_ms - waited);
         if (r > 0) {
             if (src.port != 67) { continue; }
             if ((size_t)r < sizeof(dhcp_packet) - sizeof(((dhcp_packet*)0)->options) + 4) { continue; }
@@ -206,9 +208,6 @@ static bool udp_wait_for_ack_or_nak(socket_handle_t sock, uint32_t expect_xid, c
             if (outsp) *outsp = (sizedptr){ copy, (uint32_t)r };
             if (out_msg_type) *out_msg_type = mtype;
             return true;
-        } else {
-            msleep(50);
-            waited += 50;
         }
     }
     return false;
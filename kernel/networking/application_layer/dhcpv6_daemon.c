@@ -4,6 +4,7 @@
 #include "std/string.h"
 #include "syscalls/syscalls.h"
 #include "process/scheduler.h"
+#include "exceptions/timer.h"
 #include "math/rng.h"
 
 #include "data/struct/linked_list.h"
@@ -58,6 +59,7 @@ typedef struct {
 #define DHCPV6_MAX_INFOREQ_TX 3
 #define DHCPV6_MAX_REQUEST_TX 3
 #define DHCPV6_MAX_OTHER_TX 5
+#define DHCPV6_REPLY_WAIT_MS 250
 
 static uint16_t g_dhcpv6_pid = 0xFFFF;
 static rng_t g_dhcpv6_rng;
@@ -562,22 +564,17 @@ static void fsm_once(dhcpv6_bind_t* b, uint32_t tick_ms) {
     memset(&src, 0, sizeof(src));
 
     bool got = false;
-    uint32_t waited = 0;
-
-    while (waited < 250) {
-        int64_t r = socket_recvfrom_udp_ex(b->sock, rx, sizeof(rx), &src);
-        if (r > 0) {
-            if (src.port != DHCPV6_SERVER_PORT) {
-                msleep(50);
-                waited += 50;
-                continue;
-            }
+    uint64_t start_ms = timer_now_msec();
+
+    for (;;) {
+        uint32_t waited = (uint32_t)(timer_now_msec() - start_ms);
+        if (waited >= DHCPV6_REPLY_WAIT_MS) break;
+        int64_t r = socket_recvfrom_udp_timeout(b->sock, rx, sizeof(rx), &src, DHCPV6_REPLY_WAIT_MS - waited);
+        if (r > 0 && src.port == DHCPV6_SERVER_PORT) {
             rx_len = (uint32_t)r;
             got = true;
             break;
         }
-        msleep(50);
-        waited += 50;
     }
 
     if (got && rx_len >= 4) {
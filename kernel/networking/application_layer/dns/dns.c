@@ -11,6 +11,7 @@
 #include "networking/interface_manager.h"
 #include "dns_daemon.h"
 #include "syscalls/syscalls.h"
+#include "exceptions/timer.h"
 #include "networking/transport_layer/trans_utils.h"
 
 #define MDNS_TIMEOUT_A_MS 500u
@@ -164,11 +165,13 @@ static dns_result_t perform_dns_query_once_a(socket_handle_t sock, const net_l4_
     int64_t sent = socket_sendto_udp_ex(sock, DST_ENDPOINT, &dst, 0, request_buffer, offset);
     if (sent < 0) return DNS_ERR_SEND;
 
-    uint32_t waited_ms = 0;
-    while (waited_ms < timeout_ms){
+    uint64_t start_ms = timer_now_msec();
+    for (;;){
+        uint32_t waited_ms = (uint32_t)(timer_now_msec() - start_ms);
+        if (waited_ms >= timeout_ms) break;
         uint8_t response_buffer[512];
         net_l4_endpoint source;
-        int64_t received = socket_recvfrom_udp_ex(sock, response_buffer, sizeof(response_buffer), &source);
+        int64_t received = socket_recvfrom_udp_timeout(sock, response_buffer, sizeof(response_buffer), &source, timeout_ms - waited_ms);
         bool ok_src = false;
         if (received > 0 && source.port == 53 && source.ver == dst.ver) {
             if (dst.ver == IP_VER4) ok_src = (*(uint32_t*)source.ip == *(uint32_t*)dst.ip);
@@ -185,8 +188,6 @@ static dns_result_t perform_dns_query_once_a(socket_handle_t sock, const net_l4_
             }
             if (pr == DNS_ERR_NXDOMAIN) return pr;
         }
-        msleep(50);
-        waited_ms += 50;
     }
     return DNS_ERR_TIMEOUT;
 }
@@ -218,11 +219,13 @@ static dns_result_t perform_dns_query_once_aaaa(socket_handle_t sock, const net_
     int64_t sent = socket_sendto_udp_ex(sock, DST_ENDPOINT, &dst, 0, request_buffer, offset);
     if (sent < 0) return DNS_ERR_SEND;
 
-    uint32_t waited_ms = 0;
-    while (waited_ms < timeout_ms){
+    uint64_t start_ms = timer_now_msec();
+    for (;;){
+        uint32_t waited_ms = (uint32_t)(timer_now_msec() - start_ms);
+        if (waited_ms >= timeout_ms) break;
         uint8_t response_buffer[512];
         net_l4_endpoint source;
-        int64_t received = socket_recvfrom_udp_ex(sock, response_buffer, sizeof(response_buffer), &source);
+        int64_t received = socket_recvfrom_udp_timeout(sock, response_buffer, sizeof(response_buffer), &source, timeout_ms - waited_ms);
         bool ok_src = false;
         if (received > 0 && source.port == 53 && source.ver == dst.ver) {
             if (dst.ver == IP_VER4) ok_src = (*(uint32_t*)source.ip == *(uint32_t*)dst.ip);
@@ -236,9 +239,6 @@ static dns_result_t perform_dns_query_once_aaaa(socket_handle_t sock, const net_
                 return DNS_OK;
             }
             if (pr == DNS_ERR_NXDOMAIN) return pr;
-        } else {
-            msleep(50);
-            waited_ms += 50;
         }
     }
     return DNS_ERR_TIMEOUT;
@@ -2,6 +2,7 @@
 #include "dns_daemon.h"
 #include "networking/internet_layer/ipv6_utils.h"
 #include "std/std.h"
+#include "exceptions/timer.h"
 #include "networking/transport_layer/trans_utils.h"
 
 #define MDNS_PORT 5353
@@ -185,11 +186,13 @@ static dns_result_t perform_mdns_query_once(socket_handle_t sock, const net_l4_e
     int64_t sent = socket_sendto_udp_ex(sock, DST_ENDPOINT, dst, 0, request_buffer, offset);
     if (sent < 0) return DNS_ERR_SEND;
 
-    uint32_t waited_ms = 0;
-    while (waited_ms < timeout_ms) {
+    uint64_t start_ms = timer_now_msec();
+    for (;;) {
+        uint32_t waited_ms = (uint32_t)(timer_now_msec() - start_ms);
+        if (waited_ms >= timeout_ms) break;
         uint8_t response_buffer[512];
         net_l4_endpoint source;
-        int64_t received = socket_recvfrom_udp_ex(sock, response_buffer, sizeof(response_buffer), &source);
+        int64_t received = socket_recvfrom_udp_timeout(sock, response_buffer, sizeof(response_buffer), &source, timeout_ms - waited_ms);
         if (received > 0 && source.port == MDNS_PORT){
             uint32_t ttl_s = 0;
             dns_result_t pr = parse_mdns_ip_record(response_buffer, (uint32_t)received, name, qtype, out_rdata, out_len, &ttl_s);
@@ -198,9 +201,6 @@ static dns_result_t perform_mdns_query_once(socket_handle_t sock, const net_l4_e
                 return DNS_OK;
             }
         }
-
-        msleep(20);
-        waited_ms += 20;
     }
 
     return DNS_ERR_TIMEOUT;
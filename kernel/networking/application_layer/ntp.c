@@ -250,15 +250,20 @@ ntp_result_t ntp_poll_once(uint32_t timeout_ms){
         if (ntp_send_query(sock, s1, &t1_1, &o1) != NTP_OK) t1_1 = 0;
     }
 
-    uint32_t waited = 0;
     ntp_result_t best_err = NTP_ERR_TIMEOUT;
 
     uint64_t mono_now_us = timer_now_usec();
+    uint64_t start_ms = timer_now_msec();
+
+    for (;;) {
+        uint32_t waited = (uint32_t)(timer_now_msec() - start_ms);
+        //Once one server answered the other only gets until half the timeout
+        uint32_t limit = best_err == NTP_OK ? timeout_ms / 2 : timeout_ms;
+        if (waited >= limit) break;
 
-    while (waited < timeout_ms) {
         uint8_t buf[96];
         net_l4_endpoint src;
-        int64_t n = socket_recvfrom_udp_ex(sock, buf, sizeof(buf), &src);
+        int64_t n = socket_recvfrom_udp_timeout(sock, buf, sizeof(buf), &src, limit - waited);
 
         if (n >= (int64_t)sizeof(ntp_packet_t) && src.ver == IP_VER4 && src.port == NTP_PORT) {
             uint32_t rip = 0;
@@ -378,12 +383,7 @@ ntp_result_t ntp_poll_once(uint32_t timeout_ms){
 
                 best_err =NTP_OK;
             }
-        } else {
-            msleep(50);
-            waited += 50;
         }
-
-        if (best_err == NTP_OK && waited >= (timeout_ms / 2)) break;
     }
 
     socket_destroy_udp(sock);
@@ -98,14 +98,19 @@ sntp_result_t sntp_poll_once(uint32_t timeout_ms){
         if (sntp_send_query(sock, s1, &t1_1) != SNTP_OK) t1_1 = 0;
     }
 
-    uint32_t waited = 0;
     uint64_t best_server_unix_us = 0;
     uint64_t best_rtt_us = (uint64_t)-1;
+    uint64_t start_ms = timer_now_msec();
+
+    for (;;){
+        uint32_t waited = (uint32_t)(timer_now_msec() - start_ms);
+        //Once one server answered the other only gets until half the timeout
+        uint32_t limit = best_server_unix_us != 0 ? timeout_ms / 2 : timeout_ms;
+        if (waited >= limit) break;
 
-    while (waited < timeout_ms){
         uint8_t buf[96];
         net_l4_endpoint src;
-        int64_t n = socket_recvfrom_udp_ex(sock, buf, sizeof(buf), &src);
+        int64_t n = socket_recvfrom_udp_timeout(sock, buf, sizeof(buf), &src, limit - waited);
 
         if (n >= (int64_t)sizeof(ntp_packet_t) && src.ver == IP_VER4 && src.port == NTP_PORT){
             uint32_t rip = 0;
@@ -148,12 +153,7 @@ sntp_result_t sntp_poll_once(uint32_t timeout_ms){
                     }
                 }
             }
-        } else {
-            msleep(50);
-            waited += 50;
         }
-
-        if (best_server_unix_us != 0 && waited >= (timeout_ms / 2)) break;
     }
 
     socket_destroy_udp(sock);
@@ -85,11 +85,8 @@ public:
         int hdr_end = -1;
 
         while (hdr_end < 0) {
-            int64_t r = client->recv(tmp, sizeof(tmp));
-            if (r == TCP_WOULDBLOCK) {
-                msleep(10);
-                continue;
-            }
+            int64_t r = client->recv(tmp, sizeof(tmp), SOCK_WAIT_FOREVER);
+            if (r == TCP_WOULDBLOCK) continue;
             if (r <= 0) {
                 string_free(buf);
                 return req;
@@ -162,11 +159,8 @@ public:
 
         if (need > 0) {
             while (have < need) {
-                int64_t r = client->recv(tmp, sizeof(tmp));
-                if (r == TCP_WOULDBLOCK) {
-                    msleep(10);
-                    continue;
-                }
+                int64_t r = client->recv(tmp, sizeof(tmp), SOCK_WAIT_FOREVER);
+                if (r == TCP_WOULDBLOCK) continue;
                 if (r < 0) break;
                 if (r == 0) break;
                 string_append_bytes(&buf, tmp, (uint32_t)r);
@@ -216,11 +210,8 @@ public:
         uint32_t off = 0;
         int64_t sent = 0;
         while (off < out_len) {
-            int64_t r = client->send(out.data + off, out_len - off);
-            if (r == TCP_WOULDBLOCK) {
-                msleep(5);
-                continue;
-            }
+            int64_t r = client->send(out.data + off, out_len - off, SOCK_WAIT_FOREVER);
+            if (r == TCP_WOULDBLOCK) continue;
             if (r < 0) {
                 sent = r;
                 break;
@@ -1,6 +1,14 @@
 #pragma once
 #include "types.h"
 #include "net/network_types.h"
+#include "networking/netpkt.h"
+#include "networking/network.h"
+#include "std/memory.h"
+
+static inline void net_driver_free_frame(void* ctx, uintptr_t base, uint32_t alloc_size) {
+    (void)ctx;
+    free_sized((void*)base, alloc_size);
+}
 
 class NetDriver {
 public:
@@ -9,14 +17,44 @@ public:
     virtual bool init_at(uint64_t pci_addr, uint32_t irq_base_vector) = 0;
     virtual sizedptr allocate_packet(size_t size) = 0;
     virtual sizedptr handle_receive_packet() = 0;
+    //Next received frame as a netpkt the stack can hold on to. Drivers that can lend out their own buffers override this
+    virtual netpkt_t* receive_packet() {
+        sizedptr raw = handle_receive_packet();
+        if (!raw.ptr || !raw.size) return nullptr;
+        netpkt_t* p = netpkt_wrap(raw.ptr, (uint32_t)raw.size, 0, (uint32_t)raw.size, net_driver_free_frame, nullptr);
+        if (!p) free_sized((void*)raw.ptr, raw.size);
+        return p;
+    }
     virtual void handle_sent_packet() = 0;
     virtual void enable_verbose() = 0;
     virtual bool send_packet(sizedptr packet) = 0;
+    //Transmits the packet and its fragments, taking the caller's reference whether or not it goes out.
+    //Drivers that can point the device at the packet's own buffers override this, the default flattens it into allocate_packet
+    virtual bool send_pkt(netpkt_t* pkt) {
+        uint32_t total = netpkt_total_len(pkt);
+        //Nothing here can cut a super-segment up, the stack only builds them for NICs that report TSO
+        if (!total || netpkt_gso_type(pkt) != NETPKT_GSO_NONE || !netpkt_csum_resolve(pkt)) {
+            netpkt_unref(pkt);
+            return false;
+        }
+        sizedptr raw = allocate_packet(total);
+        if (!raw.ptr) {
+            netpkt_unref(pkt);
+            return false;
+        }
+        netpkt_copy_out(pkt, (void*)(raw.ptr + get_header_size()), total);
+        netpkt_unref(pkt);
+        if (send_packet(raw)) return true;
+        free_sized((void*)raw.ptr, raw.size);
+        return false;
+    }
     virtual void get_mac(uint8_t out_mac[6]) const = 0;
     virtual uint16_t get_mtu() const = 0;
     virtual uint16_t get_header_size() const = 0;
     virtual const char* hw_ifname() const = 0;
     virtual uint32_t get_speed_mbps() const = 0;
     virtual uint8_t get_duplex() const = 0;
+    //NET_OFFLOAD_* bits the driver handles in send_pkt/receive_packet
+    virtual uint32_t get_offloads() const { return 0; }
     virtual bool sync_multicast(const uint8_t* macs, uint32_t count) {(void)macs; (void)count; return true; }
 };
\ No newline at end of file
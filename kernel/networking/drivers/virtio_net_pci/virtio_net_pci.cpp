@@ -3,6 +3,7 @@
 #include "pci.h"
 #include "syscalls/syscalls.h"
 #include "memory/page_allocator.h"
+#include "memory/slab.h"
 #include "std/memory.h"
 #include "networking/network.h"
 #include "sysregs.h"
@@ -14,9 +15,30 @@
 
 constexpr uint32_t RX_BUF_SIZE = PAGE_SIZE;
 constexpr uint16_t RX_CHAIN_SEGS = 4;
+//Upper bound on pages lent out to the stack on top of the ring's own buffers
+constexpr uint32_t RX_LOAN_MAX_PAGES = 512;
+//Header plus the linear part and up to two fragments
+constexpr uint16_t VIRTIO_NET_TX_MAX_SEGS = 4;
 
 void* g_rx_pool = nullptr;
 
+//One in-flight transmit: the device reads the header from here and the frame straight out of the netpkt
+struct virtio_net_tx {
+    virtio_request req;
+    netpkt_t* pkt;
+    virtio_net_tx* next;
+    virtio_net_hdr_mrg_rxbuf_t hdr;
+};
+
+static slab_cache* g_tx_cache = nullptr;
+
+//Frames and control buffers up to a full MTU come from the slab size classes, anything bigger still goes to the device page.
+//Either kind is released with kfree by whoever ends up owning it
+static void* net_buf_alloc(virtio_device* dev, size_t size) {
+    if (size <= SLAB_MAX_CLASS_SIZE) return slab_alloc_size(size);
+    return kalloc(dev->memory_page, size, ALIGN_64B, MEM_PRIV_KERNEL);
+}
+
 #define kprintfv(fmt, ...) \
     ({ \
         if (verbose){\
@@ -51,12 +73,12 @@ bool virtio_net_ctrl_send(virtio_device* dev, uint8_t cls, uint8_t cmd, const vo
     hdr.cmd = cmd;
 
     uint32_t in_len = (uint32_t)sizeof(hdr) + payload_len;
-    uint8_t* in = (uint8_t*)kalloc(dev->memory_page, (size_t)in_len, ALIGN_16B, MEM_PRIV_KERNEL);
+    uint8_t* in = (uint8_t*)net_buf_alloc(dev, (size_t)in_len);
     if (!in) return false;
     memcpy(in, &hdr, sizeof(hdr));
     if (payload_len && payload) memcpy(in + sizeof(hdr), payload, payload_len);
 
-    virtio_net_ctrl_ack_t* ack = (virtio_net_ctrl_ack_t*)kalloc(dev->memory_page, sizeof(virtio_net_ctrl_ack_t), ALIGN_16B, MEM_PRIV_KERNEL);
+    virtio_net_ctrl_ack_t* ack = (virtio_net_ctrl_ack_t*)net_buf_alloc(dev, sizeof(virtio_net_ctrl_ack_t));
     if (!ack) {
         kfree(in, in_len);
         return false;
@@ -87,6 +109,7 @@ bool VirtioNetDriver::init_at(uint64_t addr, uint32_t irq_base_vector) {
     mrg_rxbuf = false;
     ctrl_vq = false;
     ctrl_rx = false;
+    offloads = 0;
     header_size = sizeof(virtio_net_hdr_t);
     mtu = 1500;
     speed_mbps = 0xFFFFFFFFu;
@@ -97,8 +120,14 @@ bool VirtioNetDriver::init_at(uint64_t addr, uint32_t irq_base_vector) {
     rx_avail = nullptr;
     rx_used = nullptr;
     rx_qsz = 0;
+    rx_free_pages = nullptr;
+    rx_loan_pages = 0;
+    tx_done = nullptr;
     memset(&vnp_net_dev, 0, sizeof(vnp_net_dev));
 
+    if (!g_tx_cache) g_tx_cache = slab_cache_create("virtio_net_tx", sizeof(virtio_net_tx), ALIGN_16B, MEM_RW, 0);
+    tx_cache = g_tx_cache;
+
     kprintfv("[virtio-net] probing pci_addr=%x",(uintptr_t)addr);
 
     uint64_t mmio_addr = 0, mmio_size = 0;
@@ -131,6 +160,10 @@ bool VirtioNetDriver::init_at(uint64_t addr, uint32_t irq_base_vector) {
     net_feature_mask |= (1ULL << VIRTIO_NET_F_MRG_RXBUF);
     net_feature_mask |= (1ULL << VIRTIO_NET_F_CTRL_VQ);
     net_feature_mask |= (1ULL << VIRTIO_NET_F_CTRL_RX);
+    net_feature_mask |= (1ULL << VIRTIO_NET_F_CSUM);
+    net_feature_mask |= (1ULL << VIRTIO_NET_F_GUEST_CSUM);
+    net_feature_mask |= (1ULL << VIRTIO_NET_F_HOST_TSO4);
+    net_feature_mask |= (1ULL << VIRTIO_NET_F_HOST_TSO6);
     virtio_set_feature_mask(net_feature_mask);
 
     if (!virtio_init_device(&vnp_net_dev)){
@@ -142,6 +175,15 @@ bool VirtioNetDriver::init_at(uint64_t addr, uint32_t irq_base_vector) {
     mrg_rxbuf = (vnp_net_dev.negotiated_features & (1ULL << VIRTIO_NET_F_MRG_RXBUF)) != 0;
     header_size = mrg_rxbuf ? sizeof(virtio_net_hdr_mrg_rxbuf_t) : sizeof(virtio_net_hdr_t);
 
+    uint64_t nf = vnp_net_dev.negotiated_features;
+    if (nf & (1ULL << VIRTIO_NET_F_CSUM)) {
+        offloads |= NET_OFFLOAD_TX_CSUM;
+        //The device can only segment what it can also checksum
+        if (nf & (1ULL << VIRTIO_NET_F_HOST_TSO4)) offloads |= NET_OFFLOAD_TSO4;
+        if (nf & (1ULL << VIRTIO_NET_F_HOST_TSO6)) offloads |= NET_OFFLOAD_TSO6;
+    }
+    if (nf & (1ULL << VIRTIO_NET_F_GUEST_CSUM)) offloads |= NET_OFFLOAD_RX_CSUM;
+
     ctrl_vq = (vnp_net_dev.negotiated_features & (1ULL << VIRTIO_NET_F_CTRL_VQ)) != 0;
     ctrl_rx = (vnp_net_dev.negotiated_features & (1ULL << VIRTIO_NET_F_CTRL_RX)) != 0;
     if (CONTROL_QUEUE >= vnp_net_dev.num_queues || !vnp_net_dev.queues[CONTROL_QUEUE].valid || !vnp_net_dev.queues[CONTROL_QUEUE].size) {
@@ -216,7 +258,7 @@ bool VirtioNetDriver::init_at(uint64_t addr, uint32_t irq_base_vector) {
     }
 
     if (ctrl_vq && ctrl_rx) (void)sync_multicast((const uint8_t*)0, 0);
-    kprintfv("[virtio-net] negotiated ctrl_vq=%u ctrl_rx=%u", (unsigned)ctrl_vq, (unsigned)ctrl_rx);
+    kprintfv("[virtio-net] negotiated ctrl_vq=%u ctrl_rx=%u offloads=%x", (unsigned)ctrl_vq, (unsigned)ctrl_rx, offloads);
 
     volatile virtio_net_config* cfg = (volatile virtio_net_config*)vnp_net_dev.device_cfg;
 
@@ -272,6 +314,10 @@ const char* VirtioNetDriver::hw_ifname() const {
     return hw_name;
 }
 
+uint32_t VirtioNetDriver::get_offloads() const {
+    return offloads;
+}
+
 uint32_t VirtioNetDriver::get_speed_mbps() const { return speed_mbps; }
 
 uint8_t VirtioNetDriver::get_duplex() const {
@@ -284,14 +330,11 @@ uint8_t VirtioNetDriver::get_duplex() const {
 
 sizedptr VirtioNetDriver::allocate_packet(size_t size){
     size_t total = size + (size_t)header_size;
-    return (sizedptr){(uintptr_t)kalloc(vnp_net_dev.memory_page, total, ALIGN_64B, MEM_PRIV_KERNEL), total};
+    return (sizedptr){(uintptr_t)net_buf_alloc(&vnp_net_dev, total), total};
 }
 
-sizedptr VirtioNetDriver::handle_receive_packet(){
-    uint32_t desc_index = 0;
-    uint32_t total_len = 0;
-    uint16_t num_buffers = 1;
-
+//Pops the next completed RX chain. Malformed chains are handed straight back to the device and reported as empty
+bool VirtioNetDriver::rx_next_used(uint16_t* head, uint32_t* total_len, uint16_t* num_buffers){
     disable_interrupt();
     select_queue(&vnp_net_dev, RECEIVE_QUEUE);
     volatile virtq_used* used = rx_used;
@@ -300,75 +343,72 @@ sizedptr VirtioNetDriver::handle_receive_packet(){
     uint16_t qsz = rx_qsz;
     if (!qsz || !used || !desc || !avail) {
         enable_interrupt();
-        return (sizedptr){0,0};
+        return false;
     }
     asm volatile ("dmb ishld" ::: "memory");
 
     uint16_t new_idx = used->idx;
     if (new_idx == last_used_receive_idx) {
         enable_interrupt();
-        return (sizedptr){0,0};
+        return false;
     }
 
     uint16_t used_ring_index = (uint16_t)(last_used_receive_idx % qsz);
     volatile virtq_used_elem* e = &used->ring[used_ring_index];
     last_used_receive_idx++;
-    desc_index = e->id;
-    total_len = e->len;
-
-    if (desc_index >= qsz || total_len <= (uint32_t)header_size){
-        uint16_t aidx = avail->idx;
-        avail->ring[aidx % qsz] = (uint16_t)(desc_index % qsz);
-        asm volatile ("dmb ishst" ::: "memory");
-        avail->idx = (uint16_t)(aidx + 1);
-        asm volatile ("dmb ishst" ::: "memory");
-        select_queue(&vnp_net_dev, RECEIVE_QUEUE);
-        virtio_notify(&vnp_net_dev);
+    uint32_t desc_index = e->id;
+    uint32_t len = e->len;
+
+    if (desc_index >= qsz || len <= (uint32_t)header_size){
         enable_interrupt();
-        return (sizedptr){0,0};
+        rx_repost((uint16_t)(desc_index % qsz));
+        return false;
     }
 
-    volatile uint8_t* first_buf = (volatile uint8_t*)PHYS_TO_VIRT_P((void*)(uintptr_t)desc[desc_index].addr);
+    uint16_t nbufs = 1;
     if (mrg_rxbuf) {
+        volatile uint8_t* first_buf = (volatile uint8_t*)PHYS_TO_VIRT_P((void*)(uintptr_t)desc[desc_index].addr);
         virtio_net_hdr_mrg_rxbuf_t* h = (virtio_net_hdr_mrg_rxbuf_t*)(uintptr_t)first_buf;
-        num_buffers = h->num_buffers;
-        if (num_buffers == 0) num_buffers = 1;
-        if (num_buffers > RX_CHAIN_SEGS) {
-            uint16_t aidx = avail->idx;
-            avail->ring[aidx % qsz] = (uint16_t)desc_index;
-            asm volatile ("dmb ishst" ::: "memory");
-            avail->idx = (uint16_t)(aidx + 1);
-            asm volatile ("dmb ishst" ::: "memory");
-            select_queue(&vnp_net_dev, RECEIVE_QUEUE);
-            virtio_notify(&vnp_net_dev);
+        nbufs = h->num_buffers;
+        if (nbufs == 0) nbufs = 1;
+        if (nbufs > RX_CHAIN_SEGS) {
             enable_interrupt();
-            return (sizedptr){0,0};
+            rx_repost((uint16_t)desc_index);
+            return false;
         }
     }
+    enable_interrupt();
+
+    *head = (uint16_t)desc_index;
+    *total_len = len;
+    *num_buffers = nbufs;
+    return true;
+}
 
+void VirtioNetDriver::rx_repost(uint16_t head){
+    disable_interrupt();
+    uint16_t aidx = rx_avail->idx;
+    rx_avail->ring[aidx % rx_qsz] = head;
+    asm volatile ("dmb ishst" ::: "memory");
+    rx_avail->idx = (uint16_t)(aidx + 1);
+    asm volatile ("dmb ishst" ::: "memory");
+    select_queue(&vnp_net_dev, RECEIVE_QUEUE);
+    virtio_notify(&vnp_net_dev);
     enable_interrupt();
+}
 
+//Copies the frame out of the chain without reposting it
+sizedptr VirtioNetDriver::rx_copy_out(uint16_t head, uint32_t total_len, uint16_t num_buffers){
     uint32_t payload_len = total_len - (uint32_t)header_size;
-    void* out_buf = kalloc(vnp_net_dev.memory_page, payload_len, ALIGN_64B, MEM_PRIV_KERNEL);
-    if (!out_buf){
-        disable_interrupt();
-        uint16_t aidx = avail->idx;
-        avail->ring[aidx % qsz] = (uint16_t)desc_index;
-        asm volatile ("dmb ishst" ::: "memory");
-        avail->idx = (uint16_t)(aidx + 1);
-        asm volatile ("dmb ishst" ::: "memory");
-        select_queue(&vnp_net_dev, RECEIVE_QUEUE);
-        virtio_notify(&vnp_net_dev);
-        enable_interrupt();
-        return (sizedptr){0,0};
-    }
+    void* out_buf = net_buf_alloc(&vnp_net_dev, payload_len);
+    if (!out_buf) return (sizedptr){0,0};
 
     uint32_t written = 0;
     uint32_t remaining = payload_len;
-    uint16_t di = (uint16_t)desc_index;
+    uint16_t di = head;
     for (uint16_t bi = 0; bi < num_buffers && remaining; bi++) {
-        volatile uint8_t* buf = (volatile uint8_t*)PHYS_TO_VIRT_P((void*)(uintptr_t)desc[di].addr);
-        uint32_t cap = desc[di].len;
+        volatile uint8_t* buf = (volatile uint8_t*)PHYS_TO_VIRT_P((void*)(uintptr_t)rx_desc[di].addr);
+        uint32_t cap = rx_desc[di].len;
         uint32_t off = (bi == 0) ? (uint32_t)header_size : 0;
         if (cap <= off) break;
 
@@ -379,33 +419,105 @@ sizedptr VirtioNetDriver::handle_receive_packet(){
         remaining -= chunk;
 
         if (bi + 1 < num_buffers) {
-            if (!(desc[di].flags & VIRTQ_DESC_F_NEXT)) break;
-            di = desc[di].next;
+            if (!(rx_desc[di].flags & VIRTQ_DESC_F_NEXT)) break;
+            di = rx_desc[di].next;
         }
     }
 
-    disable_interrupt();
-    uint16_t aidx = avail->idx;
-    avail->ring[aidx % qsz] = (uint16_t)desc_index;
-    asm volatile ("dmb ishst" ::: "memory");
-    avail->idx = (uint16_t)(aidx + 1);
-    asm volatile ("dmb ishst" ::: "memory");
-    select_queue(&vnp_net_dev, RECEIVE_QUEUE);
-    virtio_notify(&vnp_net_dev);
-    enable_interrupt();
-
     if (remaining != 0) {
         kfree(out_buf, payload_len);
         return (sizedptr){0,0};
     }
-
     return (sizedptr){ (uintptr_t)out_buf, payload_len };
 }
 
+sizedptr VirtioNetDriver::handle_receive_packet(){
+    uint16_t head = 0;
+    uint32_t total_len = 0;
+    uint16_t num_buffers = 1;
+    if (!rx_next_used(&head, &total_len, &num_buffers)) return (sizedptr){0,0};
+
+    sizedptr out = rx_copy_out(head, total_len, num_buffers);
+    rx_repost(head);
+    return out;
+}
+
+void* VirtioNetDriver::rx_page_get(){
+    irq_flags_t irq = irq_save_disable();
+    void* page = rx_free_pages;
+    if (page) {
+        rx_free_pages = *(void**)page;
+        irq_restore(irq);
+        return page;
+    }
+    if (rx_loan_pages >= RX_LOAN_MAX_PAGES) {
+        irq_restore(irq);
+        return nullptr;
+    }
+    page = palloc(RX_BUF_SIZE, MEM_PRIV_KERNEL, MEM_RW, true);
+    if (page) rx_loan_pages++;
+    irq_restore(irq);
+    return page;
+}
+
+void VirtioNetDriver::rx_page_put(void* page){
+    irq_flags_t irq = irq_save_disable();
+    *(void**)page = rx_free_pages;
+    rx_free_pages = page;
+    irq_restore(irq);
+}
+
+void VirtioNetDriver::rx_page_release(void* ctx, uintptr_t base, uint32_t alloc_size){
+    (void)alloc_size;
+    ((VirtioNetDriver*)ctx)->rx_page_put((void*)base);
+}
+
+//Frames that fit the head buffer go up the stack in the buffer they were DMAd into, a spare page takes its place in the ring.
+//Once the spare pool runs dry the frame is copied like before so the ring never starves
+netpkt_t* VirtioNetDriver::receive_packet(){
+    uint16_t head = 0;
+    uint32_t total_len = 0;
+    uint16_t num_buffers = 1;
+    if (!rx_next_used(&head, &total_len, &num_buffers)) return nullptr;
+
+    uint32_t payload_len = total_len - (uint32_t)header_size;
+    bool csum_ok = false;
+    if (offloads & NET_OFFLOAD_RX_CSUM) {
+        volatile virtio_net_hdr_t* vh = (volatile virtio_net_hdr_t*)PHYS_TO_VIRT_P((void*)(uintptr_t)rx_desc[head].addr);
+        csum_ok = (vh->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID)) != 0;
+    }
+
+    if (num_buffers == 1 && total_len <= rx_desc[head].len) {
+        void* spare = rx_page_get();
+        if (spare) {
+            uintptr_t filled = (uintptr_t)PHYS_TO_VIRT_P((void*)(uintptr_t)rx_desc[head].addr);
+            netpkt_t* p = netpkt_wrap(filled, RX_BUF_SIZE, header_size, payload_len, rx_page_release, this);
+            if (p) {
+                rx_desc[head].addr = VIRT_TO_PHYS((uintptr_t)spare);
+                rx_repost(head);
+                if (csum_ok) netpkt_set_csum_valid(p);
+                return p;
+            }
+            rx_page_put(spare);
+        }
+    }
+
+    sizedptr raw = rx_copy_out(head, total_len, num_buffers);
+    rx_repost(head);
+    if (!raw.ptr) return nullptr;
+    netpkt_t* p = netpkt_wrap(raw.ptr, (uint32_t)raw.size, 0, (uint32_t)raw.size, net_driver_free_frame, nullptr);
+    if (!p) kfree((void*)raw.ptr, raw.size);
+    else if (csum_ok) netpkt_set_csum_valid(p);
+    return p;
+}
+
 void VirtioNetDriver::handle_sent_packet(){
     if (TRANSMIT_QUEUE >= vnp_net_dev.num_queues) return;
     if (!vnp_net_dev.queues[TRANSMIT_QUEUE].device) return;
+    virtio_reap(&vnp_net_dev, TRANSMIT_QUEUE);
     last_used_sent_idx = vnp_net_dev.queues[TRANSMIT_QUEUE].device->idx;
+    //Freed here as well as before each send, otherwise the last burst stays pinned until the next packet goes out
+    tx_reclaim();
 }
 
 bool VirtioNetDriver::send_packet(sizedptr packet){
@@ -428,6 +540,85 @@ bool VirtioNetDriver::send_packet(sizedptr packet){
     return ok;
 }
 
+//Called from virtio_reap, which may be partway through the ring. Packets are collected and freed by tx_reclaim once it's done
+void VirtioNetDriver::tx_complete(virtio_request* req, uint32_t len){
+    (void)len;
+    virtio_net_tx* tx = (virtio_net_tx*)req;
+    VirtioNetDriver* self = (VirtioNetDriver*)req->ctx;
+    tx->next = self->tx_done;
+    self->tx_done = tx;
+}
+
+void VirtioNetDriver::tx_reclaim(){
+    irq_flags_t irq = irq_save_disable();
+    virtio_net_tx* tx = tx_done;
+    tx_done = nullptr;
+    irq_restore(irq);
+
+    while (tx) {
+        virtio_net_tx* next = tx->next;
+        netpkt_unref(tx->pkt);
+        slab_free(tx_cache, tx);
+        tx = next;
+    }
+}
+
+//The chain is the virtio-net header followed by the packet's linear data and fragments, nothing gets copied
+bool VirtioNetDriver::send_pkt(netpkt_t* pkt){
+    tx_reclaim();
+
+    uint32_t total = netpkt_total_len(pkt);
+    uint8_t gso = netpkt_gso_type(pkt);
+    uint32_t tso_needed = gso == NETPKT_GSO_TCPV4 ? NET_OFFLOAD_TSO4 : gso == NETPKT_GSO_TCPV6 ? NET_OFFLOAD_TSO6 : 0;
+    if (!total || (tso_needed & ~offloads) || (!(offloads & NET_OFFLOAD_TX_CSUM) && !netpkt_csum_resolve(pkt))) {
+        netpkt_unref(pkt);
+        return false;
+    }
+
+    virtio_buf bufs[VIRTIO_NET_TX_MAX_SEGS];
+    uint16_t n = 1;
+    for (netpkt_t* p = pkt; p; p = netpkt_frag(p)) {
+        if (!netpkt_len(p)) continue;
+        //Longer fragment chains still go out, just flattened into a single buffer
+        if (n == VIRTIO_NET_TX_MAX_SEGS) return NetDriver::send_pkt(pkt);
+        bufs[n++] = VBUF(netpkt_data(p), netpkt_len(p), 0);
+    }
+
+    virtio_net_tx* tx = tx_cache ? (virtio_net_tx*)slab_alloc(tx_cache) : nullptr;
+    if (!tx) return NetDriver::send_pkt(pkt);
+    bufs[0] = VBUF(&tx->hdr, header_size, 0);
+
+    uint16_t csum_start = 0, csum_offset = 0;
+    if (netpkt_csum_partial(pkt, &csum_start, &csum_offset)) {
+        tx->hdr.hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        tx->hdr.hdr.csum_start = csum_start;
+        tx->hdr.hdr.csum_offset = csum_offset;
+    }
+    if (gso) {
+        tx->hdr.hdr.gso_type = gso == NETPKT_GSO_TCPV4 ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+        tx->hdr.hdr.gso_size = netpkt_gso_size(pkt);
+        //Headers are whatever sits in the linear part, the payload hangs off it as fragments
+        tx->hdr.hdr.hdr_len = (uint16_t)netpkt_len(pkt);
+    }
+    tx->pkt = pkt;
+    tx->req.done = tx_complete;
+    tx->req.ctx = this;
+
+    if (virtio_queue_add(&vnp_net_dev, TRANSMIT_QUEUE, bufs, n, &tx->req) < 0) {
+        virtio_reap(&vnp_net_dev, TRANSMIT_QUEUE);
+        tx_reclaim();
+        if (virtio_queue_add(&vnp_net_dev, TRANSMIT_QUEUE, bufs, n, &tx->req) < 0) {
+            slab_free(tx_cache, tx);
+            netpkt_unref(pkt);
+            return false;
+        }
+    }
+    virtio_queue_kick(&vnp_net_dev, TRANSMIT_QUEUE);
+
+    kprintfv("[virtio-net] tx queued len=%u segs=%u",(unsigned)total, (unsigned)n);
+    return true;
+}
+
 bool VirtioNetDriver::sync_multicast(const uint8_t* macs, uint32_t count) {
     if (!ctrl_vq) return true;
     if (!ctrl_rx) return true;
@@ -447,7 +638,7 @@ bool VirtioNetDriver::sync_multicast(const uint8_t* macs, uint32_t count) {
     else ok = ok && virtio_net_ctrl_send(&vnp_net_dev, VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOMULTI, &v0, 1);
 
     uint32_t payload_len = 8u + count * 6u;
-    uint8_t* payload = (uint8_t*)kalloc(vnp_net_dev.memory_page, payload_len, ALIGN_16B, MEM_PRIV_KERNEL);
+    uint8_t* payload = (uint8_t*)net_buf_alloc(&vnp_net_dev, payload_len);
     if (!payload) {
         enable_interrupt();
         return false;
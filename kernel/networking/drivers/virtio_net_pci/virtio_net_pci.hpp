@@ -4,6 +4,7 @@
 #include "virtio/virtio_pci.h"
 #include "std/memory.h"
 #include "networking/link_layer/nic_types.h"
+#include "memory/slab.h"
 #define VIRTIO_F_VERSION_1 32
 
 #define VIRTIO_NET_F_CSUM 0
@@ -25,6 +26,13 @@
 #define VIRTIO_NET_F_CTRL_VQ 17
 #define VIRTIO_NET_F_CTRL_RX 18
 
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+
+#define VIRTIO_NET_HDR_GSO_NONE 0
+#define VIRTIO_NET_HDR_GSO_TCPV4 1
+#define VIRTIO_NET_HDR_GSO_TCPV6 4
+
 typedef struct __attribute__((packed)) virtio_net_hdr_t {
     uint8_t flags;
     uint8_t gso_type;
@@ -51,6 +59,8 @@ typedef struct __attribute__((packed)) virtio_net_config {
     uint32_t supported_hash_types;
 } virtio_net_config;
 
+struct virtio_net_tx;
+
 class VirtioNetDriver : public NetDriver {
 public:
     VirtioNetDriver();
@@ -66,11 +76,14 @@ public:
     uint32_t get_speed_mbps() const override;
     uint8_t get_duplex() const override;
     bool sync_multicast(const uint8_t* macs, uint32_t count) override;
+    uint32_t get_offloads() const override;
 
     sizedptr allocate_packet(size_t size) override;
     sizedptr handle_receive_packet() override;
+    netpkt_t* receive_packet() override;
     void handle_sent_packet() override;
     bool send_packet(sizedptr packet) override;
+    bool send_pkt(netpkt_t* pkt) override;
 
 private:
     virtio_device vnp_net_dev = {};
@@ -80,12 +93,20 @@ private:
     volatile virtq_used* rx_used = nullptr;
     uint16_t rx_qsz = 0;
 
+    void* rx_free_pages = nullptr;
+    uint32_t rx_loan_pages = 0;
+
+    slab_cache* tx_cache = nullptr;
+    virtio_net_tx* tx_done = nullptr;
+
     bool verbose = false;
     bool mrg_rxbuf = false;
 
     bool ctrl_vq = false;
     bool ctrl_rx = false;
 
+    uint32_t offloads = 0;
+
     uint16_t header_size = sizeof(virtio_net_hdr_t);
     uint16_t mtu = 1500;
     uint32_t speed_mbps = 0xFFFFFFFFu;
@@ -94,4 +115,13 @@ private:
 
     uint16_t last_used_receive_idx = 0;
     uint16_t last_used_sent_idx = 0;
+
+    bool rx_next_used(uint16_t* head, uint32_t* total_len, uint16_t* num_buffers);
+    void rx_repost(uint16_t head);
+    sizedptr rx_copy_out(uint16_t head, uint32_t total_len, uint16_t num_buffers);
+    void* rx_page_get();
+    void rx_page_put(void* page);
+    static void rx_page_release(void* ctx, uintptr_t base, uint32_t alloc_size);
+    static void tx_complete(virtio_request* req, uint32_t len);
+    void tx_reclaim();
 };
@@ -21,6 +21,7 @@ static void* g_kmem_page_v6 = NULL;
 static l2_interface_t g_l2[MAX_L2_INTERFACES];
 static uint8_t g_l2_used[MAX_L2_INTERFACES];
 static uint8_t g_l2_count = 0;
+static volatile uint32_t g_route_gen = 1;
 
 typedef struct {
     l3_ipv4_interface_t node;
@@ -160,9 +161,17 @@ bool l2_interface_set_up(uint8_t ifindex, bool up) {
     l2_interface_t* itf = l2_interface_find_by_index(ifindex);
     if (!itf) return false;
     itf->is_up = up;
+    ifmgr_route_changed();
     return true;
 }
 
+uint32_t ifmgr_route_gen(void) { return g_route_gen; }
+
+void ifmgr_route_changed(void) {
+    uint32_t g = g_route_gen + 1;
+    g_route_gen = g ? g : 1;
+}
+
 static bool l2_sync_multicast_filters(l2_interface_t* itf) {
     if (!itf) return false;
     uint8_t macs[(MAX_IPV4_MCAST_PER_INTERFACE + MAX_IPV6_MCAST_PER_INTERFACE) * 6];
@@ -392,6 +401,7 @@ uint8_t l3_ipv4_add_to_interface(uint8_t ifindex, uint32_t ip, uint32_t mask, ui
 
     if (n->mode != IPV4_CFG_DISABLED && n->ip && l2->kind != NET_IFK_LOCALHOST) (void)l2_ipv4_mcast_join(ifindex, IPV4_MCAST_ALL_HOSTS);
 
+    ifmgr_route_changed();
     return n->l3_id;
 }
 
@@ -451,6 +461,7 @@ bool l3_ipv4_update(uint8_t l3_id, uint32_t ip, uint32_t mask, uint32_t gw, ipv4
             n->routing_table = NULL;
         }
     }
+    ifmgr_route_changed();
     return true;
 }
 
@@ -485,6 +496,7 @@ bool l3_ipv4_remove_from_interface(uint8_t l3_id){
 
     g_v4[g].used = false;
     memset(&g_v4[g], 0, sizeof(g_v4[g]));
+    ifmgr_route_changed();
     return true;
 }
 
@@ -663,6 +675,7 @@ uint8_t l3_ipv6_add_to_interface(uint8_t ifindex, const uint8_t ip[16], uint8_t
         }
     }
 
+    ifmgr_route_changed();
     return n->l3_id;
 }
 
@@ -807,6 +820,7 @@ bool l3_ipv6_update(uint8_t l3_id, const uint8_t ip[16], uint8_t prefix_len, con
         }
     }
 
+    ifmgr_route_changed();
     return true;
 }
 
@@ -849,6 +863,7 @@ bool l3_ipv6_remove_from_interface(uint8_t l3_id){
 
     g_v6[g].used = false;
     memset(&g_v6[g], 0, sizeof(g_v6[g]));
+    ifmgr_route_changed();
     return true;
 }
 
@@ -871,6 +886,7 @@ bool l3_ipv6_set_enabled(uint8_t l3_id, bool enable){
         n->dad_state = IPV6_DAD_NONE;
         n->dad_probes_sent = 0;
         n->dad_timer_ms = 0;
+        ifmgr_route_changed();
         return true;
     }
 }
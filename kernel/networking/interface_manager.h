@@ -183,6 +183,11 @@ void ifmgr_autoconfig_l2(uint8_t ifindex);
 ip_resolution_result_t resolve_ipv4_to_interface(uint32_t dst_ip);
 ip_resolution_result_t resolve_ipv6_to_interface(const uint8_t dst_ip[16]);
 
+//Bumped after anything that changes where a destination is sent: addresses, routes, link state, neighbours.
+//Per-destination tx caches compare it instead of redoing the lookup, it is never 0
+uint32_t ifmgr_route_gen(void);
+void ifmgr_route_changed(void);
+
 static inline port_manager_t* ifmgr_pm_v4(uint8_t l3_id){
     l3_ipv4_interface_t* n = l3_ipv4_find_by_id(l3_id);
     return n ? n->port_manager : NULL;
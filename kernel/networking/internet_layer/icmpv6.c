@@ -1,6 +1,6 @@
 #include "icmpv6.h"
 #include "std/memory.h"
-#include "net/checksums.h"
+#include "networking/net_checksum.h"
 #include "networking/internet_layer/ipv6.h"
 #include "networking/internet_layer/ipv6_utils.h"
 #include "networking/internet_layer/ipv6_route.h"
@@ -106,7 +106,7 @@ static bool icmpv6_send_echo_reply(uint16_t ifindex, const uint8_t src_ip[16], c
         return false;
     }
 
-    e->hdr.checksum = bswap16(checksum16_pipv6(dst_ip, src_ip, 58, (const uint8_t*)buf, icmp_len));
+    e->hdr.checksum = bswap16(net_csum_finish(net_csum_partial((const void*)buf, icmp_len, net_csum_pseudo_ipv6(dst_ip, src_ip, 58, icmp_len))));
 
     icmpv6_send_on_l2(ifindex, src_ip, dst_ip, src_mac, (const void*)buf, icmp_len, hop_limit ? hop_limit : 64);
 
@@ -141,7 +141,7 @@ static bool icmpv6_send_echo_request(const uint8_t dst_ip[16], uint16_t id, uint
         netpkt_unref(pkt);
         return false;
     }
-    e->hdr.checksum = bswap16(checksum16_pipv6(plan.src_ip, dst_ip, 58, (const uint8_t*)buf, len));
+    e->hdr.checksum = bswap16(net_csum_finish(net_csum_partial((const void*)buf, len, net_csum_pseudo_ipv6(plan.src_ip, dst_ip, 58, len))));
 
     ipv6_send_packet(dst_ip, 58, pkt, (const ipv6_tx_opts_t*)tx_opts_or_null, hop_limit ? hop_limit : 64, 0);
     return true;
@@ -262,8 +262,7 @@ void icmpv6_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_
     const icmpv6_hdr_t *h = (const icmpv6_hdr_t*)icmp;
     if (h->code != 0 && (h->type == ICMPV6_ECHO_REQUEST || h->type == ICMPV6_ECHO_REPLY)) return;
 
-    uint16_t calc = bswap16(checksum16_pipv6(src_ip, dst_ip, 58, icmp, icmp_len));
-    if (calc != 0) return;
+    if (net_csum_finish(net_csum_partial(icmp, icmp_len, net_csum_pseudo_ipv6(src_ip, dst_ip, 58, icmp_len))) != 0) return;
 
     if ((h->type == 133 || h->type == 134 || h->type == 135 || h->type == 136 || h->type == 137) && hop_limit != 255) return;
     if (h->type == 130 || h->type == 131 || h->type == 132 || h->type == 143) {
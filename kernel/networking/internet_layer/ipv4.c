@@ -12,9 +12,26 @@
 #include "ipv4_utils.h"
 #include "net/network_types.h"
 #include "networking/link_layer/nic_types.h"
+#include "exceptions/irq.h"
 
 static uint16_t g_ip_ident = 1;
 
+#define IPV4_DST_CACHE_SIZE 64
+
+//Where the last packet to dst went, good for as long as the route generation it was resolved under
+typedef struct {
+    uint32_t gen;
+    uint32_t dst;
+    uint32_t src;
+    uint16_t mtu;
+    uint8_t scope;
+    uint8_t index;
+    uint8_t ifx;
+    uint8_t mac[6];
+} ipv4_dst_entry_t;
+
+static ipv4_dst_entry_t g_dst_cache[IPV4_DST_CACHE_SIZE];
+
 static l3_ipv4_interface_t* best_v4_on_l2_for_dst(l2_interface_t* l2, uint32_t dst) {
     l3_ipv4_interface_t* best = NULL;
     uint32_t best_pl = -1;
@@ -247,21 +264,29 @@ static bool pick_route(uint32_t dst, const ipv4_tx_opts_t* opts, uint8_t* out_if
 }
 
 
-void ipv4_send_packet(uint32_t dst_ip, uint8_t proto, netpkt_t* pkt, const ipv4_tx_opts_t* opts, uint8_t ttl, uint8_t dontfrag) {
-    if (!pkt || !netpkt_len(pkt)) {
-        if (pkt) netpkt_unref(pkt);
-        return;
-    }
+static ipv4_dst_entry_t* dst_cache_slot(uint32_t dst, uint8_t scope, uint8_t index) {
+    uint32_t h = (dst ^ ((uint32_t)scope << 24) ^ ((uint32_t)index << 16)) * 2654435761u;
+    return &g_dst_cache[(h >> 16) & (IPV4_DST_CACHE_SIZE - 1)];
+}
+
+static bool dst_cache_get(uint32_t dst, uint8_t scope, uint8_t index, ipv4_dst_entry_t* out) {
+    irq_flags_t irq = irq_save_disable();
+    ipv4_dst_entry_t* e = dst_cache_slot(dst, scope, index);
+    bool hit = e->gen == ifmgr_route_gen() && e->dst == dst && e->scope == scope && e->index == index;
+    if (hit) *out = *e;
+    irq_restore(irq);
+    return hit;
+}
 
+//Full route selection and neighbour resolution, the result is cached under the generation seen before starting
+//so anything changing while ARP sleeps leaves it already stale
+static bool dst_resolve(uint32_t dst_ip, const ipv4_tx_opts_t* opts, uint8_t scope, uint8_t index, ipv4_dst_entry_t* out) {
+    uint32_t gen = ifmgr_route_gen();
     uint8_t ifx = 0;
     uint32_t src_ip = 0;
     uint32_t nh = 0;
-    if (!pick_route(dst_ip, opts, &ifx, &src_ip, &nh)) {
-        netpkt_unref(pkt);
-        return;
-    }
+    if (!pick_route(dst_ip, opts, &ifx, &src_ip, &nh)) return false;
 
-    uint8_t dst_mac[6];
     bool is_dbcast = false;
     l2_interface_t* l2 = l2_interface_find_by_index(ifx);
     if (l2) {
@@ -273,15 +298,14 @@ void ipv4_send_packet(uint32_t dst_ip, uint8_t proto, netpkt_t* pkt, const ipv4_
     }
 
     if (is_dbcast) {
-        memset(dst_mac, 0xFF, 6);
+        memset(out->mac, 0xFF, 6);
     } else if (ipv4_is_multicast(dst_ip)) {
-        ipv4_mcast_to_mac(dst_ip, dst_mac);
+        ipv4_mcast_to_mac(dst_ip, out->mac);
     } else {
         if (l2 && l2->kind == NET_IFK_LOCALHOST) {
-            memset(dst_mac, 0, 6);
-        } else if (!arp_resolve_on(ifx, nh, dst_mac, 1000)) {
-            netpkt_unref(pkt);
-            return;
+            memset(out->mac, 0, 6);
+        } else if (!arp_resolve_on(ifx, nh, out->mac, 1000)) {
+            return false;
         }
     }
 
@@ -297,16 +321,45 @@ void ipv4_send_packet(uint32_t dst_ip, uint8_t proto, netpkt_t* pkt, const ipv4_
         }
     }
 
+    out->gen = gen;
+    out->dst = dst_ip;
+    out->src = src_ip;
+    out->mtu = mtu;
+    out->scope = scope;
+    out->index = index;
+    out->ifx = ifx;
+
+    irq_flags_t irq = irq_save_disable();
+    *dst_cache_slot(dst_ip, scope, index) = *out;
+    irq_restore(irq);
+    return true;
+}
+
+void ipv4_send_packet(uint32_t dst_ip, uint8_t proto, netpkt_t* pkt, const ipv4_tx_opts_t* opts, uint8_t ttl, uint8_t dontfrag) {
+    if (!pkt || !netpkt_total_len(pkt)) {
+        if (pkt) netpkt_unref(pkt);
+        return;
+    }
+
+    uint8_t scope = opts ? (uint8_t)opts->scope : (uint8_t)IP_TX_AUTO;
+    uint8_t index = opts ? opts->index : 0;
+    ipv4_dst_entry_t route;
+    if (!dst_cache_get(dst_ip, scope, index, &route) && !dst_resolve(dst_ip, opts, scope, index, &route)) {
+        netpkt_unref(pkt);
+        return;
+    }
+
     uint32_t hdr_len = IP_IHL_NOOPTS * 4;
-    uint32_t seg_len = netpkt_len(pkt);
+    uint32_t seg_len = netpkt_total_len(pkt);
     void* hdrp = netpkt_push(pkt, hdr_len);
     if (!hdrp) {
         netpkt_unref(pkt);
         return;
     }
 
+    //Super-segments are over the MTU on purpose, the NIC cuts them back down
     uint32_t total = hdr_len + seg_len;
-    if (dontfrag && total > (uint32_t)mtu) {
+    if (dontfrag && total > (uint32_t)route.mtu && netpkt_gso_type(pkt) == NETPKT_GSO_NONE) {
         netpkt_unref(pkt);
         return;
     }
@@ -321,11 +374,11 @@ void ipv4_send_packet(uint32_t dst_ip, uint8_t proto, netpkt_t* pkt, const ipv4_
     ip->ttl = ttl ? ttl : IP_TTL_DEFAULT;
     ip->protocol = proto;
     ip->header_checksum = 0;
-    ip->src_ip = bswap32(src_ip);
+    ip->src_ip = bswap32(route.src);
     ip->dst_ip = bswap32(dst_ip);
     ip->header_checksum = checksum16((const uint16_t*)ip, hdr_len / 2);
 
-    eth_send_frame_on(ifx, ETHERTYPE_IPV4, dst_mac, pkt);
+    eth_send_frame_on(route.ifx, ETHERTYPE_IPV4, route.mac, pkt);
 }
 
 void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
@@ -399,8 +452,8 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
             uint8_t l3id = cand[i]->l3_id;
             switch (proto) {
                 case 2: igmp_input((uint8_t)ifindex, src, dst, (const void*)l4, l4_len); break;
-                case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
-                case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
+                case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
+                case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
                 default: break;
             }
         }
@@ -413,8 +466,8 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
             uint8_t l3id = cand[0]->l3_id;
             switch (proto) {
                 case 1: icmp_input(l4, l4_len, src, dst); break;
-                case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
-                case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
+                case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
+                case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
                 default: break;
             }
             return;
@@ -423,8 +476,8 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
                 uint8_t l3id = cand[i]->l3_id;
                 switch (proto) {
                     case 1: icmp_input(l4, l4_len, src, dst); break;
-                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
-                    case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
+                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
+                    case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
                     default: break;
                 }
             }
@@ -443,8 +496,8 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
     if (match_count == 1) {
         switch (proto) {
             case 1: icmp_input(l4, l4_len, src, dst); break;
-            case 6: tcp_input(IP_VER4, &src, &dst, match_l3id, l4, l4_len); break;
-            case 17: udp_input(IP_VER4, &src, &dst, match_l3id, l4, l4_len); break;
+            case 6: tcp_input(IP_VER4, &src, &dst, match_l3id, l4, l4_len, pkt); break;
+            case 17: udp_input(IP_VER4, &src, &dst, match_l3id, l4, l4_len, pkt); break;
             default: break;
         }
         return;
@@ -455,8 +508,8 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
                 uint8_t l3id = cand[i]->l3_id;
                 switch (proto) {
                     case 1: icmp_input(l4, l4_len, src, dst); break;
-                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
-                    case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
+                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
+                    case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
                     default: break;
                 }
             }
@@ -477,8 +530,8 @@ void ipv4_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
                 uint8_t l3id = v4->l3_id;
                 switch (proto) {
                     case 1: icmp_input(l4, l4_len, src, dst); break;
-                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
-                    case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len); break;
+                    case 6: tcp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
+                    case 17: udp_input(IP_VER4, &src, &dst, l3id, l4, l4_len, pkt); break;
                     default: break;
                 }
             }
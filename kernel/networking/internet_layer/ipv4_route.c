@@ -79,6 +79,7 @@ bool ipv4_build_tx_plan(uint32_t dst, const ip_tx_opts_t* hint, const uint8_t* a
     return true;
 }
 
+//Kept ordered by prefix length, longest first, then by metric so the first match is the best one
 struct ipv4_rt_table {
     ipv4_rt_entry_t e[IPV4_RT_PER_IF_MAX];
     int len;
@@ -90,6 +91,23 @@ static int prefix_len(uint32_t m) {
     return n;
 }
 
+static bool rt_before(const ipv4_rt_entry_t* a, const ipv4_rt_entry_t* b) {
+    if (a->prefix_len != b->prefix_len) return a->prefix_len > b->prefix_len;
+    return a->metric < b->metric;
+}
+
+static void rt_insert(ipv4_rt_table_t* t, ipv4_rt_entry_t ent) {
+    int i = t->len++;
+    for (; i > 0 && rt_before(&ent, &t->e[i - 1]); i--) t->e[i] = t->e[i - 1];
+    t->e[i] = ent;
+}
+
+static void rt_remove(ipv4_rt_table_t* t, int idx) {
+    for (int i = idx + 1; i < t->len; i++) t->e[i - 1] = t->e[i];
+    t->len--;
+    memset(&t->e[t->len], 0, sizeof(t->e[0]));
+}
+
 ipv4_rt_table_t* ipv4_rt_create(void) {
     ipv4_rt_table_t* t = (ipv4_rt_table_t*)malloc(sizeof(ipv4_rt_table_t));
     if (!t) return 0;
@@ -106,19 +124,26 @@ void ipv4_rt_clear(ipv4_rt_table_t* t) {
     if (!t) return;
     t->len = 0;
     memset(t->e, 0, sizeof(t->e));
+    ifmgr_route_changed();
 }
 
 bool ipv4_rt_add_in(ipv4_rt_table_t* t, uint32_t network, uint32_t mask, uint32_t gateway, uint16_t metric) {
     if (!t) return false;
     for (int i = 0; i < t->len; i++) {
         if (t->e[i].network == network && t->e[i].mask == mask) {
-            t->e[i].gateway = gateway;
-            t->e[i].metric = metric;
+            if (t->e[i].gateway == gateway && t->e[i].metric == metric) return true;
+            ipv4_rt_entry_t ent = t->e[i];
+            ent.gateway = gateway;
+            ent.metric = metric;
+            rt_remove(t, i);
+            rt_insert(t, ent);
+            ifmgr_route_changed();
             return true;
         }
     }
     if (t->len >= IPV4_RT_PER_IF_MAX) return false;
-    t->e[t->len++] = (ipv4_rt_entry_t){ network, mask, gateway, metric };
+    rt_insert(t, (ipv4_rt_entry_t){ network, mask, gateway, metric, (uint8_t)prefix_len(mask) });
+    ifmgr_route_changed();
     return true;
 }
 
@@ -126,8 +151,8 @@ bool ipv4_rt_del_in(ipv4_rt_table_t* t, uint32_t network, uint32_t mask) {
     if (!t) return false;
     for (int i = 0; i < t->len; i++) {
         if (t->e[i].network == network && t->e[i].mask == mask) {
-            t->e[i] = t->e[--t->len];
-            memset(&t->e[t->len], 0, sizeof(t->e[0]));
+            rt_remove(t, i);
+            ifmgr_route_changed();
             return true;
         }
     }
@@ -136,29 +161,15 @@ bool ipv4_rt_del_in(ipv4_rt_table_t* t, uint32_t network, uint32_t mask) {
 
 bool ipv4_rt_lookup_in(const ipv4_rt_table_t* t, uint32_t dst, uint32_t* next_hop, int* out_prefix_len, int* out_metric) {
     if (!t) return false;
-    int best_pl = -1;
-    int best_metric = 0x7FFF;
-    uint32_t best_nh = 0;
-
     for (int i = 0; i < t->len; i++) {
-        uint32_t net = t->e[i].network;
-        uint32_t mask = t->e[i].mask;
-        if (mask == 0 || ((dst & mask) == net)) {
-            int pl = prefix_len(mask);
-            int met = t->e[i].metric;
-            if (pl > best_pl || (pl == best_pl && met < best_metric)) {
-                best_pl = pl;
-                best_metric = met;
-                best_nh = t->e[i].gateway ? t->e[i].gateway : dst;
-            }
-        }
+        const ipv4_rt_entry_t* r = &t->e[i];
+        if (r->mask && (dst & r->mask) != r->network) continue;
+        if (next_hop) *next_hop = r->gateway ? r->gateway : dst;
+        if (out_prefix_len) *out_prefix_len = r->prefix_len;
+        if (out_metric) *out_metric = r->metric;
+        return true;
     }
-
-    if (best_pl < 0) return false;
-    if (next_hop) *next_hop = best_nh;
-    if (out_prefix_len) *out_prefix_len = best_pl;
-    if (out_metric) *out_metric = best_metric;
-    return true;
+    return false;
 }
 
 void ipv4_rt_ensure_basics(ipv4_rt_table_t* t, uint32_t ip, uint32_t mask, uint32_t gw, uint16_t base_metric) {
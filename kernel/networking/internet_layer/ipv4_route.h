@@ -13,6 +13,7 @@ typedef struct {
     uint32_t mask;
     uint32_t gateway;
     uint16_t metric;
+    uint8_t prefix_len;
 } ipv4_rt_entry_t;
 
 typedef struct ipv4_rt_table ipv4_rt_table_t;
@@ -15,10 +15,27 @@
 #include "math/rng.h"
 #include "net/checksums.h"
 #include "networking/link_layer/nic_types.h"
+#include "exceptions/irq.h"
 
 #define IPV6_MIN_MTU 1280u
 #define PMTU_CACHE_SIZE 16
 #define REASS_SLOTS 8
+#define DST_CACHE_SIZE 64
+
+//Where the last packet to dst went, good for as long as the route generation it was resolved under.
+//mtu is the interface one, path MTU is still applied per packet
+typedef struct {
+    uint32_t gen;
+    uint8_t dst[16];
+    uint8_t src[16];
+    uint16_t mtu;
+    uint8_t scope;
+    uint8_t index;
+    uint8_t ifx;
+    uint8_t mac[6];
+} ipv6_dst_entry_t;
+
+static ipv6_dst_entry_t g_dst_cache[DST_CACHE_SIZE];
 
 typedef struct {
     uint8_t used;
@@ -342,81 +359,106 @@ static bool pick_route(const uint8_t dst[16], const ipv6_tx_opts_t* opts, uint8_
     return pick_route_global(dst, out_ifx, out_src, out_nh);
 }
 
-void ipv6_send_packet(const uint8_t dst[16], uint8_t next_header, netpkt_t* pkt, const ipv6_tx_opts_t* opts, uint8_t hop_limit, uint8_t dontfrag) {
-    if (!dst || !pkt || !netpkt_len(pkt)) {
-        if (pkt) netpkt_unref(pkt);
-        return;
-    }
+static ipv6_dst_entry_t* dst_cache_slot(const uint8_t dst[16], uint8_t scope, uint8_t index) {
+    uint32_t h = ((uint32_t)scope << 24) ^ ((uint32_t)index << 16);
+    for (int i = 0; i < 16; i += 4) h ^= ((uint32_t)dst[i] << 24) | ((uint32_t)dst[i + 1] << 16) | ((uint32_t)dst[i + 2] << 8) | dst[i + 3];
+    h *= 2654435761u;
+    return &g_dst_cache[(h >> 16) & (DST_CACHE_SIZE - 1)];
+}
 
+static bool dst_cache_get(const uint8_t dst[16], uint8_t scope, uint8_t index, ipv6_dst_entry_t* out) {
+    irq_flags_t irq = irq_save_disable();
+    ipv6_dst_entry_t* e = dst_cache_slot(dst, scope, index);
+    bool hit = e->gen == ifmgr_route_gen() && e->scope == scope && e->index == index && ipv6_cmp(e->dst, dst) == 0;
+    if (hit) *out = *e;
+    irq_restore(irq);
+    return hit;
+}
+
+//Full route selection, source checks and neighbour resolution, cached under the generation seen before starting
+//so anything changing while NDP sleeps leaves it already stale
+static bool dst_resolve(const uint8_t dst[16], const ipv6_tx_opts_t* opts, uint8_t scope, uint8_t index, ipv6_dst_entry_t* out) {
+    uint32_t gen = ifmgr_route_gen();
     uint8_t ifx = 0;
     uint8_t src[16] = {0};
     uint8_t nh[16] = {0};
 
     l3_ipv6_interface_t* src_v6 = NULL;
 
-    if (!pick_route(dst, opts, &ifx, src, nh)) {
-        netpkt_unref(pkt);
-        return;
-    }
+    if (!pick_route(dst, opts, &ifx, src, nh)) return false;
 
     if (!ipv6_is_unspecified(src)) {
         l2_interface_t* l2 = l2_interface_find_by_index(ifx);
-        if (!l2) {
-            netpkt_unref(pkt);
-            return;
-        }
+        if (!l2) return false;
 
         int ok = 0;
         for (int i = 0; i < MAX_IPV6_PER_INTERFACE; i++) {
             l3_ipv6_interface_t* v6 = l2->l3_v6[i];
             if (!v6) continue;
             if (ipv6_cmp(v6->ip, src) != 0) continue;
-            if (v6->cfg == IPV6_CFG_DISABLE) {
-                netpkt_unref(pkt);
-                return;
-            }
-            if (v6->dad_state != IPV6_DAD_OK) {
-                netpkt_unref(pkt);
-                return;
-            }
+            if (v6->cfg == IPV6_CFG_DISABLE) return false;
+            if (v6->dad_state != IPV6_DAD_OK) return false;
             ok = 1;
             src_v6 = v6;
             break;
         }
-        if (!ok) {
-            netpkt_unref(pkt);
-            return;
-        }
+        if (!ok) return false;
     }
 
-    if (ipv6_is_linklocal(src) && !ipv6_is_linklocal(dst) && !ipv6_is_multicast(dst)) {
-        netpkt_unref(pkt);
-        return;
-    }
+    if (ipv6_is_linklocal(src) && !ipv6_is_linklocal(dst) && !ipv6_is_multicast(dst)) return false;
 
-    uint8_t dst_mac[6];
     l2_interface_t* l2 = l2_interface_find_by_index(ifx);
-    if (ipv6_is_multicast(dst)) ipv6_multicast_mac(dst, dst_mac);
-    else if (l2 && l2->kind == NET_IFK_LOCALHOST) memset(dst_mac, 0, 6);
-    else if (!ndp_resolve_on(ifx, nh, dst_mac, 200)) {
-        netpkt_unref(pkt);
-        return;
-    }
+    if (ipv6_is_multicast(dst)) ipv6_multicast_mac(dst, out->mac);
+    else if (l2 && l2->kind == NET_IFK_LOCALHOST) memset(out->mac, 0, 6);
+    else if (!ndp_resolve_on(ifx, nh, out->mac, 200)) return false;
 
     uint16_t mtu = 1500;
 
     if (!src_v6 && opts && opts->scope == IP_TX_BOUND_L3) src_v6 = l3_ipv6_find_by_id(opts->index);
     if (src_v6 && src_v6->mtu) mtu = src_v6->mtu;
 
+    out->gen = gen;
+    memcpy(out->dst, dst, 16);
+    memcpy(out->src, src, 16);
+    out->mtu = mtu;
+    out->scope = scope;
+    out->index = index;
+    out->ifx = ifx;
+
+    irq_flags_t irq = irq_save_disable();
+    *dst_cache_slot(dst, scope, index) = *out;
+    irq_restore(irq);
+    return true;
+}
+
+void ipv6_send_packet(const uint8_t dst[16], uint8_t next_header, netpkt_t* pkt, const ipv6_tx_opts_t* opts, uint8_t hop_limit, uint8_t dontfrag) {
+    if (!dst || !pkt || !netpkt_total_len(pkt)) {
+        if (pkt) netpkt_unref(pkt);
+        return;
+    }
+
+    uint8_t scope = opts ? (uint8_t)opts->scope : (uint8_t)IP_TX_AUTO;
+    uint8_t index = opts ? opts->index : 0;
+    ipv6_dst_entry_t route;
+    if (!dst_cache_get(dst, scope, index, &route) && !dst_resolve(dst, opts, scope, index, &route)) {
+        netpkt_unref(pkt);
+        return;
+    }
+
+    uint8_t ifx = route.ifx;
+    const uint8_t* src = route.src;
+    const uint8_t* dst_mac = route.mac;
+    uint16_t mtu = route.mtu;
+
     uint16_t pmtu = ipv6_pmtu_get(dst);
     if (pmtu && pmtu  <mtu) mtu = pmtu;
 
     if (mtu < IPV6_MIN_MTU) mtu = IPV6_MIN_MTU;
     uint32_t hdr_len = (uint32_t)sizeof(ipv6_hdr_t);
-    uint32_t seg_len = netpkt_len(pkt);
+    uint32_t seg_len = netpkt_total_len(pkt);
     uint32_t total_l3 = hdr_len + seg_len;
 
-    if (total_l3 <= (uint32_t)mtu) {
+    if (total_l3 <= (uint32_t)mtu || netpkt_gso_type(pkt) != NETPKT_GSO_NONE) {
         void* hdrp = netpkt_push(pkt, hdr_len);
         if (!hdrp) {
             netpkt_unref(pkt);
@@ -448,7 +490,7 @@ void ipv6_send_packet(const uint8_t dst[16], uint8_t next_header, netpkt_t* pkt,
 
     uint32_t max_chunk = (uint32_t)mtu - hdr_len - frag_hdr_len;
     max_chunk = (max_chunk / 8u) * 8u;
-    if (max_chunk == 0) {
+    if (max_chunk == 0 || !netpkt_linearize(pkt) || !netpkt_csum_resolve(pkt)) {
         netpkt_unref(pkt);
         return;
     }
@@ -810,7 +852,7 @@ void ipv6_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
         }
 
         if (inner_nh == 58) {
-            icmpv6_input(ifindex, ip6->src, ip6->dst, ip6->hop_limit, src_mac, (const uint8_t*)payload_ptr, payload_size);
+            icmpv6_input(ifindex, ip6->src, ip6->dst, ip6->hop_limit, src_mac, (const uint8_t*)payload_ptr, payload_size, NULL);
             reass_free(s);
             return;
         }
@@ -847,8 +889,8 @@ void ipv6_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
             for (int i = 0; i < ccount; i++) {
                 l3_ipv6_interface_t* v6 = cand[i];
                 if (!ipv6_is_linklocal(v6->ip) && ipv6_is_linklocal(ip6->dst)) continue;
-                if (inner_nh == 17) udp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, payload_ptr, payload_size);
-                else if (inner_nh == 6) tcp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, payload_ptr, payload_size);
+                if (inner_nh == 17) udp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, payload_ptr, payload_size, NULL);
+                else if (inner_nh == 6) tcp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, payload_ptr, payload_size, NULL);
             }
 
             reass_free(s);
@@ -865,8 +907,8 @@ void ipv6_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
         }
 
         if (match_count >= 1) {
-            if (inner_nh == 6) tcp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, payload_ptr, payload_size);
-            else if (inner_nh == 17) udp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, payload_ptr, payload_size);
+            if (inner_nh == 6) tcp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, payload_ptr, payload_size, NULL);
+            else if (inner_nh == 17) udp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, payload_ptr, payload_size, NULL);
         }
 
         reass_free(s);
@@ -908,10 +950,10 @@ void ipv6_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
 
             switch (ip6->next_header) {
             case 17:
-                udp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, l4, l4_len);
+                udp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, l4, l4_len, pkt);
                 break;
             case 6:
-                tcp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, l4, l4_len);
+                tcp_input(IP_VER6, ip6->src, ip6->dst, v6->l3_id, l4, l4_len, pkt);
                 break;
             default:
                 break;
@@ -932,10 +974,10 @@ void ipv6_input(uint16_t ifindex, netpkt_t* pkt, const uint8_t src_mac[6]) {
     if (match_count >= 1) {
         switch (ip6->next_header) {
         case 6:
-            tcp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, l4, l4_len);
+            tcp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, l4, l4_len, pkt);
             break;
         case 17:
-            udp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, l4, l4_len);
+            udp_input(IP_VER6, ip6->src, ip6->dst, match_l3id, l4, l4_len, pkt);
             break;
         default:
             break;
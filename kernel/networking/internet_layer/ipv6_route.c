@@ -88,11 +88,43 @@ bool ipv6_build_tx_plan(const uint8_t dst[16], const ip_tx_opts_t* hint, const u
     return true;
 }
 
+//Kept ordered by prefix length, longest first, then by metric so the first match is the best one
 struct ipv6_rt_table {
     ipv6_rt_entry_t e[IPV6_RT_PER_IF_MAX];
     int len;
 };
 
+static bool rt_before(const ipv6_rt_entry_t* a, const ipv6_rt_entry_t* b) {
+    if (a->prefix_len != b->prefix_len) return a->prefix_len > b->prefix_len;
+    return a->metric < b->metric;
+}
+
+static void rt_insert(ipv6_rt_table_t* t, const ipv6_rt_entry_t* ent) {
+    int i = t->len++;
+    for (; i > 0 && rt_before(ent, &t->e[i - 1]); i--) t->e[i] = t->e[i - 1];
+    t->e[i] = *ent;
+}
+
+static void rt_remove(ipv6_rt_table_t* t, int idx) {
+    for (int i = idx + 1; i < t->len; i++) t->e[i - 1] = t->e[i];
+    t->len--;
+    memset(&t->e[t->len], 0, sizeof(t->e[0]));
+}
+
+static bool rt_match(const ipv6_rt_entry_t* r, const uint8_t dst[16]) {
+    int fb = r->prefix_len / 8;
+    int rb = r->prefix_len % 8;
+
+    for (int j = 0; j < fb; j++) if (dst[j] != r->network[j]) return false;
+
+    if (rb) {
+        uint8_t m = (uint8_t)(0xFF << (8 - rb));
+        if ((dst[fb] & m) != (r->network[fb] & m)) return false;
+    }
+
+    return true;
+}
+
 ipv6_rt_table_t* ipv6_rt_create(void) {
     ipv6_rt_table_t* t = malloc(sizeof(*t));
     if (!t) return 0;
@@ -112,6 +144,7 @@ void ipv6_rt_clear(ipv6_rt_table_t* t) {
 
     t->len = 0;
     memset(t->e, 0, sizeof(t->e));
+    ifmgr_route_changed();
 }
 
 bool ipv6_rt_add_in(ipv6_rt_table_t* t, const uint8_t net[16], uint8_t plen, const uint8_t gw[16], uint16_t metric) {
@@ -119,19 +152,27 @@ bool ipv6_rt_add_in(ipv6_rt_table_t* t, const uint8_t net[16], uint8_t plen, con
 
     for (int i = 0; i < t->len; i++) {
         if (t->e[i].prefix_len == plen && memcmp(t->e[i].network, net, 16) == 0) {
-            memcpy(t->e[i].gateway, gw, 16);
-            t->e[i].metric = metric;
+            if (t->e[i].metric == metric && memcmp(t->e[i].gateway, gw, 16) == 0) return true;
+
+            ipv6_rt_entry_t ent = t->e[i];
+            memcpy(ent.gateway, gw, 16);
+            ent.metric = metric;
+            rt_remove(t, i);
+            rt_insert(t, &ent);
+            ifmgr_route_changed();
             return true;
         }
     }
 
     if (t->len >= IPV6_RT_PER_IF_MAX) return false;
 
-    memcpy(t->e[t->len].network, net, 16);
-    memcpy(t->e[t->len].gateway, gw, 16);
-    t->e[t->len].prefix_len = plen;
-    t->e[t->len].metric = metric;
-    t->len++;
+    ipv6_rt_entry_t ent;
+    memcpy(ent.network, net, 16);
+    memcpy(ent.gateway, gw, 16);
+    ent.prefix_len = plen;
+    ent.metric = metric;
+    rt_insert(t, &ent);
+    ifmgr_route_changed();
 
     return true;
 }
@@ -141,8 +182,8 @@ bool ipv6_rt_del_in(ipv6_rt_table_t* t, const uint8_t net[16], uint8_t plen) {
 
     for (int i = 0; i < t->len; i++) {
         if (t->e[i].prefix_len == plen && memcmp(t->e[i].network, net, 16) == 0) {
-            t->e[i] = t->e[--t->len];
-            memset(&t->e[t->len], 0, sizeof(t->e[0]));
+            rt_remove(t, i);
+            ifmgr_route_changed();
             return true;
         }
     }
@@ -153,53 +194,17 @@ bool ipv6_rt_del_in(ipv6_rt_table_t* t, const uint8_t net[16], uint8_t plen) {
 bool ipv6_rt_lookup_in(const ipv6_rt_table_t* t, const uint8_t dst[16], uint8_t next_hop[16], int* out_pl, int* out_metric) {
     if (!t) return false;
 
-    int best_pl = -1;
-    int best_metric = 0x7FFF;
-    uint8_t best_gw[16] = {0};
-
     for (int i = 0; i < t->len; i++) {
-        bool match = false;
+        const ipv6_rt_entry_t* r = &t->e[i];
+        if (!rt_match(r, dst)) continue;
 
-        if (t->e[i].prefix_len == 0) {
-            match = true;
-        } else {
-            int plen = t->e[i].prefix_len;
-            int fb = plen / 8;
-            int rb = plen % 8;
-
-            match = true;
-            for (int j = 0; j < fb; j++) {
-                if (dst[j] != t->e[i].network[j]) {
-                    match = false;
-                    break;
-                }
-            }
-
-            if (match && rb) {
-                uint8_t m = (uint8_t)(0xFF << (8 - rb));
-                if ((dst[fb] & m) != (t->e[i].network[fb] & m)) match = false;
-            }
-        }
-
-        if (!match) continue;
-
-        int pl = t->e[i].prefix_len;
-        int met = t->e[i].metric;
-
-        if (pl > best_pl || (pl == best_pl && met < best_metric)) {
-            best_pl = pl;
-            best_metric = met;
-            memcpy(best_gw, t->e[i].gateway, 16);
-        }
+        if (next_hop) memcpy(next_hop, r->gateway, 16);
+        if (out_pl) *out_pl = r->prefix_len;
+        if (out_metric) *out_metric = r->metric;
+        return true;
     }
 
-    if (best_pl < 0) return false;
-
-    if (next_hop) memcpy(next_hop, best_gw, 16);
-    if (out_pl) *out_pl =best_pl;
-    if (out_metric) *out_metric = best_metric;
-
-    return true;
+    return false;
 }
 
 void ipv6_rt_ensure_basics(ipv6_rt_table_t* t, const uint8_t ip[16], uint8_t plen, const uint8_t gw[16], uint16_t base_metric) {
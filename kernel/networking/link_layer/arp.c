@@ -63,37 +63,39 @@ void arp_table_put_for_l2(uint8_t ifindex, uint32_t ip, const uint8_t mac[6], ui
     arp_table_t* t = l2_arp(ifindex);
     if (!t) return;
     int idx = arp_find_slot(t, ip);
+    //Only a new or moved neighbour invalidates cached routes, refreshes are free
+    bool changed = idx < 0 || memcmp(t->entries[idx].mac, mac, 6) != 0;
     if (idx < 0) idx = arp_find_free(t);
     if (idx < 0) idx = 0;
     t->entries[idx].ip = ip;
     memcpy(t->entries[idx].mac, mac, 6);
     t->entries[idx].ttl_ms = is_static ? 0 : ttl_ms;
     t->entries[idx].static_entry = is_static ? 1 : 0;
+    if (changed) ifmgr_route_changed();
 }
 
 bool arp_table_get_for_l2(uint8_t ifindex, uint32_t ip, uint8_t mac_out[6]){
     arp_table_t* t = l2_arp(ifindex);
-    if (!t) return false;
-    for (int i=0;i<ARP_TABLE_MAX;i++){
-        if (t->entries[i].ip == ip){
-            memcpy(mac_out, t->entries[i].mac, 6);
-            return true;
-        }
-    }
-    return false;
+    int idx = arp_find_slot(t, ip);
+    if (idx < 0) return false;
+    memcpy(mac_out, t->entries[idx].mac, 6);
+    return true;
 }
 
 void arp_table_tick_for_l2(uint8_t ifindex, uint32_t ms){
     arp_table_t* t = l2_arp(ifindex);
     if (!t) return;
+    bool expired = false;
     for (int i=0;i<ARP_TABLE_MAX;i++){
         if (t->entries[i].ip == 0 || t->entries[i].static_entry) continue;
         if (t->entries[i].ttl_ms <= ms){
             memset(&t->entries[i], 0, sizeof(arp_entry_t));
+            expired = true;
         } else {
             t->entries[i].ttl_ms -= ms;
         }
     }
+    if (expired) ifmgr_route_changed();
 }
 
 void arp_tick_all(uint32_t ms){
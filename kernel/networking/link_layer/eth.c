@@ -46,9 +46,7 @@ bool eth_send_frame_on(uint16_t ifindex, uint16_t ethertype, const uint8_t dst_m
 
     (void)create_eth_packet((uintptr_t)hdrp, src_mac, dst_mac, ethertype);
 
-    bool ok = (net_tx_frame_on(ifindex, netpkt_data(pkt), netpkt_len(pkt)) == 0);
-    netpkt_unref(pkt);
-    return ok;
+    return net_tx_pkt_on(ifindex, pkt) == 0;
 }
 
 void eth_input(uint16_t ifindex, netpkt_t* pkt) {
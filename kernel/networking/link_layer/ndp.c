@@ -359,8 +359,10 @@ static int ndp_find_free(ndp_table_impl_t* t) {
 }
 
 static void ndp_entry_clear(ndp_entry_t* e) {
+    bool resolved = e->state != NDP_STATE_UNUSED && e->state != NDP_STATE_INCOMPLETE;
     memset(e, 0, sizeof(*e));
     e->state = NDP_STATE_UNUSED;
+    if (resolved) ifmgr_route_changed();
 }
 
 void ndp_table_put_for_l2(uint8_t ifindex, const uint8_t ip[16], const uint8_t mac[6], uint32_t ttl_ms, bool router) {
@@ -368,6 +370,7 @@ void ndp_table_put_for_l2(uint8_t ifindex, const uint8_t ip[16], const uint8_t m
     if (!t) return;
 
     int idx = ndp_find_slot(t, ip);
+    bool changed = idx < 0 || (mac && memcmp(t->entries[idx].mac, mac, 6) != 0);
     if (idx < 0) idx = ndp_find_free(t);
 
     if (idx < 0) {
@@ -411,6 +414,7 @@ void ndp_table_put_for_l2(uint8_t ifindex, const uint8_t ip[16], const uint8_t m
     e->is_router = router ? 1 : 0;
     e->router_lifetime_ms = router ? ttl_ms : 0;
     e->probes_sent = 0;
+    if (changed) ifmgr_route_changed();
 }
 
 static bool ndp_table_get_for_l2(uint8_t ifindex, const uint8_t ip[16], uint8_t mac_out[6]) {
@@ -756,6 +760,7 @@ bool ndp_request_dad_on(uint8_t ifindex, const uint8_t ip[16]) {
         v6->dad_timer_ms = 0;
         v6->dad_probes_sent = 0;
         v6->dad_requested = 1;
+        ifmgr_route_changed();
 
         uint8_t sn[16];
         ipv6_make_multicast(2, IPV6_MCAST_SOLICITED_NODE, v6->ip, sn);
@@ -803,6 +808,7 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
                 self->dad_timer_ms = 0;
                 self->dad_probes_sent = 0;
                 self->dad_requested = 0;
+                ifmgr_route_changed();
             }
             return;
         }
@@ -853,6 +859,7 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
                     v6->dad_requested = 0;
                     v6->dad_timer_ms = 0;
                     v6->dad_probes_sent = 0;
+                    ifmgr_route_changed();
                     return;
                 }
             }
@@ -869,6 +876,7 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
         if (!t) return;
 
         int idx = ndp_find_slot(t, na->target);
+        bool fresh = idx < 0;
         if (idx < 0) idx = ndp_find_free(t);
 
         if (idx < 0) {
@@ -958,6 +966,8 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
             if (e->is_router && !e->router_lifetime_ms) e->router_lifetime_ms = e->ttl_ms;
         }
 
+        if (fresh || memcmp(old_mac, e->mac, 6) != 0) ifmgr_route_changed();
+
         e->probes_sent = 0;
         return;
     }
@@ -1024,6 +1034,7 @@ void ndp_input(uint16_t ifindex, const uint8_t src_ip[16], const uint8_t dst_ip[
                             if (v6->mtu < 1280) continue;
                             v6->mtu = mtu32;
                         }
+                        ifmgr_route_changed();
                     }
                 }
             } else if (opt_type == 25 && opt_size >= 24u) {
@@ -1184,6 +1195,7 @@ int ndp_daemon_entry(int argc, char* argv[]) {
                         if (v6->dad_timer_ms >= 1000) {
                             v6->dad_timer_ms = 0;
                             v6->dad_state = IPV6_DAD_OK;
+                            ifmgr_route_changed();
 
                             uint8_t all_nodes[16];
                             uint8_t zero16[16] = {0};
@@ -0,0 +1,141 @@
+#include "net_checksum.h"
+#include "exceptions/irq.h"
+
+#if NET_CSUM_NEON
+//net_checksum_neon.S, both work on whole 64 byte blocks and return the unfolded sum of little endian words
+extern uint64_t net_csum_neon_blocks(const void *data, uint64_t blocks);
+extern uint64_t net_csum_copy_neon_blocks(void *dst, const void *src, uint64_t blocks);
+#endif
+
+#define NET_CSUM_BLOCK 64
+
+typedef struct __attribute__((packed)) { uint64_t v; } csum_u64_t;
+
+static inline uint32_t csum_fold64(uint64_t sum){
+    while (sum >> 16) sum = (sum & 0xFFFFu) + (sum >> 16);
+    return (uint32_t)sum;
+}
+
+//Words are summed as loaded, byte swapping the folded result gives the network order sum (RFC 1071)
+static inline uint32_t csum_le_to_be(uint64_t le){
+    uint32_t f = csum_fold64(le);
+    return ((f & 0xFFu) << 8) | (f >> 8);
+}
+
+static uint64_t csum_le_scalar(const uint8_t *p, uint32_t len){
+    uint64_t sum = 0;
+    for (; len >= 8; p += 8, len -= 8){
+        uint64_t w = ((const csum_u64_t *)p)->v;
+        sum += (uint32_t)w;
+        sum += w >> 32;
+    }
+    for (; len >= 2; p += 2, len -= 2) sum += (uint32_t)(p[0] | (p[1] << 8));
+    if (len) sum += p[0];
+    return sum;
+}
+
+static uint64_t csum_copy_le_scalar(uint8_t *d, const uint8_t *s, uint32_t len){
+    uint64_t sum = 0;
+    for (; len >= 8; d += 8, s += 8, len -= 8){
+        uint64_t w = ((const csum_u64_t *)s)->v;
+        ((csum_u64_t *)d)->v = w;
+        sum += (uint32_t)w;
+        sum += w >> 32;
+    }
+    for (; len >= 2; d += 2, s += 2, len -= 2){
+        d[0] = s[0];
+        d[1] = s[1];
+        sum += (uint32_t)(s[0] | (s[1] << 8));
+    }
+    if (len){
+        d[0] = s[0];
+        sum += s[0];
+    }
+    return sum;
+}
+
+uint32_t net_csum_partial_scalar(const void *data, uint32_t len, uint32_t sum){
+    if (!data || !len) return sum;
+    return csum_fold64((uint64_t)sum + csum_le_to_be(csum_le_scalar((const uint8_t *)data, len)));
+}
+
+uint32_t net_csum_copy_scalar(void *dst, const void *src, uint32_t len, uint32_t sum){
+    if (!dst || !src || !len) return sum;
+    return csum_fold64((uint64_t)sum + csum_le_to_be(csum_copy_le_scalar((uint8_t *)dst, (const uint8_t *)src, len)));
+}
+
+#if NET_CSUM_NEON
+//SIMD registers aren't part of the saved task context, so nothing else may run on the core while they're live
+uint32_t net_csum_partial_neon(const void *data, uint32_t len, uint32_t sum){
+    if (!data || !len) return sum;
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t le = 0;
+    uint32_t blocks = len / NET_CSUM_BLOCK;
+    if (blocks){
+        irq_flags_t irq = irq_save_disable();
+        le = net_csum_neon_blocks(p, blocks);
+        irq_restore(irq);
+        p += blocks * NET_CSUM_BLOCK;
+        len -= blocks * NET_CSUM_BLOCK;
+    }
+    le += csum_le_scalar(p, len);
+    return csum_fold64((uint64_t)sum + csum_le_to_be(le));
+}
+
+uint32_t net_csum_copy_neon(void *dst, const void *src, uint32_t len, uint32_t sum){
+    if (!dst || !src || !len) return sum;
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    uint64_t le = 0;
+    uint32_t blocks = len / NET_CSUM_BLOCK;
+    if (blocks){
+        irq_flags_t irq = irq_save_disable();
+        le = net_csum_copy_neon_blocks(d, s, blocks);
+        irq_restore(irq);
+        d += blocks * NET_CSUM_BLOCK;
+        s += blocks * NET_CSUM_BLOCK;
+        len -= blocks * NET_CSUM_BLOCK;
+    }
+    le += csum_copy_le_scalar(d, s, len);
+    return csum_fold64((uint64_t)sum + csum_le_to_be(le));
+}
+#endif
+
+uint32_t net_csum_partial(const void *data, uint32_t len, uint32_t sum){
+#if NET_CSUM_NEON
+    //Below a block the vector loop never runs, skip the irq save for it
+    if (len < NET_CSUM_BLOCK) return net_csum_partial_scalar(data, len, sum);
+    return net_csum_partial_neon(data, len, sum);
+#else
+    return net_csum_partial_scalar(data, len, sum);
+#endif
+}
+
+uint32_t net_csum_copy(void *dst, const void *src, uint32_t len, uint32_t sum){
+#if NET_CSUM_NEON
+    if (len < NET_CSUM_BLOCK) return net_csum_copy_scalar(dst, src, len, sum);
+    return net_csum_copy_neon(dst, src, len, sum);
+#else
+    return net_csum_copy_scalar(dst, src, len, sum);
+#endif
+}
+
+//IPv4 addresses are host order values, IPv6 ones are byte arrays in network order
+uint32_t net_csum_pseudo_ipv4(uint32_t src_ip, uint32_t dst_ip, uint8_t proto, uint32_t len){
+    uint64_t sum = (uint64_t)proto + (len >> 16) + (len & 0xFFFFu);
+    sum += (src_ip >> 16) + (src_ip & 0xFFFFu) + (dst_ip >> 16) + (dst_ip & 0xFFFFu);
+    return csum_fold64(sum);
+}
+
+uint32_t net_csum_pseudo_ipv6(const uint8_t src_ip[16], const uint8_t dst_ip[16], uint8_t proto, uint32_t len){
+    uint32_t sum = net_csum_partial_scalar(src_ip, 16, proto + (len >> 16) + (len & 0xFFFFu));
+    return net_csum_partial_scalar(dst_ip, 16, sum);
+}
+
+uint16_t net_csum_reduce(uint32_t sum){
+    return (uint16_t)csum_fold64(sum);
+}
+
+uint16_t net_csum_finish(uint32_t sum){
+    return (uint16_t)~csum_fold64(sum);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Build with -DNET_CSUM_SCALAR to force the portable path
+#if defined(__ARM_NEON) && !defined(NET_CSUM_SCALAR)
+#define NET_CSUM_NEON 1
+#else
+#define NET_CSUM_NEON 0
+#endif
+
+//Running internet checksum over big endian 16 bit words, unfolded and not inverted. Sums can be chained
+//by passing the previous result back in as long as every run but the last has an even length
+uint32_t net_csum_partial(const void *data, uint32_t len, uint32_t sum);
+//Same as net_csum_partial while copying src to dst in the same pass
+uint32_t net_csum_copy(void *dst, const void *src, uint32_t len, uint32_t sum);
+
+uint32_t net_csum_pseudo_ipv4(uint32_t src_ip, uint32_t dst_ip, uint8_t proto, uint32_t len);
+uint32_t net_csum_pseudo_ipv6(const uint8_t src_ip[16], const uint8_t dst_ip[16], uint8_t proto, uint32_t len);
+
+//Folded sum, what goes in the checksum field of a packet the NIC or netpkt_csum_resolve finishes
+uint16_t net_csum_reduce(uint32_t sum);
+//Final checksum in the same numeric form checksum16 returns, bswap16 it into the header
+uint16_t net_csum_finish(uint32_t sum);
+
+//Both implementations stay callable so the tests can compare them
+uint32_t net_csum_partial_scalar(const void *data, uint32_t len, uint32_t sum);
+uint32_t net_csum_copy_scalar(void *dst, const void *src, uint32_t len, uint32_t sum);
+#if NET_CSUM_NEON
+uint32_t net_csum_partial_neon(const void *data, uint32_t len, uint32_t sum);
+uint32_t net_csum_copy_neon(void *dst, const void *src, uint32_t len, uint32_t sum);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,4 +1,5 @@
 #include "netpkt.h"
+#include "net_checksum.h"
 #include "std/std.h"
 #include "memory/page_allocator.h"
 
@@ -50,6 +51,12 @@ struct netpkt {
     uint32_t len;
     uint32_t refs;
     uint32_t flags;
+    netpkt_t* frag;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t gso_size;
+    uint8_t csum_state;
+    uint8_t gso_type;
 };
 
 static uint64_t g_netpkt_page_bytes;
@@ -424,6 +431,8 @@ netpkt_t* netpkt_alloc(uint32_t data_capacity, uint32_t headroom, uint32_t tailr
     p->len = 0;
     p->refs = 1;
     p->flags = 0;
+    p->frag = 0;
+    netpkt_clear_offload(p);
     return p;
 }
 
@@ -459,6 +468,8 @@ netpkt_t* netpkt_wrap(uintptr_t base, uint32_t alloc_size, uint32_t data_off, ui
     p->len = data_len;
     p->refs = 1;
     p->flags = 0;
+    p->frag = 0;
+    netpkt_clear_offload(p);
     return p;
 }
 
@@ -485,6 +496,8 @@ netpkt_t* netpkt_view(netpkt_t* parent, uint32_t off, uint32_t len) {
     v->len = len;
     v->refs = 1;
     v->flags = NETPKT_F_VIEW;
+    v->frag = 0;
+    netpkt_clear_offload(v);
     return v;
 }
 
@@ -533,7 +546,9 @@ void netpkt_unref(netpkt_t* p) {
         }
     }
 
+    netpkt_t* frag = p->frag;
     meta_slab_free(&g_meta_slab_pkt, p);
+    if (frag) netpkt_unref(frag);
 }
 
 uintptr_t netpkt_data(const netpkt_t* p) {
@@ -546,6 +561,126 @@ uint32_t netpkt_len(const netpkt_t* p) {
     return p ? p->len : 0;
 }
 
+netpkt_t* netpkt_frag(const netpkt_t* p) {
+    return p ? p->frag : 0;
+}
+
+uint32_t netpkt_total_len(const netpkt_t* p) {
+    uint32_t total = 0;
+    for (; p; p = p->frag) total += p->len;
+    return total;
+}
+
+bool netpkt_attach(netpkt_t* p, netpkt_t* frag) {
+    if (!p || !frag || p == frag) return false;
+    while (p->frag) p = p->frag;
+    p->frag = frag;
+    return true;
+}
+
+bool netpkt_linearize(netpkt_t* p) {
+    if (!p) return false;
+    if (!p->frag) return true;
+
+    uint32_t extra = netpkt_total_len(p->frag);
+    if (!netpkt_ensure_tailroom(p, extra)) return false;
+
+    uint8_t* out = (uint8_t*)netpkt_data(p) + p->len;
+    for (netpkt_t* f = p->frag; f; f = f->frag) {
+        if (f->len) memcpy(out, (const void*)netpkt_data(f), f->len);
+        out += f->len;
+    }
+    p->len += extra;
+
+    netpkt_t* frag = p->frag;
+    p->frag = 0;
+    netpkt_unref(frag);
+    return true;
+}
+
+uint32_t netpkt_copy_out(const netpkt_t* p, void* dst, uint32_t max) {
+    uint32_t done = 0;
+    for (; p && done < max; p = p->frag) {
+        uint32_t n = p->len;
+        if (n > max - done) n = max - done;
+        if (n) memcpy((uint8_t*)dst + done, (const void*)netpkt_data(p), n);
+        done += n;
+    }
+    return done;
+}
+
+void netpkt_clear_offload(netpkt_t* p) {
+    if (!p) return;
+    p->csum_start = 0;
+    p->csum_offset = 0;
+    p->gso_size = 0;
+    p->csum_state = NETPKT_CSUM_NONE;
+    p->gso_type = NETPKT_GSO_NONE;
+}
+
+void netpkt_set_csum_partial(netpkt_t* p, uint16_t start, uint16_t offset) {
+    if (!p) return;
+    p->csum_state = NETPKT_CSUM_PARTIAL;
+    p->csum_start = start;
+    p->csum_offset = offset;
+}
+
+bool netpkt_csum_partial(const netpkt_t* p, uint16_t* start, uint16_t* offset) {
+    if (!p || p->csum_state != NETPKT_CSUM_PARTIAL) return false;
+    if (start) *start = p->csum_start;
+    if (offset) *offset = p->csum_offset;
+    return true;
+}
+
+void netpkt_set_csum_valid(netpkt_t* p) {
+    if (p) p->csum_state = NETPKT_CSUM_VALID;
+}
+
+bool netpkt_csum_valid(const netpkt_t* p) {
+    return p && p->csum_state == NETPKT_CSUM_VALID;
+}
+
+void netpkt_set_gso(netpkt_t* p, uint8_t type, uint16_t size) {
+    if (!p) return;
+    p->gso_type = size ? type : NETPKT_GSO_NONE;
+    p->gso_size = size;
+}
+
+uint8_t netpkt_gso_type(const netpkt_t* p) {
+    return p ? p->gso_type : NETPKT_GSO_NONE;
+}
+
+uint16_t netpkt_gso_size(const netpkt_t* p) {
+    return p ? p->gso_size : 0;
+}
+
+bool netpkt_csum_resolve(netpkt_t* p) {
+    if (!p || p->csum_state != NETPKT_CSUM_PARTIAL) return true;
+    if ((uint32_t)p->csum_start + (uint32_t)p->csum_offset + 2u > p->len) return false;
+
+    uint32_t sum = 0;
+    uint32_t pos = 0;
+    for (netpkt_t* f = p; f; f = f->frag) {
+        const uint8_t* d = (const uint8_t*)netpkt_data(f);
+        uint32_t len = f->len;
+        uint32_t skip = pos < p->csum_start ? p->csum_start - pos : 0;
+        if (skip < len) {
+            uint32_t part = net_csum_partial(d + skip, len - skip, 0);
+            //A run starting on an odd offset has its bytes in the opposite halves of every word
+            if ((pos + skip - p->csum_start) & 1u) part = ((part & 0xFFu) << 8) | (part >> 8);
+            sum += part;
+        }
+        pos += len;
+    }
+
+    uint8_t* field = (uint8_t*)netpkt_data(p) + p->csum_start + p->csum_offset;
+    uint16_t csum = net_csum_finish(sum);
+    field[0] = (uint8_t)(csum >> 8);
+    field[1] = (uint8_t)csum;
+    p->csum_state = NETPKT_CSUM_NONE;
+    return true;
+}
+
 uint32_t netpkt_headroom(const netpkt_t* p) {
     return p ? p->head : 0;
 }
@@ -607,6 +742,7 @@ void* netpkt_push(netpkt_t* p, uint32_t bytes) {
 
     p->head -= bytes;
     p->len += bytes;
+    if (p->csum_state == NETPKT_CSUM_PARTIAL) p->csum_start += (uint16_t)bytes;
     return (void*)(p->buf->base + (uintptr_t)p->off + (uintptr_t)p->head);
 }
 
@@ -626,6 +762,7 @@ bool netpkt_pull(netpkt_t* p, uint32_t bytes) {
     if (bytes > p->len) return false;
     p->head += bytes;
     p->len -= bytes;
+    if (p->csum_state == NETPKT_CSUM_PARTIAL) p->csum_start = p->csum_start > bytes ? (uint16_t)(p->csum_start - bytes) : 0;
 
     if (p->flags & NETPKT_F_VIEW) return true;
     if (!p->buf) return true;
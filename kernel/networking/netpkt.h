@@ -13,6 +13,16 @@ typedef void (*netpkt_free_fn)(void* ctx, uintptr_t base, uint32_t alloc_size);
 #define NETPKT_MAX_ALLOC 65536u
 #define NETPKT_MAX_PAGE_BYTES (32ull * 1024ull * 1024ull)
 
+#define NETPKT_CSUM_NONE 0
+//TX: the L4 checksum field holds the pseudo header sum, whoever sends it sums from csum_start to the end
+#define NETPKT_CSUM_PARTIAL 1
+//RX: the NIC already checked the L4 checksum
+#define NETPKT_CSUM_VALID 2
+
+#define NETPKT_GSO_NONE 0
+#define NETPKT_GSO_TCPV4 1
+#define NETPKT_GSO_TCPV6 2
+
 netpkt_t* netpkt_alloc(uint32_t data_capacity, uint32_t headroom, uint32_t tailroom);
 netpkt_t* netpkt_wrap(uintptr_t base, uint32_t alloc_size, uint32_t data_off, uint32_t data_len, netpkt_free_fn free_fn, void* ctx);
 netpkt_t* netpkt_view(netpkt_t* parent, uint32_t off, uint32_t len);
@@ -23,6 +33,26 @@ void netpkt_unref(netpkt_t* p);
 uintptr_t netpkt_data(const netpkt_t* p);
 uint32_t netpkt_len(const netpkt_t* p);
 
+//A packet can carry a chain of fragments behind its linear data, so headers built in one buffer can go out
+//in front of a payload that lives in another. The fragments are owned by the packet and dropped with it
+bool netpkt_attach(netpkt_t* p, netpkt_t* frag);
+netpkt_t* netpkt_frag(const netpkt_t* p);
+uint32_t netpkt_total_len(const netpkt_t* p);
+bool netpkt_linearize(netpkt_t* p);
+uint32_t netpkt_copy_out(const netpkt_t* p, void* dst, uint32_t max);
+
+//Offload state, csum_start is relative to the packet data and follows push/pull
+void netpkt_clear_offload(netpkt_t* p);
+void netpkt_set_csum_partial(netpkt_t* p, uint16_t start, uint16_t offset);
+bool netpkt_csum_partial(const netpkt_t* p, uint16_t* start, uint16_t* offset);
+void netpkt_set_csum_valid(netpkt_t* p);
+bool netpkt_csum_valid(const netpkt_t* p);
+void netpkt_set_gso(netpkt_t* p, uint8_t type, uint16_t size);
+uint8_t netpkt_gso_type(const netpkt_t* p);
+uint16_t netpkt_gso_size(const netpkt_t* p);
+//Finishes a partial checksum in software for paths that can't leave it to the NIC
+bool netpkt_csum_resolve(netpkt_t* p);
+
 uint32_t netpkt_headroom(const netpkt_t* p);
 uint32_t netpkt_tailroom(const netpkt_t* p);
 
@@ -28,6 +28,15 @@ int net_tx_frame_on(uint16_t ifindex, uintptr_t frame_ptr, uint32_t frame_len) {
     return dispatch->enqueue_frame(ifindex, {frame_ptr, frame_len}) ? 0 : -1;
 }
 
+int net_tx_pkt_on(uint16_t ifindex, netpkt_t* pkt) {
+    if (!pkt) return -1;
+    if (!dispatch) {
+        netpkt_unref(pkt);
+        return -1;
+    }
+    return dispatch->enqueue_pkt(ifindex, pkt) ? 0 : -1;
+}
+
 int net_rx_frame(sizedptr* out_frame) {
     if (!out_frame) return -1;
     out_frame->ptr = 0;
@@ -52,6 +61,11 @@ uint16_t network_get_header_size(uint16_t ifindex) {
     return dispatch->header_size(ifindex);
 }
 
+uint32_t network_get_offloads(uint16_t ifindex) {
+    if (!dispatch) return 0;
+    return dispatch->offloads(ifindex);
+}
+
 const char* network_get_ifname(uint16_t ifindex) {
     if (!dispatch) return 0;
     return dispatch->ifname(ifindex);
@@ -7,11 +7,18 @@ extern "C" {
 #include "types.h"
 #include "net/network_types.h"
 #include "files/system_module.h"
+#include "networking/netpkt.h"
 
 #define NET_IRQ_BASE 40
 //TODO: consider using the system MTU here
 #define MAX_PACKET_SIZE 0x1000
 
+//What a NIC can take off the stack's hands, see network_get_offloads
+#define NET_OFFLOAD_TX_CSUM 0x1u
+#define NET_OFFLOAD_RX_CSUM 0x2u
+#define NET_OFFLOAD_TSO4 0x4u
+#define NET_OFFLOAD_TSO6 0x8u
+
 void network_net_set_pid(uint16_t pid);
 uint16_t network_net_get_pid();
 
@@ -22,12 +29,15 @@ int network_net_task_entry(int argc, char* argv[]);
 
 int net_tx_frame(uintptr_t frame_ptr, uint32_t frame_len);
 int net_tx_frame_on(uint16_t ifindex, uintptr_t frame_ptr, uint32_t frame_len);
+//Queues the packet and its fragments for transmission without copying them. Takes the caller's reference either way
+int net_tx_pkt_on(uint16_t ifindex, netpkt_t* pkt);
 int net_rx_frame(sizedptr *out_frame);
 
 const uint8_t* network_get_local_mac(void);
 const uint8_t* network_get_mac(uint16_t ifindex);
 uint16_t network_get_mtu(uint16_t ifindex);
 uint16_t network_get_header_size(uint16_t ifindex);
+uint32_t network_get_offloads(uint16_t ifindex);
 const char* network_get_ifname(uint16_t ifindex);
 const char* network_get_hw_ifname(uint16_t ifindex);
 size_t network_nic_count(void);
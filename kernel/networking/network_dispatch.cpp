@@ -19,11 +19,15 @@
 #define RX_INTR_BATCH_LIMIT 64
 #define TASK_RX_BATCH_LIMIT 256
 #define TASK_TX_BATCH_LIMIT 256
+//Every NIC raises an interrupt or is fed through enqueue_pkt, this only bounds the damage of a lost MSI
+#define TASK_IDLE_TIMEOUT_MS 1000
 
 NetworkDispatch::NetworkDispatch()
 {
     nic_num = 0;
     g_net_pid = 0xFFFF;
+    net_event.waiters.head = nullptr;
+    net_event.signaled = false;
     for (int i = 0; i <= (int)MAX_L2_INTERFACES; ++i) ifindex_to_nicid[i] = 0xFF;
     for (size_t i = 0; i < MAX_NIC; ++i) {
         nics[i].drv = nullptr;
@@ -69,6 +73,7 @@ void NetworkDispatch::handle_rx_irq(size_t nic_id)
 {
     if (nic_id >= nic_num) return;
     if (!nics[nic_id].drv) return;
+    kevent_signal(&net_event);
 }
 
 void NetworkDispatch::handle_tx_irq(size_t nic_id)
@@ -77,29 +82,39 @@ void NetworkDispatch::handle_tx_irq(size_t nic_id)
     NetDriver* driver = nics[nic_id].drv;
     if (!driver) return;
     driver->handle_sent_packet();
+    if (!nics[nic_id].tx.is_empty()) kevent_signal(&net_event);
 }
 
 bool NetworkDispatch::enqueue_frame(uint8_t ifindex, const sizedptr& frame)
 {
-    int nic_id = nic_for_ifindex(ifindex);
-    if (nic_id < 0) return false;
-    NetDriver* driver = nics[nic_id].drv;
-    if (!driver) return false;
     if (frame.size == 0) return false;
-
-    sizedptr pkt = driver->allocate_packet(frame.size);
-    if (!pkt.ptr) return false;
-
-    uint16_t hs = nics[nic_id].hdr_sz;
-    void* dst = (void*)(pkt.ptr + hs);
+    netpkt_t* pkt = netpkt_alloc((uint32_t)frame.size, 0, 0);
+    if (!pkt) return false;
+    void* dst = netpkt_put(pkt, (uint32_t)frame.size);
+    if (!dst) {
+        netpkt_unref(pkt);
+        return false;
+    }
     memcpy(dst, (const void*)frame.ptr, frame.size);
+    return enqueue_pkt(ifindex, pkt);
+}
+
+//The packet goes to the driver as is, headers already pushed into its headroom and the payload possibly in fragments
+bool NetworkDispatch::enqueue_pkt(uint8_t ifindex, netpkt_t* pkt)
+{
+    int nic_id = nic_for_ifindex(ifindex);
+    if (nic_id < 0 || !nics[nic_id].drv || !netpkt_total_len(pkt)) {
+        netpkt_unref(pkt);
+        return false;
+    }
 
     if (!nics[nic_id].tx.push(pkt)) {
-        free_frame(pkt);
+        netpkt_unref(pkt);
         nics[nic_id].tx_dropped++;
         return false;
     }
     nics[nic_id].tx_produced++;
+    if (get_current_proc_pid() != g_net_pid) kevent_signal(&net_event);
     return true;
 }
 
@@ -114,14 +129,14 @@ int NetworkDispatch::net_task()
             if (driver) {
                 int lim = nics[n].kind_val == NET_IFK_LOCALHOST ? TASK_RX_BATCH_LIMIT : RX_INTR_BATCH_LIMIT;
                 for (int i = 0; i < lim; ++i) {
-                    sizedptr raw = driver->handle_receive_packet();
-                    if (!raw.ptr || raw.size == 0) break;
-                    if (raw.size < sizeof(eth_hdr_t)) {
-                        free_frame(raw);
+                    netpkt_t* np = driver->receive_packet();
+                    if (!np) break;
+                    if (netpkt_len(np) < sizeof(eth_hdr_t)) {
+                        netpkt_unref(np);
                         continue;
                     }
-                    if (!nics[n].rx.push(raw)) {
-                        free_frame(raw);
+                    if (!nics[n].rx.push(np)) {
+                        netpkt_unref(np);
                         nics[n].rx_dropped++;
                         continue;
                     }
@@ -131,14 +146,10 @@ int NetworkDispatch::net_task()
             int processed = 0;
             for (int i = 0; i < TASK_RX_BATCH_LIMIT; ++i) {
                 if (nics[n].rx.is_empty()) break;
-                sizedptr pkt{0,0};
-                if (!nics[n].rx.pop(pkt)) break;
-                netpkt_t* np = netpkt_wrap(pkt.ptr, pkt.size, 0 , pkt.size, NULL, 0);
-                if (np) {
-                    eth_input(nics[n].ifindex, np);
-                    netpkt_unref(np);
-                }
-                free_frame(pkt);
+                netpkt_t* np = nullptr;
+                if (!nics[n].rx.pop(np)) break;
+                eth_input(nics[n].ifindex, np);
+                netpkt_unref(np);
                 nics[n].rx_consumed++;
                 processed++;
             }
@@ -151,19 +162,16 @@ int NetworkDispatch::net_task()
             int processed = 0;
             for (int i = 0; i < TASK_TX_BATCH_LIMIT; ++i) {
                 if (nics[n].tx.is_empty()) break;
-                sizedptr pkt{0,0};
-                if (!nics[n].tx.pop(pkt)) break;
-                if (!driver->send_packet(pkt)) {
-                    free_frame(pkt);
-                    nics[n].tx_dropped++;
-                }
+                netpkt_t* np = nullptr;
+                if (!nics[n].tx.pop(np)) break;
+                if (!driver->send_pkt(np)) nics[n].tx_dropped++;
                 nics[n].tx_consumed++;
                 processed++;
             }
             if (processed) did_work = true;
         }
 
-        if (!did_work) msleep(1);//TODO: manage it with an event
+        if (!did_work) kevent_wait(&net_event, TASK_IDLE_TIMEOUT_MS);
     }
 }
 
@@ -212,6 +220,12 @@ uint16_t NetworkDispatch::header_size(uint8_t ifindex) const
     return nic_id < 0 ? 0 : nics[nic_id].hdr_sz;
 }
 
+uint32_t NetworkDispatch::offloads(uint8_t ifindex) const
+{
+    int nic_id = nic_for_ifindex(ifindex);
+    return nic_id < 0 || !nics[nic_id].drv ? 0 : nics[nic_id].drv->get_offloads();
+}
+
 l2_interface_t* NetworkDispatch::l2_at(uint8_t ifindex) const
 {
     return l2_interface_find_by_index(ifindex);
@@ -241,11 +255,6 @@ uint8_t NetworkDispatch::kind(uint8_t ifindex) const
     return nic_id < 0 ? 0xFFu : nics[nic_id].kind_val;
 }
 
-void NetworkDispatch::free_frame(const sizedptr &f)
-{
-    if (f.ptr) free_sized((void*)f.ptr, f.size);
-}
-
 bool NetworkDispatch::register_all_from_bus() {
     int n = net_bus_count();
     if (n <= 0) return false;
@@ -6,6 +6,8 @@
 #include "networking/internet_layer/ipv4.h"
 #include "interface_manager.h"
 #include "data/struct/ring_buffer.hpp"
+#include "process/wait_queue.h"
+#include "networking/netpkt.h"
 
 class NetworkDispatch {
 public:
@@ -16,6 +18,7 @@ public:
     void handle_tx_irq(size_t nic_id);
 
     bool enqueue_frame(uint8_t ifindex, const sizedptr&);
+    bool enqueue_pkt(uint8_t ifindex, netpkt_t* pkt);
 
     int net_task();
     void set_net_pid(uint16_t pid);
@@ -28,6 +31,7 @@ public:
     const uint8_t* mac(uint8_t ifindex) const;
     uint16_t mtu(uint8_t ifindex) const;
     uint16_t header_size(uint8_t ifindex) const;
+    uint32_t offloads(uint8_t ifindex) const;
     l2_interface_t* l2_at(uint8_t ifindex) const;
     NetDriver* driver_at(uint8_t ifindex) const;
 
@@ -49,8 +53,8 @@ private:
         uint32_t speed_mbps;
         uint8_t duplex_mode;
         uint8_t kind_val;
-        RingBuffer<sizedptr, 1024> tx;
-        RingBuffer<sizedptr, 1024> rx;
+        RingBuffer<netpkt_t*, 1024> tx;
+        RingBuffer<netpkt_t*, 1024> rx;
         uint64_t rx_produced;
         uint64_t rx_consumed;
         uint64_t tx_produced;
@@ -64,10 +68,10 @@ private:
     NICCtx nics[MAX_NIC];
     size_t nic_num;
     uint16_t g_net_pid;
+    kevent_t net_event;
 
     uint8_t ifindex_to_nicid[MAX_L2_INTERFACES + 1];
 
-    void free_frame(const sizedptr&);
     bool register_all_from_bus();
     void copy_str(char* dst, int cap, const char* src);
 
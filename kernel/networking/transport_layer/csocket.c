@@ -18,6 +18,8 @@ typedef struct ksock_handle_t {
     protocol_t protocol;
     void* sh;
     uint16_t pid;
+    uint32_t rcv_timeout_ms;
+    uint32_t snd_timeout_ms;
 } ksock_handle_t;
 
 void* csock_alloc(size_t size){
@@ -57,6 +59,8 @@ bool create_socket(Socket_Role role, protocol_t protocol, const SocketExtraOptio
     sh->id = out_handle->id;
     sh->protocol = protocol;
     sh->pid = pid;
+    sh->rcv_timeout_ms = 0;
+    sh->snd_timeout_ms = 0;
 
     if (hash_map_put(map, &out_handle->id, sizeof(uint16_t), sh) < 0){
         kprint("Failed to save socket");
@@ -186,20 +190,65 @@ int32_t listen_on(SocketHandle *handle, int32_t backlog, uint16_t pid){
     return 0;
 }
 
-void accept_on_socket(SocketHandle *handle, uint16_t pid){
+bool accept_on_socket(SocketHandle *handle, uint16_t pid){
     check_mem();
     ksock_handle_t *sh = (ksock_handle_t*)hash_map_get(map, &handle->id, sizeof(uint16_t));
     if (sh->pid != pid){
         kprintf("[SOCKET, error] illegal socket accept");
-        return;
+        return false;
     }
     protocol_t protocol = sh->protocol;
     switch (protocol) {
         case PROTO_TCP:
-            socket_accept_tcp(sh->sh);
-        break;
+            //Waiting is left to the syscall, which can't sleep in here
+            return socket_accept_tcp_timeout(sh->sh, 0) != 0;
         case PROTO_UDP:
             kprintf("[SOCKET] accept is a TCP-only function and isn't needed in UDP sockets");
         break;
     }
-}
\ No newline at end of file
+    return false;
+}
+
+uint32_t socket_poll(uint16_t id, uint16_t pid, poll_head_t **head){
+    if (head) *head = 0;
+    if (!map) return POLL_ERR;
+    ksock_handle_t *sh = (ksock_handle_t*)hash_map_get(map, &id, sizeof(uint16_t));
+    if (!sh || sh->pid != pid) return POLL_ERR;
+    switch (sh->protocol) {
+        case PROTO_TCP:
+            return socket_poll_tcp(sh->sh, head);
+        case PROTO_UDP:
+            return socket_poll_udp(sh->sh, head);
+    }
+    return POLL_ERR;
+}
+
+int32_t socket_set_timeouts(SocketHandle *handle, uint32_t rcv_ms, uint32_t snd_ms, uint16_t pid){
+    check_mem();
+    ksock_handle_t *sh = (ksock_handle_t*)hash_map_get(map, &handle->id, sizeof(uint16_t));
+    if (!sh || sh->pid != pid){
+        kprintf("[SOCKET, error] illegal socket timeout change");
+        return SOCK_ERR_PERM;
+    }
+    sh->rcv_timeout_ms = rcv_ms;
+    sh->snd_timeout_ms = snd_ms;
+    return SOCK_OK;
+}
+
+uint32_t socket_wait_prepare(SocketHandle *handle, uint32_t want, uint16_t pid, process_t *proc){
+    if (!map) return 0;
+    ksock_handle_t *sh = (ksock_handle_t*)hash_map_get(map, &handle->id, sizeof(uint16_t));
+    if (!sh || sh->pid != pid) return 0;
+    uint32_t timeout = (want & POLL_OUT) ? sh->snd_timeout_ms : sh->rcv_timeout_ms;
+    if (!timeout) return 0;
+    uint32_t ready = POLL_ERR;
+    switch (sh->protocol) {
+        case PROTO_TCP:
+            ready = socket_wait_prepare_tcp(sh->sh, want, proc);
+            break;
+        case PROTO_UDP:
+            ready = socket_wait_prepare_udp(sh->sh, want, proc);
+            break;
+    }
+    return ready ? 0 : timeout;
+}
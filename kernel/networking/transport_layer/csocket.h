@@ -3,6 +3,8 @@
 #include "types.h"
 #include "net/network_types.h"
 #include "net/socket_types.h"
+#include "process/poll.h"
+#include "socket.hpp"
 
 bool create_socket(Socket_Role role, protocol_t protocol, const SocketExtraOptions* extra, uint16_t pid, SocketHandle *out_handle);
 int32_t bind_socket(SocketHandle *handle, uint16_t port, ip_version_t ip_vers, uint16_t pid);
@@ -13,4 +15,14 @@ int64_t receive_from_socket(SocketHandle *sh, void* buf, uint64_t len, net_l4_en
 int32_t close_socket(SocketHandle *sh, uint16_t pid);
 
 int32_t listen_on(SocketHandle *sh, int32_t backlog, uint16_t pid);
-void accept_on_socket(SocketHandle *sh, uint16_t pid);
\ No newline at end of file
+//False when there was no connection waiting
+bool accept_on_socket(SocketHandle *sh, uint16_t pid);
+
+//Readiness of the socket with that id for its owner, POLL_ERR and no head when it isn't one
+uint32_t socket_poll(uint16_t id, uint16_t pid, poll_head_t **head);
+
+//How long receive/accept and send syscalls on the handle may block, 0 (the default) keeps them non-blocking
+int32_t socket_set_timeouts(SocketHandle *sh, uint32_t rcv_ms, uint32_t snd_ms, uint16_t pid);
+//For syscalls that found nothing to do. Queues proc on the socket and returns the handle's timeout for want,
+//or 0 when the call shouldn't block because there's no timeout or the socket is ready after all
+uint32_t socket_wait_prepare(SocketHandle *sh, uint32_t want, uint16_t pid, process_t *proc);
\ No newline at end of file
@@ -19,9 +19,13 @@ int32_t socket_listen_tcp(socket_handle_t sh, int32_t backlog) {
 }
 
 socket_handle_t socket_accept_tcp(socket_handle_t sh) {
+    return socket_accept_tcp_timeout(sh, TCP_ACCEPT_TIMEOUT_MS);
+}
+
+socket_handle_t socket_accept_tcp_timeout(socket_handle_t sh, uint32_t timeout_ms) {
     if (!sh) return nullptr;
     TCPSocket* srv = reinterpret_cast<TCPSocket*>(sh);
-    TCPSocket* client = srv->accept();
+    TCPSocket* client = srv->accept(timeout_ms);
     return reinterpret_cast<socket_handle_t>(client);
 }
 
@@ -35,11 +39,21 @@ int64_t socket_send_tcp(socket_handle_t sh, const void* buf, uint64_t len) {
     return reinterpret_cast<TCPSocket*>(sh)->send(buf, len);
 }
 
+int64_t socket_send_tcp_timeout(socket_handle_t sh, const void* buf, uint64_t len, uint32_t timeout_ms) {
+    if (!sh) return SOCK_ERR_INVAL;
+    return reinterpret_cast<TCPSocket*>(sh)->send(buf, len, timeout_ms);
+}
+
 int64_t socket_recv_tcp(socket_handle_t sh, void* buf, uint64_t len) {
     if (!sh) return SOCK_ERR_INVAL;
     return reinterpret_cast<TCPSocket*>(sh)->recv(buf, len);
 }
 
+int64_t socket_recv_tcp_timeout(socket_handle_t sh, void* buf, uint64_t len, uint32_t timeout_ms) {
+    if (!sh) return SOCK_ERR_INVAL;
+    return reinterpret_cast<TCPSocket*>(sh)->recv(buf, len, timeout_ms);
+}
+
 int32_t socket_close_tcp(socket_handle_t sh) {
     if (!sh) return SOCK_ERR_INVAL;
     return reinterpret_cast<TCPSocket*>(sh)->close();
@@ -85,4 +99,16 @@ bool socket_is_connected_tcp(socket_handle_t sh) {
     return reinterpret_cast<TCPSocket*>(sh)->is_connected();
 }
 
+uint32_t socket_poll_tcp(socket_handle_t sh, poll_head_t **head) {
+    if (!sh) return POLL_ERR;
+    TCPSocket* s = reinterpret_cast<TCPSocket*>(sh);
+    if (head) *head = &s->poll_head;
+    return s->poll_events();
+}
+
+uint32_t socket_wait_prepare_tcp(socket_handle_t sh, uint32_t want, process_t* proc) {
+    if (!sh) return POLL_ERR;
+    return reinterpret_cast<TCPSocket*>(sh)->wait_prepare(proc, want);
+}
+
 }
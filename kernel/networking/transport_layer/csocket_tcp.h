@@ -14,9 +14,12 @@ socket_handle_t socket_tcp_create(uint8_t role, uint32_t pid, const SocketExtraO
 int32_t socket_bind_tcp_ex(socket_handle_t sh, const SockBindSpec* spec, uint16_t port);
 int32_t socket_listen_tcp(socket_handle_t sh, int32_t backlog);
 socket_handle_t socket_accept_tcp(socket_handle_t sh);
+socket_handle_t socket_accept_tcp_timeout(socket_handle_t sh, uint32_t timeout_ms);
 int32_t socket_connect_tcp_ex(socket_handle_t sh, uint8_t dst_kind, const void* dst, uint16_t port);
 int64_t socket_send_tcp(socket_handle_t sh, const void* buf, uint64_t len);
+int64_t socket_send_tcp_timeout(socket_handle_t sh, const void* buf, uint64_t len, uint32_t timeout_ms);
 int64_t socket_recv_tcp(socket_handle_t sh, void* buf, uint64_t len);
+int64_t socket_recv_tcp_timeout(socket_handle_t sh, void* buf, uint64_t len, uint32_t timeout_ms);
 int32_t socket_close_tcp(socket_handle_t sh);
 void socket_destroy_tcp(socket_handle_t sh);
 
@@ -27,6 +30,8 @@ uint8_t socket_get_protocol_tcp(socket_handle_t sh);
 uint8_t socket_get_role_tcp(socket_handle_t sh);
 bool socket_is_bound_tcp(socket_handle_t sh);
 bool socket_is_connected_tcp(socket_handle_t sh);
+uint32_t socket_poll_tcp(socket_handle_t sh, poll_head_t **head);
+uint32_t socket_wait_prepare_tcp(socket_handle_t sh, uint32_t want, process_t *proc);
 
 #ifdef __cplusplus
 }
@@ -21,6 +21,11 @@ extern "C" int64_t socket_recvfrom_udp_ex(socket_handle_t sh, void* buf, uint64_
     return reinterpret_cast<UDPSocket*>(sh)->recvfrom(buf, len, out_src);
 }
 
+extern "C" int64_t socket_recvfrom_udp_timeout(socket_handle_t sh, void* buf, uint64_t len, net_l4_endpoint* out_src, uint32_t timeout_ms) {
+    if (!sh || !buf || !len) return 0;
+    return reinterpret_cast<UDPSocket*>(sh)->recvfrom(buf, len, out_src, timeout_ms);
+}
+
 extern "C" int32_t socket_close_udp(socket_handle_t sh) {
     if (!sh) return SOCK_ERR_INVAL;
     return reinterpret_cast<UDPSocket*>(sh)->close();
@@ -65,3 +70,15 @@ extern "C" bool socket_is_connected_udp(socket_handle_t sh) {
     if (!sh) return false;
     return reinterpret_cast<UDPSocket*>(sh)->is_connected();
 }
+
+extern "C" uint32_t socket_poll_udp(socket_handle_t sh, poll_head_t **head) {
+    if (!sh) return POLL_ERR;
+    UDPSocket* s = reinterpret_cast<UDPSocket*>(sh);
+    if (head) *head = &s->poll_head;
+    return s->poll_events();
+}
+
+extern "C" uint32_t socket_wait_prepare_udp(socket_handle_t sh, uint32_t want, process_t* proc) {
+    if (!sh) return POLL_ERR;
+    return reinterpret_cast<UDPSocket*>(sh)->wait_prepare(proc, want);
+}
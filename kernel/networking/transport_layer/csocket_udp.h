@@ -14,6 +14,7 @@ socket_handle_t udp_socket_create(uint8_t role, uint32_t pid, const SocketExtraO
 int32_t socket_bind_udp_ex(socket_handle_t sh, const SockBindSpec* spec, uint16_t port);
 int64_t socket_sendto_udp_ex(socket_handle_t sh, uint8_t dst_kind, const void* dst, uint16_t port, const void* buf, uint64_t len);
 int64_t socket_recvfrom_udp_ex(socket_handle_t sh, void* buf, uint64_t len, net_l4_endpoint* out_src);
+int64_t socket_recvfrom_udp_timeout(socket_handle_t sh, void* buf, uint64_t len, net_l4_endpoint* out_src, uint32_t timeout_ms);
 int32_t socket_close_udp(socket_handle_t sh);
 void socket_destroy_udp(socket_handle_t sh);
 
@@ -25,6 +26,8 @@ uint8_t socket_get_protocol_udp(socket_handle_t sh);
 uint8_t socket_get_role_udp(socket_handle_t sh);
 bool socket_is_bound_udp(socket_handle_t sh);
 bool socket_is_connected_udp(socket_handle_t sh);
+uint32_t socket_poll_udp(socket_handle_t sh, poll_head_t **head);
+uint32_t socket_wait_prepare_udp(socket_handle_t sh, uint32_t want, process_t *proc);
 
 #ifdef __cplusplus
 }
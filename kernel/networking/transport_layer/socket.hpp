@@ -7,6 +7,11 @@
 #include "net/socket_types.h"
 #include "console/kio.h"
 #include "networking/net_logger/net_logger.h"
+#include "process/poll.h"
+#include "process/scheduler.h"
+#include "exceptions/irq.h"
+#include "exceptions/timer.h"
+#include "syscalls/syscalls.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -27,6 +32,11 @@ extern "C" {
 #define SOCK_ERR_STATE      -8
 #define SOCK_ERR_DNS        -9
 
+//Timeouts of the blocking calls. 0 returns right away like the plain calls do
+#define SOCK_WAIT_FOREVER   0xFFFFFFFFu
+//Longest single sleep of a blocking call, longer waits just loop
+#define SOCK_MAX_SLICE_MS   60000
+
 #ifdef __cplusplus
 }
 #endif
@@ -62,7 +72,57 @@ protected:
     void set_remote_endpoint(const net_l4_endpoint& ep) { remoteEP = ep; }
 
 public:
-    virtual ~Socket() { close(); }
+    //Poll sets watching this socket, woken whenever poll_events() may have changed
+    poll_head_t poll_head = {};
+    //Processes blocked in a call on this socket, woken together with poll_head
+    wait_queue_t waiters = {};
+
+    virtual ~Socket() {
+        close();
+        poll_head_detach(&poll_head);
+        wait_queue_release(&waiters);
+    }
+
+    virtual uint32_t poll_events() { return 0; }
+
+    void notify(uint32_t events) {
+        poll_head_wake(&poll_head, events);
+        wait_queue_wake_all(&waiters);
+    }
+
+    //Queues proc on the socket unless one of want, or an error or hangup, is already reported.
+    //Returns what was ready, the process is only left queued when that's 0
+    uint32_t wait_prepare(process_t* proc, uint32_t want) {
+        irq_flags_t irq = irq_save_disable();
+        uint32_t ready = poll_events() & (want | POLL_ERR | POLL_HUP);
+        //Nothing would wake a process already queued elsewhere, the error returns instead of sleeping
+        if (!ready && !wait_queue_add(&waiters, proc)) ready = POLL_ERR;
+        irq_restore(irq);
+        return ready;
+    }
+
+    static uint64_t deadline_for(uint32_t timeout_ms) {
+        if (timeout_ms == SOCK_WAIT_FOREVER) return UINT64_MAX;
+        return timer_now_msec() + timeout_ms;
+    }
+
+    //Sleeps until one of want is ready or deadline_msec passes, false on timeout.
+    //Kernel process context only, syscalls go through wait_prepare and restart instead
+    bool wait_until(uint32_t want, uint64_t deadline_msec) {
+        process_t* proc = get_current_proc();
+        for (;;) {
+            if (wait_prepare(proc, want)) return true;
+            uint64_t now = timer_now_msec();
+            if (now >= deadline_msec) {
+                wait_queue_remove(&waiters, proc);
+                return false;
+            }
+            uint64_t slice = deadline_msec - now;
+            if (slice > SOCK_MAX_SLICE_MS) slice = SOCK_MAX_SLICE_MS;
+            msleep(slice);
+            wait_queue_remove(&waiters, proc);
+        }
+    }
 
     virtual int32_t bind(const SockBindSpec& spec, uint16_t port) = 0;
 
@@ -79,6 +139,7 @@ public:
         remoteEP.port = 0;
         remoteEP.ver = IP_VER4;
         memset(remoteEP.ip, 0, 16);
+        notify(POLL_HUP);
         return SOCK_OK;
     }
 
@@ -18,6 +18,7 @@
 static constexpr int TCP_MAX_BACKLOG = 8;
 static constexpr dns_server_sel_t TCP_DNS_SEL = DNS_USE_BOTH;
 static constexpr uint32_t TCP_DNS_TIMEOUT_MS = 3000;
+static constexpr uint32_t TCP_ACCEPT_TIMEOUT_MS = 1000;
 
 class TCPSocket : public Socket {
     inline static TCPSocket* s_list_head = nullptr;
@@ -170,8 +171,10 @@ class TCPSocket : public Socket {
                 }
 
 			    child->insert_in_list();
+                tcp_flow_set_notify(child->flow, flow_notify, child);
 
                 srv->pending[srv->backlogLen++] = child;
+                srv->notify(POLL_IN);
                 break;
             }
             return 0;
@@ -243,9 +246,17 @@ class TCPSocket : public Socket {
             pushed = (uint32_t)ring.push_buf(src, accept);
         }
 
+        if (pushed) notify(POLL_IN);
         return pushed;
     }
 
+    //Acks, window updates and state changes of the flow, which poll_events() reads back
+    static void flow_notify(void* arg, bool freed) {
+        TCPSocket* s = reinterpret_cast<TCPSocket*>(arg);
+        if (freed) s->flow = nullptr;
+        s->notify(POLL_IN | POLL_OUT | POLL_HUP);
+    }
+
     void insert_in_list() {
         for (TCPSocket* it = s_list_head; it; it = it->next){
             if (it == this) {
@@ -467,13 +478,27 @@ public:
         return SOCK_OK;
     }
 
-    TCPSocket* accept(){
-        const int max_iters = 100;
-        int iter = 0;
+    uint32_t poll_events() override {
+        uint32_t ev = 0;
+        if (role == SOCK_ROLE_SERVER) {
+            if (backlogLen) ev |= POLL_IN;
+            if (!bound) ev |= POLL_HUP;
+            return ev;
+        }
+        if (!connected || !flow) return ev | POLL_HUP;
+        if (ring.size()) ev |= POLL_IN;
+        //Sends stop being accepted once the peer's FIN is in too, so this is the end for both directions
+        if (tcp_flow_rx_closed(flow)) ev |= POLL_IN | POLL_HUP;
+        else if (tcp_flow_can_send(flow)) ev |= POLL_OUT;
+        return ev;
+    }
 
-        while (backlogLen == 0){
-            if (++iter > max_iters) return nullptr;
-            msleep(10);
+    TCPSocket* accept(uint32_t timeout_ms = TCP_ACCEPT_TIMEOUT_MS){
+        if (backlogLen == 0) {
+            if (!timeout_ms || role != SOCK_ROLE_SERVER) return nullptr;
+            uint64_t deadline = deadline_for(timeout_ms);
+            while (backlogLen == 0)
+                if (!bound || !wait_until(POLL_IN, deadline)) return nullptr;
         }
 
         TCPSocket* client = pending[0];
@@ -627,6 +652,7 @@ public:
 
         remoteEP = d;
         connected = true;
+        tcp_flow_set_notify(flow, flow_notify, this);
         netlog_socket_event_t ev1{};
         ev1.comp = NETLOG_COMP_TCP;
         ev1.action = NETLOG_ACT_CONNECTED;
@@ -639,7 +665,8 @@ public:
         return SOCK_OK;
     }
 
-    int64_t send(const void* buf, uint64_t len) {
+    //With a timeout it waits for acks to open the window until all of buf is queued
+    int64_t send(const void* buf, uint64_t len, uint32_t timeout_ms = 0) {
         netlog_socket_event_t ev{};
         ev.comp = NETLOG_COMP_TCP;
         ev.action = NETLOG_ACT_SEND;
@@ -652,6 +679,7 @@ public:
 
         const uint8_t* p = (const uint8_t*)buf;
         uint64_t sent_total = 0;
+        uint64_t deadline = timeout_ms ? deadline_for(timeout_ms) : 0;
 
         while (sent_total < len) {
             uint64_t remain = len - sent_total;
@@ -661,21 +689,24 @@ public:
             flow->flags = (1u<<PSH_F) | (1u<<ACK_F);
 
             tcp_result_t res = tcp_flow_send(flow);
-            if (res != TCP_OK) {
+            uint32_t pushed = res == TCP_OK ? flow->payload.size : 0;
+            if (pushed) {
+                sent_total += pushed;
+                continue;
+            }
+            if (res != TCP_OK && res != TCP_WOULDBLOCK) {
                 if (sent_total) return (int64_t)sent_total;
                 return (int64_t)res;
             }
-
-            uint32_t pushed = flow->payload.size;
-            if (!pushed) break;
-            sent_total += pushed;
+            if (!deadline || !wait_until(POLL_OUT, deadline) || !connected || !flow) break;
         }
 
         if (sent_total) return (int64_t)sent_total;
         return TCP_WOULDBLOCK;
     }
 
-    int64_t recv(void* buf, uint64_t len){
+    //Returns 0 once the peer has closed and everything it sent was read
+    int64_t recv(void* buf, uint64_t len, uint32_t timeout_ms = 0){
         netlog_socket_event_t ev{};
         ev.comp = NETLOG_COMP_TCP;
         ev.action = NETLOG_ACT_RECV;
@@ -687,16 +718,17 @@ public:
         if (!buf || !len) return 0;
 
         uint8_t* out = (uint8_t*)buf;
-        uint64_t n = 0;
-
-        n = ring.pop_buf(out, len);
+        uint64_t deadline = timeout_ms ? deadline_for(timeout_ms) : 0;
 
-        if (n) {
-            if (flow) tcp_flow_on_app_read(flow, (uint32_t)n);
-            return (int64_t)n;
+        for (;;) {
+            uint64_t n = ring.pop_buf(out, len);
+            if (n) {
+                if (flow) tcp_flow_on_app_read(flow, (uint32_t)n);
+                return (int64_t)n;
+            }
+            if (!connected || !flow || tcp_flow_rx_closed(flow)) return 0;
+            if (!deadline || !wait_until(POLL_IN, deadline)) return TCP_WOULDBLOCK;
         }
-        if (connected) return TCP_WOULDBLOCK;
-        return 0;
     }
 
     int32_t close() override {
@@ -708,6 +740,7 @@ public:
         ev.remote_ep = remoteEP;
         netlog_socket_event(&extraOpts, &ev);
         if (connected && flow){
+            tcp_flow_set_notify(flow, nullptr, nullptr);
             tcp_flow_close(flow);
             connected = false;
             flow = nullptr;
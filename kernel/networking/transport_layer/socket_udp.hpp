@@ -23,7 +23,8 @@ static constexpr uint32_t UDP_DNS_TIMEOUT_MS = 3000;
 class UDPSocket : public Socket {
     inline static UDPSocket* s_list_head = nullptr;
 
-    sizedptr ring[UDP_RING_CAP];
+    //Datagram payloads as handed over by udp_input, usually views of the driver's receive buffer
+    netpkt_t* ring[UDP_RING_CAP];
     net_l4_endpoint src_eps[UDP_RING_CAP];
     int32_t r_head = 0;
     int32_t r_tail = 0;
@@ -120,6 +121,8 @@ class UDPSocket : public Socket {
     static uint32_t dispatch(uint8_t ifindex, ip_version_t ipver, const void* src_ip_addr, const void* dst_ip_addr, uintptr_t frame_ptr, uint32_t frame_len, uint16_t src_port, uint16_t dst_port) {
         UDPSocket* first = nullptr;
         uint32_t ret = frame_len;
+        netpkt_t* pkt = (netpkt_t*)frame_ptr;
+        if (!pkt) return 0;
         irq_flags_t irq = irq_save_disable();
 
         for (UDPSocket* s = s_list_head; s; s = s->next) {
@@ -129,42 +132,38 @@ class UDPSocket : public Socket {
                 continue;
             }
 
-            uintptr_t copy = (uintptr_t)malloc(frame_len);
-            if (!copy) continue;
-
-            memcpy((void*)copy, (const void*)frame_ptr, frame_len);
-            s->on_receive(ipver, src_ip_addr, src_port, copy, frame_len);
+            netpkt_ref(pkt);
+            s->on_receive(ipver, src_ip_addr, src_port, pkt);
         }
 
-        if (first) first->on_receive(ipver, src_ip_addr, src_port, frame_ptr, frame_len);
-        else if (frame_ptr && frame_len) free_sized((void*)frame_ptr, frame_len);
+        if (first) first->on_receive(ipver, src_ip_addr, src_port, pkt);
+        else netpkt_unref(pkt);
         irq_restore(irq);
         return ret;
     }
 
-    void on_receive(ip_version_t ver, const void* src_ip_addr, uint16_t src_port, uintptr_t ptr, uint32_t len) {
+    void drop_head() {
+        rx_bytes -= netpkt_len(ring[r_head]);
+        netpkt_unref(ring[r_head]);
+        ring[r_head] = nullptr;
+        r_head = (r_head + 1) % UDP_RING_CAP;
+    }
+
+    void on_receive(ip_version_t ver, const void* src_ip_addr, uint16_t src_port, netpkt_t* pkt) {
+        uint32_t len = netpkt_len(pkt);
         uint32_t limit = 0xFFFFFFFFu;
         if ((extraOpts.flags & SOCK_OPT_BUF_SIZE) && extraOpts.buf_size) limit = extraOpts.buf_size;
         if (len > limit) {
-            if (ptr && len) free_sized((void*)ptr, len);
+            netpkt_unref(pkt);
             return;
         }
 
-        while (rx_bytes + len > limit && r_head != r_tail) {
-            rx_bytes -= ring[r_head].size;
-            free_sized((void*)ring[r_head].ptr, ring[r_head].size);
-            r_head = (r_head + 1) % UDP_RING_CAP;
-        }
+        while (rx_bytes + len > limit && r_head != r_tail) drop_head();
 
         int nexti = (r_tail + 1) % UDP_RING_CAP;
-        if (nexti == r_head) {
-            rx_bytes -= ring[r_head].size;
-            free_sized((void*)ring[r_head].ptr, ring[r_head].size);
-            r_head = (r_head + 1) % UDP_RING_CAP;
-        }
+        if (nexti == r_head) drop_head();
 
-        ring[r_tail].ptr = ptr;
-        ring[r_tail].size = len;
+        ring[r_tail] = pkt;
         rx_bytes += len;
 
         src_eps[r_tail].ver = ver;
@@ -181,6 +180,7 @@ class UDPSocket : public Socket {
 
         r_tail = nexti;
         remoteEP = src_eps[(r_tail + UDP_RING_CAP - 1) % UDP_RING_CAP];
+        notify(POLL_IN);
     }
 
     void insert_in_list() {
@@ -729,7 +729,16 @@ public:
         return SOCK_ERR_INVAL;
     }
 
-    int64_t recvfrom(void* buf, uint64_t len, net_l4_endpoint* src) {
+    uint32_t poll_events() override {
+        irq_flags_t irq = irq_save_disable();
+        uint32_t ev = POLL_OUT;
+        if (r_head != r_tail) ev |= POLL_IN;
+        irq_restore(irq);
+        return ev;
+    }
+
+    //With a timeout it sleeps until a datagram is queued, returns 0 if none came
+    int64_t recvfrom(void* buf, uint64_t len, net_l4_endpoint* src, uint32_t timeout_ms = 0) {
         netlog_socket_event_t ev{};
         ev.comp = NETLOG_COMP_UDP;
         ev.action = NETLOG_ACT_RECVFROM;
@@ -738,20 +747,30 @@ public:
         ev.local_port = localPort;
         ev.remote_ep = remoteEP;
         netlog_socket_event(&extraOpts, &ev);
-        if (r_head == r_tail) return 0;
+        if (timeout_ms) wait_until(POLL_IN, deadline_for(timeout_ms));
+        irq_flags_t irq = irq_save_disable();
+        if (r_head == r_tail) {
+            irq_restore(irq);
+            return 0;
+        }
 
-        sizedptr p = ring[r_head];
+        netpkt_t* p = ring[r_head];
         net_l4_endpoint se = src_eps[r_head];
+        ring[r_head] = nullptr;
         r_head = (r_head + 1) % UDP_RING_CAP;
-        rx_bytes -= p.size;
+        rx_bytes -= netpkt_len(p);
+        irq_restore(irq);
 
-        uint32_t tocpy = p.size;
+        uint32_t tocpy = netpkt_len(p);
         if (tocpy > len) tocpy = (uint32_t)len;
 
-        memcpy(buf, (void*)p.ptr, tocpy);
+        //The only copy on the receive path, straight out of the buffer the NIC wrote
+        memcpy(buf, (void*)netpkt_data(p), tocpy);
         if (src) *src = se;
 
-        free_sized((void*)p.ptr, p.size);
+        irq = irq_save_disable();
+        netpkt_unref(p);
+        irq_restore(irq);
         remoteEP = se;
         return tocpy;
     }
@@ -764,11 +783,9 @@ public:
         ev.local_port = localPort;
         ev.remote_ep = remoteEP;
         netlog_socket_event(&extraOpts, &ev);
-        while (r_head != r_tail) {
-            rx_bytes -= ring[r_head].size;
-            free_sized((void*)ring[r_head].ptr, ring[r_head].size);
-            r_head = (r_head + 1) % UDP_RING_CAP;
-        }
+        irq_flags_t irq = irq_save_disable();
+        while (r_head != r_tail) drop_head();
+        irq_restore(irq);
         return Socket::close();
     }
 
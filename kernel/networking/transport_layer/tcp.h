@@ -70,7 +70,8 @@ typedef enum {
     TCP_TIME_WAIT
 } tcp_state_t;
 
-#define MAX_TCP_FLOWS 512
+#define MAX_TCP_FLOWS 8192
+#define TCP_FLOWS_INITIAL 64
 #define TCP_SYN_RETRIES 5
 #define TCP_DATA_RETRIES 5
 #define TCP_RETRY_TIMEOUT_MS 200
@@ -98,9 +99,19 @@ tcp_result_t tcp_flow_close(tcp_data *flow_ctx);
 void tcp_flow_window_update(tcp_data *flow_ctx);
 void tcp_flow_on_app_read(tcp_data *flow_ctx, uint32_t bytes_read);
 
-void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint8_t l3_id, uintptr_t ptr, uint32_t len);
+//Called from the input path and the timers when the flow got acked, its window opened or its state changed.
+//freed is set on the last call, made just before the flow is released. Contexts of it must be dropped then
+typedef void (*tcp_notify_t)(void *arg, bool freed);
+void tcp_flow_set_notify(tcp_data *flow_ctx, tcp_notify_t fn, void *arg);
+//Whether tcp_flow_send would take at least one byte now
+bool tcp_flow_can_send(tcp_data *flow_ctx);
+//The peer has sent its FIN or the flow is gone, nothing else will arrive on it
+bool tcp_flow_rx_closed(tcp_data *flow_ctx);
 
-void tcp_tick_all(uint32_t elapsed_ms);
+//pkt is the frame the segment came in, NULL for reassembled datagrams
+void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint8_t l3_id, uintptr_t ptr, uint32_t len, netpkt_t *pkt);
+
+void tcp_run_timers(void);
 int tcp_daemon_entry(int argc, char *argv[]);
 
 #ifdef __cplusplus
@@ -9,63 +9,217 @@
 #include "math/rng.h"
 #include "syscalls/syscalls.h"
 #include "networking/transport_layer/trans_utils.h"
+#include "process/wait_queue.h"
+#include "exceptions/timer.h"
+
+tcp_flow_t **tcp_flows;
+uint32_t tcp_flow_cap;
+static uint32_t tcp_flow_free_hint;
+
+#define TCP_CONN_BUCKETS_INITIAL 128
+#define TCP_LISTEN_BUCKETS 64
+#define TCP_SYN_BACKLOG_PORT 32
+
+static tcp_flow_t **conn_buckets;
+static uint32_t conn_bucket_count;
+static uint32_t conn_hashed;
+static tcp_flow_t *listen_buckets[TCP_LISTEN_BUCKETS];
+static uint32_t tcp_hash_seed;
+static uint32_t syn_total;
+
+static inline size_t ip_len(ip_version_t ver){
+    return (size_t)(ver == IP_VER6 ? 16 : 4);
+}
+
+static uint32_t tcp_tuple_hash(uint16_t local_port, uint16_t remote_port, ip_version_t ver, const void *local_ip, const void *remote_ip){
+    const uint8_t *l = (const uint8_t *)local_ip;
+    const uint8_t *r = (const uint8_t *)remote_ip;
+    uint32_t h = tcp_hash_seed ^ (((uint32_t)local_port << 16) | remote_port);
+    for (size_t i = 0; i < ip_len(ver); i += 4){
+        uint32_t wl, wr;
+        memcpy(&wl, l + i, 4);
+        memcpy(&wr, r + i, 4);
+        h = (h ^ wl) * 0x85EBCA6Bu;
+        h = (h ^ wr) * 0xC2B2AE35u;
+        h ^= h >> 15;
+    }
+    return h ^ (h >> 16);
+}
 
-tcp_flow_t *tcp_flows[MAX_TCP_FLOWS];
+static bool tcp_hash_setup(void){
+    if (conn_buckets) return true;
+    uint64_t virt_timer;
+    asm volatile ("mrs %0, cntvct_el0" : "=r"(virt_timer));
+    rng_t rng;
+    rng_seed(&rng, virt_timer);
+    tcp_hash_seed = rng_next32(&rng);
 
+    conn_buckets = (tcp_flow_t **)malloc(sizeof(tcp_flow_t *) * TCP_CONN_BUCKETS_INITIAL);
+    if (!conn_buckets) return false;
+    memset(conn_buckets, 0, sizeof(tcp_flow_t *) * TCP_CONN_BUCKETS_INITIAL);
+    conn_bucket_count = TCP_CONN_BUCKETS_INITIAL;
+    return true;
+}
 
-int find_flow(uint16_t local_port, ip_version_t ver, const void *local_ip, const void *remote_ip, uint16_t remote_port){
-    for (int i = 0; i < MAX_TCP_FLOWS; i++){
-        tcp_flow_t *f = tcp_flows[i];
-        if (!f) continue;
-
-        if (f->state == TCP_STATE_CLOSED) continue;
-        if (f->local_port != local_port) continue;
-
-        if (f->state == TCP_LISTEN){
-            if (remote_ip || remote_port) continue;
-            if (f->local.ver && f->local.ver != ver) continue;
-            if (!local_ip) return i;
-
-            size_t l = (size_t)(ver == IP_VER6 ? 16 : 4);
-            int unspec = 1;
-            for (size_t k = 0; k < l; ++k){
-                if (f->local.ip[k]){
-                    unspec = 0;
-                    break;
-                }
-            }
-            if (unspec) return i;
-            if (memcmp(f->local.ip, local_ip, l) == 0) return i;
-            continue;
+static inline tcp_flow_t **conn_bucket(tcp_flow_t *f){
+    return &conn_buckets[tcp_tuple_hash(f->local_port, f->remote.port, f->remote.ver, f->local.ip, f->remote.ip) & (conn_bucket_count - 1)];
+}
+
+//Keeps chains short as connections pile up, a failed allocation just leaves the old table in place
+static void conn_table_grow(void){
+    uint32_t count = conn_bucket_count * 2;
+    tcp_flow_t **nb = (tcp_flow_t **)malloc(sizeof(tcp_flow_t *) * count);
+    if (!nb) return;
+    memset(nb, 0, sizeof(tcp_flow_t *) * count);
+
+    tcp_flow_t **old = conn_buckets;
+    uint32_t old_count = conn_bucket_count;
+    conn_buckets = nb;
+    conn_bucket_count = count;
+    for (uint32_t b = 0; b < old_count; b++){
+        tcp_flow_t *f = old[b];
+        while (f){
+            tcp_flow_t *next = f->hnext;
+            tcp_flow_t **head = conn_bucket(f);
+            f->hnext = *head;
+            *head = f;
+            f = next;
         }
+    }
+    free_sized(old, sizeof(tcp_flow_t *) * old_count);
+}
+
+void tcp_flow_hash(tcp_flow_t *f){
+    if (!f || f->hashed) return;
+    if (!tcp_hash_setup()) return;
+
+    if (f->state == TCP_LISTEN){
+        tcp_flow_t **head = &listen_buckets[f->local_port & (TCP_LISTEN_BUCKETS - 1)];
+        f->hnext = *head;
+        *head = f;
+    } else {
+        if (conn_hashed >= conn_bucket_count * 2) conn_table_grow();
+        tcp_flow_t **head = conn_bucket(f);
+        f->hnext = *head;
+        *head = f;
+        conn_hashed++;
+    }
+    f->hashed = 1;
+}
 
-        if (!remote_ip) continue;
-        if (!local_ip) continue;
-        if (f->remote.ver != ver) continue;
-        if (f->remote.port != remote_port) continue;
+static void tcp_flow_unhash(tcp_flow_t *f){
+    if (!f->hashed) return;
+    tcp_flow_t **link = f->state == TCP_LISTEN ? &listen_buckets[f->local_port & (TCP_LISTEN_BUCKETS - 1)] : conn_bucket(f);
+    while (*link && *link != f) link = &(*link)->hnext;
+    if (*link) *link = f->hnext;
+    if (f->state != TCP_LISTEN) conn_hashed--;
+    f->hnext = NULL;
+    f->hashed = 0;
+}
 
-        size_t l = (size_t)(ver == IP_VER6 ? 16 : 4);
+tcp_flow_t *tcp_lookup_flow(uint16_t local_port, ip_version_t ver, const void *local_ip, const void *remote_ip, uint16_t remote_port){
+    if (!conn_buckets || !local_ip || !remote_ip) return NULL;
+    size_t l = ip_len(ver);
+    uint32_t b = tcp_tuple_hash(local_port, remote_port, ver, local_ip, remote_ip) & (conn_bucket_count - 1);
+    for (tcp_flow_t *f = conn_buckets[b]; f; f = f->hnext){
+        if (f->local_port != local_port || f->remote.port != remote_port) continue;
+        if (f->remote.ver != ver || f->state == TCP_STATE_CLOSED) continue;
         if (memcmp(f->local.ip, local_ip, l) != 0) continue;
         if (memcmp(f->remote.ip, remote_ip, l) != 0) continue;
+        return f;
+    }
+    return NULL;
+}
 
-        return i;
+//An exact address match wins over a wildcard listener on the same port
+tcp_flow_t *tcp_find_listener(uint16_t local_port, ip_version_t ver, const void *local_ip){
+    tcp_flow_t *wildcard = NULL;
+    size_t l = ip_len(ver);
+    for (tcp_flow_t *f = listen_buckets[local_port & (TCP_LISTEN_BUCKETS - 1)]; f; f = f->hnext){
+        if (f->local_port != local_port || f->state != TCP_LISTEN) continue;
+        if (f->local.ver && f->local.ver != ver) continue;
+        if (!local_ip) return f;
+
+        int unspec = 1;
+        for (size_t k = 0; k < l; ++k){
+            if (f->local.ip[k]){
+                unspec = 0;
+                break;
+            }
+        }
+        if (unspec){
+            if (!wildcard) wildcard = f;
+            continue;
+        }
+        if (memcmp(f->local.ip, local_ip, l) == 0) return f;
     }
+    return wildcard;
+}
 
-    return -1;
+int find_flow(uint16_t local_port, ip_version_t ver, const void *local_ip, const void *remote_ip, uint16_t remote_port){
+    tcp_flow_t *f = (remote_ip || remote_port) ? tcp_lookup_flow(local_port, ver, local_ip, remote_ip, remote_port) : tcp_find_listener(local_port, ver, local_ip);
+    return f ? (int)f->slot : -1;
 }
 
 tcp_data *tcp_get_ctx(uint16_t local_port, ip_version_t ver, const void *local_ip, const void *remote_ip, uint16_t remote_port){
-    int idx = find_flow(local_port, ver, local_ip, remote_ip, remote_port);
+    tcp_flow_t *f = tcp_lookup_flow(local_port, ver, local_ip, remote_ip, remote_port);
+    return f ? &f->ctx : NULL;
+}
+
+//The ctx handed to sockets is embedded in its flow. Holders drop it when notified of the free, since the slot
+//and even the address may be reused by the next flow the check here only catches contexts that were never valid
+tcp_flow_t *tcp_flow_from_ctx(tcp_data *ctx){
+    if (!ctx) return NULL;
+    tcp_flow_t *f = (tcp_flow_t *)((uintptr_t)ctx - __builtin_offsetof(tcp_flow_t, ctx));
+    uint32_t slot = f->slot;
+    if (slot >= tcp_flow_cap || tcp_flows[slot] != f) return NULL;
+    return f;
+}
+
+void tcp_flow_set_notify(tcp_data *flow_ctx, tcp_notify_t fn, void *arg){
+    tcp_flow_t *f = tcp_flow_from_ctx(flow_ctx);
+    if (!f) return;
+    f->notify = fn;
+    f->notify_arg = arg;
+}
+
+bool tcp_syn_backlog_full(tcp_flow_t *listener){
+    if (syn_total >= MAX_TCP_FLOWS / 4) return true;
+    return listener && listener->syn_backlog >= TCP_SYN_BACKLOG_PORT;
+}
 
-    if (idx < 0) return NULL;
-    return &tcp_flows[idx]->ctx;
+void tcp_syn_backlog_enter(tcp_flow_t *listener, tcp_flow_t *flow){
+    if (!flow || flow->syn_counted) return;
+    flow->syn_counted = 1;
+    syn_total++;
+    flow->syn_listener = listener;
+    if (listener) listener->syn_backlog++;
+}
+
+void tcp_syn_backlog_leave(tcp_flow_t *flow){
+    if (!flow || !flow->syn_counted) return;
+    flow->syn_counted = 0;
+    if (syn_total) syn_total--;
+    tcp_flow_t *lf = flow->syn_listener;
+    flow->syn_listener = NULL;
+    if (lf && lf->syn_backlog) lf->syn_backlog--;
+}
+
+//Embryonic flows outlive a closed listener, they mustn't keep pointing at it
+static void tcp_syn_backlog_orphan(tcp_flow_t *listener){
+    for (uint32_t i = 0; i < tcp_flow_cap && listener->syn_backlog; i++){
+        tcp_flow_t *f = tcp_flows[i];
+        if (!f || f->syn_listener != listener) continue;
+        f->syn_listener = NULL;
+        listener->syn_backlog--;
+    }
 }
 
 static void clear_txq(tcp_flow_t *f){
     for (int i = 0; i < TCP_MAX_TX_SEGS; i++){
         tcp_tx_seg_t *s = &f->txq[i];
 
-        if (s->used && s->buf && s->len) free_sized((void *)s->buf, s->len);
+        if (s->pkt) netpkt_unref(s->pkt);
 
         s->used = 0;
         s->syn = 0;
@@ -75,6 +229,7 @@ static void clear_txq(tcp_flow_t *f){
         s->seq = 0;
         s->len = 0;
         s->buf = 0;
+        s->pkt = 0;
         s->timer_ms = 0;
         s->timeout_ms = 0;
 }
@@ -96,56 +251,80 @@ static void clear_reass(tcp_flow_t *f){
     f->rcv_buf_used = 0;
 }
 
-tcp_flow_t *tcp_alloc_flow(void){
-    for (int i = 0; i < MAX_TCP_FLOWS; i++){
-        if (tcp_flows[i]) continue;
+static bool tcp_flows_grow(void){
+    if (tcp_flow_cap >= MAX_TCP_FLOWS) return false;
+    uint32_t cap = tcp_flow_cap ? tcp_flow_cap * 2 : TCP_FLOWS_INITIAL;
+    if (cap > MAX_TCP_FLOWS) cap = MAX_TCP_FLOWS;
+
+    tcp_flow_t **nf = (tcp_flow_t **)malloc(sizeof(tcp_flow_t *) * cap);
+    if (!nf) return false;
+    memset(nf, 0, sizeof(tcp_flow_t *) * cap);
+    if (tcp_flows){
+        memcpy(nf, tcp_flows, sizeof(tcp_flow_t *) * tcp_flow_cap);
+        free_sized(tcp_flows, sizeof(tcp_flow_t *) * tcp_flow_cap);
+    }
+    tcp_flow_free_hint = tcp_flow_cap;
+    tcp_flows = nf;
+    tcp_flow_cap = cap;
+    return true;
+}
 
-        tcp_flow_t *f = (tcp_flow_t *)malloc(sizeof(tcp_flow_t));
-        if (!f) return NULL;
-        memset(f, 0, sizeof(tcp_flow_t));
-        tcp_flows[i] = f;
+static int tcp_find_free_slot(void){
+    for (uint32_t n = 0; n < tcp_flow_cap; n++){
+        uint32_t i = (tcp_flow_free_hint + n) % tcp_flow_cap;
+        if (!tcp_flows[i]) return (int)i;
+    }
+    if (!tcp_flows_grow()) return -1;
+    return (int)tcp_flow_free_hint;
+}
 
-        f->rto = TCP_INIT_RTO;
-        f->rcv_wnd_max = TCP_DEFAULT_RCV_BUF;
-        f->rcv_wnd = f->rcv_wnd_max;
+tcp_flow_t *tcp_alloc_flow(void){
+    int i = tcp_find_free_slot();
+    if (i < 0) return NULL;
 
-        f->mss = TCP_DEFAULT_MSS;
-        f->cwnd = f->mss;
-        f->ssthresh = TCP_RECV_WINDOW;
+    tcp_flow_t *f = (tcp_flow_t *)malloc(sizeof(tcp_flow_t));
+    if (!f) return NULL;
+    memset(f, 0, sizeof(tcp_flow_t));
+    tcp_flows[i] = f;
+    f->slot = (uint32_t)i;
+    tcp_flow_free_hint = (uint32_t)i + 1;
 
-        clear_reass(f);
-        clear_txq(f);
+    f->rto = TCP_INIT_RTO;
+    f->rcv_wnd_max = TCP_DEFAULT_RCV_BUF;
+    f->rcv_wnd = f->rcv_wnd_max;
 
-        return f;
-    }
+    f->mss = TCP_DEFAULT_MSS;
+    f->cwnd = f->mss;
+    f->ssthresh = TCP_RECV_WINDOW;
 
-    return NULL;
+    clear_reass(f);
+    clear_txq(f);
+    tcp_timer_init(f);
+
+    return f;
 }
 
 void tcp_free_flow(int idx) {
-    if (idx < 0 || idx >= MAX_TCP_FLOWS) return;
+    if (idx < 0 || (uint32_t)idx >= tcp_flow_cap) return;
 
     tcp_flow_t *f = tcp_flows[idx];
     if (!f) return;
 
+    //Last chance for the socket to forget the ctx, nothing validates it once the memory is reused
+    if (f->notify) f->notify(f->notify_arg, true);
+    f->notify = NULL;
+    tcp_timer_stop(f);
+    tcp_flow_unhash(f);
+    tcp_syn_backlog_leave(f);
+    tcp_syn_backlog_orphan(f);
     clear_txq(f);
     clear_reass(f);
 
     memset(f, 0, sizeof(*f));
 
-    f->state = TCP_STATE_CLOSED;
-
-    f->rto = TCP_INIT_RTO;
-
-    f->rcv_wnd_max = TCP_DEFAULT_RCV_BUF;
-    f->rcv_wnd = f->rcv_wnd_max;
-
-    f->mss = TCP_DEFAULT_MSS;
-    f->cwnd = f->mss;
-    f->ssthresh = TCP_RECV_WINDOW;
-
     free_sized(f, sizeof(*f));
     tcp_flows[idx] = NULL;
+    tcp_flow_free_hint = (uint32_t)idx;
 }
 
 bool tcp_send_segment(ip_version_t ver, const void *src_ip_addr, const void *dst_ip_addr, tcp_hdr_t *hdr, const uint8_t *opts, uint8_t opts_len, const uint8_t *payload, uint16_t payload_len, const ip_tx_opts_t *txp, uint8_t ttl, uint8_t dontfrag){
@@ -192,6 +371,54 @@ bool tcp_send_segment(ip_version_t ver, const void *src_ip_addr, const void *dst
     return false;
 }
 
+bool tcp_send_segment_pkt(ip_version_t ver, const void *src_ip_addr, const void *dst_ip_addr, tcp_hdr_t *hdr, netpkt_t *payload, const uint32_t *payload_sum, uint16_t mss, const ip_tx_opts_t *txp, uint8_t ttl, uint8_t dontfrag){
+    if (!hdr || !payload || (ver != IP_VER4 && ver != IP_VER6)) {
+        if (payload) netpkt_unref(payload);
+        return false;
+    }
+
+    uint32_t payload_len = netpkt_total_len(payload);
+    uint32_t tcp_len = (uint32_t)sizeof(tcp_hdr_t) + payload_len;
+    if (tcp_len > 0xFFFFu) {
+        netpkt_unref(payload);
+        return false;
+    }
+
+    uint32_t headroom = (uint32_t)sizeof(eth_hdr_t) + (uint32_t)(ver == IP_VER4 ? sizeof(ipv4_hdr_t) : sizeof(ipv6_hdr_t));
+    netpkt_t *pkt = netpkt_alloc(sizeof(tcp_hdr_t), headroom, 0);
+    tcp_hdr_t *h = pkt ? (tcp_hdr_t *)netpkt_put(pkt, sizeof(tcp_hdr_t)) : 0;
+    if (!h) {
+        if (pkt) netpkt_unref(pkt);
+        netpkt_unref(payload);
+        return false;
+    }
+
+    *h = *hdr;
+    h->data_offset_reserved = (uint8_t)((sizeof(tcp_hdr_t) / 4) << 4);
+    h->window = bswap16(h->window);
+    h->checksum = 0;
+    netpkt_attach(pkt, payload);
+
+    uint32_t pseudo = ver == IP_VER4
+        ? net_csum_pseudo_ipv4(*(const uint32_t *)src_ip_addr, *(const uint32_t *)dst_ip_addr, 6, tcp_len)
+        : net_csum_pseudo_ipv6((const uint8_t *)src_ip_addr, (const uint8_t *)dst_ip_addr, 6, tcp_len);
+
+    bool gso = mss && payload_len > mss;
+    if (payload_sum && !gso) {
+        //Payload was summed when it was copied in, only the header is left to add
+        h->checksum = bswap16(net_csum_finish(net_csum_partial(h, sizeof(tcp_hdr_t), pseudo + *payload_sum)));
+    } else {
+        //Only the pseudo header is summed here, the rest is left to the NIC or netpkt_csum_resolve
+        netpkt_set_csum_partial(pkt, 0, (uint16_t)__builtin_offsetof(tcp_hdr_t, checksum));
+        if (gso) netpkt_set_gso(pkt, ver == IP_VER4 ? NETPKT_GSO_TCPV4 : NETPKT_GSO_TCPV6, mss);
+        h->checksum = bswap16(net_csum_reduce(pseudo));
+    }
+
+    if (ver == IP_VER4) ipv4_send_packet(*(const uint32_t *)dst_ip_addr, 6, pkt, (const ipv4_tx_opts_t *)txp, ttl, dontfrag);
+    else ipv6_send_packet((const uint8_t *)dst_ip_addr, 6, pkt, (const ipv6_tx_opts_t *)txp, ttl, dontfrag);
+    return true;
+}
+
 void tcp_send_reset(ip_version_t ver, const void *src_ip_addr, const void *dst_ip_addr, uint16_t src_port, uint16_t dst_port, uint32_t seq, uint32_t ack, bool ack_valid){
     tcp_hdr_t rst_hdr;
 
@@ -266,8 +493,7 @@ bool tcp_bind_l3(uint8_t l3_id, uint16_t port, uint16_t pid, port_recv_handler_t
     if (!pm) return false;
     if (!port_bind_manual(pm, PROTO_TCP, port, pid, handler)) return false;
 
-    int listen_idx = find_flow(port, ver, NULL, NULL, 0);
-    if (listen_idx >= 0) return true;
+    if (tcp_find_listener(port, ver, NULL)) return true;
 
     tcp_flow_t *f = tcp_alloc_flow();
     if (!f) {
@@ -327,6 +553,8 @@ bool tcp_bind_l3(uint8_t l3_id, uint16_t port, uint16_t pid, port_recv_handler_t
 
         f->time_wait_ms = 0;
         f->fin_wait2_ms = 0;
+
+        tcp_flow_hash(f);
     }
 
     return true;
@@ -350,30 +578,31 @@ bool tcp_unbind_l3(uint8_t l3_id, uint16_t port, uint16_t pid){
     bool res = port_unbind(pm, PROTO_TCP, port, pid);
 
     if (res){
-        for (int i = 0; i < MAX_TCP_FLOWS; i++){
-            tcp_flow_t *f = tcp_flows[i];
-            if (!f) continue;
-            if (f->state==TCP_LISTEN && f->local_port==port && f->local.ver==ver) tcp_free_flow(i);
-        }
+        tcp_flow_t *f;
+        while ((f = tcp_find_listener(port, ver, NULL)) != NULL) tcp_free_flow((int)f->slot);
     }
 
     return res;
 }
 
+typedef struct {
+    kevent_t changed;
+    bool freed;
+} tcp_handshake_wait_t;
+
+static void tcp_handshake_notify(void *arg, bool freed){
+    tcp_handshake_wait_t *w = (tcp_handshake_wait_t *)arg;
+    if (freed) w->freed = true;
+    kevent_signal(&w->changed);
+}
+
 bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst, tcp_data *flow_ctx, uint16_t pid, const SocketExtraOptions* extra){
     (void)pid;
 
     tcp_flow_t *flow = tcp_alloc_flow();
     if (!flow) return false;
 
-    int idx = -1;
-    for (int i = 0; i < MAX_TCP_FLOWS; i++) {
-        if (tcp_flows[i] == flow) {
-            idx = i;
-            break;
-        }
-    }
-    if (idx < 0) return false;
+    int idx = (int)flow->slot;
 
     flow->local_port = local_port;
     flow->l3_id = l3_id;
@@ -407,6 +636,7 @@ bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst,
 
     flow->state = TCP_SYN_SENT;
     flow->retries = TCP_SYN_RETRIES;
+    tcp_flow_hash(flow);
 
     rng_t rng;
     uint64_t virt_timer;
@@ -484,6 +714,7 @@ bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst,
     seg->seq = flow->snd_nxt;
     seg->len = 0;
     seg->buf = 0;
+    seg->pkt = 0;
     seg->timer_ms = 0;
     seg->timeout_ms = flow->rto ? flow->rto : TCP_INIT_RTO;
 
@@ -517,14 +748,22 @@ bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst,
     flow->ctx.sequence = flow->snd_nxt;
     flow->ctx.expected_ack = flow->snd_nxt;
 
-    tcp_daemon_kick();
+    //Woken by the input path on the SYN/ACK or a reset and by the timers giving up, instead of polling the state
+    tcp_handshake_wait_t wait = {};
+    flow->notify = tcp_handshake_notify;
+    flow->notify_arg = &wait;
+
+    tcp_timer_rearm(flow);
 
-    uint64_t waited = 0;
-    const uint64_t interval = 50;
     const uint64_t max_wait = (uint64_t)TCP_MAX_RTO * (uint64_t)(TCP_SYN_RETRIES + 1);
+    uint64_t deadline = timer_now_msec() + max_wait;
+
+    for (;;){
+        if (wait.freed) return false;
 
-    while (waited < max_wait){
         if (flow->state == TCP_ESTABLISHED){
+            flow->notify = NULL;
+            flow->notify_arg = NULL;
             tcp_data *ctx = tcp_get_ctx(local_port, dst->ver, flow->local.ip, dst->ip, dst->port);
             if (!ctx) return false;
 
@@ -532,13 +771,11 @@ bool tcp_handshake_l3(uint8_t l3_id, uint16_t local_port, net_l4_endpoint *dst,
             return true;
         }
 
-        if (flow->state == TCP_STATE_CLOSED){
-            tcp_free_flow(idx);
-            return false;
-        }
+        if (flow->state == TCP_STATE_CLOSED) break;
 
-        msleep(interval);
-        waited += interval;
+        uint64_t now = timer_now_msec();
+        if (now >= deadline) break;
+        kevent_wait(&wait.changed, deadline - now);
     }
 
     tcp_free_flow(idx);
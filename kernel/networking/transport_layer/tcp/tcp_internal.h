@@ -7,11 +7,12 @@
 #include "networking/internet_layer/ipv6.h"
 #include "networking/internet_layer/ipv4_utils.h"
 #include "networking/internet_layer/ipv6_utils.h"
-#include "net/checksums.h"
+#include "networking/net_checksum.h"
 #include "std/memory.h"
 #include "math/rng.h"
 #include "syscalls/syscalls.h"
 #include "tcp_utils.h"
+#include "exceptions/timer_wheel.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,6 +22,8 @@ extern "C" {
 #define TCP_DEFAULT_MSS 1460
 #define TCP_DEFAULT_RCV_BUF (256u * 1024u)
 #define TCP_PERSIST_PROBE_BUFSZ 1
+//Largest super-segment handed to a TSO capable NIC, leaves room for the IP and TCP headers in a 64K datagram
+#define TCP_TSO_MAX_PAYLOAD (65535u - 60u)
 
 #define TCP_DELAYED_ACK_MS 200
 #define TCP_PERSIST_MIN_MS 500
@@ -35,6 +38,10 @@ typedef struct {
     uint32_t seq;
     uint64_t len;
     uintptr_t buf;
+    //Owns buf, retransmits go out as views of it so the payload is never copied again
+    netpkt_t *pkt;
+    //net_csum_partial of buf, taken while copying it in so software checksums don't touch the payload again
+    uint32_t csum;
     uint32_t timer_ms;
     uint32_t timeout_ms;
 } tcp_tx_seg_t;
@@ -45,7 +52,7 @@ typedef struct {
     uintptr_t buf;
 } tcp_reass_seg_t;
 
-typedef struct {
+typedef struct tcp_flow {
     uint16_t local_port;
     net_l4_endpoint local;
     net_l4_endpoint remote;
@@ -101,13 +108,46 @@ typedef struct {
     uint8_t keepalive_on;
     uint32_t keepalive_ms;
     uint32_t keepalive_idle_ms;
+
+    uint32_t slot;
+    uint8_t hashed;
+    uint8_t syn_counted;
+    uint16_t syn_backlog;
+    //Listener whose syn_backlog this embryonic flow is counted in, cleared if the listener goes first
+    struct tcp_flow *syn_listener;
+    struct tcp_flow *hnext;
+
+    //One wheel entry per flow, armed for the earliest of its timers. The *_ms accumulators above are brought up to date from timer_last_ms
+    ktimer_t timer;
+    uint64_t timer_last_ms;
+    struct tcp_flow *expired_next;
+    uint8_t timer_expired;
+
+    tcp_notify_t notify;
+    void *notify_arg;
 } tcp_flow_t;
 
-extern tcp_flow_t *tcp_flows[MAX_TCP_FLOWS];
+//Indexed by tcp_flow_t.slot, grows up to MAX_TCP_FLOWS. Entries may be NULL
+extern tcp_flow_t **tcp_flows;
+extern uint32_t tcp_flow_cap;
 
 tcp_flow_t *tcp_alloc_flow(void);
 void tcp_free_flow(int idx);
 
+//Publishes a flow once its addresses are set. Listeners go into the per port table, everything else is keyed by the 4-tuple
+void tcp_flow_hash(tcp_flow_t *flow);
+tcp_flow_t *tcp_lookup_flow(uint16_t local_port, ip_version_t ver, const void *local_ip, const void *remote_ip, uint16_t remote_port);
+tcp_flow_t *tcp_find_listener(uint16_t local_port, ip_version_t ver, const void *local_ip);
+tcp_flow_t *tcp_flow_from_ctx(tcp_data *ctx);
+
+static inline void tcp_flow_notify(tcp_flow_t *flow) {
+    if (flow && flow->notify) flow->notify(flow->notify_arg, false);
+}
+
+bool tcp_syn_backlog_full(tcp_flow_t *listener);
+void tcp_syn_backlog_enter(tcp_flow_t *listener, tcp_flow_t *flow);
+void tcp_syn_backlog_leave(tcp_flow_t *flow);
+
 void tcp_rtt_update(tcp_flow_t *flow, uint32_t sample_ms);
 
 tcp_tx_seg_t *tcp_alloc_tx_seg(tcp_flow_t *flow);
@@ -115,22 +155,28 @@ void tcp_send_from_seg(tcp_flow_t *flow, tcp_tx_seg_t *seg);
 void tcp_send_ack_now(tcp_flow_t *flow);
 
 static inline uint16_t tcp_checksum_ipv4(const void *segment, uint16_t seg_len, uint32_t src_ip, uint32_t dst_ip) {
-    uint16_t csum = checksum16_pipv4(src_ip, dst_ip, 6, (const uint8_t *)segment, seg_len);
-    return bswap16(csum);
+    return bswap16(net_csum_finish(net_csum_partial(segment, seg_len, net_csum_pseudo_ipv4(src_ip, dst_ip, 6, seg_len))));
 }
 static inline uint16_t tcp_checksum_ipv6(const void *segment, uint16_t seg_len,  const uint8_t src_ip[16], const uint8_t dst_ip[16]) {
-    uint16_t csum = checksum16_pipv6(src_ip, dst_ip, 6, (const uint8_t *)segment, seg_len);
-    return bswap16(csum);
+    return bswap16(net_csum_finish(net_csum_partial(segment, seg_len, net_csum_pseudo_ipv6(src_ip, dst_ip, 6, seg_len))));
 }
 
 bool tcp_send_segment(ip_version_t ver, const void *src_ip_addr, const void *dst_ip_addr, tcp_hdr_t *hdr, const uint8_t *opts, uint8_t opts_len, const uint8_t *payload, uint16_t payload_len, const ip_tx_opts_t *txp, uint8_t ttl, uint8_t dontfrag);
+//Sends hdr in its own buffer with payload chained behind it, consuming the payload reference.
+//With payload_sum the checksum is finished here, otherwise it's left partial and payloads over mss go out
+//as a single super-segment for the NIC to cut
+bool tcp_send_segment_pkt(ip_version_t ver, const void *src_ip_addr, const void *dst_ip_addr, tcp_hdr_t *hdr, netpkt_t *payload, const uint32_t *payload_sum, uint16_t mss, const ip_tx_opts_t *txp, uint8_t ttl, uint8_t dontfrag);
 void tcp_send_reset(ip_version_t ver, const void *src_ip_addr, const void *dst_ip_addr, uint16_t src_port, uint16_t dst_port, uint32_t seq, uint32_t ack, bool ack_valid);
 tcp_tx_seg_t *tcp_find_first_unacked(tcp_flow_t *flow);
 void tcp_cc_on_timeout(tcp_flow_t *f);
 
-int tcp_has_pending_timers(void);
+void tcp_timer_init(tcp_flow_t *f);
+void tcp_timer_stop(tcp_flow_t *f);
+//Accrues the time since the last sync into every running timer, call before touching any *_ms field
+void tcp_timer_sync(tcp_flow_t *f);
+//Re-arms the flow's wheel entry after its timers changed, cancels it when none are running
+void tcp_timer_rearm(tcp_flow_t *f);
 
-void tcp_daemon_kick(void);
 uint16_t tcp_calc_adv_wnd_field(tcp_flow_t *flow, uint8_t apply_scale);
 
 #ifdef __cplusplus
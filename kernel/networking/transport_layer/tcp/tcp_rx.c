@@ -325,21 +325,23 @@ static void tcp_cc_on_dupack(tcp_flow_t *f) {
     }
 }
 
-void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint8_t l3_id, uintptr_t ptr, uint32_t len) {
+void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint8_t l3_id, uintptr_t ptr, uint32_t len, netpkt_t *pkt) {
     if (len < sizeof(tcp_hdr_t)) return;
 
     tcp_hdr_t *hdr = (tcp_hdr_t *)ptr;
 
-    uint16_t recv_checksum = hdr->checksum;
-    hdr->checksum = 0;
+    if (!netpkt_csum_valid(pkt)) {
+        uint16_t recv_checksum = hdr->checksum;
+        hdr->checksum = 0;
 
-    uint16_t calc;
+        uint16_t calc;
 
-    if (ipver == IP_VER4) calc = tcp_checksum_ipv4(hdr, (uint16_t)len, *(const uint32_t *)src_ip_addr, *(const uint32_t *)dst_ip_addr);
-    else calc = tcp_checksum_ipv6(hdr, (uint16_t)len, (const uint8_t *)src_ip_addr, (const uint8_t *)dst_ip_addr);
+        if (ipver == IP_VER4) calc = tcp_checksum_ipv4(hdr, (uint16_t)len, *(const uint32_t *)src_ip_addr, *(const uint32_t *)dst_ip_addr);
+        else calc = tcp_checksum_ipv6(hdr, (uint16_t)len, (const uint8_t *)src_ip_addr, (const uint8_t *)dst_ip_addr);
 
-    hdr->checksum = recv_checksum;
-    if (recv_checksum != calc) return;
+        hdr->checksum = recv_checksum;
+        if (recv_checksum != calc) return;
+    }
 
     uint16_t src_port = bswap16(hdr->src_port);
     uint16_t dst_port = bswap16(hdr->dst_port);
@@ -353,8 +355,9 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
 
     uint32_t data_len = len - hdr_len;
 
-    int idx = find_flow(dst_port, ipver, dst_ip_addr, src_ip_addr, src_port);
-    tcp_flow_t *flow = idx >= 0 ? tcp_flows[idx] : NULL;
+    tcp_flow_t *flow = tcp_lookup_flow(dst_port, ipver, dst_ip_addr, src_ip_addr, src_port);
+    int idx = flow ? (int)flow->slot : -1;
+    if (flow) tcp_timer_sync(flow);
     if (flow) flow->keepalive_idle_ms = 0;
     if (flow) flow->l3_id = l3_id;
 
@@ -376,38 +379,22 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
     if (!pm) return;
 
     if (!flow){
-        int listen_idx = find_flow(dst_port, ipver, dst_ip_addr, NULL, 0);
-        if (listen_idx < 0)
-            listen_idx = find_flow(dst_port, ipver, NULL, NULL, 0);
+        tcp_flow_t *lf = tcp_find_listener(dst_port, ipver, dst_ip_addr);
+        if (!lf) lf = tcp_find_listener(dst_port, ipver, NULL);
 
-        if ((flags & (1u << SYN_F)) && !(flags & (1u << ACK_F)) && listen_idx >= 0){
+        if ((flags & (1u << SYN_F)) && !(flags & (1u << ACK_F)) && lf){
             rng_t rng;
             uint64_t virt_timer;
             asm volatile ("mrs %0, cntvct_el0" : "=r"(virt_timer));
             rng_seed(&rng, virt_timer);
 
-            int syn_total = 0;
-            int syn_port = 0;
-            for (int k = 0; k < MAX_TCP_FLOWS; k++){
-                tcp_flow_t *f = tcp_flows[k];
-                if (!f) continue;
-                if (f->state != TCP_SYN_RECEIVED) continue;
-                syn_total++;
-                if (f->local_port == dst_port && f->l3_id == l3_id) syn_port++;
-            }
-            if (syn_total >= (MAX_TCP_FLOWS / 4) || syn_port >= 32) return;
+            if (tcp_syn_backlog_full(lf)) return;
 
-            tcp_flow_t *lf = tcp_flows[listen_idx];
             tcp_flow_t *nf = tcp_alloc_flow();
             if (!nf) return;
 
             flow = nf;
-            for (int k = 0; k < MAX_TCP_FLOWS; k++) {
-                if (tcp_flows[k] == nf) {
-                    idx = k;
-                    break;
-                }
-            }
+            idx = (int)nf->slot;
 
             flow->local_port = dst_port;
             flow->l3_id = l3_id;
@@ -424,6 +411,8 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
 
             flow->state = TCP_SYN_RECEIVED;
             flow->retries = TCP_SYN_RETRIES;
+            tcp_flow_hash(flow);
+            tcp_syn_backlog_enter(lf, flow);
 
             tcp_parsed_opts_t pop;
             tcp_parse_options((const uint8_t *)(ptr + sizeof(tcp_hdr_t)), (uint32_t)(hdr_len > sizeof(tcp_hdr_t) ? hdr_len - sizeof(tcp_hdr_t) : 0), &pop);
@@ -521,7 +510,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                 tcp_send_segment(IP_VER6, flow->local.ip, src_ip_addr, &synack_hdr, syn_opts, syn_opts_len, NULL, 0, (const ip_tx_opts_t *)&tx, flow->ip_ttl, flow->ip_dontfrag);
             }
 
-            tcp_daemon_kick();
+            tcp_timer_rearm(flow);
             return;
         }
 
@@ -558,6 +547,12 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
 
         return;
     }
+
+    //Compared against below to tell the owning socket about freed send space and state changes
+    uint32_t entry_una = flow->snd_una;
+    uint32_t entry_wnd = flow->snd_wnd;
+    tcp_state_t entry_state = flow->state;
+
     uint32_t new_wnd = window;
     if (flow->ws_ok && flow->ws_recv) new_wnd <<= flow->ws_recv;
     flow->snd_wnd = new_wnd;
@@ -568,7 +563,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
         flow->persist_timeout_ms = 0;
         flow->persist_probe_cnt = 0;
     } else {
-        tcp_daemon_kick();
+        tcp_timer_rearm(flow);
     }
 
     uint8_t fin = (flags & (1u << FIN_F)) ? 1u : 0u;
@@ -590,10 +585,11 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                 if (s_end <= ack){
                     if (s->rtt_sample && s->retransmit_cnt == 0) tcp_rtt_update(flow, s->timer_ms);
 
-                    if (s->buf && s->len) free_sized((void *)s->buf, s->len);
+                    if (s->pkt) netpkt_unref(s->pkt);
 
                     s->used = 0;
                     s->buf = 0;
+                    s->pkt = 0;
                     s->len = 0;
                 }
             }
@@ -603,7 +599,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
             if (flow->state == TCP_FIN_WAIT_1 && ack >= flow->ctx.expected_ack){
                 flow->state = TCP_FIN_WAIT_2;
                 flow->fin_wait2_ms = 0;
-                tcp_daemon_kick();
+                tcp_timer_rearm(flow);
             } else if ((flow->state == TCP_LAST_ACK || flow->state == TCP_CLOSING) && ack >= flow->ctx.expected_ack){
                 tcp_free_flow(idx);
                 return;
@@ -616,6 +612,8 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
         }
     }
 
+    if (flow->snd_una != entry_una || (!entry_wnd && flow->snd_wnd)) tcp_flow_notify(flow);
+
     uint32_t seg_seq = seq;
 
     switch (flow->state){
@@ -681,11 +679,12 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
             flow->state = TCP_ESTABLISHED;
             flow->delayed_ack_pending = 0;
             flow->delayed_ack_timer_ms = 0;
-            tcp_daemon_kick();
+            tcp_timer_rearm(flow);
         } else if (flags & (1u << RST_F)){
             flow->state = TCP_STATE_CLOSED;
         }
 
+        if (flow->state != entry_state) tcp_flow_notify(flow);
         return;
 
     case TCP_SYN_RECEIVED:
@@ -694,6 +693,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
             flow->snd_una = ack;
             flow->snd_nxt = flow->ctx.sequence;
             flow->state = TCP_ESTABLISHED;
+            tcp_syn_backlog_leave(flow);
             flow->delayed_ack_pending = 0;
             flow->delayed_ack_timer_ms = 0;
             flow->ctx.ack_received = ack;
@@ -701,7 +701,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
             port_recv_handler_t h = port_get_handler(pm, PROTO_TCP, dst_port);
             if (h) (void)h(ifx, ipver, src_ip_addr, dst_ip_addr, 0, 0, src_port, dst_port);
 
-            tcp_daemon_kick();
+            tcp_timer_rearm(flow);
         } else if (flags & (1u << RST_F)){
             tcp_free_flow(idx);
         }
@@ -806,7 +806,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                         else if (old == TCP_FIN_WAIT_2 || old == TCP_CLOSING || old == TCP_LAST_ACK) {
                             flow->state = TCP_TIME_WAIT;
                             flow->time_wait_ms = 0;
-                            tcp_daemon_kick();
+                            tcp_timer_rearm(flow);
                         }
 
                         ack_immediate = 1;
@@ -830,7 +830,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
                     else if (old == TCP_FIN_WAIT_2 || old == TCP_CLOSING || old == TCP_LAST_ACK) {
                         flow->state = TCP_TIME_WAIT;
                         flow->time_wait_ms = 0;
-                        tcp_daemon_kick();
+                        tcp_timer_rearm(flow);
                     }
 
                     ack_immediate = 1;
@@ -861,7 +861,7 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
             if (!flow->delayed_ack_pending){
                 flow->delayed_ack_pending = 1;
                 flow->delayed_ack_timer_ms = 0;
-                tcp_daemon_kick();
+                tcp_timer_rearm(flow);
             } else {
                 tcp_send_ack_now(flow);
             }
@@ -869,27 +869,22 @@ void tcp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
             if (!flow->delayed_ack_pending){
                 flow->delayed_ack_pending = 1;
                 flow->delayed_ack_timer_ms = 0;
-                tcp_daemon_kick();
+                tcp_timer_rearm(flow);
             } else {
                 tcp_send_ack_now(flow);
             }
         }
     }
+
+    if (flow->state != entry_state) tcp_flow_notify(flow);
 }
 
 void tcp_flow_on_app_read(tcp_data *flow_ctx, uint32_t bytes_read){
     if (!flow_ctx || bytes_read == 0) return;
 
-    tcp_flow_t *flow = NULL;
-    for (int i = 0; i < MAX_TCP_FLOWS; ++i) {
-        tcp_flow_t *f = tcp_flows[i];
-        if (!f) continue;
-        if (&f->ctx == flow_ctx) {
-            flow = f;
-            break;
-        }
-    }
+    tcp_flow_t *flow = tcp_flow_from_ctx(flow_ctx);
     if (!flow) return;
+    tcp_timer_sync(flow);
 
     if (bytes_read > flow->rcv_buf_used) bytes_read = flow->rcv_buf_used;
     flow->rcv_buf_used -= bytes_read;
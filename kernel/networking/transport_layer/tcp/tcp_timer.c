@@ -1,236 +1,291 @@
 #include "tcp_internal.h"
 #include "kernel_processes/kprocess_loader.h"
 #include "exceptions/irq.h"
+#include "exceptions/timer.h"
+#include "process/wait_queue.h"
 
 static volatile int tcp_daemon_running = 0;
-//TODO make tcp_daemon_running atomic or use a lock, this may end in a double deamon process
-void tcp_daemon_kick(void) {
-    if(!tcp_has_pending_timers()) return;
 
-    disable_interrupt();
+//Flows whose wheel entry fired, drained by the daemon. Only touched with interrupts off
+static tcp_flow_t *tcp_expired_head;
+static kevent_t tcp_timer_event;
+
+static void tcp_daemon_kick(void) {
+    irq_flags_t irq = irq_save_disable();
     if(tcp_daemon_running){
-        enable_interrupt();
+        irq_restore(irq);
         return;
     }
     tcp_daemon_running = 1;
-    enable_interrupt();
+    irq_restore(irq);
 
     process_t *p = create_kernel_process("tcp_timer", tcp_daemon_entry, 0, 0);
     if(!p){
-        disable_interrupt();
+        irq = irq_save_disable();
         tcp_daemon_running = 0;
-        enable_interrupt();
+        irq_restore(irq);
     }
 }
 
-int tcp_has_pending_timers(void) { //TODO mhh this should be event driven to avoid MAX_TCP_FLOWS*TCP_MAX_TX_SEGS scans.
+//Runs from the timer interrupt, the actual work happens in the daemon
+static void tcp_flow_timer_fired(ktimer_t *timer) {
+    tcp_flow_t *f = (tcp_flow_t *)timer->data;
+    if (!f->timer_expired) {
+        f->timer_expired = 1;
+        f->expired_next = tcp_expired_head;
+        tcp_expired_head = f;
+    }
+    kevent_signal(&tcp_timer_event);
+}
 
+void tcp_timer_init(tcp_flow_t *f) {
+    ktimer_init(&f->timer, tcp_flow_timer_fired, f);
+    f->timer_last_ms = timer_now_msec();
+}
+
+void tcp_timer_stop(tcp_flow_t *f) {
+    irq_flags_t irq = irq_save_disable();
+    ktimer_cancel(&f->timer);
+    if (f->timer_expired) {
+        tcp_flow_t **it = &tcp_expired_head;
+        while (*it && *it != f) it = &(*it)->expired_next;
+        if (*it) *it = f->expired_next;
+        f->expired_next = NULL;
+        f->timer_expired = 0;
+    }
+    irq_restore(irq);
+}
 
-    for (int i = 0; i < MAX_TCP_FLOWS; i++) {
-        tcp_flow_t *f = tcp_flows[i];
-        if (!f) continue;
-        if (f->state == TCP_STATE_CLOSED) continue;
+void tcp_timer_sync(tcp_flow_t *f) {
+    uint64_t now = timer_now_msec();
+    uint64_t delta = now > f->timer_last_ms ? now - f->timer_last_ms : 0;
+    f->timer_last_ms = now;
+    if (!delta) return;
+    uint32_t elapsed_ms = delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+
+    if (f->state == TCP_TIME_WAIT) f->time_wait_ms += elapsed_ms;
+    if (f->state == TCP_FIN_WAIT_2) f->fin_wait2_ms += elapsed_ms;
+    if (f->delayed_ack_pending) f->delayed_ack_timer_ms += elapsed_ms;
+    if (f->keepalive_on && f->state == TCP_ESTABLISHED && f->keepalive_ms) f->keepalive_idle_ms += elapsed_ms;
+    if (f->persist_active) f->persist_timer_ms += elapsed_ms;
+
+    for (int j = 0; j < TCP_MAX_TX_SEGS; j++) {
+        tcp_tx_seg_t *s = &f->txq[j];
+        if (s->used) s->timer_ms += elapsed_ms;
+    }
+}
 
-        if (f->state == TCP_TIME_WAIT) return 1;
-        if (f->state == TCP_FIN_WAIT_2) return 1;
-        if (f->delayed_ack_pending) return 1;
-        if (f->persist_active) return 1;
-        if (f->keepalive_on && f->state == TCP_ESTABLISHED && f->keepalive_ms) return 1;
+static inline void tcp_due_after(uint64_t *due, uint64_t base, uint32_t spent_ms, uint32_t limit_ms) {
+    uint64_t at = base + (spent_ms < limit_ms ? limit_ms - spent_ms : 0);
+    if (at < *due) *due = at;
+}
 
-        for (int j = 0; j < TCP_MAX_TX_SEGS; j++) {
-            tcp_tx_seg_t *s = &f->txq[j];
-            if (!s->used) continue;
-            uint32_t end = s->seq + s->len + (s->syn ? 1u : 0u) + (s->fin ? 1u : 0u);
-            if (end > f->snd_una) return 1;
-        }
+//Earliest deadline across every timer the flow has running, measured from the last sync
+static uint64_t tcp_flow_next_due(tcp_flow_t *f) {
+    uint64_t due = KTIMER_NEVER;
+    uint64_t base = f->timer_last_ms;
+    if (f->state == TCP_STATE_CLOSED) return due;
+
+    if (f->state == TCP_TIME_WAIT) tcp_due_after(&due, base, f->time_wait_ms, TCP_2MSL_MS);
+    if (f->state == TCP_FIN_WAIT_2) tcp_due_after(&due, base, f->fin_wait2_ms, TCP_2MSL_MS);
+    if (f->delayed_ack_pending) tcp_due_after(&due, base, f->delayed_ack_timer_ms, TCP_DELAYED_ACK_MS);
+    if (f->keepalive_on && f->state == TCP_ESTABLISHED && f->keepalive_ms) tcp_due_after(&due, base, f->keepalive_idle_ms, f->keepalive_ms);
+
+    if (f->snd_wnd == 0 && f->snd_nxt > f->snd_una) {
+        if (f->persist_active) tcp_due_after(&due, base, f->persist_timer_ms, f->persist_timeout_ms);
+        else due = base;
+    } else if (f->persist_active) {
+        due = base;
     }
 
-    return 0;
+    for (int j = 0; j < TCP_MAX_TX_SEGS; j++) {
+        tcp_tx_seg_t *s = &f->txq[j];
+        if (s->used) tcp_due_after(&due, base, s->timer_ms, s->timeout_ms);
+    }
+    return due;
 }
 
-void tcp_tick_all(uint32_t elapsed_ms) {
-    for (int i = 0; i < MAX_TCP_FLOWS; i++) {
-        tcp_flow_t *f = tcp_flows[i];
-        if (!f) continue;
-        if (f->state == TCP_STATE_CLOSED) continue;
-
-        if (f->state == TCP_TIME_WAIT) {
-            f->time_wait_ms += elapsed_ms;
-            if (f->time_wait_ms >= TCP_2MSL_MS) {
-                tcp_free_flow(i);
-                continue;
-            }
-        }
+void tcp_timer_rearm(tcp_flow_t *f) {
+    if (!f) return;
+    uint64_t due = tcp_flow_next_due(f);
+    irq_flags_t irq = irq_save_disable();
+    if (due == KTIMER_NEVER) {
+        ktimer_cancel(&f->timer);
+        irq_restore(irq);
+        return;
+    }
+    if (!ktimer_pending(&f->timer) || f->timer.expires != due) ktimer_arm(&f->timer, due);
+    irq_restore(irq);
+    tcp_daemon_kick();
+}
 
-        if (f->state == TCP_FIN_WAIT_2) {
-            f->fin_wait2_ms += elapsed_ms;
-            if (f->fin_wait2_ms >= TCP_2MSL_MS) {
-                tcp_free_flow(i);
-                continue;
-            }
-        }
+static void tcp_flow_service(tcp_flow_t *f) {
+    tcp_timer_sync(f);
+    if (f->state == TCP_STATE_CLOSED) return;
+    int i = (int)f->slot;
 
-        if (f->delayed_ack_pending) {
-            f->delayed_ack_timer_ms += elapsed_ms;
-            if (f->delayed_ack_timer_ms >= TCP_DELAYED_ACK_MS) tcp_send_ack_now(f);
+    if (f->state == TCP_TIME_WAIT && f->time_wait_ms >= TCP_2MSL_MS) {
+        tcp_free_flow(i);
+        return;
+    }
+
+    if (f->state == TCP_FIN_WAIT_2 && f->fin_wait2_ms >= TCP_2MSL_MS) {
+        tcp_free_flow(i);
+        return;
+    }
+
+    if (f->delayed_ack_pending && f->delayed_ack_timer_ms >= TCP_DELAYED_ACK_MS) tcp_send_ack_now(f);
+
+    if (f->keepalive_on && f->state == TCP_ESTABLISHED && f->keepalive_ms && f->keepalive_idle_ms >= f->keepalive_ms) {
+        tcp_hdr_t hdr;
+        hdr.src_port = bswap16(f->local_port);
+        hdr.dst_port = bswap16(f->remote.port);
+        uint32_t seq = f->snd_nxt;
+        if (seq) seq -= 1;
+        hdr.sequence = bswap32(seq);
+        hdr.ack = bswap32(f->ctx.ack);
+        hdr.flags = (uint8_t)(1u << ACK_F);
+        hdr.window = tcp_calc_adv_wnd_field(f, 1);
+        hdr.urgent_ptr = 0;
+
+        if (f->local.ver == IP_VER4) {
+            ipv4_tx_opts_t tx;
+            tcp_build_tx_opts_from_local_v4(f->local.ip, &tx);
+            (void)tcp_send_segment(IP_VER4, f->local.ip, f->remote.ip, &hdr, NULL, 0, NULL, 0, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
+        } else if (f->local.ver == IP_VER6) {
+            ipv6_tx_opts_t tx;
+            tcp_build_tx_opts_from_local_v6(f->local.ip, &tx);
+            (void)tcp_send_segment(IP_VER6, f->local.ip, f->remote.ip, &hdr, NULL, 0, NULL, 0, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
         }
+        f->keepalive_idle_ms = 0;
+    }
 
-        if (f->keepalive_on && f->state == TCP_ESTABLISHED && f->keepalive_ms) {
-            f->keepalive_idle_ms += elapsed_ms;
-            if (f->keepalive_idle_ms >= f->keepalive_ms) {
-                tcp_hdr_t hdr;
-                hdr.src_port = bswap16(f->local_port);
-                hdr.dst_port = bswap16(f->remote.port);
-                uint32_t seq = f->snd_nxt;
-                if (seq) seq -= 1;
-                hdr.sequence = bswap32(seq);
-                hdr.ack = bswap32(f->ctx.ack);
-                hdr.flags = (uint8_t)(1u << ACK_F);
-                hdr.window = tcp_calc_adv_wnd_field(f, 1);
-                hdr.urgent_ptr = 0;
-
-                if (f->local.ver == IP_VER4) {
-                    ipv4_tx_opts_t tx;
-                    tcp_build_tx_opts_from_local_v4(f->local.ip, &tx);
-                    (void)tcp_send_segment(IP_VER4, f->local.ip, f->remote.ip, &hdr, NULL, 0, NULL, 0, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
-                } else if (f->local.ver == IP_VER6) {
-                    ipv6_tx_opts_t tx;
-                    tcp_build_tx_opts_from_local_v6(f->local.ip, &tx);
-                    (void)tcp_send_segment(IP_VER6, f->local.ip, f->remote.ip, &hdr, NULL, 0, NULL, 0, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
+    if (f->snd_wnd == 0 && f->snd_nxt > f->snd_una) {
+        if (!f->persist_active) {
+            f->persist_active = 1;
+            f->persist_timer_ms = 0;
+            f->persist_probe_cnt = 0;
+            f->persist_timeout_ms = TCP_PERSIST_MIN_MS;
+        } else if (f->persist_timer_ms >= f->persist_timeout_ms) {
+            if (f->persist_probe_cnt >= TCP_MAX_PERSIST_PROBES) {
+                if (f->state == TCP_ESTABLISHED) {
+                    f->ctx.flags = (uint8_t)((1u << FIN_F) | (1u << ACK_F));
+                    f->ctx.payload.ptr = 0;
+                    f->ctx.payload.size = 0;
+
+                    tcp_flow_send(&f->ctx);
+                    f->state = TCP_FIN_WAIT_1;
+                    f->ctx.expected_ack = f->snd_nxt;
+                    tcp_timer_rearm(f);
+                } else {
+                    tcp_free_flow(i);
                 }
-                f->keepalive_idle_ms = 0;
+                return;
             }
-        }
+            tcp_tx_seg_t *best = tcp_find_first_unacked(f);
 
-        if (f->snd_wnd == 0 && f->snd_nxt > f->snd_una) {
-            if (!f->persist_active) {
-                f->persist_active = 1;
-                f->persist_timer_ms = 0;
-                f->persist_probe_cnt = 0;
-                f->persist_timeout_ms = TCP_PERSIST_MIN_MS;
-            } else {
-                f->persist_timer_ms += elapsed_ms;
-                if (f->persist_timer_ms >= f->persist_timeout_ms) {
-                    if (f->persist_probe_cnt >= TCP_MAX_PERSIST_PROBES) {
-                        if (f->state == TCP_ESTABLISHED) {
-                            f->ctx.flags = (uint8_t)((1u << FIN_F) | (1u << ACK_F));
-                            f->ctx.payload.ptr = 0;
-                            f->ctx.payload.size = 0;
-
-                            tcp_flow_send(&f->ctx);
-                            f->state = TCP_FIN_WAIT_1;
-                            f->ctx.expected_ack = f->snd_nxt;
-                            tcp_daemon_kick();
-                        } else {
-                            tcp_free_flow(i);
-                        }
-                        continue;
-                    }
-                    tcp_tx_seg_t *best = tcp_find_first_unacked(f);
-
-                    tcp_hdr_t hdr;
-                    hdr.src_port = bswap16(f->local_port);
-                    hdr.dst_port = bswap16(f->remote.port);
-
-                    uint8_t payload[1];
-                    const uint8_t *pp = NULL;
-                    uint16_t pl = 0;
-
-                    uint32_t probe_seq = f->snd_una;
-
-                    if (best && best->buf && best->len && probe_seq >= best->seq && probe_seq < best->seq + best->len) {
-                        payload[0] = *((uint8_t *)best->buf + (probe_seq - best->seq));
-                        pp = payload;
-                        pl = 1;
-                    }
-
-                    hdr.sequence = bswap32(probe_seq);
-                    hdr.ack = bswap32(f->ctx.ack);
-                    hdr.flags = (uint8_t)(1u << ACK_F);
-                    hdr.window = tcp_calc_adv_wnd_field(f, 1);
-                    hdr.urgent_ptr = 0;
-
-                    if (f->local.ver == IP_VER4) {
-                        ipv4_tx_opts_t tx;
-                        tcp_build_tx_opts_from_local_v4(f->local.ip, &tx);
-                        (void)tcp_send_segment(IP_VER4, f->local.ip, f->remote.ip, &hdr, NULL, 0, pp, pl, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
-                    } else if (f->local.ver == IP_VER6) {
-                        ipv6_tx_opts_t tx;
-                        tcp_build_tx_opts_from_local_v6(f->local.ip, &tx);
-                        (void)tcp_send_segment(IP_VER6, f->local.ip, f->remote.ip, &hdr, NULL, 0, pp, pl, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
-                    }
-
-                    if (f->persist_probe_cnt < UINT8_MAX) f->persist_probe_cnt++;
-                    f->persist_timer_ms = 0;
-
-                    if (f->persist_timeout_ms < TCP_PERSIST_MAX_MS) {
-                        uint32_t next = f->persist_timeout_ms << 1;
-                        if (next > TCP_PERSIST_MAX_MS) next = TCP_PERSIST_MAX_MS;
-                        f->persist_timeout_ms = next;
-                    }
-                }
+            tcp_hdr_t hdr;
+            hdr.src_port = bswap16(f->local_port);
+            hdr.dst_port = bswap16(f->remote.port);
+
+            uint8_t payload[1];
+            const uint8_t *pp = NULL;
+            uint16_t pl = 0;
+
+            uint32_t probe_seq = f->snd_una;
+
+            if (best && best->buf && best->len && probe_seq >= best->seq && probe_seq < best->seq + best->len) {
+                payload[0] = *((uint8_t *)best->buf + (probe_seq - best->seq));
+                pp = payload;
+                pl = 1;
             }
-        } else {
-            f->persist_active = 0;
-            f->persist_timer_ms = 0;
-            f->persist_timeout_ms = 0;
-            f->persist_probe_cnt = 0;
-        }
 
-        for (int j = 0; j < TCP_MAX_TX_SEGS; j++) {
-            tcp_tx_seg_t *s = &f->txq[j];
-            if (!s->used) continue;
+            hdr.sequence = bswap32(probe_seq);
+            hdr.ack = bswap32(f->ctx.ack);
+            hdr.flags = (uint8_t)(1u << ACK_F);
+            hdr.window = tcp_calc_adv_wnd_field(f, 1);
+            hdr.urgent_ptr = 0;
+
+            if (f->local.ver == IP_VER4) {
+                ipv4_tx_opts_t tx;
+                tcp_build_tx_opts_from_local_v4(f->local.ip, &tx);
+                (void)tcp_send_segment(IP_VER4, f->local.ip, f->remote.ip, &hdr, NULL, 0, pp, pl, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
+            } else if (f->local.ver == IP_VER6) {
+                ipv6_tx_opts_t tx;
+                tcp_build_tx_opts_from_local_v6(f->local.ip, &tx);
+                (void)tcp_send_segment(IP_VER6, f->local.ip, f->remote.ip, &hdr, NULL, 0, pp, pl, (const ip_tx_opts_t *)&tx, f->ip_ttl, f->ip_dontfrag);
+            }
 
-            s->timer_ms += elapsed_ms;
-            if (s->timer_ms < s->timeout_ms) continue;
+            if (f->persist_probe_cnt < UINT8_MAX) f->persist_probe_cnt++;
+            f->persist_timer_ms = 0;
 
-            if (s->retransmit_cnt >= TCP_MAX_RETRANS) {
-                tcp_free_flow(i);
-                break;
+            if (f->persist_timeout_ms < TCP_PERSIST_MAX_MS) {
+                uint32_t next = f->persist_timeout_ms << 1;
+                if (next > TCP_PERSIST_MAX_MS) next = TCP_PERSIST_MAX_MS;
+                f->persist_timeout_ms = next;
             }
+        }
+    } else {
+        f->persist_active = 0;
+        f->persist_timer_ms = 0;
+        f->persist_timeout_ms = 0;
+        f->persist_probe_cnt = 0;
+    }
+
+    for (int j = 0; j < TCP_MAX_TX_SEGS; j++) {
+        tcp_tx_seg_t *s = &f->txq[j];
+        if (!s->used) continue;
+        if (s->timer_ms < s->timeout_ms) continue;
 
-            tcp_cc_on_timeout(f);
+        if (s->retransmit_cnt >= TCP_MAX_RETRANS) {
+            tcp_free_flow(i);
+            return;
+        }
 
-            tcp_send_from_seg(f, s);
+        tcp_cc_on_timeout(f);
 
-            s->retransmit_cnt++;
-            s->timer_ms = 0;
+        tcp_send_from_seg(f, s);
 
-            if (s->timeout_ms == 0) {
-                uint32_t rto = f->rto ? f->rto : TCP_INIT_RTO;
-                if (rto < TCP_MIN_RTO) rto = TCP_MIN_RTO;
-                s->timeout_ms = rto;
-            } else if (s->timeout_ms < TCP_MAX_RTO) {
-                uint32_t next = s->timeout_ms << 1;
-                if (next > TCP_MAX_RTO) next = TCP_MAX_RTO;
-                s->timeout_ms = next;
-            }
+        s->retransmit_cnt++;
+        s->timer_ms = 0;
+
+        if (s->timeout_ms == 0) {
+            uint32_t rto = f->rto ? f->rto : TCP_INIT_RTO;
+            if (rto < TCP_MIN_RTO) rto = TCP_MIN_RTO;
+            s->timeout_ms = rto;
+        } else if (s->timeout_ms < TCP_MAX_RTO) {
+            uint32_t next = s->timeout_ms << 1;
+            if (next > TCP_MAX_RTO) next = TCP_MAX_RTO;
+            s->timeout_ms = next;
         }
     }
+
+    tcp_timer_rearm(f);
 }
 
+void tcp_run_timers(void) {
+    while (1) {
+        irq_flags_t irq = irq_save_disable();
+        tcp_flow_t *f = tcp_expired_head;
+        if (f) {
+            tcp_expired_head = f->expired_next;
+            f->expired_next = NULL;
+            f->timer_expired = 0;
+        }
+        irq_restore(irq);
+        if (!f) return;
+        tcp_flow_service(f);
+    }
+}
 
+//Sleeps until a flow's wheel entry fires, there is no periodic tick
 int tcp_daemon_entry(int argc, char *argv[]) {
     (void)argc;
     (void)argv;
 
-    const uint32_t tick_ms = 25;
-    const uint32_t grace_ms = 10000;
-    uint32_t idle_ms = 0;
-
     while (1) {
-        if (tcp_has_pending_timers()) {
-            tcp_tick_all(tick_ms);
-            idle_ms = 0;
-        } else {
-            idle_ms += tick_ms;
-            if(idle_ms >= grace_ms) break;
-        }
-        msleep(tick_ms);
+        kevent_wait(&tcp_timer_event, KEVENT_WAIT_FOREVER);
+        tcp_run_timers();
     }
-
-    disable_interrupt();
-    tcp_daemon_running = 0;
-    enable_interrupt();
     return 0;
 }
@@ -1,4 +1,6 @@
 #include "tcp_internal.h"
+#include "networking/network.h"
+#include "networking/interface_manager.h"
 
 uint16_t tcp_calc_adv_wnd_field(tcp_flow_t *flow, uint8_t apply_scale) {
     if (!flow) return 0;
@@ -42,7 +44,21 @@ static void tcp_persist_arm(tcp_flow_t *flow) {
     if (flow->persist_timeout_ms == 0) flow->persist_timeout_ms = TCP_PERSIST_MIN_MS;
     if (flow->persist_timeout_ms < TCP_PERSIST_MIN_MS) flow->persist_timeout_ms = TCP_PERSIST_MIN_MS;
     if (flow->persist_timeout_ms > TCP_PERSIST_MAX_MS) flow->persist_timeout_ms = TCP_PERSIST_MAX_MS;
-    tcp_daemon_kick();
+    tcp_timer_rearm(flow);
+}
+
+//With TSO the NIC cuts the segment into mss sized frames, so whole multiples of the mss go down as one
+static uint32_t tcp_flow_seg_max(tcp_flow_t *flow){
+    uint32_t mss = flow->mss ? flow->mss : TCP_DEFAULT_MSS;
+    uint32_t need = flow->local.ver == IP_VER4 ? NET_OFFLOAD_TSO4 : NET_OFFLOAD_TSO6;
+    if (!(network_get_offloads(l3_ifindex_from_id(flow->l3_id)) & need)) return flow->mss ? flow->mss : 0xFFFFFFFFu;
+    uint32_t max = (TCP_TSO_MAX_PAYLOAD / mss) * mss;
+    return max > mss ? max : mss;
+}
+
+static void tcp_seg_buf_free(void *ctx, uintptr_t base, uint32_t alloc_size){
+    (void)ctx;
+    free_sized((void *)base, alloc_size);
 }
 
 tcp_tx_seg_t *tcp_alloc_tx_seg(tcp_flow_t *flow){
@@ -57,9 +73,11 @@ tcp_tx_seg_t *tcp_alloc_tx_seg(tcp_flow_t *flow){
             s->seq = 0;
             s->len = 0;
             s->buf = 0;
+            s->pkt = 0;
+            s->csum = 0;
             s->timer_ms = 0;
             s->timeout_ms = flow->rto ? flow->rto : TCP_INIT_RTO;
-            tcp_daemon_kick();
+            tcp_timer_rearm(flow);
             return s;
         }
     }
@@ -84,17 +102,25 @@ void tcp_send_from_seg(tcp_flow_t *flow, tcp_tx_seg_t *seg){
     hdr.window = tcp_calc_adv_wnd_field(flow, seg->syn ? 0 : 1);
     hdr.urgent_ptr = 0;
 
+    netpkt_t *payload = seg->pkt && seg->len ? netpkt_view(seg->pkt, 0, (uint32_t)seg->len) : 0;
+    //Without checksum offload the sum from the copy-in finishes it, with it the NIC is cheaper still
+    const uint32_t *payload_sum = network_get_offloads(l3_ifindex_from_id(flow->l3_id)) & NET_OFFLOAD_TX_CSUM ? 0 : &seg->csum;
+
     if (flow->local.ver == IP_VER4) {
         ipv4_tx_opts_t tx;
         tcp_build_tx_opts_from_local_v4(flow->local.ip, &tx);
-        (void)tcp_send_segment(IP_VER4, flow->local.ip, flow->remote.ip, &hdr, NULL, 0, seg->buf ? (const uint8_t *)seg->buf : NULL, seg->len, (const ip_tx_opts_t *)&tx, flow->ip_ttl, flow->ip_dontfrag);
+        if (payload) (void)tcp_send_segment_pkt(IP_VER4, flow->local.ip, flow->remote.ip, &hdr, payload, payload_sum, (uint16_t)flow->mss, (const ip_tx_opts_t *)&tx, flow->ip_ttl, flow->ip_dontfrag);
+        else (void)tcp_send_segment(IP_VER4, flow->local.ip, flow->remote.ip, &hdr, NULL, 0, seg->buf ? (const uint8_t *)seg->buf : NULL, seg->len, (const ip_tx_opts_t *)&tx, flow->ip_ttl, flow->ip_dontfrag);
     } else if (flow->local.ver == IP_VER6) {
         ipv6_tx_opts_t tx;
         tcp_build_tx_opts_from_local_v6(flow->local.ip, &tx);
-        (void)tcp_send_segment(IP_VER6, flow->local.ip, flow->remote.ip, &hdr, NULL, 0, seg->buf ? (const uint8_t *)seg->buf : NULL, seg->len, (const ip_tx_opts_t *)&tx, flow->ip_ttl, flow->ip_dontfrag);
+        if (payload) (void)tcp_send_segment_pkt(IP_VER6, flow->local.ip, flow->remote.ip, &hdr, payload, payload_sum, (uint16_t)flow->mss, (const ip_tx_opts_t *)&tx, flow->ip_ttl, flow->ip_dontfrag);
+        else (void)tcp_send_segment(IP_VER6, flow->local.ip, flow->remote.ip, &hdr, NULL, 0, seg->buf ? (const uint8_t *)seg->buf : NULL, seg->len, (const ip_tx_opts_t *)&tx, flow->ip_ttl, flow->ip_dontfrag);
+    } else if (payload) {
+        netpkt_unref(payload);
     }
 
-    tcp_daemon_kick();
+    tcp_timer_rearm(flow);
 }
 
 void tcp_send_ack_now(tcp_flow_t *flow){
@@ -173,21 +199,15 @@ void tcp_send_ack_now(tcp_flow_t *flow){
 
     flow->delayed_ack_pending = 0;
     flow->delayed_ack_timer_ms = 0;
-    tcp_daemon_kick();
+    tcp_timer_rearm(flow);
 }
 
 tcp_result_t tcp_flow_send(tcp_data *flow_ctx){
     if (!flow_ctx) return TCP_INVALID;
 
-    tcp_flow_t *flow = NULL;
-    for (int i = 0; i < MAX_TCP_FLOWS; i++) {
-        if (!tcp_flows[i]) continue;
-        if (&tcp_flows[i]->ctx == flow_ctx) {
-            flow = tcp_flows[i];
-            break;
-        }
-    }
+    tcp_flow_t *flow = tcp_flow_from_ctx(flow_ctx);
     if (!flow) return TCP_INVALID;
+    tcp_timer_sync(flow);
 
     uint8_t flags = flow_ctx->flags;
     uint8_t *payload_ptr = (uint8_t *)flow_ctx->payload.ptr;
@@ -214,27 +234,36 @@ tcp_result_t tcp_flow_send(tcp_data *flow_ctx){
     uint64_t can_send = eff_wnd - in_flight;
     if (can_send == 0 && !(flags & (1u << FIN_F))) return TCP_WOULDBLOCK;
 
+    uint32_t seg_max = tcp_flow_seg_max(flow);
     uint64_t remaining = payload_len;
     uint64_t sent_bytes = 0;
     int first_segment = 1;
 
     while (remaining > 0 && can_send > 0) {
         uint64_t seg_len = (uint64_t)(remaining > can_send ? can_send : remaining);
-        if (flow->mss && seg_len > flow->mss) seg_len = (uint64_t)flow->mss;
+        if (seg_len > seg_max) seg_len = (uint64_t)seg_max;
 
         tcp_tx_seg_t *seg = tcp_alloc_tx_seg(flow);
         if (!seg) break;
 
         uintptr_t buf = 0;
+        netpkt_t *data = 0;
         if (seg_len) {
             buf = (uintptr_t)malloc(seg_len);
             if (!buf) { seg->used = 0; break; }
-            memcpy((void *)buf, payload_ptr + sent_bytes, seg_len);
+            data = netpkt_wrap(buf, (uint32_t)seg_len, 0, (uint32_t)seg_len, tcp_seg_buf_free, 0);
+            if (!data) {
+                free_sized((void *)buf, seg_len);
+                seg->used = 0;
+                break;
+            }
+            seg->csum = net_csum_copy((void *)buf, payload_ptr + sent_bytes, (uint32_t)seg_len, 0);
         }
 
         seg->seq = flow->snd_nxt;
         seg->len = seg_len;
         seg->buf = buf;
+        seg->pkt = data;
         seg->syn = 0;
         seg->fin = 0;
         seg->timer_ms = 0;
@@ -259,6 +288,7 @@ tcp_result_t tcp_flow_send(tcp_data *flow_ctx){
         seg->seq = flow->snd_nxt;
         seg->len = 0;
         seg->buf = 0;
+        seg->pkt = 0;
         seg->syn = 0;
         seg->fin = 1;
         seg->timer_ms = 0;
@@ -275,7 +305,7 @@ tcp_result_t tcp_flow_send(tcp_data *flow_ctx){
     flow_ctx->sequence = flow->snd_nxt;
     flow->ctx.sequence = flow->snd_nxt;
 
-    tcp_daemon_kick();
+    tcp_timer_rearm(flow);
 
     flow_ctx->payload.size = sent_bytes;
     return sent_bytes || (flags & (1u << FIN_F)) ? TCP_OK : TCP_WOULDBLOCK;
@@ -284,15 +314,9 @@ tcp_result_t tcp_flow_send(tcp_data *flow_ctx){
 tcp_result_t tcp_flow_close(tcp_data *flow_ctx){
     if (!flow_ctx) return TCP_INVALID;
 
-    tcp_flow_t *flow = NULL;
-    for (int i = 0; i < MAX_TCP_FLOWS; i++) {
-        if (!tcp_flows[i]) continue;
-        if (&tcp_flows[i]->ctx == flow_ctx) {
-            flow = tcp_flows[i];
-            break;
-        }
-    }
+    tcp_flow_t *flow = tcp_flow_from_ctx(flow_ctx);
     if (!flow) return TCP_INVALID;
+    tcp_timer_sync(flow);
 
     if (flow->state == TCP_ESTABLISHED || flow->state == TCP_CLOSE_WAIT) {
         flow_ctx->sequence = flow->snd_nxt;
@@ -307,9 +331,38 @@ tcp_result_t tcp_flow_close(tcp_data *flow_ctx){
             if (flow->state == TCP_ESTABLISHED) flow->state = TCP_FIN_WAIT_1;
             else flow->state = TCP_LAST_ACK;
         }
-        tcp_daemon_kick();
+        tcp_timer_rearm(flow);
         return res;
     }
 
     return TCP_INVALID;
-}
\ No newline at end of file
+}
+
+bool tcp_flow_can_send(tcp_data *flow_ctx){
+    tcp_flow_t *flow = tcp_flow_from_ctx(flow_ctx);
+    if (!flow || flow->state != TCP_ESTABLISHED || !flow->snd_wnd) return false;
+
+    uint32_t cwnd = flow->cwnd ? flow->cwnd : (flow->mss ? flow->mss : TCP_DEFAULT_MSS);
+    uint32_t eff_wnd = flow->snd_wnd < cwnd ? flow->snd_wnd : cwnd;
+    if (eff_wnd == 0) eff_wnd = 1;
+    if ((uint64_t)(flow->snd_nxt - flow->snd_una) >= eff_wnd) return false;
+
+    for (int i = 0; i < TCP_MAX_TX_SEGS; i++)
+        if (!flow->txq[i].used) return true;
+    return false;
+}
+
+bool tcp_flow_rx_closed(tcp_data *flow_ctx){
+    tcp_flow_t *flow = tcp_flow_from_ctx(flow_ctx);
+    if (!flow) return true;
+    switch (flow->state) {
+        case TCP_SYN_SENT:
+        case TCP_SYN_RECEIVED:
+        case TCP_ESTABLISHED:
+        case TCP_FIN_WAIT_1:
+        case TCP_FIN_WAIT_2:
+            return false;
+        default:
+            return true;
+    }
+}
@@ -1,5 +1,5 @@
 #include "udp.h"
-#include "net/checksums.h"
+#include "networking/net_checksum.h"
 #include "networking/internet_layer/ipv4.h"
 #include "networking/internet_layer/ipv6.h"
 #include "networking/port_manager.h"
@@ -27,10 +27,10 @@ size_t create_udp_segment(uintptr_t buf, const net_l4_endpoint *src, const net_l
     if (src->ver == IP_VER4) {
         uint32_t s = v4_u32_from_arr(src->ip);
         uint32_t d = v4_u32_from_arr(dst->ip);
-        uint16_t csum = checksum16_pipv4(s, d, 0x11, (const uint8_t *)udp, full_len);
+        uint16_t csum = net_csum_finish(net_csum_partial(udp, full_len, net_csum_pseudo_ipv4(s, d, 0x11, full_len)));
         udp->checksum = bswap16(csum);
     } else if (src->ver == IP_VER6) {
-        uint16_t csum = checksum16_pipv6(src->ip, dst->ip, 17, (const uint8_t *)udp, full_len);
+        uint16_t csum = net_csum_finish(net_csum_partial(udp, full_len, net_csum_pseudo_ipv6(src->ip, dst->ip, 17, full_len)));
         udp->checksum = bswap16(csum);
     }
 
@@ -77,26 +77,47 @@ sizedptr udp_strip_header(uintptr_t ptr, uint32_t len) {
     };
 }
 
-void udp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint8_t l3_id, uintptr_t ptr, uint32_t len) {
+static netpkt_t* udp_payload_pkt(netpkt_t *pkt, sizedptr pl) {
+    if (pkt) {
+        uintptr_t base = netpkt_data(pkt);
+        if (pl.ptr >= base && pl.ptr + pl.size <= base + netpkt_len(pkt)) {
+            netpkt_t *view = netpkt_view(pkt, (uint32_t)(pl.ptr - base), (uint32_t)pl.size);
+            if (view) return view;
+        }
+    }
+
+    netpkt_t *copy = netpkt_alloc((uint32_t)pl.size, 0, 0);
+    if (!copy) return NULL;
+    void *dst = netpkt_put(copy, (uint32_t)pl.size);
+    if (!dst && pl.size) {
+        netpkt_unref(copy);
+        return NULL;
+    }
+    if (pl.size) memcpy(dst, (const void *)pl.ptr, pl.size);
+    return copy;
+}
+
+void udp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_addr, uint8_t l3_id, uintptr_t ptr, uint32_t len, netpkt_t *pkt) {
     sizedptr pl = udp_strip_header(ptr, len);
     if (!pl.ptr) return;
 
     udp_hdr_t *hdr = (udp_hdr_t *)ptr;
 
-    if (hdr->checksum) {
+    if (hdr->checksum && !netpkt_csum_valid(pkt)) {
         if (ipver == IP_VER4) {
             uint16_t recv = hdr->checksum;
             hdr->checksum = 0;
-            uint16_t calc = checksum16_pipv4(
-                *(const uint32_t *)src_ip_addr, *(const uint32_t *)dst_ip_addr, 0x11,
-                (const uint8_t *)hdr, (uint16_t)(pl.size + sizeof(*hdr))
-            );
+            uint32_t udp_len = (uint32_t)(pl.size + sizeof(*hdr));
+            uint32_t pseudo = net_csum_pseudo_ipv4(*(const uint32_t *)src_ip_addr, *(const uint32_t *)dst_ip_addr, 0x11, udp_len);
+            uint16_t calc = net_csum_finish(net_csum_partial(hdr, udp_len, pseudo));
             hdr->checksum = recv;
             if (calc != bswap16(recv)) return;
         } else if (ipver == IP_VER6) {
             uint16_t recv = hdr->checksum;
             hdr->checksum = 0;
-            uint16_t calc = checksum16_pipv6( (const uint8_t*)src_ip_addr, (const uint8_t*)dst_ip_addr, 0x11, (const uint8_t*)hdr, (uint32_t)(pl.size + sizeof(*hdr)));
+            uint32_t udp_len = (uint32_t)(pl.size + sizeof(*hdr));
+            uint32_t pseudo = net_csum_pseudo_ipv6((const uint8_t*)src_ip_addr, (const uint8_t*)dst_ip_addr, 0x11, udp_len);
+            uint16_t calc = net_csum_finish(net_csum_partial(hdr, udp_len, pseudo));
             hdr->checksum = recv;
             if (calc != bswap16(recv)) return;
         }
@@ -121,15 +142,14 @@ void udp_input(ip_version_t ipver, const void *src_ip_addr, const void *dst_ip_a
 
     port_recv_handler_t handler = port_get_handler(pm, PROTO_UDP, dst_port);
     if (handler) {
-        uintptr_t copy = (uintptr_t)malloc(pl.size);
-        if (!copy) return;
-        memcpy((void*)copy, (const void*)pl.ptr, pl.size);
+        netpkt_t *dgram = udp_payload_pkt(pkt, pl);
+        if (!dgram) return;
 
         uint8_t ifx = 0;
         if (v4 && v4->l2) ifx = v4->l2->ifindex;
         else if (v6 && v6->l2) ifx = v6->l2->ifindex;
 
-        handler(ifx, ipver, src_ip_addr, dst_ip_addr, copy, pl.size, src_port, dst_port);
+        handler(ifx, ipver, src_ip_addr, dst_ip_addr, (uintptr_t)dgram, pl.size, src_port, dst_port);
     }
 }
 
@@ -22,12 +22,15 @@ size_t create_udp_segment(uintptr_t buf,
 
 void udp_send_segment(const net_l4_endpoint *src, const net_l4_endpoint *dst, sizedptr payload, const ip_tx_opts_t* tx_opts, uint8_t ttl, uint8_t dontfrag);
 
+//pkt is the packet ptr points into, if any. The datagram payload reaches the port handler as a netpkt_t* in frame_ptr,
+//a view of pkt when possible or a copy otherwise, and the handler owns that reference
 void udp_input(ip_version_t ipver,
                const void *src_ip_addr,
                const void *dst_ip_addr,
                uint8_t l3_id,
                uintptr_t ptr,
-               uint32_t len);
+               uint32_t len,
+               netpkt_t *pkt);
 
 bool udp_bind_l3(uint8_t l3_id, uint16_t port, uint16_t pid, port_recv_handler_t handler);
 bool udp_unbind_l3(uint8_t l3_id, uint16_t port, uint16_t pid);
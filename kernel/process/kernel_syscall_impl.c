@@ -8,6 +8,7 @@
 #include "graph/tres.h"
 #include "exceptions/timer.h"
 #include "networking/transport_layer/csocket.h"
+#include "syscalls/syscalls.h"
 #include "net/socket_types.h"
 #include "net/network_types.h"
 #include "filesystem/filesystem.h"
@@ -89,6 +90,25 @@ uint64_t get_time(){
     return timer_now_msec();
 }
 
+//Kernel processes have a stack to come back to, so they sleep right here on the handle's timeouts
+//where the syscalls restart. deadline starts at 0 and is fixed by the first call
+static bool socket_kernel_block(SocketHandle *handle, uint32_t want, uint64_t *deadline){
+    process_t *proc = get_current_proc();
+    uint32_t timeout = socket_wait_prepare(handle, want, get_current_proc_pid(), proc);
+    if (!timeout) return false;
+    uint64_t now = timer_now_msec();
+    if (!*deadline) *deadline = timeout == SOCK_WAIT_FOREVER ? UINT64_MAX : now + timeout;
+    if (now >= *deadline) {
+        wait_queue_remove((wait_queue_t*)proc->wait_queue, proc);
+        return false;
+    }
+    uint64_t slice = *deadline - now;
+    if (slice > SOCK_MAX_SLICE_MS) slice = SOCK_MAX_SLICE_MS;
+    msleep(slice);
+    if (proc->wait_queue) wait_queue_remove((wait_queue_t*)proc->wait_queue, proc);
+    return true;
+}
+
 bool socket_create(Socket_Role role, protocol_t protocol, const SocketExtraOptions* extra, SocketHandle *out_handle){
     return create_socket(role, protocol, extra, get_current_proc_pid(), out_handle);
 }
@@ -106,16 +126,26 @@ int32_t socket_listen(SocketHandle *handle){
 }
 
 bool socket_accept(SocketHandle *spec){
-    accept_on_socket(spec, get_current_proc_pid());
-    return 1;
+    uint64_t deadline = 0;
+    bool accepted;
+    while (!(accepted = accept_on_socket(spec, get_current_proc_pid())) && socket_kernel_block(spec, POLL_IN, &deadline));
+    return accepted;
 }
 
 size_t socket_send(SocketHandle *handle, SockDstKind dst_kind, const void* dst, uint16_t port, void *packet, size_t size){
-    return send_on_socket(handle, dst_kind, dst, port, packet, size, get_current_proc_pid());
+    uint64_t deadline = 0;
+    for (;;) {
+        int64_t r = send_on_socket(handle, dst_kind, dst, port, packet, size, get_current_proc_pid());
+        if (r != TCP_WOULDBLOCK || !socket_kernel_block(handle, POLL_OUT, &deadline)) return r;
+    }
 }
 
 bool socket_receive(SocketHandle *handle, void *packet, size_t size, net_l4_endpoint* out_src){
-    return receive_from_socket(handle, packet, size, out_src, get_current_proc_pid());
+    uint64_t deadline = 0;
+    for (;;) {
+        int64_t r = receive_from_socket(handle, packet, size, out_src, get_current_proc_pid());
+        if ((r && r != TCP_WOULDBLOCK) || !socket_kernel_block(handle, POLL_IN, &deadline)) return r;
+    }
 }
 
 int32_t socket_close(SocketHandle *handle){
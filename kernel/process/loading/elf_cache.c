@@ -0,0 +1,232 @@
+#include "elf_cache.h"
+#include "memory/page_allocator.h"
+#include "memory/zero_pool.h"
+#include "memory/addr.h"
+#include "exceptions/irq.h"
+#include "std/memory.h"
+#include "std/string.h"
+#include "alloc/allocate.h"
+#include "filesystem/filesystem.h"
+#include "console/kio.h"
+
+static elf_image *images;
+static uint32_t image_count;
+static uint32_t image_clock;
+
+//FNV-1a over whole words, only has to tell rebuilt binaries apart
+uint64_t elf_image_hash(uint64_t seed, const void *data, size_t size){
+    uint64_t h = (seed ? seed : 0xCBF29CE484222325ULL) ^ size;
+    const uint8_t *p = (const uint8_t*)data;
+    size_t words = size / sizeof(uint64_t);
+    for (size_t i = 0; i < words; i++) {
+        uint64_t w;
+        memcpy(&w, p + (i * sizeof(uint64_t)), sizeof(w));
+        h = (h ^ w) * 0x100000001B3ULL;
+    }
+    for (size_t i = words * sizeof(uint64_t); i < size; i++) h = (h ^ p[i]) * 0x100000001B3ULL;
+    return h;
+}
+
+size_t elf_backing_read(elf_backing *backing, uint64_t offset, void *buf, size_t size){
+    if (!backing || !backing->mod || !backing->mod->read) return 0;
+    //Own copy of the descriptor so concurrent faults don't fight over the cursor
+    file gfd = backing->fd;
+    gfd.cursor = offset;
+    size_t total = 0;
+    while (total < size) {
+        size_t got = backing->mod->read(&gfd, (char*)buf + total, size - total, offset + total);
+        if (!got) break;
+        total += got;
+        gfd.cursor = offset + total;
+    }
+    return total;
+}
+
+void elf_backing_close(elf_backing *backing){
+    if (!backing || !backing->mod) return;
+    close_file_global(&backing->fd, backing->mod);
+    backing->mod = 0;
+}
+
+static void elf_image_free(elf_image *image){
+    for (uint32_t i = 0; i < image->page_count; i++)
+        if (image->pages[i]) pfree((void*)dmap_pa_to_kva(image->pages[i]), PAGE_SIZE);
+    release(image->pages);
+    elf_backing_close(&image->backing);
+    release(image);
+}
+
+//Callers hold the lock. images holds every live image, image_count only the cached ones
+static void elf_image_unlink(elf_image *image){
+    elf_image **it = &images;
+    while (*it && *it != image) it = &(*it)->next;
+    if (*it) *it = image->next;
+    image->next = 0;
+}
+
+static void elf_cache_retire(elf_image *image){
+    if (!image->cached) return;
+    image->cached = false;
+    image_count--;
+}
+
+elf_image* elf_cache_get(const elf_image_key *key, uaddr_t min_map, size_t size){
+    if (!key || !key->path) return 0;
+    size_t len = strlen(key->path) + 1;
+    if (len > ELF_CACHE_PATH_MAX) return 0;
+    elf_image *found = 0;
+    elf_image *stale = 0;
+    irq_flags_t irq = irq_save_disable();
+    for (elf_image *image = images; image; image = image->next) {
+        if (!image->cached || memcmp(image->path, key->path, len) != 0) continue;
+        if (image->file_size == key->size && image->hash == key->hash && image->min_map == min_map && image->size == size) {
+            found = image;
+            found->refs++;
+            found->last_use = image_clock++;
+        } else {
+            //The file changed since, whoever still maps the old image keeps it until they exit
+            stale = image;
+            elf_cache_retire(stale);
+            if (stale->refs) stale = 0;
+            else elf_image_unlink(stale);
+        }
+        break;
+    }
+    irq_restore(irq);
+    if (stale) elf_image_free(stale);
+    return found;
+}
+
+elf_image* elf_image_create(const elf_image_key *key, elf_backing *backing, uaddr_t min_map, size_t size, const elf_image_seg *segs, uint8_t seg_count){
+    if (!key || !key->path || !backing || !backing->mod || seg_count > ELF_IMAGE_MAX_SEGS) return 0;
+    size_t len = strlen(key->path) + 1;
+    if (len > ELF_CACHE_PATH_MAX) return 0;
+    elf_image *image = (elf_image*)zalloc(sizeof(elf_image));
+    if (!image) return 0;
+    image->page_count = size / PAGE_SIZE;
+    image->pages = (paddr_t*)zalloc((image->page_count ? image->page_count : 1) * sizeof(paddr_t));
+    if (!image->pages) {
+        release(image);
+        return 0;
+    }
+    image->min_map = min_map;
+    image->size = size;
+    image->seg_count = seg_count;
+    memcpy(image->segs, segs, seg_count * sizeof(elf_image_seg));
+    image->backing = *backing;
+    backing->mod = 0;
+    image->refs = 1;
+    memcpy(image->path, key->path, len);
+    image->file_size = key->size;
+    image->hash = key->hash;
+    image->file_key = key->file_key;
+
+    elf_image *evict = 0;
+    irq_flags_t irq = irq_save_disable();
+    image->last_use = image_clock++;
+    image->next = images;
+    image->cached = true;
+    images = image;
+    image_count++;
+    if (image_count > ELF_CACHE_MAX) {
+        for (elf_image *it = images; it; it = it->next)
+            if (it->cached && !it->refs && (!evict || it->last_use < evict->last_use)) evict = it;
+        if (evict) {
+            elf_cache_retire(evict);
+            elf_image_unlink(evict);
+        }
+    }
+    irq_restore(irq);
+    if (evict) elf_image_free(evict);
+    return image;
+}
+
+void elf_cache_put(elf_image *image){
+    if (!image) return;
+    bool free = false;
+    irq_flags_t irq = irq_save_disable();
+    if (image->refs) image->refs--;
+    if (!image->refs && (!image->cached || image_count > ELF_CACHE_MAX)) {
+        elf_cache_retire(image);
+        elf_image_unlink(image);
+        free = true;
+    }
+    irq_restore(irq);
+    if (free) elf_image_free(image);
+}
+
+bool elf_cache_write_allowed(system_module *mod, uint64_t file_key){
+    if (!mod || !file_key) return true;
+    elf_image *dropped = 0;
+    bool allowed = true;
+    irq_flags_t irq = irq_save_disable();
+    for (elf_image *image = images; image; image = image->next)
+        if (image->backing.mod == mod && image->file_key == file_key && image->refs) allowed = false;
+    if (allowed) {
+        elf_image **it = &images;
+        while (*it) {
+            elf_image *image = *it;
+            if (image->backing.mod != mod || image->file_key != file_key) {
+                it = &image->next;
+                continue;
+            }
+            elf_cache_retire(image);
+            *it = image->next;
+            image->next = dropped;
+            dropped = image;
+        }
+    }
+    irq_restore(irq);
+    while (dropped) {
+        elf_image *next = dropped->next;
+        elf_image_free(dropped);
+        dropped = next;
+    }
+    if (!allowed) kprintf("[ELF] Refusing to modify a file that is being executed");
+    return allowed;
+}
+
+paddr_t elf_image_peek(elf_image *image, uaddr_t va){
+    if (!image || va < image->min_map) return 0;
+    uint64_t idx = (va - image->min_map) / PAGE_SIZE;
+    if (idx >= image->page_count) return 0;
+    irq_flags_t irq = irq_save_disable();
+    paddr_t pa = image->pages[idx];
+    irq_restore(irq);
+    return pa;
+}
+
+paddr_t elf_image_page(elf_image *image, uaddr_t va){
+    if (!image || va < image->min_map) return 0;
+    uint64_t idx = (va - image->min_map) / PAGE_SIZE;
+    if (idx >= image->page_count) return 0;
+    paddr_t pa = elf_image_peek(image, va);
+    if (pa) return pa;
+
+    paddr_t fresh = zero_pool_alloc_page();
+    if (!fresh) return 0;
+    uaddr_t page = image->min_map + (idx * PAGE_SIZE);
+    uint8_t *kva = (uint8_t*)dmap_pa_to_kva(fresh);
+    for (uint8_t i = 0; i < image->seg_count; i++) {
+        elf_image_seg *s = &image->segs[i];
+        uaddr_t lo = s->vaddr > page ? s->vaddr : page;
+        uaddr_t hi = s->vaddr + s->filesz < page + PAGE_SIZE ? s->vaddr + s->filesz : page + PAGE_SIZE;
+        if (lo >= hi) continue;
+        if (elf_backing_read(&image->backing, s->offset + (lo - s->vaddr), kva + (lo - page), hi - lo) != hi - lo) {
+            pfree(kva, PAGE_SIZE);
+            return 0;
+        }
+    }
+
+    //Another process may have read the same page in meanwhile, theirs wins
+    irq_flags_t irq = irq_save_disable();
+    pa = image->pages[idx];
+    if (!pa) image->pages[idx] = pa = fresh;
+    irq_restore(irq);
+    if (pa != fresh) pfree(kva, PAGE_SIZE);
+    return pa;
+}
+
+bool elf_image_owns(elf_image *image, uaddr_t va, paddr_t pa){
+    return pa && elf_image_peek(image, va) == pa;
+}
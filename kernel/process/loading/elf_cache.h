@@ -0,0 +1,79 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+#include "files/system_module.h"
+
+//Images kept around for relaunching once nothing maps them anymore
+#define ELF_CACHE_MAX 8
+#define ELF_CACHE_PATH_MAX 128
+#define ELF_IMAGE_MAX_SEGS 16
+
+//hash covers the first page only, rewrites of the file are caught by elf_cache_write_allowed instead.
+//file_key is fs_file_key of the path, which writes through the filesystem are checked against
+typedef struct {
+    const char *path;
+    uint64_t size;
+    uint64_t hash;
+    uint64_t file_key;
+} elf_image_key;
+
+//Module level handle, unlike process descriptors it can be read from whichever process faults
+typedef struct {
+    system_module *mod;
+    file fd;
+} elf_backing;
+
+//File contents of one PT_LOAD, the rest of its memory size reads as zero
+typedef struct {
+    uaddr_t vaddr;
+    uint64_t offset;
+    uint64_t filesz;
+} elf_image_seg;
+
+//Loaded segments laid out from min_map as the process sees them. Pages are read from the file the first time
+//any process touches them and never written afterwards, writable segments get private copies on write
+typedef struct elf_image {
+    struct elf_image *next;
+    char path[ELF_CACHE_PATH_MAX];
+    uint64_t file_size;
+    uint64_t hash;
+    uint64_t file_key;
+    uaddr_t min_map;
+    size_t size;
+    paddr_t *pages;
+    uint32_t page_count;
+    elf_image_seg segs[ELF_IMAGE_MAX_SEGS];
+    uint8_t seg_count;
+    elf_backing backing;
+    uint32_t refs;
+    uint32_t last_use;
+    //Cleared once a newer build of the file replaces it, it's then only kept for whoever still maps it
+    bool cached;
+} elf_image;
+
+uint64_t elf_image_hash(uint64_t seed, const void *data, size_t size);
+size_t elf_backing_read(elf_backing *backing, uint64_t offset, void *buf, size_t size);
+void elf_backing_close(elf_backing *backing);
+
+//Referenced image built from the same file at the same addresses, 0 if there isn't one
+elf_image* elf_cache_get(const elf_image_key *key, uaddr_t min_map, size_t size);
+//Referenced and cached, the key needs a path that fits. Takes over the backing, which is left cleared
+elf_image* elf_image_create(const elf_image_key *key, elf_backing *backing, uaddr_t min_map, size_t size, const elf_image_seg *segs, uint8_t seg_count);
+void elf_cache_put(elf_image *image);
+//Called before the filesystem writes to or truncates a file. Refused while a live image still reads pages from it,
+//otherwise cached images of it are dropped so the next launch reads the new contents
+bool elf_cache_write_allowed(system_module *mod, uint64_t file_key);
+
+//Page holding va, read in from the file if this is its first use. 0 if it couldn't be read
+paddr_t elf_image_page(elf_image *image, uaddr_t va);
+//Page holding va only if it was already read in
+paddr_t elf_image_peek(elf_image *image, uaddr_t va);
+bool elf_image_owns(elf_image *image, uaddr_t va, paddr_t pa);
+
+#ifdef __cplusplus
+}
+#endif
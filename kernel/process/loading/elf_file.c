@@ -60,61 +60,90 @@ typedef struct elf_section_header
   uint64_t	sh_entsize;		/* Entry size if section holds table */
 } elf_section_header;
 
-void get_elf_debug_info(process_t* proc, void* file, size_t filesize){
-    if (!proc) return;
-    if (!file) return;
-    if (filesize < sizeof(elf_header)) return;
-
-     elf_header *header = (elf_header*)file;
+//Where the ELF is read from, a copy already in memory or the file itself
+typedef struct {
+    void *file;
+    elf_backing *backing;
+    size_t size;
+} elf_source;
+
+static bool elf_read(const elf_source *src, uint64_t offset, void *buf, size_t size){
+    if (offset > src->size || size > src->size - offset) return false;
+    if (src->backing) return elf_backing_read(src->backing, offset, buf, size) == size;
+    memcpy(buf, (uint8_t*)src->file + offset, size);
+    return true;
+}
 
-    if (memcmp(header->magic, "\x7f" "ELF", 4) != 0) return;
+static sizedptr elf_copy_section(const elf_source *src, const elf_section_header *section){
+    if (!section->sh_size) return (sizedptr){};
+    void *buf = palloc(section->sh_size, MEM_PRIV_KERNEL, MEM_RO, true);
+    if (!buf) return (sizedptr){};
+    if (!elf_read(src, section->sh_offset, buf, section->sh_size)) {
+        pfree(buf, section->sh_size);
+        return (sizedptr){};
+    }
+    return (sizedptr){(uintptr_t)buf, section->sh_size};
+}
 
-    if (header->section_entry_size != sizeof(elf_section_header)) return;
-    if (header->section_num_entries == 0) return;
-    if (header->section_header_offset >= filesize) return;
+//Only the section table, its names and the two line sections are read, so a file source never gets read whole
+static void elf_debug_info(process_t* proc, const elf_source *src){
+    elf_header header;
+    if (!elf_read(src, 0, &header, sizeof(header))) return;
 
-    size_t sh_total = (size_t)header->section_num_entries * sizeof(elf_section_header);
-    if (header->section_header_offset + sh_total > filesize) return;
-    if (header->string_table_section_index >= header->section_num_entries) return;
+    if (memcmp(header.magic, "\x7f" "ELF", 4) != 0) return;
 
-    elf_section_header *sections = (elf_section_header*)(file + header->section_header_offset);
+    if (header.section_entry_size != sizeof(elf_section_header)) return;
+    if (header.section_num_entries == 0) return;
+    if (header.string_table_section_index >= header.section_num_entries) return;
 
-    if (sections[header->string_table_section_index].sh_offset >= filesize) return;
-    if (sections[header->string_table_section_index].sh_offset + sections[header->string_table_section_index].sh_size > filesize) return;
+    size_t sh_total = (size_t)header.section_num_entries * sizeof(elf_section_header);
+    elf_section_header *sections = (elf_section_header*)talloc(sh_total);
+    if (!sections) return;
+    if (!elf_read(src, header.section_header_offset, sections, sh_total)) {
+        temp_free(sections, sh_total);
+        return;
+    }
 
-    sizedptr debug_line = {};
-    sizedptr debug_line_str = {};
+    elf_section_header *strings = &sections[header.string_table_section_index];
+    size_t names_size = strings->sh_size;
+    char *names = names_size ? (char*)talloc(names_size + 1) : 0;
+    if (!names || !elf_read(src, strings->sh_offset, names, names_size)) {
+        if (names) temp_free(names, names_size + 1);
+        temp_free(sections, sh_total);
+        return;
+    }
+    names[names_size] = 0;
 
-    for (int i = 1; i < header->section_num_entries; i++){
-        if (sections[i].sh_name >= sections[header->string_table_section_index].sh_size) continue;
+    int debug_line = 0;
+    int debug_line_str = 0;
 
-        char *section_name = (char*)(file + sections[header->string_table_section_index].sh_offset + sections[i].sh_name);
-        if (!debug_line.ptr && strcmp_case(".debug_line", section_name,true) == 0){
-            if (sections[i].sh_offset < filesize && sections[i].sh_offset + sections[i].sh_size <= filesize){
-                debug_line = (sizedptr){(uintptr_t)file + sections[i].sh_offset,sections[i].sh_size};
-            }
-        }
+    for (int i = 1; i < header.section_num_entries; i++){
+        if (sections[i].sh_name >= names_size) continue;
 
-        if (!debug_line_str.ptr && strcmp_case(".debug_line_str", section_name,true) == 0){
-            if (sections[i].sh_offset < filesize && sections[i].sh_offset + sections[i].sh_size <= filesize){
-                debug_line_str = (sizedptr){(uintptr_t)file + sections[i].sh_offset,sections[i].sh_size};
-            }
-        }
-        if (debug_line.ptr && debug_line_str.ptr) break;
+        char *section_name = names + sections[i].sh_name;
+        if (!debug_line && strcmp_case(".debug_line", section_name,true) == 0) debug_line = i;
+        if (!debug_line_str && strcmp_case(".debug_line_str", section_name,true) == 0) debug_line_str = i;
+        if (debug_line && debug_line_str) break;
     }
     
-    if (debug_line.ptr && debug_line.size){ 
-        proc->debug_lines.size = debug_line.size;
-        void* dl = palloc(debug_line.size, MEM_PRIV_KERNEL, MEM_RO, true);
-        memcpy(dl, (void*)debug_line.ptr, debug_line.size);
-        proc->debug_lines.ptr = (uintptr_t)dl;
+    if (debug_line) {
+        sizedptr dl = elf_copy_section(src, &sections[debug_line]);
+        if (dl.ptr) proc->debug_lines = dl;
     }
-    if (debug_line_str.ptr && debug_line_str.size){ 
-        proc->debug_line_str.size = debug_line_str.size;
-        void* dls = palloc(debug_line_str.size, MEM_PRIV_KERNEL, MEM_RO, true);
-        memcpy(dls, (void*)debug_line_str.ptr, debug_line_str.size);
-        proc->debug_line_str.ptr = (uintptr_t)dls;
+    if (debug_line_str) {
+        sizedptr dls = elf_copy_section(src, &sections[debug_line_str]);
+        if (dls.ptr) proc->debug_line_str = dls;
     }
+
+    temp_free(names, names_size + 1);
+    temp_free(sections, sh_total);
+}
+
+void get_elf_debug_info(process_t* proc, void* file, size_t filesize){
+    if (!proc) return;
+    if (!file) return;
+    elf_source src = { file, 0, filesize };
+    elf_debug_info(proc, &src);
 }
 
 uint8_t elf_to_red_permissions(uint8_t flags){
@@ -195,28 +224,114 @@ bool setup_process_args(process_t *proc, int argc, const char *argv[]) {
     return true;
 }
 
-process_t* load_elf_process_path(const char *name, const char *bundle, const char *path, int argc, const char *argv[]) {
-    if (!path || !*path) return 0;
-    
-    file fd = {};
-    if (open_file(kernel_fs(), path, &fd) != FS_RESULT_SUCCESS) return 0;
-    
-    char *program = (char*)zalloc(fd.size);
-    if (!program) {
-        close_file(&fd);
+static bool set_default_args(process_t *proc, const char *name, const char *bundle){
+    char argv0[256] = {};
+    if (bundle && *bundle) string_format_buf(argv0, sizeof(argv0), "%s/%s.elf", bundle, name);
+    else string_format_buf(argv0, sizeof(argv0), "%s", name);
+    const char *default_argv[] = { argv0 };
+    return setup_process_args(proc, 1, default_argv);
+}
+
+//Only the headers are kept here, segments are paged in from the file as the process touches them.
+//Sets eager when the file has to go through load_elf_file instead
+static process_t* load_elf_backed(const char *name, const char *bundle, const char *path, elf_backing *backing, bool *eager){
+    *eager = true;
+    size_t filesize = backing->fd.size;
+    elf_source src = { 0, backing, filesize };
+
+    size_t first_size = filesize < PAGE_SIZE ? filesize : PAGE_SIZE;
+    if (first_size < sizeof(elf_header)) return 0;
+    uint8_t *first = (uint8_t*)talloc(PAGE_SIZE);
+    if (!first) return 0;
+    if (!elf_read(&src, 0, first, first_size)) {
+        temp_free(first, PAGE_SIZE);
         return 0;
     }
-    
-    bool ok = read_file(&fd, program, fd.size) == fd.size;
-    close_file(&fd);
-    if (!ok) {
-        release(program);
+
+    elf_header *header = (elf_header*)first;
+    size_t ph_total = (size_t)header->program_header_num_entries * sizeof(elf_program_header);
+    //Program headers past the first page are rare enough to leave to the eager loader
+    if (memcmp(header->magic, "\x7f" "ELF", 4) != 0 || header->program_header_entry_size != sizeof(elf_program_header) || !ph_total
+        || header->program_header_offset > first_size || ph_total > first_size - header->program_header_offset) {
+        temp_free(first, PAGE_SIZE);
         return 0;
     }
+    elf_program_header *program_headers = (elf_program_header*)(first + header->program_header_offset);
+
+    program_load_data data[ELF_IMAGE_MAX_SEGS];
+    size_t di = 0;
+    for (int i = 0; i < header->program_header_num_entries; i++) {
+        if (program_headers[i].segment_type != 1) continue;
+        if (program_headers[i].p_memsz == 0) continue;
+        uint8_t perm = elf_to_red_permissions(program_headers[i].flags);
+        if ((perm & (MEM_RW | MEM_EXEC)) == (MEM_RW | MEM_EXEC) || di == ELF_IMAGE_MAX_SEGS) {
+            temp_free(first, PAGE_SIZE);
+            return 0;
+        }
+        if (program_headers[i].p_offset > filesize) continue;
+        if (program_headers[i].p_filez > filesize) continue;
+        if (program_headers[i].p_offset + program_headers[i].p_filez > filesize) continue;
+        data[di++] = (program_load_data){
+            .permissions = perm,
+            .file_cpy = (sizedptr){0, program_headers[i].p_filez},
+            .virt_mem = (sizedptr){program_headers[i].p_vaddr, program_headers[i].p_memsz},
+            .file_offset = program_headers[i].p_offset
+        };
+    }
+    if (!di) {
+        temp_free(first, PAGE_SIZE);
+        return 0;
+    }
+    //Images are only kept under paths the cache can hold, and writes to the file are checked against it
+    system_module *mod = 0;
+    uint64_t file_key = fs_file_key(kernel_fs(), path, &mod);
+    if (strlen(path) + 1 > ELF_CACHE_PATH_MAX || !file_key || mod != backing->mod) {
+        temp_free(first, PAGE_SIZE);
+        return 0;
+    }
+    *eager = false;
+
+    //Path, size and the first page pick out the image. Rebuilding the file means writing it through the filesystem,
+    //and elf_cache_write_allowed drops the cached image then, so the rest of the file doesn't need to be read here
+    uint64_t hash = elf_image_hash(0, first, first_size);
+    uintptr_t entry = header->program_entry_offset;
+    temp_free(first, PAGE_SIZE);
+
+    elf_image_key key = { .path = path, .size = filesize, .hash = hash, .file_key = file_key };
+    process_t *proc = create_process(name, bundle, data, di, entry, false, &key, backing);
+    if (!proc) return 0;
+
+    if (!set_default_args(proc, name, bundle)) {
+        reset_process(proc);
+        return 0;
+    }
+
+    //The image holds an open handle to the same file whether it was just built or found in the cache
+    elf_source image_src = { 0, &proc->mm.image->backing, filesize };
+    elf_debug_info(proc, &image_src);
+    return proc;
+}
+
+process_t* load_elf_process_path(const char *name, const char *bundle, const char *path, int argc, const char *argv[]) {
+    if (!path || !*path) return 0;
     
-    process_t *proc = load_elf_file(name, bundle,program, fd.size);
-    release(program);
+    file fd = {};
+    system_module *mod = 0;
+    if (open_file_global(kernel_fs(), path, &fd, &mod) != FS_RESULT_SUCCESS) return 0;
+    elf_backing backing = { mod, fd };
+
+    bool eager = false;
+    process_t *proc = load_elf_backed(name, bundle, path, &backing, &eager);
+    if (!proc && eager) {
+        char *program = (char*)zalloc(fd.size);
+        if (program && elf_backing_read(&backing, 0, program, fd.size) == fd.size)
+            proc = load_elf_file(name, bundle, program, fd.size);
+        if (program) release(program);
+    }
+    //Still set if the process didn't keep it
+    elf_backing_close(&backing);
     if (!proc) return 0;
+
     if (!setup_process_args(proc, argc, argv)) {
         reset_process(proc);
         return 0;
@@ -315,15 +430,11 @@ process_t* load_elf_file(const char *name, const char *bundle, void* file, size_
                         }
 
                         if (di) {
-                            process_t *proc = create_process(name, bundle, data, di, header->program_entry_offset, true);
+                            process_t *proc = create_process(name, bundle, data, di, header->program_entry_offset, true, 0, 0);
                             temp_free(data, sec_count * sizeof(program_load_data));
                             if (!proc) return 0;
 
-                            char argv0[256] = {};
-                            if (bundle && *bundle) string_format_buf(argv0, sizeof(argv0), "%s/%s.elf", bundle, name);
-                            else string_format_buf(argv0, sizeof(argv0), "%s", name);
-                            const char *default_argv[] = {argv0};
-                            if (!setup_process_args(proc, 1, default_argv)) {
+                            if (!set_default_args(proc, name, bundle)) {
                                 reset_process(proc);
                                 return 0;
                             }
@@ -374,15 +485,11 @@ process_t* load_elf_file(const char *name, const char *bundle, void* file, size_
         return 0;
     }
 
-    process_t *proc = create_process(name, bundle, data, di, header->program_entry_offset, false);
+    process_t *proc = create_process(name, bundle, data, di, header->program_entry_offset, false, 0, 0);
     temp_free(data, load_count * sizeof(program_load_data));
     if (!proc) return 0;
 
-    char argv0[256] = {};
-    if (bundle && *bundle) string_format_buf(argv0, sizeof(argv0), "%s/%s.elf", bundle, name);
-    else string_format_buf(argv0, sizeof(argv0), "%s", name);
-    const char *default_argv[] = { argv0 };
-    if (!setup_process_args(proc, 1, default_argv)) {
+    if (!set_default_args(proc, name, bundle)) {
         reset_process(proc);
         return 0;
     }
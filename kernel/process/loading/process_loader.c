@@ -12,6 +12,7 @@
 #include "string/string.h"
 #include "syscalls/syscall_codes.h"
 #include "process/isolated_fs/isolated_fs.h"
+#include "memory/mm_process.h"
 
 typedef struct {
     uint64_t code_base_start;
@@ -279,7 +280,7 @@ size_t map_section(process_t *proc, kaddr_t base, uaddr_t off, program_load_data
     return data.virt_mem.size;
 }
 
-process_t* create_process(const char *name, const char *bundle, program_load_data *data, size_t data_count, uintptr_t entry, bool allow_rwx) {
+process_t* create_process(const char *name, const char *bundle, program_load_data *data, size_t data_count, uintptr_t entry, bool allow_rwx, const elf_image_key *key, elf_backing *backing) {
 
     process_t* proc = init_process();
 
@@ -309,15 +310,38 @@ process_t* create_process(const char *name, const char *bundle, program_load_dat
     proc->mm.ttbr0 = ttbr;
     proc->mm.ttbr0_phys = pt_va_to_pa(ttbr);
 
-    paddr_t dest = palloc_inner(code_size, MEM_PRIV_USER, MEM_RW, true, false);
-    if (!dest) {
-        reset_process(proc);
-        return 0;
+    //File backed images are shared and read in on first touch, everything else is copied in up front
+    elf_image *image = 0;
+    paddr_t dest = 0;
+    if (backing) {
+        image = elf_cache_get(key, min_map, code_size);
+        if (!image) {
+            elf_image_seg segs[ELF_IMAGE_MAX_SEGS];
+            if (data_count > ELF_IMAGE_MAX_SEGS) {
+                reset_process(proc);
+                return 0;
+            }
+            for (size_t i = 0; i < data_count; i++)
+                segs[i] = (elf_image_seg){ data[i].virt_mem.ptr, data[i].file_offset, data[i].file_cpy.size };
+            image = elf_image_create(key, backing, min_map, code_size, segs, (uint8_t)data_count);
+        }
+        if (!image) {
+            reset_process(proc);
+            return 0;
+        }
+        //Owned from here on, reset_process drops the reference
+        proc->mm.image = image;
+    } else {
+        dest = palloc_inner(code_size, MEM_PRIV_USER, MEM_RW, true, false);
+        if (!dest) {
+            reset_process(proc);
+            return 0;
+        }
     }
     if (!shared_page) {
         shared_page = palloc_inner(PAGE_SIZE, MEM_PRIV_SHARED, MEM_EXEC, true, false);
         if (!shared_page) {
-            pfree((void*)dmap_pa_to_kva(dest), code_size);
+            if (dest) pfree((void*)dmap_pa_to_kva(dest), code_size);
             reset_process(proc);
             return 0;
         }
@@ -350,22 +374,30 @@ process_t* create_process(const char *name, const char *bundle, program_load_dat
             return 0;
         }
         if (rw && !allow_rwx) ex = false;
+        //Left to the fault handler
+        if (image) continue;
 
         uint8_t attr = MEM_NORM;
         if (rw) attr |= MEM_RW;
         if (ex) attr |= MEM_EXEC;
         mmu_map_4kb((uint64_t*)ttbr, (uint64_t)va, (paddr_t)(dest + (va - min_map)), MAIR_IDX_NORMAL, attr, MEM_PRIV_USER);
     }
-    memset((void*)dmap_pa_to_kva(dest), 0, code_size);
 
     for (size_t i = 0; i < data_count; i++) {
         uint8_t prot = MEM_NORM;
         if (data[i].permissions & MEM_RW) prot |= MEM_RW;
         if (data[i].permissions & MEM_EXEC) prot |= MEM_EXEC;
-        mm_add_vma(&proc->mm, data[i].virt_mem.ptr, data[i].virt_mem.ptr + data[i].virt_mem.size, prot, VMA_KIND_ELF, 0);
+        uint8_t kind = image ? VMA_KIND_FILE : VMA_KIND_ELF;
+        //Image pages are never written, the fault hands out a private copy
+        uint8_t flags = image ? VMA_FLAG_DEMAND : 0;
+        if (image && (prot & MEM_RW)) flags |= VMA_FLAG_COW;
+        mm_add_vma(&proc->mm, data[i].virt_mem.ptr, data[i].virt_mem.ptr + data[i].virt_mem.size, prot, kind, flags);
+    }
+    if (dest) {
+        memset((void*)dmap_pa_to_kva(dest), 0, code_size);
+        for (size_t i = 0; i < data_count; i++)
+            map_section(proc, dmap_pa_to_kva(dest), min_map, data[i]);
     }
-    for (size_t i = 0; i < data_count; i++)
-        map_section(proc, dmap_pa_to_kva(dest), min_map, data[i]);
 
     proc->va = min_map;
     proc->code = dest;
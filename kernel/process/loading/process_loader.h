@@ -5,14 +5,19 @@ extern "C" {
 #endif
 #include "types.h"
 #include "process/process.h"
+#include "elf_cache.h"
 
 typedef struct {
     sizedptr file_cpy;
     sizedptr virt_mem;
     uint8_t permissions;
+    //Where file_cpy starts in the backing file, only used when loading from one
+    uint64_t file_offset;
 } program_load_data;
 
-process_t* create_process(const char *name, const char *bundle, program_load_data *data, size_t data_count, uintptr_t entry, bool allow_rwx);
+//With a backing nothing is copied, segments are paged in from the file on first touch and shared with other processes
+//launched from the same file (matched by key), writable ones copy on write. The backing is cleared if the image took it over
+process_t* create_process(const char *name, const char *bundle, program_load_data *data, size_t data_count, uintptr_t entry, bool allow_rwx, const elf_image_key *key, elf_backing *backing);
 void translate_enable_verbose();
 void decode_instruction(uint32_t instruction);
 #ifdef __cplusplus
@@ -0,0 +1,222 @@
+#include "poll.h"
+#include "process.h"
+#include "memory/page_allocator.h"
+#include "memory/slab.h"
+#include "exceptions/irq.h"
+#include "networking/transport_layer/csocket.h"
+#include "filesystem/filesystem.h"
+#include "input/input_dispatch.h"
+
+typedef struct poll_set poll_set_t;
+
+struct poll_entry {
+    poll_entry_t *src_next;
+    poll_entry_t *set_next;
+    poll_head_t *head;
+    poll_set_t *set;
+    poll_event_t ev;
+    bool detached;
+};
+
+struct poll_set {
+    poll_set_t *next;
+    poll_entry_t *entries;
+    wait_queue_t waiters;
+    uint32_t count;
+    int32_t id;
+    uint16_t pid;
+};
+
+static slab_cache *set_cache;
+static slab_cache *entry_cache;
+static poll_set_t *sets;
+static int32_t next_set_id = 1;
+
+//Errors and hangups are always reported whether they were asked for or not
+#define POLL_ALWAYS (POLL_ERR | POLL_HUP)
+
+static poll_set_t* poll_find_set(uint16_t pid, int32_t set_id){
+    for (poll_set_t *set = sets; set; set = set->next)
+        if (set->id == set_id) return set->pid == pid ? set : 0;
+    return 0;
+}
+
+static poll_entry_t* poll_find_entry(poll_set_t *set, uint8_t kind, uint64_t id){
+    for (poll_entry_t *e = set->entries; e; e = e->set_next)
+        if (e->ev.kind == kind && (kind == POLL_SRC_INPUT || e->ev.id == id)) return e;
+    return 0;
+}
+
+//Current readiness of the source, and the head its wakeups come through
+static uint32_t poll_query(uint8_t kind, uint64_t id, uint16_t pid, poll_head_t **head){
+    *head = 0;
+    switch (kind) {
+        case POLL_SRC_SOCKET: return socket_poll((uint16_t)id, pid, head);
+        case POLL_SRC_FILE: return file_poll(id, pid, head);
+        case POLL_SRC_INPUT: return sys_poll_input(pid, head);
+    }
+    return POLL_ERR;
+}
+
+static void poll_unlink_head(poll_entry_t *e){
+    if (!e->head) return;
+    poll_entry_t **it = &e->head->entries;
+    while (*it && *it != e) it = &(*it)->src_next;
+    if (*it) *it = e->src_next;
+    e->src_next = 0;
+    e->head = 0;
+}
+
+static void poll_free_entry(poll_set_t *set, poll_entry_t *e){
+    poll_entry_t **it = &set->entries;
+    while (*it && *it != e) it = &(*it)->set_next;
+    if (*it) *it = e->set_next;
+    poll_unlink_head(e);
+    set->count--;
+    slab_free(entry_cache, e);
+}
+
+void poll_head_wake(poll_head_t *head, uint32_t events){
+    if (!head) return;
+    irq_flags_t irq = irq_save_disable();
+    for (poll_entry_t *e = head->entries; e; e = e->src_next)
+        if ((e->ev.events | POLL_ALWAYS) & events) wait_queue_wake_all(&e->set->waiters);
+    irq_restore(irq);
+}
+
+void poll_head_detach(poll_head_t *head){
+    if (!head) return;
+    irq_flags_t irq = irq_save_disable();
+    poll_entry_t *e = head->entries;
+    head->entries = 0;
+    while (e) {
+        poll_entry_t *next = e->src_next;
+        e->src_next = 0;
+        e->head = 0;
+        e->detached = true;
+        wait_queue_wake_all(&e->set->waiters);
+        e = next;
+    }
+    irq_restore(irq);
+}
+
+int32_t poll_create(uint16_t pid){
+    irq_flags_t irq = irq_save_disable();
+    if (!set_cache) set_cache = slab_cache_create("poll_set", sizeof(poll_set_t), ALIGN_16B, MEM_RW, 0);
+    if (!entry_cache) entry_cache = slab_cache_create("poll_entry", sizeof(poll_entry_t), ALIGN_16B, MEM_RW, 0);
+    poll_set_t *set = (poll_set_t*)slab_alloc(set_cache);
+    if (!set) {
+        irq_restore(irq);
+        return POLL_ERR_NOMEM;
+    }
+    set->id = next_set_id++;
+    set->pid = pid;
+    set->next = sets;
+    sets = set;
+    irq_restore(irq);
+    return set->id;
+}
+
+int32_t poll_ctl(uint16_t pid, int32_t set_id, uint8_t op, const poll_event_t *ev){
+    if (!ev) return POLL_ERR_INVAL;
+    irq_flags_t irq = irq_save_disable();
+    poll_set_t *set = poll_find_set(pid, set_id);
+    if (!set) {
+        irq_restore(irq);
+        return POLL_ERR_NOENT;
+    }
+    poll_entry_t *e = poll_find_entry(set, ev->kind, ev->id);
+    int32_t result = 0;
+
+    switch (op) {
+        case POLL_CTL_ADD: {
+            if (e) { result = POLL_ERR_EXIST; break; }
+            if (set->count >= POLL_MAX_ENTRIES) { result = POLL_ERR_FULL; break; }
+            poll_head_t *head = 0;
+            poll_query(ev->kind, ev->id, pid, &head);
+            if (!head) { result = POLL_ERR_NOENT; break; }
+            e = (poll_entry_t*)slab_alloc(entry_cache);
+            if (!e) { result = POLL_ERR_NOMEM; break; }
+            e->ev = *ev;
+            e->set = set;
+            e->head = head;
+            e->src_next = head->entries;
+            head->entries = e;
+            e->set_next = set->entries;
+            set->entries = e;
+            set->count++;
+            break;
+        }
+        case POLL_CTL_MOD:
+            if (!e) { result = POLL_ERR_NOENT; break; }
+            e->ev.events = ev->events;
+            e->ev.data = ev->data;
+            break;
+        case POLL_CTL_DEL:
+            if (!e) { result = POLL_ERR_NOENT; break; }
+            poll_free_entry(set, e);
+            break;
+        default:
+            result = POLL_ERR_INVAL;
+    }
+    irq_restore(irq);
+    return result;
+}
+
+static void poll_destroy(poll_set_t *set){
+    poll_set_t **it = &sets;
+    while (*it && *it != set) it = &(*it)->next;
+    if (*it) *it = set->next;
+    while (set->entries) poll_free_entry(set, set->entries);
+    wait_queue_release(&set->waiters);
+    slab_free(set_cache, set);
+}
+
+int32_t poll_close(uint16_t pid, int32_t set_id){
+    irq_flags_t irq = irq_save_disable();
+    poll_set_t *set = poll_find_set(pid, set_id);
+    if (set) poll_destroy(set);
+    irq_restore(irq);
+    return set ? 0 : POLL_ERR_NOENT;
+}
+
+void poll_close_process(uint16_t pid){
+    irq_flags_t irq = irq_save_disable();
+    poll_set_t *set = sets;
+    while (set) {
+        poll_set_t *next = set->next;
+        if (set->pid == pid) poll_destroy(set);
+        set = next;
+    }
+    irq_restore(irq);
+}
+
+int32_t poll_collect(process_t *proc, int32_t set_id, poll_event_t *out, uint32_t max, bool wait){
+    if (!proc || !out || !max) return POLL_ERR_INVAL;
+    irq_flags_t irq = irq_save_disable();
+    poll_set_t *set = poll_find_set(proc->id, set_id);
+    if (!set) {
+        irq_restore(irq);
+        return POLL_ERR_NOENT;
+    }
+    wait_queue_remove(&set->waiters, proc);
+
+    uint32_t n = 0;
+    for (poll_entry_t *e = set->entries; e && n < max; e = e->set_next) {
+        poll_head_t *head = 0;
+        uint32_t ready = e->detached ? POLL_HUP : poll_query(e->ev.kind, e->ev.id, proc->id, &head);
+        ready &= e->ev.events | POLL_ALWAYS;
+        if (!ready) continue;
+        out[n] = e->ev;
+        out[n].events = ready;
+        n++;
+    }
+
+    //Queued before the lock drops so a wake between here and the sleep isn't lost
+    if (!n && wait && !wait_queue_add(&set->waiters, proc)) {
+        irq_restore(irq);
+        return POLL_ERR_INVAL;
+    }
+    irq_restore(irq);
+    return (int32_t)n;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "types.h"
+#include "wait_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLL_IN  0x1
+#define POLL_OUT 0x2
+#define POLL_ERR 0x4
+#define POLL_HUP 0x8
+
+#define POLL_SRC_SOCKET 1
+#define POLL_SRC_FILE   2
+//The calling process' own key and event buffers, id is ignored
+#define POLL_SRC_INPUT  3
+
+#define POLL_CTL_ADD 1
+#define POLL_CTL_MOD 2
+#define POLL_CTL_DEL 3
+
+#define POLL_ERR_INVAL -1
+#define POLL_ERR_NOENT -2
+#define POLL_ERR_EXIST -3
+#define POLL_ERR_NOMEM -4
+#define POLL_ERR_FULL  -5
+
+#define POLL_WAIT_FOREVER 0xFFFFFFFFFFFFFFFFULL
+#define POLL_MAX_ENTRIES 64
+
+//What userspace registers and what poll_wait hands back with events replaced by the ready ones.
+//Sources are named by SocketHandle.id or file.id, data is returned untouched
+typedef struct {
+    uint8_t kind;
+    uint32_t events;
+    uint64_t id;
+    uint64_t data;
+} poll_event_t;
+
+typedef struct poll_entry poll_entry_t;
+
+//Embedded in every pollable object, entries of the sets watching it hang off it
+typedef struct {
+    poll_entry_t *entries;
+} poll_head_t;
+
+//Called by sources when their state changes. Waiters recheck readiness themselves so extra wakes are harmless
+void poll_head_wake(poll_head_t *head, uint32_t events);
+//The object is going away, its entries stay registered but report POLL_HUP
+void poll_head_detach(poll_head_t *head);
+
+int32_t poll_create(uint16_t pid);
+int32_t poll_ctl(uint16_t pid, int32_t set_id, uint8_t op, const poll_event_t *ev);
+int32_t poll_close(uint16_t pid, int32_t set_id);
+void poll_close_process(uint16_t pid);
+
+//Level triggered scan of the set, returns how many entries were written to out or a negative error.
+//With wait set and nothing ready the process is left on the set's wait queue for the caller to sleep
+int32_t poll_collect(process_t *proc, int32_t set_id, poll_event_t *out, uint32_t max, bool wait);
+
+#ifdef __cplusplus
+}
+#endif
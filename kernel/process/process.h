@@ -9,9 +9,11 @@ extern "C" {
 #include "net/network_types.h"
 #include "files/system_module.h"
 #include "memory/mm_process.h"
+#include "exceptions/timer_wheel.h"
 #include "graphic_types.h"
 #include "signals/signals.h"
 #include "environment/environment.h"
+#include "poll.h"
 
 #define INPUT_BUFFER_CAPACITY 64
 #define PACKET_BUFFER_CAPACITY 128
@@ -63,10 +65,24 @@ typedef struct process {
     uint64_t spsr; 
     //Not used in process saving
     uint16_t id;
+    uint32_t sched_magic;
     bool in_ready_queue;
+    uint8_t sched_class;
+    uint8_t ready_level;
+    uint8_t cpu;
+    bool on_cpu;
+    bool is_idle;
+    struct process *ready_prev;
+    struct process *ready_next;
     bool sleeping;
     bool suspended;
     uint64_t wake_at_msec;
+    ktimer_t sleep_timer;
+    bool wake_pending;
+    struct process *wait_next;
+    void *wait_queue;
+    //Set while a blocking syscall is being restarted, so every retry counts down the same timeout
+    uint64_t wait_deadline_msec;
     uintptr_t stack;
     paddr_t stack_phys;
     uint64_t stack_size;
@@ -91,6 +107,7 @@ typedef struct process {
     __attribute__((aligned(16))) packet_buffer_t packet_buffer;
     __attribute__((aligned(16))) scroll_buffer_t scroll_buffer;
     __attribute__((aligned(16))) signal_buffer_t signal_buffer;
+    poll_head_t input_poll;
     __attribute__((aligned(16))) signal_handler signal_handlers[NUMBER_SIGNALS];
     uint8_t priority;
     system_permissions permissions;
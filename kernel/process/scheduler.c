@@ -5,35 +5,61 @@
 #include "input/input_dispatch.h"
 #include "exceptions/exception_handler.h"
 #include "exceptions/timer.h"
+#include "exceptions/timer_wheel.h"
+#include "process/wait_queue.h"
 #include "console/kconsole/kconsole.h"
 #include "data/struct/hashmap.h"
-#include "data/struct/queue.h"
-#include "data/struct/linked_list.h"
 #include "std/memory.h"
 #include "math/math.h"
 #include "memory/mmu.h"
 #include "process/syscall.h"
 #include "memory/addr.h"
+#include "memory/zero_pool.h"
+#include "process/loading/elf_cache.h"
 #include "sysregs.h"
 #include "filesystem/filesystem.h"
 #include "filesystem/modules/module_loader.h"
 #include "string/string.h"
 #include "alloc/allocate.h"
 #include "files/dir_list.h"
+#include "hw/smp.h"
+#include "exceptions/spinlock.h"
 
 extern void save_pc_interrupt(uintptr_t ptr);
 extern void restore_context(uintptr_t ptr);
 
-static process_t *current_proc = 0;
 static process_t *kernel_proc = 0;
-static process_t *idle_proc = 0;
 static process_t *process_list = 0;
 uint16_t proc_count = 0;
 uint16_t next_proc_index = 1;
+static volatile bool scheduler_started = false;
 
-//TODO maybe use a weighted ready queue based on process priority
-CQueue ready_queue = {};
-linked_list_t sleeping_list = {};
+#define PROC_SCHED_MAGIC 0x50524F43
+//Picks in a row a higher class can take while lower ones wait before one of those gets a turn. Realtime is never held back
+#define SCHED_STARVE_PICKS 8
+
+typedef struct {
+    process_t *head;
+    process_t *tail;
+} ready_level_t;
+
+//Run queues are only touched with the kernel lock held, which already serializes them across cores
+typedef struct {
+    ready_level_t levels[PROC_CLASS_COUNT];
+    uint32_t bitmap;
+    process_t *current;
+    process_t *idle;
+    uint8_t passed_over;
+    uint8_t age_cursor;
+    //Picked ahead of higher classes, left to run out its slice instead of being preempted by them straight away
+    process_t *aged;
+} run_queue_t;
+
+static run_queue_t run_queues[MAX_CPUS];
+
+#define this_rq() (&run_queues[cpu_id()])
+#define current_proc (this_rq()->current)
+#define idle_proc (this_rq()->idle)
 
 hash_map_t *proc_opened_files;
 
@@ -46,20 +72,15 @@ typedef struct {
 
 __attribute__((noreturn)) static void idle_entry() {
     for (;;) {
+        //Spare cycles go to clearing pages for later faults, sleep once the pool is full
+        if (zero_pool_refill(ZERO_POOL_BATCH)) continue;
         asm volatile("dsb sy" ::: "memory");
         asm volatile("wfi");
     }
 }
 
 static bool process_is_known(process_t *proc){
-    if (!proc) return false;
-    if (proc == idle_proc) return true;
-    process_t *it = process_list;
-    while (it) {
-        if (it == proc) return true;
-        it = it->process_next;
-    }
-    return false;
+    return proc && proc->sched_magic == PROC_SCHED_MAGIC;
 }
 
 static bool process_has_runtime_state(process_t *proc){
@@ -75,46 +96,144 @@ static bool process_can_run(process_t *proc){
 }
 
 static bool process_can_reset(process_t *proc){
-    return proc && proc->state == STOPPED && proc->pending_reset && !proc->procfs_refs;
+    return proc && proc->state == STOPPED && proc->pending_reset && !proc->procfs_refs && !proc->on_cpu;
+}
+
+static bool process_running_elsewhere(process_t *proc){
+    return proc->on_cpu && proc != current_proc;
+}
+
+//Kernel processes run with interrupts on and so without the kernel lock. The subsystems they share (bcache, TCP flows,
+//poll sets, filesystem modules) still count on that only ever happening on one core, so they stay on the boot core
+static bool process_boot_cpu_only(process_t *proc){
+    return !proc->is_idle && (proc->spsr & 0xF) != 0;
+}
+
+static void kick_cpu_for(process_t *proc){
+    uint32_t self = cpu_id();
+    run_queue_t *rq = &run_queues[proc->cpu];
+    if (!rq->current || rq->current == rq->idle || proc->sched_class < rq->current->sched_class) {
+        if (proc->cpu != self) smp_send_reschedule(proc->cpu);
+        return;
+    }
+    if (process_boot_cpu_only(proc)) return;
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        if (i == self || i == proc->cpu) continue;
+        if (run_queues[i].current && run_queues[i].current == run_queues[i].idle) {
+            smp_send_reschedule(i);
+            return;
+        }
+    }
 }
 
 static void enqueue_ready_process(process_t *proc){
-    if (!proc || proc == idle_proc || proc->in_ready_queue) return;
-    if (!ready_queue.elem_size) cqueue_init(&ready_queue, 0, sizeof(process_t*),0,0);
-    if (!cqueue_enqueue(&ready_queue, &proc)) panic("ready enqueue failed", proc->id);
+    if (!proc || proc->is_idle || proc->in_ready_queue) return;
+    //Still running on another core, it gets requeued there once switched out
+    if (process_running_elsewhere(proc)) return;
+    if (proc->cpu >= smp_cpu_count()) proc->cpu = cpu_id();
+    if (process_boot_cpu_only(proc)) proc->cpu = 0;
+    run_queue_t *rq = &run_queues[proc->cpu];
+    uint8_t level = proc->sched_class < PROC_CLASS_COUNT ? proc->sched_class : PROC_CLASS_NORMAL;
+    ready_level_t *rl = &rq->levels[level];
+    proc->ready_level = level;
+    proc->ready_next = 0;
+    proc->ready_prev = rl->tail;
+    if (rl->tail) rl->tail->ready_next = proc;
+    else rl->head = proc;
+    rl->tail = proc;
+    rq->bitmap |= 1u << level;
     proc->in_ready_queue = true;
     proc->state = READY;
+    if (smp_cpu_count() > 1) kick_cpu_for(proc);
+}
+
+static void dequeue_ready_process(process_t *proc){
+    if (!proc || !proc->in_ready_queue) return;
+    run_queue_t *rq = &run_queues[proc->cpu];
+    ready_level_t *rl = &rq->levels[proc->ready_level];
+    if (proc->ready_prev) proc->ready_prev->ready_next = proc->ready_next;
+    else rl->head = proc->ready_next;
+    if (proc->ready_next) proc->ready_next->ready_prev = proc->ready_prev;
+    else rl->tail = proc->ready_prev;
+    if (!rl->head) rq->bitmap &= ~(1u << proc->ready_level);
+    proc->ready_prev = 0;
+    proc->ready_next = 0;
+    proc->in_ready_queue = false;
+}
+
+//Next waiting class below top after the one aged last time, so a middle class isn't starved by the ones on either side
+static uint32_t aged_level(run_queue_t *rq, uint32_t top){
+    uint32_t lower = rq->bitmap & ~((2u << top) - 1);
+    uint32_t after = lower & ~((2u << rq->age_cursor) - 1);
+    return __builtin_ctz(after ? after : lower);
+}
+
+//Strict class order, except that after SCHED_STARVE_PICKS picks passed over a waiting lower class it gets one
+static process_t* take_ready_process(run_queue_t *rq){
+    rq->aged = 0;
+    while (rq->bitmap) {
+        uint32_t top = __builtin_ctz(rq->bitmap);
+        bool waiting = top != PROC_CLASS_REALTIME && (rq->bitmap >> (top + 1)) != 0;
+        bool aging = waiting && rq->passed_over >= SCHED_STARVE_PICKS;
+        uint32_t level = aging ? aged_level(rq, top) : top;
+        process_t *proc = rq->levels[level].head;
+        dequeue_ready_process(proc);
+        if (process_running_elsewhere(proc)) continue;
+        if (proc->state != READY || !process_can_run(proc)) continue;
+        if (aging) {
+            rq->passed_over = 0;
+            rq->age_cursor = level;
+            rq->aged = proc;
+        } else rq->passed_over = waiting ? rq->passed_over + 1 : 0;
+        return proc;
+    }
+    return 0;
 }
 
-static bool remove_sleeping_process(process_t *proc, uint16_t pid){
-    bool removed = false;
-    linked_list_node_t *sleep = sleeping_list.head;
-    while (sleep) {
-        linked_list_node_t *next = sleep->next;
-        process_t *sleep_proc = (process_t*)sleep->data;
-        if (sleep_proc == proc || (sleep_proc && sleep_proc->id == pid)) {
-            linked_list_remove(&sleeping_list, sleep);
-            removed = true;
+//Picks from another core's queue, leaving alone whatever can't run here or is stale and up to that core to drop
+static process_t* steal_ready_process(run_queue_t *rq){
+    for (uint32_t level = 0; level < PROC_CLASS_COUNT; level++) {
+        for (process_t *proc = rq->levels[level].head; proc; proc = proc->ready_next) {
+            if (process_boot_cpu_only(proc) || process_running_elsewhere(proc)) continue;
+            if (proc->state != READY || !process_can_run(proc)) continue;
+            dequeue_ready_process(proc);
+            return proc;
         }
-        sleep = next;
     }
-    return removed;
+    return 0;
 }
 
-void save_return_address_interrupt(){
-    save_pc_interrupt(cpec);
+static process_t* pop_ready_process(){
+    process_t *proc = take_ready_process(this_rq());
+    if (proc) return proc;
+    uint32_t self = cpu_id();
+    uint32_t count = smp_cpu_count();
+    for (uint32_t i = 1; i < count; i++) {
+        run_queue_t *rq = &run_queues[(self + i) % count];
+        if (!rq->bitmap) continue;
+        proc = steal_ready_process(rq);
+        if (proc) return proc;
+    }
+    return 0;
 }
 
-void update_sleep_timer() {
-    if (sleeping_list.head) {
-        process_t *head_proc = (process_t*)sleeping_list.head->data;
-        if (head_proc) {
-            uint64_t now = timer_now_msec();
-            uint64_t wait = head_proc->wake_at_msec > now ? head_proc->wake_at_msec - now : 1;
-            virtual_timer_reset(wait);
-            virtual_timer_enable();
-        } else virtual_timer_disable();
-    } else virtual_timer_disable();
+static process_t* local_current_proc(){
+    irq_flags_t irq = local_irq_save();
+    process_t *proc = current_proc;
+    local_irq_restore(irq);
+    return proc;
+}
+
+static void sleep_timer_expired(ktimer_t *timer){
+    process_t *proc = (process_t*)timer->data;
+    if (!proc) return;
+    proc->sleeping = false;
+    proc->wake_at_msec = 0;
+    if (proc->state != STOPPED) enqueue_ready_process(proc);
+}
+
+void save_return_address_interrupt(){
+    save_pc_interrupt(cpec);
 }
 
 void switch_proc(ProcSwitchReason reason) {
@@ -122,26 +241,21 @@ void switch_proc(ProcSwitchReason reason) {
         panic("No processes active", 0);
     process_t *prev = current_proc, *next_proc = 0;
     if (prev && prev->state == RUNNING) {
-        if (prev == idle_proc) prev->state = BLOCKED;
+        if (prev->is_idle) prev->state = BLOCKED;
         else ready_process(prev);
     }
 
-    while (!cqueue_is_empty(&ready_queue)) {
-        process_t *queued = 0;
-        if (!cqueue_dequeue(&ready_queue, &queued)) break;
-        if (!queued) continue;
-        if (process_is_known(queued)) queued->in_ready_queue = false;
-        if (queued->state != READY || !process_can_run(queued)) continue;
-        next_proc = queued;
-        break;
-    }
+    next_proc = pop_ready_process();
 
     if (!next_proc && current_proc && current_proc != idle_proc && current_proc->state == RUNNING && process_can_run(current_proc)) next_proc = current_proc;
     if (!next_proc) next_proc = idle_proc;
     if (!next_proc || !process_can_run(next_proc)) panic("no runnable process", 0);
     //if (next_proc == idle_proc && prev != idle_proc) kprint("entering idle");
 
+    if (prev) prev->on_cpu = false;
     next_proc->state = RUNNING;
+    next_proc->on_cpu = true;
+    next_proc->cpu = cpu_id();
     current_proc = next_proc;
     cpec = (uintptr_t)current_proc;
     if (current_proc == idle_proc) timer_disable();
@@ -170,7 +284,7 @@ void process_restore(){
             current_proc->pending_reset = true;
             current_proc->state = STOPPED;
             current_proc->sleeping = false;
-            current_proc->in_ready_queue = false;
+            dequeue_ready_process(current_proc);
             switch_proc(HALT);
             panic("process_restore recovery returned", cpec);
         }
@@ -190,8 +304,10 @@ void process_restore(){
             else handle_signal_default(current_proc, info);
         } else handle_signal_default(current_proc, info);
         switch_proc(RECV_SIGNAL);//TODO: wasteful, we might have a lot of CPU time left for this proc to use
-    } else 
+    } else {
+        kernel_lock_prepare_return(current_proc->spsr);
         restore_context(cpec);
+    }
 }
 
 bool start_scheduler(){
@@ -199,10 +315,16 @@ bool start_scheduler(){
     kconsole_clear();
     disable_interrupt();
     timer_init(current_proc ? current_proc->priority : PROC_PRIORITY_LOW);
+    smp_start_secondaries();
+    scheduler_started = true;
     switch_proc(YIELD);
     return true;
 }
 
+bool scheduler_running(){
+    return scheduler_started;
+}
+
 void* procfs_alloc(size_t size){
     return allocate(proc_page, size, page_alloc);
 }
@@ -213,22 +335,23 @@ bool init_scheduler_module(){
         proc_opened_files->free = release;
         proc_opened_files->alloc = procfs_alloc;
     }
-    if (!ready_queue.elem_size) cqueue_init(&ready_queue, 0, sizeof(process_t*),0,0);
     return true;
 }
 
 
 uintptr_t get_current_heap(){
-    if (current_proc->heap_phys) return (uintptr_t)dmap_pa_to_kva(current_proc->heap_phys);
-    return current_proc->mm.mmap_bottom;
+    process_t *proc = local_current_proc();
+    if (proc->heap_phys) return (uintptr_t)dmap_pa_to_kva(proc->heap_phys);
+    return proc->mm.mmap_bottom;
 }
 
 bool get_current_privilege(){
-    return current_proc && (current_proc->spsr & 0b1111) != 0;
+    process_t *proc = local_current_proc();
+    return proc && (proc->spsr & 0b1111) != 0;
 }
 
 process_t* get_current_proc(){
-    return current_proc;
+    return local_current_proc();
 }
 
 process_t* get_kernel_proc(){
@@ -236,11 +359,24 @@ process_t* get_kernel_proc(){
 }
 
 process_t* get_idle_proc(){
-    return idle_proc;
+    irq_flags_t irq = local_irq_save();
+    process_t *proc = idle_proc;
+    local_irq_restore(irq);
+    return proc;
 }
 
 bool scheduler_in_idle(){
-    return current_proc == idle_proc;
+    process_t *proc = local_current_proc();
+    return !proc || proc->is_idle;
+}
+
+bool scheduler_should_preempt(){
+    run_queue_t *rq = this_rq();
+    if (!rq->current || rq->current == rq->idle) return true;
+    if (rq->current->mm.ttbr0 && (rq->current->spsr & 0xF) != 0) return false;
+    if (rq->current->state != RUNNING) return true;
+    if (!rq->bitmap || rq->current == rq->aged) return false;
+    return (uint32_t)__builtin_ctz(rq->bitmap) < rq->current->sched_class;
 }
 
 void ready_process(process_t *proc){
@@ -264,12 +400,13 @@ process_t* get_proc_by_pid(uint16_t pid){
 }
 
 uint16_t get_current_proc_pid(){
-    return current_proc ? current_proc->id : 0;
+    process_t *proc = local_current_proc();
+    return proc ? proc->id : 0;
 }
 
 void reset_process(process_t *proc){
     if (!proc) panic("reset_process null", 0);
-    if (proc == current_proc) panic("reset_process current", proc->id);
+    if (proc == current_proc || proc->on_cpu) panic("reset_process current", proc->id);
     if (proc->procfs_refs) panic("reset_process with procfs refs", proc->id);
 
     uint16_t pid = proc->id;
@@ -277,14 +414,15 @@ void reset_process(process_t *proc){
     bool counted = proc->sp || proc->pc || proc->spsr || proc->stack || proc->heap_phys || proc->mm.ttbr0;
 
     irq_flags_t irq = irq_save_disable();
+    //A reset slot isn't a process until init_process hands it out again
+    proc->sched_magic = 0;
     proc->pending_reset = false;
     proc->sleeping = false;
     proc->wake_at_msec = 0;
-    proc->in_ready_queue = false;
-
-    remove_sleeping_process(proc, pid);
-
-    update_sleep_timer();
+    dequeue_ready_process(proc);
+    ktimer_cancel(&proc->sleep_timer);
+    if (proc->wait_queue) wait_queue_remove((wait_queue_t*)proc->wait_queue, proc);
+    proc->wake_pending = false;
     irq_restore(irq);
     proc->sp = 0;
     proc->pc = 0;
@@ -301,6 +439,9 @@ void reset_process(process_t *proc){
         proc->packet_buffer.entries[k] = (sizedptr){0};
     }
     close_files_for_process(pid);
+    poll_close_process(pid);
+    poll_head_detach(&proc->input_poll);
+    proc->wait_deadline_msec = 0;
 
     if (proc->postmortem_output) {
         release((void*)proc->postmortem_output);
@@ -406,7 +547,7 @@ void reset_process(process_t *proc){
             for (uaddr_t va = start; va < end; va += GRANULE_4KB) {
                 paddr_t pa = 0;
                 if (!mmu_unmap_and_get_pa((uint64_t*)proc->mm.ttbr0, (uint64_t)va, &pa)) continue;
-                if (!nofree) pfree((void*)dmap_pa_to_kva(pa), GRANULE_4KB);
+                if (!nofree && !elf_image_owns(proc->mm.image, va, pa)) pfree((void*)dmap_pa_to_kva(pa), GRANULE_4KB);
                 if (m->kind == VMA_KIND_STACK) {
                     if (proc->mm.rss_stack_pages) proc->mm.rss_stack_pages--;
                 } else if (m->kind == VMA_KIND_ANON) {
@@ -414,8 +555,10 @@ void reset_process(process_t *proc){
                 }
             }
         }
-        proc->mm.vma_count = 0;
     }
+    mm_release_vmas(&proc->mm);
+    elf_cache_put(proc->mm.image);
+    proc->mm.image = 0;
 
     if (proc->alloc_map) {
         if (proc->mm.ttbr0) {
@@ -465,17 +608,18 @@ void reset_process(process_t *proc){
 
 void init_main_process(){
     proc_page = page_alloc(PAGE_SIZE*16);
-    if (!ready_queue.elem_size) cqueue_init(&ready_queue, 0, sizeof(process_t*),0,0);
     size_t kernel_proc_size = (sizeof(process_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     kernel_proc = (process_t*)palloc(kernel_proc_size, MEM_PRIV_KERNEL, MEM_RW, true);
     if (!kernel_proc) panic("kernel process alloc failed", 0);
-    idle_proc = (process_t*)palloc(kernel_proc_size, MEM_PRIV_KERNEL, MEM_RW, true);
-    if (!idle_proc) panic("idle process alloc failed", 0);
-
     current_proc = kernel_proc;
     process_list = kernel_proc;
     cpec = (uintptr_t)kernel_proc;
     kernel_proc->id = next_proc_index++;
+    kernel_proc->sched_magic = PROC_SCHED_MAGIC;
+    kernel_proc->sched_class = PROC_CLASS_NORMAL;
+    ktimer_init(&kernel_proc->sleep_timer, sleep_timer_expired, kernel_proc);
+    kernel_proc->cpu = 0;
+    kernel_proc->on_cpu = true;
     kernel_proc->alloc_map = make_page_index();
     kernel_proc->state = BLOCKED;
     kernel_proc->heap_phys = (uintptr_t)palloc(0x1000, MEM_PRIV_KERNEL, MEM_RW, false);
@@ -488,25 +632,49 @@ void init_main_process(){
     kernel_proc->postmortem_output_size = 0;
     kernel_proc->priority = PROC_PRIORITY_LOW;
     name_process(kernel_proc, "kernel");
-    idle_proc->state = BLOCKED;
-    idle_proc->priority = PROC_PRIORITY_LOW;
-    idle_proc->stack_size = 0x4000;
-    uintptr_t idle_stack = (uintptr_t)palloc(idle_proc->stack_size,MEM_PRIV_KERNEL, MEM_RW,true);
-    if (!idle_stack) panic("idle stack alloc failed", 0);
-    idle_proc->stack = idle_stack + idle_proc->stack_size;
-    idle_proc->sp = idle_proc->stack;
-    idle_proc->pc = (uintptr_t)idle_entry;
-    idle_proc->spsr = 0x205;
-    name_process(idle_proc, "idle");
+    scheduler_init_cpu(0);
 
     proc_count++;
 }
 
+void scheduler_init_cpu(uint32_t id){
+    if (id >= MAX_CPUS) panic("scheduler_init_cpu invalid cpu", id);
+    size_t proc_size = (sizeof(process_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    process_t *idle = (process_t*)palloc(proc_size, MEM_PRIV_KERNEL, MEM_RW, true);
+    if (!idle) panic("idle process alloc failed", id);
+    idle->state = BLOCKED;
+    idle->sched_magic = PROC_SCHED_MAGIC;
+    idle->sched_class = PROC_CLASS_BACKGROUND;
+    idle->priority = PROC_PRIORITY_LOW;
+    idle->cpu = id;
+    idle->is_idle = true;
+    idle->stack_size = 0x4000;
+    uintptr_t idle_stack = (uintptr_t)palloc(idle->stack_size,MEM_PRIV_KERNEL, MEM_RW,true);
+    if (!idle_stack) panic("idle stack alloc failed", id);
+    idle->stack = idle_stack + idle->stack_size;
+    idle->sp = idle->stack;
+    idle->pc = (uintptr_t)idle_entry;
+    idle->spsr = 0x205;
+    name_process(idle, "idle");
+    run_queues[id].idle = idle;
+}
+
+void scheduler_release_cpu(uint32_t id){
+    if (!id || id >= MAX_CPUS) return;
+    process_t *idle = run_queues[id].idle;
+    if (!idle) return;
+    run_queues[id].idle = 0;
+    run_queues[id].current = 0;
+    run_queues[id].aged = 0;
+    pfree((void*)(idle->stack - idle->stack_size), idle->stack_size);
+    pfree(idle, (sizeof(process_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
 process_t* init_process(){
     irq_flags_t irq = irq_save_disable();
     process_t* proc = process_list;
     while (proc) {
-        if (proc != kernel_proc && proc->state == STOPPED && !proc->procfs_refs) {
+        if (proc != kernel_proc && proc->state == STOPPED && !proc->procfs_refs && !proc->on_cpu) {
             if (process_has_runtime_state(proc)) {
                 irq_restore(irq);
                 reset_process(proc);
@@ -519,12 +687,16 @@ process_t* init_process(){
                     proc->postmortem_output_size = 0;
                 }
                 proc->id = next_proc_index++;
+                proc->sched_magic = PROC_SCHED_MAGIC;
                 proc->exit_code = 0;
                 proc->state = BLOCKED;
                 proc->priority = PROC_PRIORITY_LOW;
-                proc->in_ready_queue = false;
+                proc->sched_class = PROC_CLASS_NORMAL;
+                dequeue_ready_process(proc);
+                proc->cpu = cpu_id();
                 proc->sleeping = false;
                 proc->wake_at_msec = 0;
+                ktimer_init(&proc->sleep_timer, sleep_timer_expired, proc);
                 proc->pending_reset = false;
                 proc_count++;
                 irq_restore(irq);
@@ -539,8 +711,12 @@ process_t* init_process(){
     if (!proc) panic("Out of process memory", 0);
 
     proc->id = next_proc_index++;
+    proc->sched_magic = PROC_SCHED_MAGIC;
     proc->state = BLOCKED;
     proc->priority = PROC_PRIORITY_LOW;
+    proc->sched_class = PROC_CLASS_NORMAL;
+    proc->cpu = cpu_id();
+    ktimer_init(&proc->sleep_timer, sleep_timer_expired, proc);
     proc->postmortem_output = 0;
     proc->postmortem_output_size = 0;
     proc->process_next = 0;
@@ -569,6 +745,17 @@ void name_process(process_t *proc, const char *name){
     }
 }
 
+void set_process_class(process_t *proc, ProcSchedClass sched_class){
+    if (!proc || sched_class >= PROC_CLASS_COUNT) return;
+    irq_flags_t irq = irq_save_disable();
+    proc->sched_class = sched_class;
+    if (proc->in_ready_queue && proc->ready_level != sched_class) {
+        dequeue_ready_process(proc);
+        enqueue_ready_process(proc);
+    }
+    irq_restore(irq);
+}
+
 void stop_process(uint16_t pid, int32_t exit_code){
     irq_flags_t irq = irq_save_disable();
     process_t *proc = get_proc_by_pid(pid);
@@ -583,15 +770,15 @@ void stop_process(uint16_t pid, int32_t exit_code){
 
     kprintf("[SCHEDULER] Stop process %i with code %i",proc->id,proc->exit_code);
     
-    proc->in_ready_queue = false;
+    dequeue_ready_process(proc);
     proc->sleeping = false;
     proc->wake_at_msec = 0;
     if (proc->focused)
         sys_unset_focus(false);
     
-    remove_sleeping_process(proc, pid);
-    update_sleep_timer();
+    ktimer_cancel(&proc->sleep_timer);
     if (!current) {
+        if (proc->on_cpu) smp_send_reschedule(proc->cpu);
         irq_restore(irq);
         return;
     }
@@ -631,24 +818,19 @@ void sleep_process(uint64_t msec){
         return;
     }
 
+    //A wakeup posted after the wait was armed but before the sleep cuts it short instead of getting lost.
+    //Only queued waiters get one and wait_queue_add/remove clear it, so plain sleeps run their full time
+    if (current_proc->wake_pending) {
+        current_proc->wake_pending = false;
+        irq_restore(irq);
+        return;
+    }
+
     uint64_t wake_at = timer_now_msec() + msec;
     current_proc->state = BLOCKED;
     current_proc->sleeping = true;
     current_proc->wake_at_msec = wake_at;
-
-    linked_list_node_t *it = sleeping_list.head, *prev = 0;
-    while (it) {
-        process_t *cur = (process_t*)it->data;
-        if (!cur || cur->wake_at_msec > wake_at) break;
-        prev = it;
-        it = it->next;
-    }
-
-    linked_list_insert_after(&sleeping_list, prev, current_proc);
-    if (sleeping_list.head && sleeping_list.head->data == current_proc){
-        virtual_timer_reset(msec);
-        virtual_timer_enable();
-    }
+    ktimer_arm(&current_proc->sleep_timer, wake_at);
     switch_proc(YIELD);
     irq_restore(irq);
 }
@@ -662,41 +844,18 @@ void wake_process(process_t *proc){
         return;
     }
 
-    if (remove_sleeping_process(proc, proc->id)) {
+    if (ktimer_cancel(&proc->sleep_timer)) {
         proc->sleeping = false;
         proc->wake_at_msec = 0;
 
         if (proc->state == BLOCKED) enqueue_ready_process(proc);
-    }
+    } else if (!proc->sleeping && proc->wait_queue) proc->wake_pending = true;
 
-    update_sleep_timer();
     irq_restore(irq);
 }
 
 void wake_processes(){
-    irq_flags_t irq = irq_save_disable();
-    uint64_t now = timer_now_msec();
-    while (sleeping_list.head) {
-        process_t *proc = (process_t*)sleeping_list.head->data;
-
-        if (!proc) {
-            linked_list_pop_front(&sleeping_list);
-            continue;
-        }
-
-        if (proc->wake_at_msec > now) break;
-        proc = (process_t*)linked_list_pop_front(&sleeping_list);
-
-        if (proc) {
-            proc->sleeping = false;
-            proc->wake_at_msec = 0;
-
-            if (proc->state != STOPPED) enqueue_ready_process(proc);
-        }
-    }
-
-    update_sleep_timer();
-    irq_restore(irq);
+    timer_wheel_run();
 }
 
 bool load_process_module(process_t *p, system_module *m){
@@ -17,14 +17,27 @@ typedef enum {
 #define PROC_PRIORITY_HIGH 10
 #define PROC_PRIORITY_LOW  1
 
+typedef enum {
+    PROC_CLASS_REALTIME,
+    PROC_CLASS_SYSTEM,
+    PROC_CLASS_NORMAL,
+    PROC_CLASS_BACKGROUND,
+    PROC_CLASS_COUNT,
+} ProcSchedClass;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void switch_proc(ProcSwitchReason reason);
 bool start_scheduler();
+//False during boot, when nothing can sleep yet because the scheduler has no timer to wake it
+bool scheduler_running();
 void save_return_address_interrupt();
 void init_main_process();
+void scheduler_init_cpu(uint32_t id);
+//Undoes scheduler_init_cpu for a core that never came online
+void scheduler_release_cpu(uint32_t id);
 process_t* init_process();
 void ready_process(process_t *proc);
 void save_syscall_return(uint64_t value);
@@ -38,6 +51,7 @@ void block_process(process_t *proc);
 void resume_blocked_process(process_t *proc);
 
 void name_process(process_t *proc, const char *name);
+void set_process_class(process_t *proc, ProcSchedClass sched_class);
 
 void sleep_process(uint64_t msec);
 void wake_processes();
@@ -49,6 +63,7 @@ process_t* get_current_proc();
 process_t* get_kernel_proc();
 process_t* get_idle_proc();
 bool scheduler_in_idle();
+bool scheduler_should_preempt();
 process_t* get_proc_by_pid(uint16_t pid);
 uint16_t get_current_proc_pid();
 
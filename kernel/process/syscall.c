@@ -34,9 +34,9 @@
 #include "filesystem/modules/fs_isolation.h"
 #include "files/dir_list.h"
 #include "theme/theme.h"
+#include "exceptions/spinlock.h"
+#include "process/poll.h"
 
-int syscall_depth = 0;
-uintptr_t cpec;
 
 #define SYSCALL_STR(name, arg, write)\
     if (!ctx->arg) return 0;\
@@ -66,7 +66,6 @@ uptr syscall_palloc(process_t *ctx){
         if (ctx->mm.rss_anon_pages + pages > ctx->mm.cap_anon_pages) return 0;
         uptr va = mm_alloc_mmap(&ctx->mm, alloc_size, MEM_RW, VMA_KIND_ANON, VMA_FLAG_DEMAND | VMA_FLAG_USERALLOC | VMA_FLAG_ZERO);
         if (!va) return 0;
-        mmu_flush_asid(ctx->mm.asid);
         return va;
     }
 
@@ -226,6 +225,48 @@ u64 syscall_get_time(process_t *ctx){
     return timer_now_msec();
 }
 
+//Longest single sleep of a blocking syscall, longer timeouts just restart
+#define WAIT_MAX_SLICE_MS 60000
+
+//Fixed on the first run of a blocking syscall so its restarts keep counting down the same timeout
+static uint64_t syscall_wait_deadline(process_t *ctx, uint64_t timeout){
+    if (!ctx->wait_deadline_msec) {
+        uint64_t now = timer_now_msec();
+        ctx->wait_deadline_msec = timeout > UINT64_MAX - now ? UINT64_MAX : now + timeout;
+    }
+    return ctx->wait_deadline_msec;
+}
+
+static void syscall_wait_done(process_t *ctx){
+    ctx->wait_deadline_msec = 0;
+    if (ctx->wait_queue) wait_queue_remove((wait_queue_t*)ctx->wait_queue, ctx);
+}
+
+//There's no kernel stack to come back to once asleep, so the svc is rewound and the whole call
+//reruns on wakeup with the same arguments. Only returns when a wakeup was already pending
+static void syscall_wait_restart(process_t *ctx, uint64_t now){
+    uint64_t slice = ctx->wait_deadline_msec - now;
+    if (slice > WAIT_MAX_SLICE_MS) slice = WAIT_MAX_SLICE_MS;
+    ctx->pc -= 4;
+    syscall_depth--;
+    sleep_process(slice);
+    syscall_depth++;
+    ctx->pc += 4;
+}
+
+//A socket call found nothing to do, sleeps on the socket if the handle has a timeout for want.
+//False when the call should return what it got, true to retry it
+static bool syscall_socket_block(process_t *ctx, SocketHandle *handle, uint32_t want){
+    uint32_t timeout = socket_wait_prepare(handle, want, ctx->id, ctx);
+    uint64_t now = timer_now_msec();
+    if (!timeout || now >= syscall_wait_deadline(ctx, timeout == SOCK_WAIT_FOREVER ? UINT64_MAX : timeout)) {
+        syscall_wait_done(ctx);
+        return false;
+    }
+    syscall_wait_restart(ctx, now);
+    return true;
+}
+
 u64 syscall_socket_create(process_t *ctx){
     Socket_Role role = (Socket_Role)ctx->PROC_X0;
     protocol_t protocol = (protocol_t)ctx->PROC_X1;
@@ -272,8 +313,10 @@ u64 syscall_socket_listen(process_t *ctx){
 
 u64 syscall_socket_accept(process_t *ctx){
     SYSCALL_ARG(SocketHandle,handle, PROC_X0, true);
-    accept_on_socket(handle, ctx->id);
-    return 1;
+    bool accepted;
+    while (!(accepted = accept_on_socket(handle, ctx->id)) && syscall_socket_block(ctx, handle, POLL_IN));
+    syscall_wait_done(ctx);
+    return accepted;
 }
 
 u64 syscall_socket_send(process_t *ctx){
@@ -302,7 +345,14 @@ u64 syscall_socket_send(process_t *ctx){
     SYSCALL_ARG_SIZE(void, kbuf, alloc_size, PROC_X4, true);
     if (!kbuf) return 0;
 
-    return send_on_socket(handle, dst_kind, dst, port, kbuf, size, ctx->id);
+    //Only blocks while nothing at all was queued, a partial send returns so a restart can't send the start twice
+    for (;;) {
+        int64_t r = send_on_socket(handle, dst_kind, dst, port, kbuf, size, ctx->id);
+        if (r != TCP_WOULDBLOCK || !syscall_socket_block(ctx, handle, POLL_OUT)) {
+            syscall_wait_done(ctx);
+            return r;
+        }
+    }
 }
 
 u64 syscall_socket_receive(process_t *ctx){
@@ -314,7 +364,13 @@ u64 syscall_socket_receive(process_t *ctx){
     SYSCALL_ARG_SIZE(void, buf, alloc_size, PROC_X1, true);
 
     SYSCALL_ARG(net_l4_endpoint, src, PROC_X3, true);
-    return receive_from_socket(handle, buf, size, src, ctx->id);
+    for (;;) {
+        int64_t r = receive_from_socket(handle, buf, size, src, ctx->id);
+        if ((r && r != TCP_WOULDBLOCK) || !syscall_socket_block(ctx, handle, POLL_IN)) {
+            syscall_wait_done(ctx);
+            return r;
+        }
+    }
 }
 
 u64 syscall_socket_close(process_t *ctx){
@@ -322,6 +378,46 @@ u64 syscall_socket_close(process_t *ctx){
     return close_socket(handle, ctx->id);
 }
 
+u64 syscall_socket_timeout(process_t *ctx){
+    SYSCALL_ARG(SocketHandle,handle, PROC_X0, true);
+    return (u64)(int64_t)socket_set_timeouts(handle, (uint32_t)ctx->PROC_X1, (uint32_t)ctx->PROC_X2, ctx->id);
+}
+
+u64 syscall_poll_create(process_t *ctx){
+    return (u64)(int64_t)poll_create(ctx->id);
+}
+
+u64 syscall_poll_ctl(process_t *ctx){
+    int32_t set = (int32_t)ctx->PROC_X0;
+    uint8_t op = (uint8_t)ctx->PROC_X1;
+    SYSCALL_ARG(const poll_event_t, ev, PROC_X2, false);
+    return (u64)(int64_t)poll_ctl(ctx->id, set, op, ev);
+}
+
+u64 syscall_poll_wait(process_t *ctx){
+    int32_t set = (int32_t)ctx->PROC_X0;
+    uint32_t max = (uint32_t)ctx->PROC_X2;
+    uint64_t timeout = ctx->PROC_X3;
+    if (!max) return 0;
+    if (max > POLL_MAX_ENTRIES) max = POLL_MAX_ENTRIES;
+    SYSCALL_ARG_SIZE(poll_event_t, out, max * sizeof(poll_event_t), PROC_X1, true);
+
+    for (;;) {
+        uint64_t now = timer_now_msec();
+        bool can_wait = now < syscall_wait_deadline(ctx, timeout);
+        int32_t n = poll_collect(ctx, set, out, max, can_wait);
+        if (n || !can_wait) {
+            ctx->wait_deadline_msec = 0;
+            return (u64)(int64_t)n;
+        }
+        syscall_wait_restart(ctx, now);
+    }
+}
+
+u64 syscall_poll_close(process_t *ctx){
+    return (u64)(int64_t)poll_close(ctx->id, (int32_t)ctx->PROC_X0);
+}
+
 #define ISOLATEDFS
 #define ISOLATEDFS_ALLOW_KFS true
 
@@ -364,7 +460,7 @@ u64 syscall_writef(process_t *ctx){
 u64 syscall_sreadf(process_t *ctx){
     SYSCALL_STR(path, PROC_X0, false);
     size_t size = (size_t)ctx->PROC_X2;
-    SYSCALL_ARG_SIZE(void, buf, size, PROC_X1, false);
+    SYSCALL_ARG_SIZE(void, buf, size, PROC_X1, true);
 #ifdef ISOLATEDFS
     module_root rootfs = {}; 
     string s = resolve_isolated_path(path, ctx->permissions.fs_id, &rootfs, ISOLATEDFS_ALLOW_KFS);
@@ -517,6 +613,7 @@ syscall_entry syscalls[] = {
     [SOCKET_SEND_CODE] = syscall_socket_send,
     [SOCKET_RECEIVE_CODE] = syscall_socket_receive,
     [SOCKET_CLOSE_CODE] = syscall_socket_close,
+    [SOCKET_TIMEOUT_CODE] = syscall_socket_timeout,
     [FILE_OPEN_CODE] = syscall_openf,
     [FILE_READ_CODE] = syscall_readf,
     [FILE_WRITE_CODE] = syscall_writef,
@@ -529,6 +626,11 @@ syscall_entry syscalls[] = {
     // [LOAD_FSMODULE_CODE] = syscall_load_fsmod,
     // [UNLOAD_FSMODULE_CODE] = syscall_unload_fsmod,
 
+    [POLL_CREATE_CODE] = syscall_poll_create,
+    [POLL_CTL_CODE] = syscall_poll_ctl,
+    [POLL_WAIT_CODE] = syscall_poll_wait,
+    [POLL_CLOSE_CODE] = syscall_poll_close,
+
     [SIGNAL_SEND_CODE] = syscall_signal_send,
     [SIGNAL_HANDLER_CODE] = syscall_signal_handler,
     
@@ -618,6 +720,7 @@ void coredump(uintptr_t esr, uintptr_t elr, uintptr_t far, uintptr_t sp){
 
 void sync_el0_handler_c(){
     save_return_address_interrupt();
+    kernel_lock_acquire();
     mmu_ttbr0_disable_user();
 
     syscall_depth++;
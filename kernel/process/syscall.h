@@ -1,8 +1,18 @@
 #pragma once
 
 #include "types.h"
+#include "hw/smp.h"
 
-extern int syscall_depth;
-extern uintptr_t cpec;
+//Both live in the per-core block so every core tracks its own running context
+#define syscall_depth (this_cpu()->syscall_depth)
+#define cpec (this_cpu()->cpec)
+
+//Kernel side of the syscall code table, continuing syscalls/syscall_codes.h from the shared library.
+//Keep the numbering in step with it, an identical definition there is harmless
+#define POLL_CREATE_CODE 80
+#define POLL_CTL_CODE 81
+#define POLL_WAIT_CODE 82
+#define POLL_CLOSE_CODE 83
+#define SOCKET_TIMEOUT_CODE 84
 
 void trace();
\ No newline at end of file
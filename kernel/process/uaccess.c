@@ -80,6 +80,8 @@ bool validate_address(process_t *proc, uintptr_t addr, size_t size, bool want_wr
             mmu_translate((uint64_t*)proc->mm.ttbr0, addr, &st);
             if (st) return false;
         }
+        //Callers write through their own mappings or hand the pages to devices, neither faults on shared image pages
+        if (want_write && !mm_make_writable(proc, addr)) return false;
 
         addr += chunk;
         size -= chunk;
@@ -109,6 +111,9 @@ uaccess_result_t copy_to_user(process_t *proc, uintptr_t dst, const void *src, s
             pa = mmu_translate((uint64_t*)proc->mm.ttbr0, dst, &st);
             if (st) return UACCESS_EFAULT;
         }
+        if (!mm_make_writable(proc, dst)) return UACCESS_EFAULT;
+        pa = mmu_translate((uint64_t*)proc->mm.ttbr0, dst, &st);
+        if (st) return UACCESS_EFAULT;
 
         memcpy((void*)dmap_pa_to_kva((paddr_t)pa), s, chunk);
         s += chunk;
@@ -0,0 +1,112 @@
+#include "wait_queue.h"
+#include "process/process.h"
+#include "process/scheduler.h"
+#include "exceptions/irq.h"
+#include "exceptions/timer.h"
+#include "syscalls/syscalls.h"
+
+//Upper bound for a single sleep so wake_at never overflows, waits longer than this just loop
+#define KEVENT_MAX_SLICE_MS 60000
+#define KEVENT_POLL_MS 1
+
+bool wait_queue_add(wait_queue_t *wq, process_t *proc){
+    if (!wq || !proc) return false;
+    irq_flags_t irq = irq_save_disable();
+    if (proc->wait_queue) {
+        bool same = proc->wait_queue == wq;
+        irq_restore(irq);
+        return same;
+    }
+    proc->wait_next = wq->head;
+    proc->wait_queue = wq;
+    wq->head = proc;
+    //Arms a new wait, a wakeup left over from an earlier one mustn't end it early
+    proc->wake_pending = false;
+    irq_restore(irq);
+    return true;
+}
+
+void wait_queue_remove(wait_queue_t *wq, process_t *proc){
+    if (!wq || !proc) return;
+    irq_flags_t irq = irq_save_disable();
+    //The wait is over either way, a wakeup that raced in was for it and not for whatever sleeps next
+    if (!proc->wait_queue || proc->wait_queue == wq) proc->wake_pending = false;
+    if (proc->wait_queue != wq) {
+        irq_restore(irq);
+        return;
+    }
+    process_t **it = &wq->head;
+    while (*it && *it != proc) it = &(*it)->wait_next;
+    if (*it) *it = proc->wait_next;
+    proc->wait_next = 0;
+    proc->wait_queue = 0;
+    irq_restore(irq);
+}
+
+void wait_queue_wake_all(wait_queue_t *wq){
+    if (!wq) return;
+    irq_flags_t irq = irq_save_disable();
+    for (process_t *proc = wq->head; proc; proc = proc->wait_next)
+        wake_process(proc);
+    irq_restore(irq);
+}
+
+bool wait_queue_wake_one(wait_queue_t *wq){
+    if (!wq) return false;
+    irq_flags_t irq = irq_save_disable();
+    process_t *proc = wq->head;
+    if (proc) wake_process(proc);
+    irq_restore(irq);
+    return proc != 0;
+}
+
+void wait_queue_release(wait_queue_t *wq){
+    if (!wq) return;
+    irq_flags_t irq = irq_save_disable();
+    while (wq->head) {
+        process_t *proc = wq->head;
+        //Woken while still queued, so a waiter that hasn't gone to sleep yet keeps the wakeup
+        wake_process(proc);
+        wq->head = proc->wait_next;
+        proc->wait_next = 0;
+        proc->wait_queue = 0;
+    }
+    irq_restore(irq);
+}
+
+void kevent_signal(kevent_t *ev){
+    if (!ev) return;
+    irq_flags_t irq = irq_save_disable();
+    ev->signaled = true;
+    wait_queue_wake_one(&ev->waiters);
+    irq_restore(irq);
+}
+
+bool kevent_wait(kevent_t *ev, uint64_t timeout_msec){
+    if (!ev) return false;
+    process_t *proc = get_current_proc();
+    uint64_t deadline = timeout_msec ? timer_now_msec() + timeout_msec : 0;
+    for (;;) {
+        irq_flags_t irq = irq_save_disable();
+        if (ev->signaled) {
+            ev->signaled = false;
+            wait_queue_remove(&ev->waiters, proc);
+            irq_restore(irq);
+            return true;
+        }
+        uint64_t now = timer_now_msec();
+        if (deadline && now >= deadline) {
+            wait_queue_remove(&ev->waiters, proc);
+            irq_restore(irq);
+            return false;
+        }
+        //Already waiting on something else, nothing would wake this one so it polls
+        bool queued = wait_queue_add(&ev->waiters, proc);
+        irq_restore(irq);
+
+        uint64_t slice = deadline ? deadline - now : KEVENT_MAX_SLICE_MS;
+        if (slice > KEVENT_MAX_SLICE_MS) slice = KEVENT_MAX_SLICE_MS;
+        if (!queued && slice > KEVENT_POLL_MS) slice = KEVENT_POLL_MS;
+        msleep(slice);
+    }
+}
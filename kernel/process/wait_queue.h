@@ -0,0 +1,37 @@
+#pragma once
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct process process_t;
+
+typedef struct {
+    process_t *head;
+} wait_queue_t;
+
+//Auto-reset event. A signal posted while nobody waits is kept for the next waiter so wakeups are never lost.
+typedef struct {
+    wait_queue_t waiters;
+    volatile bool signaled;
+} kevent_t;
+
+#define KEVENT_WAIT_FOREVER 0
+
+//False if proc is already waiting on a different queue, a process waits on one queue at a time
+bool wait_queue_add(wait_queue_t *wq, process_t *proc);
+void wait_queue_remove(wait_queue_t *wq, process_t *proc);
+void wait_queue_wake_all(wait_queue_t *wq);
+bool wait_queue_wake_one(wait_queue_t *wq);
+//Wakes and unlinks every waiter, for queues embedded in objects that are about to be freed
+void wait_queue_release(wait_queue_t *wq);
+
+void kevent_signal(kevent_t *ev);
+//Must be called from process context, blocks through the sleep syscall. Returns false on timeout.
+bool kevent_wait(kevent_t *ev, uint64_t timeout_msec);
+
+#ifdef __cplusplus
+}
+#endif
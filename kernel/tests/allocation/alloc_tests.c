@@ -1,6 +1,12 @@
 #include "alloc_tests.h"
 #include "debug/assert.h"
 #include "memory/page_allocator.h"
+#include "memory/mmu.h"
+#include "memory/slab.h"
+#include "memory/zero_pool.h"
+#include "memory/mm_process.h"
+#include "memory/addr.h"
+#include "sysregs.h"
 
 bool test_kalloc_free(){
     void *page = palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, false);
@@ -86,6 +92,70 @@ bool test_palloc_large_reuse() {
     return true;
 }
 
+bool test_palloc_buddy_alignment() {
+    void *mem = palloc(GRANULE_2MB, MEM_PRIV_KERNEL, MEM_RW, true);
+    assert_true(mem != 0, "2MB allocation failed");
+    assert_eq(VIRT_TO_PHYS((uintptr_t)mem) & (GRANULE_2MB - 1), 0, "2MB allocation not aligned: %llx", (uint64_t)mem);
+    pfree(mem, GRANULE_2MB);
+    assert_false(page_used((uintptr_t)mem), "2MB allocation not freed");
+    return true;
+}
+
+bool test_zero_pool() {
+    uint32_t added = zero_pool_refill(2);
+    assert_true(added > 0 || zero_pool_get_stats().available, "zero pool could not be filled");
+    paddr_t pa = zero_pool_take();
+    assert_true(pa != 0, "zero pool empty after refill");
+    assert_true(page_used((uintptr_t)dmap_pa_to_kva(pa)), "pooled page not marked used");
+    uint64_t *words = (uint64_t*)dmap_pa_to_kva(pa);
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+        assert_eq(words[i], 0, "pooled page not zero at %i: %llx", i, words[i]);
+    pfree(words, PAGE_SIZE);
+    zero_pool_drain();
+    assert_eq(zero_pool_get_stats().available, 0, "zero pool not drained");
+    return true;
+}
+
+bool test_vma_lookup() {
+    mm_struct mm = {};
+    //Every other page, so neighbours can't merge and the count goes past the initial array
+    const uint16_t count = 300;
+    uaddr_t base = 0x40000000;
+    for (uint16_t i = 0; i < count; i++)
+        assert_true(mm_add_vma(&mm, base + (i * 2 * PAGE_SIZE), base + ((i * 2 + 1) * PAGE_SIZE), MEM_RW, VMA_KIND_ANON, VMA_FLAG_USERALLOC), "vma %i not added", i);
+    assert_eq(mm.vma_count, count, "wrong vma count %i", mm.vma_count);
+    assert_false(mm_add_vma(&mm, base + PAGE_SIZE - 1, base + (3 * PAGE_SIZE), MEM_RW, VMA_KIND_ANON, 0), "overlapping vma added");
+
+    for (uint16_t i = 0; i < count; i++) {
+        uaddr_t start = base + (i * 2 * PAGE_SIZE);
+        vma *m = mm_find_vma(&mm, start + 8);
+        assert_true(m && m->start == start, "vma %i not found", i);
+        assert_eq(mm_find_vma(&mm, start + PAGE_SIZE), 0, "hole after vma %i found", i);
+    }
+    assert_eq(mm_find_vma(&mm, base - 1), 0, "address below every vma found");
+
+    //Punching a hole splits one vma in two
+    assert_true(mm_add_vma(&mm, 0x80000000, 0x80000000 + (4 * PAGE_SIZE), MEM_RW, VMA_KIND_ANON, 0), "large vma not added");
+    assert_true(mm_remove_vma(&mm, 0x80000000 + PAGE_SIZE, 0x80000000 + (2 * PAGE_SIZE)), "hole not removed");
+    assert_true(mm_find_vma(&mm, 0x80000000) != 0, "vma before the hole lost");
+    assert_eq(mm_find_vma(&mm, 0x80000000 + PAGE_SIZE), 0, "hole still mapped");
+    assert_true(mm_find_vma(&mm, 0x80000000 + (3 * PAGE_SIZE)) != 0, "vma after the hole lost");
+    assert_eq(mm.vma_count, count + 2, "wrong vma count after split %i", mm.vma_count);
+
+    mm_release_vmas(&mm);
+    assert_eq(mm_find_vma(&mm, base), 0, "vma found after release");
+    return true;
+}
+
+bool test_kalloc_big_freed_with_owner() {
+    void *page = palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, false);
+    void *big = kalloc(page, PAGE_SIZE * 3, ALIGN_16B, MEM_PRIV_KERNEL);
+    assert_true(big && page_used((uintptr_t)big), "big allocation failed");
+    free_managed_page(page);
+    assert_false(page_used((uintptr_t)big), "big allocation not freed with its owner: %llx", (uint64_t)big);
+    return true;
+}
+
 bool test_kalloc_fragment_reuse() {
     void *page = palloc(PAGE_SIZE, MEM_PRIV_KERNEL, MEM_RW, false);
     void *a = kalloc(page, 64, ALIGN_16B, MEM_PRIV_KERNEL);
@@ -101,6 +171,50 @@ bool test_kalloc_fragment_reuse() {
     return true;
 }
 
+static void slab_test_ctor(void *obj){
+    *(uint64_t*)obj = 0x51AB;
+}
+
+bool test_slab_cache(){
+    slab_cache *cache = slab_cache_create("test", 40, ALIGN_64B, MEM_RW, slab_test_ctor);
+    assert_true(cache != 0, "slab cache not created");
+    void *objs[100];
+    for (int i = 0; i < 100; i++){
+        objs[i] = slab_alloc(cache);
+        assert_true(objs[i] != 0, "slab alloc %i failed", i);
+        assert_eq((uintptr_t)objs[i] & (ALIGN_64B - 1), 0, "slab object not aligned: %llx", (uint64_t)objs[i]);
+        assert_eq(*(uint64_t*)objs[i], 0x51AB, "constructor not run: %llx", *(uint64_t*)objs[i]);
+    }
+    assert_true((uintptr_t)objs[1] == (uintptr_t)objs[0] + 64, "objects not packed: %llx %llx", (uint64_t)objs[0], (uint64_t)objs[1]);
+    slab_stats stats = slab_cache_stats(cache);
+    assert_eq(stats.in_use, 100, "wrong in use count %i", stats.in_use);
+    assert_true(stats.pages >= 2, "100 objects fit in %i pages", stats.pages);
+
+    void *freed = objs[50];
+    slab_free(cache, freed);
+    void *again = slab_alloc(cache);
+    assert_eq((uintptr_t)again, (uintptr_t)freed, "freed slot not reused: %llx", (uint64_t)again);
+    objs[50] = again;
+
+    for (int i = 0; i < 100; i++) kfree(objs[i], 40);
+    stats = slab_cache_stats(cache);
+    assert_eq(stats.in_use, 0, "objects still in use after kfree %i", stats.in_use);
+    assert_true(stats.pages <= 1, "empty pages not released %i", stats.pages);
+    return true;
+}
+
+bool test_slab_size_classes(){
+    void *small = slab_alloc_size(24);
+    void *frame = slab_alloc_size(1526);
+    assert_true(small && frame, "size class alloc failed");
+    assert_eq(slab_obj_size(small), 32, "24 bytes landed in class %i", slab_obj_size(small));
+    assert_eq(slab_obj_size(frame), SLAB_MAX_CLASS_SIZE, "frame landed in class %i", slab_obj_size(frame));
+    assert_true(slab_alloc_size(SLAB_MAX_CLASS_SIZE + 1) == 0, "oversized request served by a size class");
+    kfree(small, 24);
+    kfree(frame, 1526);
+    return true;
+}
+
 bool test_after_free(){
     uint64_t *a = malloc(64);
     a[3] = 12345678;
@@ -115,10 +229,16 @@ bool alloc_tests(){
     test_palloc_reuse_single() &&
     test_palloc_reuse_gap() &&
     test_palloc_large_reuse() &&
+    test_palloc_buddy_alignment() &&
+    test_zero_pool() &&
+    test_vma_lookup() &&
+    test_kalloc_big_freed_with_owner() &&
     test_kalloc_fragment_reuse() &&
     test_kalloc_free() &&
     test_page_kalloc_free_managed() && 
     test_page_kalloc_no_free_unmanaged() && 
     test_kalloc_alignment_free() &&
+    test_slab_cache() &&
+    test_slab_size_classes() &&
     true;
 }
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include "checksum_tests.h"
+#include "debug/assert.h"
+#include "networking/net_checksum.h"
+#include "exceptions/timer.h"
+#include "console/kio.h"
+#include "syscalls/syscalls.h"
+
+#define CSUM_TEST_BUF 65536
+#define CSUM_BENCH_BYTES (4u << 20)
+
+//Straight RFC 1071 loop, what every other path is checked against
+static uint32_t csum_reference(const uint8_t *p, uint32_t len){
+    uint64_t sum = 0;
+    for (; len > 1; p += 2, len -= 2) sum += (uint32_t)((p[0] << 8) | p[1]);
+    if (len) sum += (uint32_t)(p[0] << 8);
+    while (sum >> 16) sum = (sum & 0xFFFFu) + (sum >> 16);
+    return (uint32_t)sum;
+}
+
+static void csum_fill(uint8_t *buf, uint32_t len){
+    uint32_t x = 0x12345678u;
+    for (uint32_t i = 0; i < len; i++){
+        x = x * 1664525u + 1013904223u;
+        buf[i] = (uint8_t)(x >> 24);
+    }
+}
+
+bool test_checksum_rfc1071_vector(){
+    const uint8_t data[8] = { 0x00, 0x01, 0xF2, 0x03, 0xF4, 0xF5, 0xF6, 0xF7 };
+    uint16_t sum = net_csum_reduce(net_csum_partial(data, sizeof(data), 0));
+    assert_eq(sum, 0xDDF2, "Wrong sum for the RFC 1071 example: %x", sum);
+    assert_eq(net_csum_finish(net_csum_partial(data, sizeof(data), 0)), (uint16_t)~0xDDF2, "Wrong final checksum");
+    return true;
+}
+
+bool test_checksum_matches_reference(){
+    uint8_t *buf = (uint8_t*)malloc(CSUM_TEST_BUF + 8);
+    uint8_t *dst = (uint8_t*)malloc(CSUM_TEST_BUF + 8);
+    assert_true(buf && dst, "No memory for checksum buffers");
+    csum_fill(buf, CSUM_TEST_BUF + 8);
+
+    //Every length across a few blocks at every alignment, then some large ones
+    for (uint32_t off = 0; off < 8; off++){
+        for (uint32_t len = 0; len < 300; len++){
+            uint32_t ref = csum_reference(buf + off, len);
+            uint16_t s = net_csum_reduce(net_csum_partial_scalar(buf + off, len, 0));
+            assert_eq(s, ref, "Scalar sum off=%i len=%i: %x != %x", off, len, s, ref);
+#if NET_CSUM_NEON
+            uint16_t n = net_csum_reduce(net_csum_partial_neon(buf + off, len, 0));
+            assert_eq(n, ref, "NEON sum off=%i len=%i: %x != %x", off, len, n, ref);
+#endif
+            uint16_t c = net_csum_reduce(net_csum_copy(dst + (7 - off), buf + off, len, 0));
+            assert_eq(c, ref, "Copy sum off=%i len=%i: %x != %x", off, len, c, ref);
+            for (uint32_t i = 0; i < len; i++)
+                assert_eq(dst[7 - off + i], buf[off + i], "Copy mismatch at %i", i);
+        }
+    }
+    const uint32_t big[] = { 1500, 1501, 4096, 9000, 65535, CSUM_TEST_BUF };
+    for (uint32_t i = 0; i < sizeof(big) / sizeof(big[0]); i++){
+        uint32_t ref = csum_reference(buf + 1, big[i]);
+        uint16_t s = net_csum_reduce(net_csum_partial(buf + 1, big[i], 0));
+        assert_eq(s, ref, "Sum len=%i: %x != %x", big[i], s, ref);
+    }
+
+    free_sized(buf, CSUM_TEST_BUF + 8);
+    free_sized(dst, CSUM_TEST_BUF + 8);
+    return true;
+}
+
+bool test_checksum_chaining(){
+    uint8_t buf[1500];
+    csum_fill(buf, sizeof(buf));
+    uint32_t ref = csum_reference(buf, sizeof(buf));
+    uint32_t sum = net_csum_partial(buf, 20, 0);
+    sum = net_csum_partial(buf + 20, 640, sum);
+    sum = net_csum_partial(buf + 660, sizeof(buf) - 660, sum);
+    assert_eq(net_csum_reduce(sum), ref, "Chained sum differs: %x != %x", net_csum_reduce(sum), ref);
+
+    uint8_t pseudo[12] = { 10, 0, 0, 1, 10, 0, 0, 2, 0, 6, 0x05, 0xDC };
+    uint32_t v4 = net_csum_pseudo_ipv4(0x0A000001u, 0x0A000002u, 6, sizeof(buf));
+    assert_eq(net_csum_reduce(v4), csum_reference(pseudo, sizeof(pseudo)), "IPv4 pseudo header sum wrong");
+    return true;
+}
+
+//Not pass/fail, just numbers to compare builds with
+bool bench_checksum(){
+    uint8_t *buf = (uint8_t*)malloc(CSUM_TEST_BUF);
+    uint8_t *dst = (uint8_t*)malloc(CSUM_TEST_BUF);
+    if (!buf || !dst) return true;
+    csum_fill(buf, CSUM_TEST_BUF);
+
+    const uint32_t sizes[] = { 64, 576, 1500, 9000, 65535 };
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+        uint32_t iters = CSUM_BENCH_BYTES / sizes[i];
+        volatile uint32_t sink = 0;
+
+        uint64_t t0 = timer_now_usec();
+        for (uint32_t k = 0; k < iters; k++) sink += net_csum_partial_scalar(buf, sizes[i], 0);
+        uint64_t scalar_us = timer_now_usec() - t0;
+
+        t0 = timer_now_usec();
+        for (uint32_t k = 0; k < iters; k++) sink += net_csum_copy_scalar(dst, buf, sizes[i], 0);
+        uint64_t scalar_copy_us = timer_now_usec() - t0;
+
+#if NET_CSUM_NEON
+        t0 = timer_now_usec();
+        for (uint32_t k = 0; k < iters; k++) sink += net_csum_partial_neon(buf, sizes[i], 0);
+        uint64_t neon_us = timer_now_usec() - t0;
+
+        t0 = timer_now_usec();
+        for (uint32_t k = 0; k < iters; k++) sink += net_csum_copy_neon(dst, buf, sizes[i], 0);
+        uint64_t neon_copy_us = timer_now_usec() - t0;
+
+        kprintf("[CSUM] %i bytes x%i: scalar %i us, neon %i us, copy scalar %i us, copy neon %i us", sizes[i], iters, scalar_us, neon_us, scalar_copy_us, neon_copy_us);
+#else
+        kprintf("[CSUM] %i bytes x%i: scalar %i us, copy scalar %i us", sizes[i], iters, scalar_us, scalar_copy_us);
+#endif
+        (void)sink;
+    }
+
+    free_sized(buf, CSUM_TEST_BUF);
+    free_sized(dst, CSUM_TEST_BUF);
+    return true;
+}
+
+bool checksum_tests(){
+    return
+    test_checksum_rfc1071_vector() &&
+    test_checksum_matches_reference() &&
+    test_checksum_chaining() &&
+    true;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "types.h"
+
+bool checksum_tests();
+bool bench_checksum();
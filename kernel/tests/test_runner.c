@@ -1,5 +1,6 @@
 #include "test_runner.h"
 #include "allocation/alloc_tests.h"
+#include "networking/checksum_tests.h"
 #include "console/kio.h"
 
 extern bool run_redlib_tests();
@@ -7,5 +8,12 @@ extern bool run_redlib_tests();
 bool run_tests(){
     return alloc_tests() &&
     run_redlib_tests() &&
+    checksum_tests() &&
+    true;
+}
+
+//Timing runs, only built with BENCH since they take far longer than the checks
+bool run_benchmarks(){
+    return bench_checksum() &&
     true;
 }
\ No newline at end of file
@@ -2,4 +2,5 @@
 
 #include "types.h"
 
-bool run_tests();
\ No newline at end of file
+bool run_tests();
+bool run_benchmarks();
\ No newline at end of file
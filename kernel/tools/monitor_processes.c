@@ -48,6 +48,7 @@ void print_process_info(){
             print("Stack: %x (%x). SP: %x",proc->stack, proc->stack_size, proc->sp);
             print("Heap: %x (%x)",proc->mm.mmap_bottom, calc_heap(proc->heap_phys));
             print("Flags: %x", proc->spsr);
+            if (proc->mm.ttbr0) print("Faults: %i (%i pages, %i around). Access: %i. COW: %i", proc->mm.faults, proc->mm.fault_pages, proc->mm.fault_around_pages, proc->mm.faults_access, proc->mm.faults_cow);
             print("PC: %x",proc->pc);
         }
         proc = proc->process_next;
@@ -6,9 +6,8 @@
 #include "virtio_pci.h"
 #include "async.h"
 #include "sysregs.h"
-
-//TODO implement proper virtqueue handling w/ descriptor allocation, reuse and support for multiple in-flight requests using used.ring completions
-
+#include "exceptions/irq.h"
+#include "process/scheduler.h"
 
 #define VIRTIO_PCI_CAP_COMMON_CFG   1
 #define VIRTIO_PCI_CAP_NOTIFY_CFG   2
@@ -17,6 +16,9 @@
 #define VIRTIO_PCI_CAP_PCI_CFG      5
 #define VIRTIO_PCI_CAP_VENDOR_CFG   9
 
+//Sleeps are capped so a lost interrupt only delays a waiter, it reaps the queue itself on every wakeup
+#define VIRTIO_WAIT_SLICE_MS 10
+
 struct virtio_pci_cap {
     uint8_t cap_vndr;
     uint8_t cap_next;
@@ -174,11 +176,16 @@ bool virtio_init_device(virtio_device *dev) {
         void* base = palloc(desc_alloc, MEM_PRIV_KERNEL, MEM_DEV | MEM_RW, true);
         void* avail = palloc(avail_alloc, MEM_PRIV_KERNEL, MEM_DEV | MEM_RW, true);
         void* used = palloc(used_alloc, MEM_PRIV_KERNEL, MEM_DEV | MEM_RW, true);
-        if (!base || !avail || !used) return false;
+        uint64_t inflight_alloc = (sizeof(virtio_request*) * size + (uint64_t)(PAGE_SIZE - 1)) & ~(uint64_t)(PAGE_SIZE - 1);
+        virtio_request **inflight = (virtio_request**)palloc(inflight_alloc, MEM_PRIV_KERNEL, MEM_RW, true);
+        if (!base || !avail || !used || !inflight) return false;
 
         memset(base, 0, desc_alloc);
         memset(avail, 0, avail_alloc);
         memset(used, 0, used_alloc);
+        memset(inflight, 0, inflight_alloc);
+        for (uint16_t i = 0; i < size; i++)
+            ((virtq_desc*)base)[i].next = (uint16_t)(i + 1);
         uint64_t desc_pa = VIRT_TO_PHYS((uint64_t)base);
         uint64_t driver_pa = VIRT_TO_PHYS((uint64_t)avail);
         uint64_t device_pa = VIRT_TO_PHYS((uint64_t)used);
@@ -199,6 +206,11 @@ bool virtio_init_device(virtio_device *dev) {
         dev->queues[queue_index].desc = (volatile virtq_desc*)base;
         dev->queues[queue_index].driver = (volatile virtq_avail*)avail;
         dev->queues[queue_index].device = (volatile virtq_used*)used;
+        dev->queues[queue_index].free_head = 0;
+        dev->queues[queue_index].num_free = size;
+        dev->queues[queue_index].last_used_idx = 0;
+        dev->queues[queue_index].kicked_idx = 0;
+        dev->queues[queue_index].inflight = inflight;
     }
 
     kprintfv("Device initialized %i virtqueues", dev->num_queues);
@@ -223,9 +235,8 @@ uint32_t select_queue(virtio_device *dev, uint32_t index){
     return dev->queues[index].size;
 }
 
-void virtio_notify(virtio_device *dev) {
+static void virtio_notify_queue(virtio_device *dev, uint16_t index) {
     if (!dev || !dev->notify_cfg) return;
-    uint16_t index = dev->current_queue;
     if (index >= VIRTIO_MAX_QUEUES) return;
     if (!dev->queues[index].valid) return;
 
@@ -238,68 +249,189 @@ void virtio_notify(virtio_device *dev) {
     *(volatile uint16_t*)((uintptr_t)dev->notify_cfg + (uint64_t)off * (uint64_t)mul) = value;
 }
 
-bool virtio_send_nd(virtio_device *dev, const virtio_buf *bufs, uint16_t n) {
+void virtio_notify(virtio_device *dev) {
+    if (!dev) return;
+    virtio_notify_queue(dev, dev->current_queue);
+}
 
-    if (!dev || !bufs || !n) return false;
+//used_event lives right after the avail ring, avail_event right after the used ring
+#define VQ_USED_EVENT(q) (*(volatile uint16_t*)&(q)->driver->ring[(q)->size])
+#define VQ_AVAIL_EVENT(q) (*(volatile uint16_t*)&(q)->device->ring[(q)->size])
 
-    if (dev->current_queue >= VIRTIO_MAX_QUEUES) return false;
-    virtio_queue *queue = &dev->queues[dev->current_queue];
-    if (!queue->valid || !queue->size || n > queue->size) return false;
+static inline bool virtio_event_idx(virtio_device *dev){
+    return (dev->negotiated_features & (1ULL << VIRTIO_F_RING_EVENT_IDX)) != 0;
+}
 
-    volatile virtq_desc* d = queue->desc;
-    volatile virtq_avail* a = queue->driver;
-    volatile virtq_used* u = queue->device;
-    if (!d || !a || !u) return false;
+static inline bool vring_need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx){
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
 
-    uint16_t qsz = queue->size;
-    uint16_t last_used_idx = u->idx;
+static virtio_queue* virtio_engine_queue(virtio_device *dev, uint16_t index){
+    if (!dev || index >= VIRTIO_MAX_QUEUES) return 0;
+    virtio_queue *queue = &dev->queues[index];
+    if (!queue->valid || !queue->size || !queue->inflight) return 0;
+    if (!queue->desc || !queue->driver || !queue->device) return 0;
+    return queue;
+}
+
+//Takes n descriptors off the free list and publishes the chain in the avail ring without notifying the device. Returns the head descriptor or -1
+int32_t virtio_queue_add(virtio_device *dev, uint16_t index, const virtio_buf *bufs, uint16_t n, virtio_request *req) {
+    virtio_queue *queue = virtio_engine_queue(dev, index);
+    if (!queue || !bufs || !n || n > queue->size) return -1;
+    for (uint16_t i = 0; i < n; ++i)
+        if (!bufs[i].addr || !bufs[i].len) return -1;
+
+    irq_flags_t irq = irq_save_disable();
+    if (queue->num_free < n){
+        irq_restore(irq);
+        return -1;
+    }
 
+    volatile virtq_desc* d = queue->desc;
+    volatile virtq_avail* a = queue->driver;
+    uint16_t head = queue->free_head;
+    uint16_t idx = head;
     for (uint16_t i = 0; i < n; ++i) {
-        if (!bufs[i].addr || !bufs[i].len) return false;
-        d[i].addr = VIRT_TO_PHYS(bufs[i].addr);
-        d[i].len = bufs[i].len;
-        d[i].flags = bufs[i].flags;
-        if (i + 1 < n) {
-            d[i].flags |= VIRTQ_DESC_F_NEXT;
-            d[i].next = (uint16_t)(i + 1);
-        } else {
-            d[i].next = 0;
-        }
+        d[idx].addr = VIRT_TO_PHYS(bufs[i].addr);
+        d[idx].len = bufs[i].len;
+        d[idx].flags = bufs[i].flags & ~VIRTQ_DESC_F_NEXT;
+        if (i + 1 < n) d[idx].flags |= VIRTQ_DESC_F_NEXT;
+        idx = d[idx].next;
     }
+    queue->free_head = idx;
+    queue->num_free -= n;
 
-    asm volatile ("dmb ishst" ::: "memory");
+    if (req){
+        req->used_len = 0;
+        req->complete = false;
+        req->event.signaled = false;
+    }
+    queue->inflight[head] = req;
 
-    a->ring[a->idx % qsz] = 0;
     asm volatile ("dmb ishst" ::: "memory");
-    a->idx++;
+    a->ring[a->idx % queue->size] = head;
     asm volatile ("dmb ishst" ::: "memory");
-    virtio_notify(dev);
+    a->idx++;
+    irq_restore(irq);
+    return head;
+}
 
-    while (last_used_idx == u->idx);//TODO: OPT
+//Notifies the device of everything added since the last kick, unless event idx says it's not listening for it
+void virtio_queue_kick(virtio_device *dev, uint16_t index) {
+    virtio_queue *queue = virtio_engine_queue(dev, index);
+    if (!queue) return;
+
+    irq_flags_t irq = irq_save_disable();
+    asm volatile ("dmb ish" ::: "memory");
+    uint16_t new_idx = queue->driver->idx;
+    uint16_t old_idx = queue->kicked_idx;
+    queue->kicked_idx = new_idx;
+    bool notify = new_idx != old_idx;
+    if (notify && virtio_event_idx(dev))
+        notify = vring_need_event(VQ_AVAIL_EVENT(queue), new_idx, old_idx);
+    if (notify) virtio_notify_queue(dev, index);
+    irq_restore(irq);
+}
 
+bool virtio_submit(virtio_device *dev, uint16_t index, const virtio_buf *bufs, uint16_t n, virtio_request *req) {
+    if (virtio_queue_add(dev, index, bufs, n, req) < 0) return false;
+    virtio_queue_kick(dev, index);
     return true;
 }
 
-void virtio_add_buffer(virtio_device *dev, uint16_t index, uint64_t buf, uint32_t buf_len, bool host_to_dev) {
-    if (!dev) return;
-    if (dev->current_queue >= VIRTIO_MAX_QUEUES) return;
-
-    virtio_queue *queue = &dev->queues[dev->current_queue];
-    if (!queue->valid || !queue->size) return;
+//Returns finished chains to the free list and completes their requests. Safe to call from the queue's interrupt handler
+uint32_t virtio_reap(virtio_device *dev, uint16_t index) {
+    virtio_queue *queue = virtio_engine_queue(dev, index);
+    if (!queue) return 0;
 
+    irq_flags_t irq = irq_save_disable();
     volatile virtq_desc* d = queue->desc;
-    volatile virtq_avail* a = queue->driver;
-    if (!d || !a) return;
-    
-    d[index].addr = VIRT_TO_PHYS(buf);
-    d[index].len = buf_len;
-    d[index].flags = host_to_dev ? 0 : VIRTQ_DESC_F_WRITE;
-    d[index].next = 0;
+    volatile virtq_used* u = queue->device;
+    uint32_t reaped = 0;
+    while (queue->last_used_idx != u->idx) {
+        asm volatile ("dmb ishld" ::: "memory");
+        volatile virtq_used_elem *e = &u->ring[queue->last_used_idx % queue->size];
+        uint32_t head = e->id;
+        uint32_t len = e->len;
+        queue->last_used_idx++;
+        if (head >= queue->size) continue;
+
+        uint16_t idx = (uint16_t)head;
+        uint16_t count = 1;
+        while ((d[idx].flags & VIRTQ_DESC_F_NEXT) && count < queue->size) {
+            idx = d[idx].next;
+            count++;
+        }
+        d[idx].next = queue->free_head;
+        queue->free_head = (uint16_t)head;
+        queue->num_free += count;
+
+        virtio_request *req = queue->inflight[head];
+        queue->inflight[head] = 0;
+        reaped++;
+        if (!req) continue;
+        void (*done)(virtio_request*, uint32_t) = req->done;
+        req->used_len = len;
+        //Signaled before complete is set, a waiter that sees complete may already be done with req
+        kevent_signal(&req->event);
+        asm volatile ("dmb ish" ::: "memory");
+        req->complete = true;
+        if (done) done(req, len);
+    }
+    if (virtio_event_idx(dev)){
+        VQ_USED_EVENT(queue) = queue->last_used_idx;
+        asm volatile ("dmb ish" ::: "memory");
+    }
+    irq_restore(irq);
+    return reaped;
+}
 
-    asm volatile ("dmb ishst" ::: "memory");
-    a->ring[a->idx % queue->size] = index;
-    asm volatile ("dmb ishst" ::: "memory");
-    a->idx++;
-    asm volatile ("dmb ishst" ::: "memory");
-    virtio_notify(dev);
-}
\ No newline at end of file
+//Only a process running with interrupts enabled can block, anything else has to keep polling
+bool virtio_can_sleep(){
+    uint64_t daif;
+    asm volatile ("mrs %0, daif" : "=r"(daif));
+    if (daif & SPSR_IRQ_MASKED) return false;
+    process_t *proc = get_current_proc();
+    return scheduler_running() && proc && proc != get_idle_proc();
+}
+
+bool virtio_wait(virtio_device *dev, uint16_t index, virtio_request *req) {
+    virtio_queue *queue = virtio_engine_queue(dev, index);
+    if (!queue || !req) return false;
+    while (!req->complete) {
+        if (virtio_reap(dev, index)) continue;
+        if (queue->irq_reap && virtio_can_sleep()) kevent_wait(&req->event, VIRTIO_WAIT_SLICE_MS);
+        else asm volatile ("yield");
+    }
+    return true;
+}
+
+bool virtio_send_nd(virtio_device *dev, const virtio_buf *bufs, uint16_t n) {
+    if (!dev || dev->current_queue >= VIRTIO_MAX_QUEUES) return false;
+    uint16_t index = dev->current_queue;
+    virtio_queue *queue = &dev->queues[index];
+
+    virtio_request req = {0};
+    while (virtio_queue_add(dev, index, bufs, n, &req) < 0) {
+        //Only a full ring is worth waiting on
+        if (!virtio_engine_queue(dev, index) || n > queue->size || queue->num_free >= n) return false;
+        if (!virtio_reap(dev, index)) asm volatile ("yield");
+    }
+    virtio_queue_kick(dev, index);
+
+    return virtio_wait(dev, index, &req);
+}
+
+//Single descriptor, fire and forget. Goes through the free list like any other chain, a full ring is reaped once before giving up
+bool virtio_add_buffer(virtio_device *dev, uint64_t buf, uint32_t buf_len, bool host_to_dev) {
+    if (!dev || dev->current_queue >= VIRTIO_MAX_QUEUES) return false;
+    uint16_t index = dev->current_queue;
+
+    virtio_buf b = VBUF(buf, buf_len, host_to_dev ? 0 : VIRTQ_DESC_F_WRITE);
+    if (virtio_queue_add(dev, index, &b, 1, 0) < 0) {
+        virtio_reap(dev, index);
+        if (virtio_queue_add(dev, index, &b, 1, 0) < 0) return false;
+    }
+    virtio_queue_kick(dev, index);
+    return true;
+}
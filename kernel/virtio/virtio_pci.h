@@ -1,6 +1,7 @@
 #pragma once
 
 #include "types.h"
+#include "process/wait_queue.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,6 +12,7 @@ extern "C" {
 
 #define VIRTIO_VENDOR 0x1AF4
 
+#define VIRTIO_F_RING_EVENT_IDX 29
 #define VIRTIO_F_VERSION_1 32
 #define VIRTIO_F_NOTIFICATION_DATA 38
 
@@ -71,6 +73,16 @@ typedef struct {
     virtq_used_elem ring[];
 }__attribute__((packed)) virtq_used;
 
+//Caller owned, must stay alive until complete is set. done runs with interrupts disabled from whoever reaps the used ring.
+//event is signaled on completion so virtio_wait can sleep on it
+typedef struct virtio_request {
+    void (*done)(struct virtio_request *req, uint32_t len);
+    void *ctx;
+    uint32_t used_len;
+    volatile bool complete;
+    kevent_t event;
+} virtio_request;
+
 typedef struct virtio_queue {
     bool valid;
     uint16_t size;
@@ -82,6 +94,13 @@ typedef struct virtio_queue {
     volatile virtq_desc *desc;
     volatile virtq_avail *driver;
     volatile virtq_used *device;
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t last_used_idx;
+    uint16_t kicked_idx;
+    //Set by drivers whose interrupt handler reaps this queue, lets waiters sleep instead of polling it
+    bool irq_reap;
+    virtio_request **inflight;
 } virtio_queue;
 
 typedef struct virtio_device {
@@ -112,7 +131,13 @@ void virtio_enable_verbose();
 void virtio_get_capabilities(virtio_device *dev, uint64_t pci_addr, uint64_t *mmio_start, uint64_t *mmio_size);
 bool virtio_init_device(virtio_device *dev);
 bool virtio_send_nd(virtio_device *dev, const virtio_buf *bufs, uint16_t n);
-void virtio_add_buffer(virtio_device *dev, uint16_t index, uint64_t buf, uint32_t buf_len, bool host_to_dev);
+int32_t virtio_queue_add(virtio_device *dev, uint16_t queue, const virtio_buf *bufs, uint16_t n, virtio_request *req);
+void virtio_queue_kick(virtio_device *dev, uint16_t queue);
+bool virtio_submit(virtio_device *dev, uint16_t queue, const virtio_buf *bufs, uint16_t n, virtio_request *req);
+uint32_t virtio_reap(virtio_device *dev, uint16_t queue);
+bool virtio_wait(virtio_device *dev, uint16_t queue, virtio_request *req);
+bool virtio_can_sleep();
+bool virtio_add_buffer(virtio_device *dev, uint64_t buf, uint32_t buf_len, bool host_to_dev);
 uint32_t select_queue(virtio_device *dev, uint32_t index);
 
 #ifdef __cplusplus
@@ -1,6 +1,7 @@
 #include "audio/audio.h"
 #include "virtio_audio_pci.hpp"
 #include "kernel_processes/kprocess_loader.h"
+#include "process/scheduler.h"
 #include "syscalls/syscalls.h"
 #include "exceptions/timer.h"
 #include "exceptions/exception_handler.h"
@@ -181,7 +182,9 @@ static int audio_mixer(int argc, char* argv[]){
 
 process_t* init_audio_mixer(){
     if (!audio_driver || !audio_driver->out_dev) return 0;
-    return create_kernel_process("Audio out", audio_mixer, 0, 0);
+    process_t *proc = create_kernel_process("Audio out", audio_mixer, 0, 0);
+    set_process_class(proc, PROC_CLASS_REALTIME);
+    return proc;
 }
 
 
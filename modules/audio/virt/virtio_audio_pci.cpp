@@ -114,7 +114,7 @@ bool VirtioAudioDriver::init(){
     //TODO: This should (probably) be for input devices only
     // for (uint16_t i = 0; i < 128; i++){
     //     void* buf = kalloc(audio_dev.memory_page, sizeof(virtio_snd_event), ALIGN_64B, MEM_PRIV_KERNEL);
-    //     virtio_add_buffer(&audio_dev, i, (uintptr_t)buf, sizeof(virtio_snd_event));
+    //     virtio_add_buffer(&audio_dev, (uintptr_t)buf, sizeof(virtio_snd_event), false);
     // }
 
     select_queue(&audio_dev, CONTROL_QUEUE);
@@ -218,12 +218,14 @@ void VirtioAudioDriver::send_buffer(sizedptr buf){
     if (!audio_dev.queues[TRANSMIT_QUEUE].valid || !audio_dev.queues[TRANSMIT_QUEUE].size) return;
 
     select_queue(&audio_dev, TRANSMIT_QUEUE);
-    uint16_t qsz = audio_dev.queues[TRANSMIT_QUEUE].size;
-    uint16_t index = cmd_index % qsz;
-    virtio_add_buffer(&audio_dev, index, buf.ptr, buf.size, true);
-    cmd_index++;
-    volatile virtq_used* u = audio_dev.queues[TRANSMIT_QUEUE].device;
-    while (u && (uint16_t)(cmd_index - u->idx) > 2) msleep(1);
+    virtio_queue *q = &audio_dev.queues[TRANSMIT_QUEUE];
+    if (!virtio_add_buffer(&audio_dev, buf.ptr, buf.size, true)) return;
+    //Keep at most two periods queued ahead of the device, reaping hands their descriptors back
+    while (true) {
+        virtio_reap(&audio_dev, TRANSMIT_QUEUE);
+        if ((uint16_t)(q->size - q->num_free) <= 2) break;
+        msleep(1);
+    }
 }
 
 typedef struct virtio_snd_pcm_set_params { 
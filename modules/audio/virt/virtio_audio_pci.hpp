@@ -30,7 +30,6 @@ private:
 
     uint16_t last_used_idx = 0;
 
-    uint16_t cmd_index = 0;
 
     virtio_device audio_dev = {};
 };
\ No newline at end of file
@@ -22,6 +22,25 @@ extern "C" void disk_read(void *buffer, uint32_t sector, uint32_t count){
     sdhci_driver.read(buffer, sector, count);
 }
 
+//SDHCI transfers are synchronous, so requests complete before they're queued
+extern "C" bool disk_read_async(void *buffer, uint32_t sector, uint32_t count, disk_done_fn done, void *ctx){
+    bool ok = sdhci_driver.read(buffer, sector, count);
+    if (done) done(ctx, ok);
+    return true;
+}
+
+extern "C" bool disk_write_async(const void *buffer, uint32_t sector, uint32_t count, disk_done_fn done, void *ctx){
+    sdhci_driver.write(buffer, sector, count);
+    if (done) done(ctx, true);
+    return true;
+}
+
+extern "C" void disk_submit(){}
+
+extern "C" void disk_wait_all(){}
+
+extern "C" void disk_handle_interrupt(){}
+
 system_module disk_module = (system_module){
     .name = "sdhci",
     .mount = "disk",
@@ -6,10 +6,20 @@
 #include "sysregs.h"
 #include "memory/page_allocator.h"
 #include "exceptions/irq.h"
+#include "memory/va_layout.h"
 
 #define VIRTIO_BLK_T_IN   0
 #define VIRTIO_BLK_T_OUT  1
 
+#define VIRTIO_BLK_S_OK   0
+
+#define BLK_REQUEST_QUEUE 0
+#define BLK_MAX_SLOTS 32
+#define BLK_MAX_SEGS 16
+#define BLK_MAX_SECTORS 2048
+//Sleeps are capped so a lost interrupt only delays a waiter, it reaps the queue itself on every wakeup
+#define BLK_WAIT_SLICE_MS 10
+
 typedef struct {
     uint32_t type;
     uint32_t reserved;
@@ -19,11 +29,37 @@ typedef struct {
 #define VIRTIO_BLK_SUPPORTED_FEATURES \
     ((1 << 0) | (1 << 1) | (1 << 4))
 
+typedef struct {
+    void *target;
+    void *bounce;
+    uint32_t size;
+    disk_done_fn done;
+    void *ctx;
+} blk_segment;
+
+//One virtio-blk request, possibly covering several merged caller requests for contiguous sectors
+typedef struct {
+    virtio_request vreq;
+    virtio_blk_req *cmd;
+    uint8_t *status;
+    uint32_t type;
+    uint32_t sector;
+    uint32_t count;
+    uint16_t nsegs;
+    bool busy;
+    blk_segment segs[BLK_MAX_SEGS];
+} blk_slot;
 
 static bool blk_disk_enable_verbose;
 static virtio_device blk_dev;
-static virtio_blk_req *disk_cmd;
-static uint8_t *disk_status;
+static bool blk_ready;
+static blk_slot blk_slots[BLK_MAX_SLOTS];
+static blk_slot *blk_plugged;
+static volatile uint32_t blk_inflight;
+//Segments per request, a request plus its header and status descriptors has to fit the ring on its own
+static uint16_t blk_max_segs;
+//Signaled whenever a request completes, which frees both a slot and ring descriptors
+static kevent_t blk_progress;
 
 #define VIRTIO_BLK_ID 0x1001
 
@@ -47,6 +83,9 @@ bool init_disk_device(){
         return false;
     }
 
+    uint8_t interrupts_ok = pci_setup_interrupts(addr, DISK_IRQ, 1);
+    if (!interrupts_ok) kprintfv("Disk interrupts unavailable, completions will be polled");
+
     pci_enable_device(addr);
 
     uint64_t disk_device_address, disk_device_size;
@@ -58,55 +97,197 @@ bool init_disk_device(){
         return false;
     }
 
-    disk_cmd = (virtio_blk_req*)kalloc(blk_dev.memory_page, sizeof(virtio_blk_req), ALIGN_64B, MEM_PRIV_KERNEL);
-    disk_status = (uint8_t*)kalloc(blk_dev.memory_page, 64, ALIGN_64B, MEM_PRIV_KERNEL);
-    if (!disk_cmd || !disk_status) {
-        if (disk_cmd) kfree(disk_cmd, sizeof(virtio_blk_req));
-        if (disk_status) kfree(disk_status, 64);
-        kprintf("failed disk DMA buffer");
+    uint16_t queue_size = blk_dev.queues[BLK_REQUEST_QUEUE].size;
+    if (queue_size < 3){
+        kprintf("Disk request queue too small (%i)", queue_size);
         return false;
     }
+    blk_max_segs = queue_size - 2 < BLK_MAX_SEGS ? queue_size - 2 : BLK_MAX_SEGS;
 
+    if (interrupts_ok){
+        select_queue(&blk_dev, BLK_REQUEST_QUEUE);
+        blk_dev.common_cfg->queue_msix_vector = 0;
+        blk_dev.queues[BLK_REQUEST_QUEUE].irq_reap = true;
+    }
+
+    for (uint32_t i = 0; i < BLK_MAX_SLOTS; i++){
+        blk_slot *slot = &blk_slots[i];
+        slot->cmd = (virtio_blk_req*)kalloc(blk_dev.memory_page, sizeof(virtio_blk_req), ALIGN_64B, MEM_PRIV_KERNEL);
+        slot->status = (uint8_t*)kalloc(blk_dev.memory_page, 64, ALIGN_64B, MEM_PRIV_KERNEL);
+        if (!slot->cmd || !slot->status) {
+            kprintf("failed disk DMA buffer");
+            return false;
+        }
+        slot->vreq.ctx = slot;
+        slot->busy = false;
+    }
 
     blk_dev.common_cfg->device_status |= VIRTIO_STATUS_DRIVER_OK;
+    blk_ready = true;
     return true;
 }
 
-void disk_write(const void *buffer, uint32_t sector, uint32_t count){
-    if (!disk_cmd || !disk_status || !count) return;
+//Buffers outside the linear map (kernel image, user memory) can't be handed to the device by physical address
+static inline bool blk_dma_direct(const void *buffer){
+    uintptr_t va = (uintptr_t)buffer;
+    return va >= HIGH_VA && va < KERNEL_IMAGE_VA_BASE;
+}
+
+static void blk_complete(virtio_request *req, uint32_t len){
+    blk_slot *slot = (blk_slot*)req->ctx;
+    bool ok = slot->status[0] == VIRTIO_BLK_S_OK;
+    if (!ok) kprintfv("Disk request for sector %i failed with %i", slot->sector, slot->status[0]);
+    for (uint16_t i = 0; i < slot->nsegs; i++){
+        blk_segment *seg = &slot->segs[i];
+        if (seg->bounce){
+            if (ok && slot->type == VIRTIO_BLK_T_IN) memcpy(seg->target, seg->bounce, seg->size);
+            kfree(seg->bounce, seg->size);
+        }
+        if (seg->done) seg->done(seg->ctx, ok);
+    }
+    slot->nsegs = 0;
+    slot->busy = false;
+    blk_inflight--;
+    kevent_signal(&blk_progress);
+}
+
+//Hands the plugged slot to the device. False if the ring has no room for it yet, the slot then stays plugged
+static bool blk_unplug(){
+    blk_slot *slot = blk_plugged;
+    if (!slot) return true;
+
+    slot->cmd->type = slot->type;
+    slot->cmd->reserved = 0;
+    slot->cmd->sector = slot->sector;
+    slot->status[0] = 0xFF;
+
+    uint16_t data_flags = slot->type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0;
+    virtio_buf b[BLK_MAX_SEGS + 2];
+    uint16_t n = 0;
+    b[n++] = VBUF(slot->cmd, sizeof(virtio_blk_req), 0);
+    for (uint16_t i = 0; i < slot->nsegs; i++)
+        b[n++] = VBUF(slot->segs[i].bounce ? slot->segs[i].bounce : slot->segs[i].target, slot->segs[i].size, data_flags);
+    b[n++] = VBUF(slot->status, 1, VIRTQ_DESC_F_WRITE);
+
+    slot->vreq.done = blk_complete;
+    if (virtio_queue_add(&blk_dev, BLK_REQUEST_QUEUE, b, n, &slot->vreq) < 0) return false;
+    blk_plugged = 0;
+    blk_inflight++;
+    return true;
+}
+
+//Must be called without the lock held. Reaps what the device finished, if there was nothing it sleeps on ev
+//when the interrupt will reap for it, otherwise it just yields and the caller polls again
+static void blk_wait(kevent_t *ev){
+    virtio_queue_kick(&blk_dev, BLK_REQUEST_QUEUE);
+    if (virtio_reap(&blk_dev, BLK_REQUEST_QUEUE)) return;
+    if (blk_dev.queues[BLK_REQUEST_QUEUE].irq_reap && virtio_can_sleep()) kevent_wait(ev, BLK_WAIT_SLICE_MS);
+    else asm volatile ("yield");
+}
+
+//The plugged slot if the request merges into it, otherwise a freshly plugged one. 0 while the ring or every slot is busy
+static blk_slot* blk_plug_slot(uint32_t type, uint32_t sector, uint32_t count){
+    blk_slot *slot = blk_plugged;
+    if (slot && slot->type == type && slot->sector + slot->count == sector && slot->nsegs < blk_max_segs && slot->count + count <= BLK_MAX_SECTORS)
+        return slot;
+    if (!blk_unplug()) return 0;
+
+    for (uint32_t i = 0; i < BLK_MAX_SLOTS; i++){
+        slot = &blk_slots[i];
+        if (slot->busy) continue;
+        slot->busy = true;
+        slot->type = type;
+        slot->sector = sector;
+        slot->count = 0;
+        slot->nsegs = 0;
+        blk_plugged = slot;
+        return slot;
+    }
+    return 0;
+}
+
+static bool blk_queue(uint32_t type, void *buffer, uint32_t sector, uint32_t count, disk_done_fn done, void *ctx){
+    if (!blk_ready || !buffer || !count) return false;
+    uint32_t size = count * 512;
+
     irq_flags_t irq = irq_save_disable();
-    
-    void* data = kalloc(blk_dev.memory_page, count * 512, ALIGN_64B, MEM_PRIV_KERNEL);
-    if (!data) {
+    void *bounce = 0;
+    if (!blk_dma_direct(buffer)){
+        bounce = kalloc(blk_dev.memory_page, size, ALIGN_64B, MEM_PRIV_KERNEL);
+        if (!bounce){
+            irq_restore(irq);
+            return false;
+        }
+        if (type == VIRTIO_BLK_T_OUT) memcpy(bounce, buffer, size);
+    }
+
+    blk_slot *slot;
+    while (!(slot = blk_plug_slot(type, sector, count))){
         irq_restore(irq);
-        return;
+        blk_wait(&blk_progress);
+        irq = irq_save_disable();
     }
 
-    memcpy(data, buffer, count * 512);
+    slot->segs[slot->nsegs++] = (blk_segment){ .target = buffer, .bounce = bounce, .size = size, .done = done, .ctx = ctx };
+    slot->count += count;
+    irq_restore(irq);
+    return true;
+}
+
+bool disk_read_async(void *buffer, uint32_t sector, uint32_t count, disk_done_fn done, void *ctx){
+    return blk_queue(VIRTIO_BLK_T_IN, buffer, sector, count, done, ctx);
+}
 
-    disk_cmd->type = VIRTIO_BLK_T_OUT;
-    disk_cmd->reserved = 0;
-    disk_cmd->sector = sector;
+bool disk_write_async(const void *buffer, uint32_t sector, uint32_t count, disk_done_fn done, void *ctx){
+    return blk_queue(VIRTIO_BLK_T_OUT, (void*)buffer, sector, count, done, ctx);
+}
 
-    disk_status[0] = 0;
-    virtio_buf b[3] = {VBUF(disk_cmd, sizeof(virtio_blk_req), 0), VBUF(data, count * 512, 0), VBUF(disk_status, 1, VIRTQ_DESC_F_WRITE)};
-    virtio_send_nd(&blk_dev, b, 3);
-    kfree((void *)data,count * 512);
+void disk_submit(){
+    if (!blk_ready) return;
+    irq_flags_t irq = irq_save_disable();
+    while (!blk_unplug()){
+        irq_restore(irq);
+        blk_wait(&blk_progress);
+        irq = irq_save_disable();
+    }
+    virtio_queue_kick(&blk_dev, BLK_REQUEST_QUEUE);
     irq_restore(irq);
 }
 
-void disk_read(void *buffer, uint32_t sector, uint32_t count){
-    if (!disk_cmd || !disk_status || !count) return;
+void disk_wait_all(){
+    disk_submit();
+    while (blk_inflight) blk_wait(&blk_progress);
+}
 
-    irq_flags_t irq = irq_save_disable();
-    disk_cmd->type = VIRTIO_BLK_T_IN;
-    disk_cmd->reserved = 0;
-    disk_cmd->sector = sector;
+void disk_handle_interrupt(){
+    if (blk_ready) virtio_reap(&blk_dev, BLK_REQUEST_QUEUE);
+}
 
-    disk_status[0] = 0;
-    virtio_buf b[3] = {VBUF(disk_cmd, sizeof(virtio_blk_req), 0), VBUF(buffer, count * 512, VIRTQ_DESC_F_WRITE), VBUF(disk_status, 1, VIRTQ_DESC_F_WRITE)};
-    virtio_send_nd(&blk_dev, b, 3);
-    irq_restore(irq);
+typedef struct {
+    kevent_t done;
+    volatile int result;
+} blk_sync_wait;
+
+static void blk_sync_done(void *ctx, bool ok){
+    blk_sync_wait *wait = (blk_sync_wait*)ctx;
+    //Signaled before result is set, the waiter's frame may be gone once it sees result
+    kevent_signal(&wait->done);
+    wait->result = ok ? 1 : -1;
+}
+
+static void blk_sync(uint32_t type, void *buffer, uint32_t sector, uint32_t count){
+    blk_sync_wait wait = {0};
+    if (!blk_queue(type, buffer, sector, count, blk_sync_done, &wait)) return;
+    disk_submit();
+    while (!wait.result) blk_wait(&wait.done);
+}
+
+void disk_write(const void *buffer, uint32_t sector, uint32_t count){
+    blk_sync(VIRTIO_BLK_T_OUT, (void*)buffer, sector, count);
+}
+
+void disk_read(void *buffer, uint32_t sector, uint32_t count){
+    blk_sync(VIRTIO_BLK_T_IN, buffer, sector, count);
 }
 
 system_module disk_module = (system_module){
@@ -5,6 +5,7 @@
 #include "std/std.h"
 #include "theme/theme.h"
 #include "memory/page_allocator.h"
+#include "memory/slab.h"
 #include "sysregs.h"
 
 #define VIRTIO_GPU_CMD_GET_DISPLAY_INFO         0x0100
@@ -34,6 +35,9 @@
 
 #define VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM 1
 
+//Every control command and response shares one cache, the display info response is the largest of them
+#define VIRTIO_GPU_CMD_SIZE 512
+
 VirtioGPUDriver* VirtioGPUDriver::try_init(gpu_size preferred_screen_size){
     VirtioGPUDriver* driver = new VirtioGPUDriver();
     if (driver->init(preferred_screen_size))
@@ -61,6 +65,12 @@ bool VirtioGPUDriver::init(gpu_size preferred_screen_size){
         return false;
     }
 
+    cmd_cache = slab_cache_create("virtio_gpu_cmd", VIRTIO_GPU_CMD_SIZE, ALIGN_64B, MEM_DEV | MEM_RW, 0);
+    if (!cmd_cache) {
+        kprintf("[VIRTIO_GPU error] Failed to create command cache");
+        return false;
+    }
+
     kprintf("[VIRTIO_GPU] GPU initialized. Issuing commands");
 
     screen_size = get_display_info();
@@ -124,6 +134,7 @@ typedef struct virtio_gpu_resp_display_info {
         uint32_t flags;
     } pmodes[VIRTIO_GPU_MAX_SCANOUTS];
 } virtio_gpu_resp_display_info;
+static_assert(sizeof(virtio_gpu_resp_display_info) <= VIRTIO_GPU_CMD_SIZE, "Display info response must fit a command slot");
 
 typedef struct virtio_2d_resource {
     struct virtio_gpu_ctrl_hdr hdr;
@@ -134,7 +145,7 @@ typedef struct virtio_2d_resource {
 } virtio_2d_resource;
 
 gpu_size VirtioGPUDriver::get_display_info(){
-    virtio_gpu_ctrl_hdr* cmd = (virtio_gpu_ctrl_hdr*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_ctrl_hdr), ALIGN_4KB, MEM_PRIV_KERNEL);
+    virtio_gpu_ctrl_hdr* cmd = (virtio_gpu_ctrl_hdr*)slab_alloc(cmd_cache);
     cmd->type = VIRTIO_GPU_CMD_GET_DISPLAY_INFO;
     cmd->flags = 0;
     cmd->fence_id = 0;
@@ -144,20 +155,20 @@ gpu_size VirtioGPUDriver::get_display_info(){
     cmd->padding[1] = 0;
     cmd->padding[2] = 0;
 
-    virtio_gpu_resp_display_info* resp = (virtio_gpu_resp_display_info*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_resp_display_info), ALIGN_4KB, MEM_PRIV_KERNEL);
+    virtio_gpu_resp_display_info* resp = (virtio_gpu_resp_display_info*)slab_alloc(cmd_cache);
 
     scanout_found = false;
 
     virtio_buf b[2] = {VBUF(cmd, sizeof(virtio_gpu_ctrl_hdr), 0), VBUF(resp, sizeof(virtio_gpu_resp_display_info), VIRTQ_DESC_F_WRITE)};
     if(!virtio_send_nd(&gpu_dev, b, 2)){
-        kfree(cmd, sizeof(virtio_gpu_ctrl_hdr));
-        kfree(resp, sizeof(virtio_gpu_resp_display_info));
+        slab_free(cmd_cache, cmd);
+        slab_free(cmd_cache, resp);
         return (gpu_size){0, 0};
     }
 
     if (resp->hdr.type != VIRTIO_GPU_RESP_OK_DISPLAY_INFO) {
-        kfree(cmd, sizeof(virtio_gpu_ctrl_hdr));
-        kfree(resp, sizeof(virtio_gpu_resp_display_info));
+        slab_free(cmd_cache, cmd);
+        slab_free(cmd_cache, resp);
         return (gpu_size){0, 0};
     }
 
@@ -166,19 +177,19 @@ gpu_size VirtioGPUDriver::get_display_info(){
             scanout_id = i;
             scanout_found = true;
             gpu_size size = {resp->pmodes[i].rect.width, resp->pmodes[i].rect.height};
-            kfree(cmd, sizeof(virtio_gpu_ctrl_hdr));
-            kfree(resp, sizeof(virtio_gpu_resp_display_info));
+            slab_free(cmd_cache, cmd);
+            slab_free(cmd_cache, resp);
             return size;
         }
     }
 
-    kfree(cmd, sizeof(virtio_gpu_ctrl_hdr));
-    kfree(resp, sizeof(virtio_gpu_resp_display_info));
+    slab_free(cmd_cache, cmd);
+    slab_free(cmd_cache, resp);
     return (gpu_size){0, 0};
 }
 
 bool VirtioGPUDriver::create_2d_resource(uint32_t resource_id, gpu_size size) {
-    virtio_2d_resource* cmd = (virtio_2d_resource*)kalloc(gpu_dev.memory_page, sizeof(virtio_2d_resource), ALIGN_4KB, MEM_PRIV_KERNEL);
+    virtio_2d_resource* cmd = (virtio_2d_resource*)slab_alloc(cmd_cache);
     
     cmd->hdr.type = VIRTIO_GPU_CMD_RESOURCE_CREATE_2D;
     cmd->hdr.flags = 0;
@@ -193,23 +204,23 @@ bool VirtioGPUDriver::create_2d_resource(uint32_t resource_id, gpu_size size) {
     cmd->width = size.width;
     cmd->height = size.height;
 
-    virtio_gpu_ctrl_hdr* resp = (virtio_gpu_ctrl_hdr*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_ctrl_hdr), ALIGN_4KB, MEM_PRIV_KERNEL);
+    virtio_gpu_ctrl_hdr* resp = (virtio_gpu_ctrl_hdr*)slab_alloc(cmd_cache);
 
     virtio_buf b[2] = {VBUF(cmd, sizeof(virtio_2d_resource), 0), VBUF(resp, sizeof(virtio_gpu_ctrl_hdr), VIRTQ_DESC_F_WRITE)};
     if(!virtio_send_nd(&gpu_dev, b, 2)){
-        kfree((void*)cmd, sizeof(virtio_2d_resource));
-        kfree((void*)resp, sizeof(virtio_gpu_ctrl_hdr));
+        slab_free(cmd_cache, cmd);
+        slab_free(cmd_cache, resp);
         return false;
     }
     
     if (resp->type != VIRTIO_GPU_RESP_OK_NODATA) {
-        kfree((void*)cmd, sizeof(virtio_2d_resource));
-        kfree((void*)resp, sizeof(virtio_gpu_ctrl_hdr));
+        slab_free(cmd_cache, cmd);
+        slab_free(cmd_cache, resp);
         return false;
     }
 
-    kfree((void*)cmd, sizeof(virtio_2d_resource));
-    kfree((void*)resp, sizeof(virtio_gpu_ctrl_hdr));
+    slab_free(cmd_cache, cmd);
+    slab_free(cmd_cache, resp);
 
     return true;
 }
@@ -226,7 +237,7 @@ typedef struct virtio_backing_cmd {
 }__attribute__((packed)) virtio_backing_cmd;
 
 bool VirtioGPUDriver::attach_backing(uint32_t resource_id, sizedptr ptr) {
-    virtio_backing_cmd* cmd = (virtio_backing_cmd*)kalloc(gpu_dev.memory_page, sizeof(virtio_backing_cmd), ALIGN_4KB, MEM_PRIV_KERNEL);
+    virtio_backing_cmd* cmd = (virtio_backing_cmd*)slab_alloc(cmd_cache);
 
     cmd->hdr.type = VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING;
     cmd->hdr.flags = 0;
@@ -243,23 +254,23 @@ bool VirtioGPUDriver::attach_backing(uint32_t resource_id, sizedptr ptr) {
     cmd->entries[0].length = ptr.size;
     cmd->entries[0].padding = 0;
 
-    virtio_gpu_ctrl_hdr* resp = (virtio_gpu_ctrl_hdr*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_ctrl_hdr), ALIGN_4KB, MEM_PRIV_KERNEL);
+    virtio_gpu_ctrl_hdr* resp = (virtio_gpu_ctrl_hdr*)slab_alloc(cmd_cache);
 
     virtio_buf b[2] = {VBUF(cmd, sizeof(*cmd), 0), VBUF(resp, sizeof(virtio_gpu_ctrl_hdr), VIRTQ_DESC_F_WRITE)};
     if (!virtio_send_nd(&gpu_dev, b, 2)){
-        kfree((void*)cmd, sizeof(*cmd));
-        kfree((void*)resp, sizeof(virtio_gpu_ctrl_hdr));
+        slab_free(cmd_cache, cmd);
+        slab_free(cmd_cache, resp);
         return false;
     }
 
     if (resp->type != VIRTIO_GPU_RESP_OK_NODATA) {
-        kfree((void*)cmd, sizeof(virtio_backing_cmd));
-        kfree((void*)resp, sizeof(virtio_gpu_ctrl_hdr));
+        slab_free(cmd_cache, cmd);
+        slab_free(cmd_cache, resp);
         return false;
     }
 
-    kfree((void*)cmd, sizeof(virtio_backing_cmd));
-    kfree((void*)resp, sizeof(virtio_gpu_ctrl_hdr));
+    slab_free(cmd_cache, cmd);
+    slab_free(cmd_cache, resp);
     return true;
 }
 
@@ -271,7 +282,7 @@ typedef struct virtio_scanout_cmd {
 }__attribute__((packed)) virtio_scanout_cmd;
 
 bool VirtioGPUDriver::set_scanout() {
-    virtio_scanout_cmd* cmd = (virtio_scanout_cmd*)kalloc(gpu_dev.memory_page, sizeof(virtio_scanout_cmd), ALIGN_4KB, MEM_PRIV_KERNEL);
+    virtio_scanout_cmd* cmd = (virtio_scanout_cmd*)slab_alloc(cmd_cache);
     
     cmd->r.x = 0;
     cmd->r.y = 0;
@@ -290,29 +301,29 @@ bool VirtioGPUDriver::set_scanout() {
     cmd->hdr.padding[1] = 0;
     cmd->hdr.padding[2] = 0;
 
-    virtio_gpu_ctrl_hdr* resp = (virtio_gpu_ctrl_hdr*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_ctrl_hdr), ALIGN_4KB, MEM_PRIV_KERNEL);
+    virtio_gpu_ctrl_hdr* resp = (virtio_gpu_ctrl_hdr*)slab_alloc(cmd_cache);
 
     virtio_buf b[2] = {VBUF(cmd, sizeof(*cmd), 0), VBUF(resp, sizeof(virtio_gpu_ctrl_hdr), VIRTQ_DESC_F_WRITE)};
     if (!virtio_send_nd(&gpu_dev, b, 2)){
-        kfree((void*)cmd, sizeof(virtio_scanout_cmd));
-        kfree((void*)resp, sizeof(virtio_gpu_ctrl_hdr));
+        slab_free(cmd_cache, cmd);
+        slab_free(cmd_cache, resp);
         return false;
     }
 
     if (resp->type != VIRTIO_GPU_RESP_OK_NODATA) {
-        kfree((void*)cmd, sizeof(virtio_scanout_cmd));
-        kfree((void*)resp, sizeof(virtio_gpu_ctrl_hdr));
+        slab_free(cmd_cache, cmd);
+        slab_free(cmd_cache, resp);
         return false;
     }
 
-    kfree((void*)cmd, sizeof(virtio_scanout_cmd));
-    kfree((void*)resp, sizeof(virtio_gpu_ctrl_hdr));
+    slab_free(cmd_cache, cmd);
+    slab_free(cmd_cache, resp);
     return true;
 }
 
 bool VirtioGPUDriver::transfer_to_host(uint32_t resource_id, gpu_rect rect) {
     if (!trans_cmd)
-        trans_cmd = (virtio_transfer_cmd*)kalloc(gpu_dev.memory_page, sizeof(virtio_transfer_cmd), ALIGN_4KB, MEM_PRIV_KERNEL);
+        trans_cmd = (virtio_transfer_cmd*)slab_alloc(cmd_cache);
     
     trans_cmd->hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
     trans_cmd->hdr.flags = VIRTIO_GPU_FLAG_FENCE;
@@ -329,7 +340,7 @@ bool VirtioGPUDriver::transfer_to_host(uint32_t resource_id, gpu_rect rect) {
     trans_cmd->rect.height = rect.size.height;
 
     if (!trans_resp)
-        trans_resp = (virtio_gpu_ctrl_hdr*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_ctrl_hdr), ALIGN_4KB, MEM_PRIV_KERNEL);
+        trans_resp = (virtio_gpu_ctrl_hdr*)slab_alloc(cmd_cache);
 
     virtio_buf b[2] = {VBUF(trans_cmd, sizeof(virtio_transfer_cmd), 0), VBUF(trans_resp, sizeof(virtio_gpu_ctrl_hdr), VIRTQ_DESC_F_WRITE)};
     return virtio_send_nd(&gpu_dev, b, 2);
@@ -352,7 +363,7 @@ void VirtioGPUDriver::flush() {
     }
     
     if (!flush_cmd)
-        flush_cmd = (virtio_flush_cmd*)kalloc(gpu_dev.memory_page, sizeof(virtio_flush_cmd), ALIGN_4KB, MEM_PRIV_KERNEL);
+        flush_cmd = (virtio_flush_cmd*)slab_alloc(cmd_cache);
     
     flush_cmd->hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
     flush_cmd->hdr.flags = 0;
@@ -368,7 +379,7 @@ void VirtioGPUDriver::flush() {
     flush_cmd->rect.height = screen_size.height;
     
     if (!flush_resp)
-        flush_resp = (virtio_gpu_ctrl_hdr*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_ctrl_hdr), ALIGN_4KB, MEM_PRIV_KERNEL);
+        flush_resp = (virtio_gpu_ctrl_hdr*)slab_alloc(cmd_cache);
     
     virtio_buf b[2] = {VBUF(flush_cmd, sizeof(virtio_flush_cmd), 0), VBUF(flush_resp, sizeof(virtio_gpu_ctrl_hdr), VIRTQ_DESC_F_WRITE)};
     virtio_send_nd(&gpu_dev, b, 2);
@@ -389,7 +400,7 @@ struct virtio_gpu_resp_capset_info {
 };
 
 void VirtioGPUDriver::get_capset(uint32_t capset){
-    virtio_gpu_get_capset_info* cmd = (virtio_gpu_get_capset_info*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_get_capset_info), ALIGN_4KB, MEM_PRIV_KERNEL);
+    virtio_gpu_get_capset_info* cmd = (virtio_gpu_get_capset_info*)slab_alloc(cmd_cache);
 
     cmd->hdr.type = VIRTIO_GPU_CMD_GET_CAPSET_INFO;
     cmd->hdr.flags = 0;
@@ -397,27 +408,27 @@ void VirtioGPUDriver::get_capset(uint32_t capset){
     cmd->capset_index = capset;
     cmd->padding = 0;
 
-    virtio_gpu_resp_capset_info* resp = (virtio_gpu_resp_capset_info*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_resp_capset_info), ALIGN_4KB, MEM_PRIV_KERNEL);
+    virtio_gpu_resp_capset_info* resp = (virtio_gpu_resp_capset_info*)slab_alloc(cmd_cache);
 
     virtio_buf b[2] = {VBUF(cmd, sizeof(virtio_gpu_get_capset_info), 0), VBUF(resp, sizeof(virtio_gpu_resp_capset_info), VIRTQ_DESC_F_WRITE)};
     if (!virtio_send_nd(&gpu_dev, b, 2)){
         kprintf("Could not send command");
-        kfree((void*)cmd, sizeof(virtio_gpu_get_capset_info));
-        kfree((void*)resp, sizeof(virtio_gpu_resp_capset_info));
+        slab_free(cmd_cache, cmd);
+        slab_free(cmd_cache, resp);
         return;
     }
 
     if (resp->hdr.type != VIRTIO_GPU_RESP_OK_CAPSET_INFO) {
         kprintf("Received wrong response");
-        kfree((void*)cmd, sizeof(virtio_gpu_get_capset_info));
-        kfree((void*)resp, sizeof(virtio_gpu_resp_capset_info));
+        slab_free(cmd_cache, cmd);
+        slab_free(cmd_cache, resp);
         return;
     }
 
     kprintf("Capset 0's %i", resp->capset_id);
 
-    kfree((void*)cmd, sizeof(virtio_gpu_get_capset_info));
-    kfree((void*)resp, sizeof(virtio_gpu_resp_capset_info));
+    slab_free(cmd_cache, cmd);
+    slab_free(cmd_cache, resp);
     return;
 }
 
@@ -482,7 +493,7 @@ void VirtioGPUDriver::update_cursor(uint32_t x, uint32_t y, bool full)
 {
     select_queue(&gpu_dev, CURSOR_QUEUE);
 
-    if (!cursor_cmd) cursor_cmd = (virtio_gpu_update_cursor*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_update_cursor), ALIGN_4KB, MEM_PRIV_KERNEL);
+    if (!cursor_cmd) cursor_cmd = (virtio_gpu_update_cursor*)slab_alloc(cmd_cache);
     
     cursor_cmd->hdr.type = full ? VIRTIO_GPU_CMD_UPDATE_CURSOR : VIRTIO_GPU_CMD_MOVE_CURSOR;
     cursor_cmd->hdr.flags = 0;
@@ -498,7 +509,7 @@ void VirtioGPUDriver::update_cursor(uint32_t x, uint32_t y, bool full)
     cursor_cmd->resource_id = cursor_resource_id;
 
     if (!cursor_resp)
-        cursor_resp = (virtio_gpu_ctrl_hdr*)kalloc(gpu_dev.memory_page, sizeof(virtio_gpu_ctrl_hdr), ALIGN_4KB, MEM_PRIV_KERNEL);
+        cursor_resp = (virtio_gpu_ctrl_hdr*)slab_alloc(cmd_cache);
 
     virtio_buf b[2] = {VBUF(cursor_cmd, sizeof(virtio_gpu_update_cursor), 0), VBUF(cursor_resp, sizeof(virtio_gpu_ctrl_hdr), VIRTQ_DESC_F_WRITE)};
     virtio_send_nd(&gpu_dev, b, 2);
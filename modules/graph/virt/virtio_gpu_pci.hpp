@@ -1,6 +1,7 @@
 #pragma once 
 
 #include "virtio/virtio_pci.h"
+#include "memory/slab.h"
 #include "common/gpu_driver.hpp"
 #include "utils/cursor/cursor_manager.h"
 
@@ -106,6 +107,7 @@ private:
     uint32_t cursor_unpressed_resource_id = 0;
     cursor_types last_cursor_type;
 
+    slab_cache *cmd_cache = nullptr;
     virtio_gpu_ctrl_hdr *trans_resp = nullptr;
     virtio_gpu_ctrl_hdr *flush_resp = nullptr;
     virtio_gpu_ctrl_hdr *cursor_resp = nullptr;
@@ -2,6 +2,7 @@
 #include "xhci.hpp"
 #include "hw/hw.h"
 #include "kernel_processes/kprocess_loader.h"
+#include "process/scheduler.h"
 #include "sysregs.h"
 #include "syscalls/syscalls.h"
 
@@ -52,9 +53,9 @@ int usb_process_fake_interrupts(int argc, char* argv[]){
 extern "C" void init_usb_process(){
     if (!input_driver) return;
     if (!input_driver->use_interrupts)
-        create_kernel_process("input_poll", &usb_process_poll, 0, 0);
+        set_process_class(create_kernel_process("input_poll", &usb_process_poll, 0, 0), PROC_CLASS_SYSTEM);
     if (input_driver->quirk_simulate_interrupts)
-        create_kernel_process("input_int_mock", &usb_process_fake_interrupts, 0, 0);
+        set_process_class(create_kernel_process("input_int_mock", &usb_process_fake_interrupts, 0, 0), PROC_CLASS_SYSTEM);
 }
 
 extern "C" void handle_usb_interrupt(){